@@ -0,0 +1,122 @@
+#!/bin/sh
+#
+# bfq-latency.sh - measure what BFQ's weight raising does for latency
+#
+# Runs a mixed fio workload against a block device, once with BFQ's
+# low_latency heuristics off and once with them on:
+#
+#	bgread		a sequential reader, like a media scan
+#	bgwrite		a buffered sequential writer, like a package install
+#	interactive	small random reads separated by think time, like an
+#			application that the user is waiting on
+#
+# and prints the interactive job's completion latencies next to the
+# throughput of the background jobs, along with the weight-raising
+# statistics BFQ kept during the run. With weight raising, the interactive
+# latencies should drop while the background throughput stays about the
+# same.
+#
+# The device must be request based for an I/O scheduler to be used at
+# all: brd ramdisks and loop devices are not. Without -d, a scsi_debug
+# ramdisk is set up, with a jiffy of delay per command so that requests
+# queue up the way they do on real flash.
+#
+# Usage: bfq-latency.sh [-d device] [-s seconds] [-t think_ms]
+#
+# Must be run as root, with fio installed. The contents of the device are
+# overwritten.
+
+DEV=
+RUNTIME=30
+THINK=100
+SCSI_DEBUG=
+
+while getopts d:s:t: opt; do
+	case $opt in
+	d) DEV=$OPTARG ;;
+	s) RUNTIME=$OPTARG ;;
+	t) THINK=$OPTARG ;;
+	*) echo "usage: $0 [-d device] [-s seconds] [-t think_ms]" >&2
+	   exit 1 ;;
+	esac
+done
+
+die() {
+	echo "$0: $*" >&2
+	exit 1
+}
+
+cleanup() {
+	rm -f $JOB $JOB.out
+	[ -n "$SCSI_DEBUG" ] && rmmod scsi_debug 2>/dev/null
+}
+
+JOB=$(mktemp /tmp/bfq-latency.XXXXXX) || die "cannot create job file"
+trap cleanup EXIT
+
+if [ -z "$DEV" ]; then
+	modprobe scsi_debug dev_size_mb=512 delay=1 ||
+		die "cannot load scsi_debug"
+	SCSI_DEBUG=1
+	udevadm settle 2>/dev/null || sleep 2
+	SD=/sys/bus/pseudo/drivers/scsi_debug
+	for b in $SD/adapter*/host*/target*/*/block/*; do
+		DEV=/dev/${b##*/}
+	done
+	[ -b "$DEV" ] || die "no scsi_debug disk found"
+fi
+
+NAME=${DEV##*/}
+Q=/sys/block/$NAME/queue
+[ -d $Q ] || die "$DEV is not a whole disk"
+echo bfq > $Q/scheduler || die "cannot select bfq for $DEV"
+
+cat > $JOB <<EOF
+[global]
+filename=$DEV
+runtime=$RUNTIME
+time_based
+ioengine=sync
+
+[bgread]
+rw=read
+bs=1m
+direct=1
+offset=0
+size=40%
+
+[bgwrite]
+rw=write
+bs=1m
+offset=40%
+size=40%
+end_fsync=1
+
+[interactive]
+rw=randread
+bs=4k
+direct=1
+offset=80%
+size=20%
+thinktime=${THINK}000
+EOF
+
+printf "%-11s %14s %14s %14s %14s\n" low_latency "read KiB/s" "write KiB/s" \
+	"interact. us" "int. p99 us"
+
+for ll in 0 1; do
+	echo $ll > $Q/iosched/low_latency
+	# terse v3: read bw is field 7, clat mean 16, clat p99 30,
+	# write bw 48
+	fio --minimal $JOB > $JOB.out || die "fio failed"
+	awk -F';' -v ll=$ll '
+		$3 == "bgread" { rd = $7 }
+		$3 == "bgwrite" { wr = $48 }
+		$3 == "interactive" { lat = $16; split($30, p, "="); p99 = p[2] }
+		END { printf "%-11d %14d %14d %14.0f %14d\n", ll, rd, wr,
+			lat, p99 }' $JOB.out
+	rm -f $JOB.out
+done
+
+echo
+cat $Q/iosched/raising_stats
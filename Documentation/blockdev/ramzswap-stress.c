@@ -0,0 +1,209 @@
+/*
+ * ramzswap-stress.c - measure ramzswap write (swap-out) throughput
+ *
+ * Writes page sized, moderately compressible buffers to an initialized but
+ * inactive ramzswap device with O_DIRECT, from an increasing number of
+ * threads, each pinned to its own CPU. Every write is a single page bio,
+ * which is exactly what the swap code issues, so the numbers reflect the
+ * swap-out path of the driver: compression, allocation and table update.
+ *
+ * Build: gcc -O2 -Wall -o ramzswap-stress ramzswap-stress.c -lpthread
+ * Usage: ramzswap-stress [-t max_threads] [-m MB_per_thread] /dev/ramzswapN
+ *
+ * The device must not be in use as swap: its contents are overwritten
+ * (the swap header in the first page is left alone).
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <linux/fs.h>
+
+#define PAGE_SZ		4096
+#define NR_TEMPLATES	64
+
+static int fd;
+static unsigned long long dev_pages;
+static unsigned long pages_per_thread;
+static char *templates;
+
+struct worker {
+	pthread_t thread;
+	int cpu;
+	unsigned long long first_page;
+	int err;
+};
+
+/*
+ * Roughly half random bytes, half text: LZO compresses these to a bit
+ * more than half a page, which is typical for anonymous memory.
+ */
+static void fill_templates(void)
+{
+	static const char text[] = "ramzswap stress test page contents ";
+	int i, j;
+
+	for (i = 0; i < NR_TEMPLATES; i++) {
+		char *p = templates + i * PAGE_SZ;
+
+		for (j = 0; j < PAGE_SZ / 2; j++)
+			p[j] = random();
+		for (; j < PAGE_SZ; j++)
+			p[j] = text[j % (sizeof(text) - 1)];
+	}
+}
+
+static void *worker_fn(void *arg)
+{
+	struct worker *w = arg;
+	unsigned long i;
+	cpu_set_t set;
+	char *buf;
+
+	CPU_ZERO(&set);
+	CPU_SET(w->cpu, &set);
+	sched_setaffinity(0, sizeof(set), &set);
+
+	if (posix_memalign((void **)&buf, PAGE_SZ, PAGE_SZ)) {
+		w->err = ENOMEM;
+		return NULL;
+	}
+
+	for (i = 0; i < pages_per_thread; i++) {
+		unsigned long long page = w->first_page + i;
+
+		memcpy(buf, templates + (page % NR_TEMPLATES) * PAGE_SZ,
+			PAGE_SZ);
+		/* make every page unique */
+		memcpy(buf, &page, sizeof(page));
+
+		if (pwrite(fd, buf, PAGE_SZ, page * PAGE_SZ) != PAGE_SZ) {
+			w->err = errno;
+			break;
+		}
+	}
+
+	free(buf);
+	return NULL;
+}
+
+static double run(int nr_threads, int nr_cpus)
+{
+	struct worker *workers;
+	struct timeval start, end;
+	double secs;
+	int i;
+
+	workers = calloc(nr_threads, sizeof(*workers));
+	if (!workers) {
+		perror("calloc");
+		exit(1);
+	}
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < nr_threads; i++) {
+		workers[i].cpu = i % nr_cpus;
+		/* skip the swap header page */
+		workers[i].first_page = 1 + (unsigned long long)i *
+						pages_per_thread;
+		pthread_create(&workers[i].thread, NULL, worker_fn,
+				&workers[i]);
+	}
+	for (i = 0; i < nr_threads; i++) {
+		pthread_join(workers[i].thread, NULL);
+		if (workers[i].err) {
+			fprintf(stderr, "thread %d: %s\n", i,
+				strerror(workers[i].err));
+			exit(1);
+		}
+	}
+	gettimeofday(&end, NULL);
+
+	free(workers);
+
+	secs = (end.tv_sec - start.tv_sec) +
+		(end.tv_usec - start.tv_usec) / 1e6;
+	return secs;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long long bytes;
+	int max_threads, nr_cpus, nr_threads, opt;
+	unsigned long mb = 64;
+	double base = 0;
+
+	nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	max_threads = nr_cpus;
+
+	while ((opt = getopt(argc, argv, "t:m:")) != -1) {
+		switch (opt) {
+		case 't':
+			max_threads = atoi(optarg);
+			break;
+		case 'm':
+			mb = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (optind != argc - 1 || max_threads < 1 || !mb)
+		goto usage;
+
+	fd = open(argv[optind], O_WRONLY | O_DIRECT);
+	if (fd < 0) {
+		perror(argv[optind]);
+		return 1;
+	}
+	if (ioctl(fd, BLKGETSIZE64, &bytes) < 0) {
+		perror("BLKGETSIZE64");
+		return 1;
+	}
+	dev_pages = bytes / PAGE_SZ;
+
+	pages_per_thread = mb * (1024 * 1024 / PAGE_SZ);
+	if (1 + max_threads * (unsigned long long)pages_per_thread >
+								dev_pages) {
+		fprintf(stderr, "device too small: need %llu pages, "
+			"have %llu\n",
+			1 + max_threads * (unsigned long long)pages_per_thread,
+			dev_pages);
+		return 1;
+	}
+
+	templates = malloc(NR_TEMPLATES * PAGE_SZ);
+	if (!templates) {
+		perror("malloc");
+		return 1;
+	}
+	fill_templates();
+
+	printf("%8s %12s %12s %8s\n", "threads", "MB/s", "pages/s", "scale");
+	for (nr_threads = 1; nr_threads <= max_threads; nr_threads++) {
+		double secs = run(nr_threads, nr_cpus);
+		double pages = (double)nr_threads * pages_per_thread;
+		double mbps = pages * PAGE_SZ / (1024 * 1024) / secs;
+
+		if (nr_threads == 1)
+			base = mbps;
+		printf("%8d %12.1f %12.0f %8.2f\n", nr_threads, mbps,
+			pages / secs, mbps / base);
+	}
+
+	close(fd);
+	return 0;
+
+usage:
+	fprintf(stderr, "usage: %s [-t max_threads] [-m MB_per_thread] "
+		"/dev/ramzswapN\n", argv[0]);
+	return 1;
+}
@@ -0,0 +1,386 @@
+/*
+ * hybrid-replay.c - replay a load trace to compare cpufreq governors
+ *
+ * Each line of the trace is a burst of work followed by some idle time:
+ *
+ *	<work_us> <idle_us> [input]
+ *
+ * where work_us is how long the burst takes at the maximum frequency.
+ * With "input", a key event is sent through uinput right before the
+ * burst, the way a touch comes before the frames that answer it.
+ *
+ * The trace is run once per governor on a single cpu.  For each governor
+ * the program reports how late the bursts complete compared with the
+ * maximum frequency, which is the latency the user sees, and the energy
+ * spent, estimated from the time cpufreq_stats counted at each frequency.
+ * Without a power table, the power at a frequency is taken to grow with
+ * its cube, as when the voltage scales with the frequency, and the
+ * energy is given relative to running the whole trace at the maximum
+ * frequency.  A power table has one "<kHz> <mW>" line per frequency and
+ * gives the energy in mJ.  Either way, idle time is charged at the
+ * frequency it was spent at, so the figures overestimate the energy of
+ * idle periods alike for all governors.
+ *
+ * Without a trace file, a synthetic one is used: ten rounds of a touch
+ * followed by 30 frames that each take 6ms of a 16.7ms period, and a
+ * second of idle time.  -S prints it, as a starting point for others.
+ *
+ * Needs root, CONFIG_CPU_FREQ_STAT, and CONFIG_INPUT_UINPUT for input
+ * events.  The governors must be built in or loaded.
+ *
+ * Build: gcc -O2 -Wall -o hybrid-replay hybrid-replay.c
+ * Usage: hybrid-replay [-c cpu] [-g gov,...] [-p power_table] [-S] [trace]
+ */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <linux/input.h>
+#include <linux/uinput.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#define MAX_BURSTS	65536
+#define MAX_FREQS	64
+
+struct burst {
+	unsigned int work_us;
+	unsigned int idle_us;
+	int input;
+};
+
+static struct burst bursts[MAX_BURSTS];
+static int nr_bursts;
+
+static unsigned int freqs[MAX_FREQS];
+static double power[MAX_FREQS];
+static int nr_freqs, have_power;
+
+static int cpu;
+static double loops_per_us;
+static int uinput_fd = -1;
+static char path[256];
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+static double now_us(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1e6 + tv.tv_usec;
+}
+
+static const char *cpufreq_file(const char *name)
+{
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cpufreq/%s",
+		 cpu, name);
+	return path;
+}
+
+static void write_file(const char *file, const char *val)
+{
+	FILE *f = fopen(file, "w");
+
+	if (!f || fputs(val, f) < 0 || fclose(f))
+		die(file);
+}
+
+static void read_governor(char *buf, int len)
+{
+	FILE *f = fopen(cpufreq_file("scaling_governor"), "r");
+
+	if (!f || !fgets(buf, len, f))
+		die(path);
+	fclose(f);
+	buf[strcspn(buf, "\n")] = 0;
+}
+
+/* Time spent at each frequency, in 10ms units, and the transitions. */
+static void read_stats(unsigned long long *time, unsigned long *trans)
+{
+	unsigned int freq;
+	unsigned long long t;
+	FILE *f;
+	int i;
+
+	f = fopen(cpufreq_file("stats/time_in_state"), "r");
+	if (!f)
+		die(path);
+	for (i = 0; i < MAX_FREQS && fscanf(f, "%u %llu", &freq, &t) == 2;
+	     i++) {
+		freqs[i] = freq;
+		time[i] = t;
+	}
+	nr_freqs = i;
+	fclose(f);
+
+	f = fopen(cpufreq_file("stats/total_trans"), "r");
+	if (!f || fscanf(f, "%lu", trans) != 1)
+		die(path);
+	fclose(f);
+}
+
+static void spin(unsigned long loops)
+{
+	volatile unsigned long i;
+
+	for (i = 0; i < loops; i++)
+		;
+}
+
+static void calibrate(void)
+{
+	unsigned long loops = 1000000;
+	double start, elapsed;
+
+	write_file(cpufreq_file("scaling_governor"), "performance");
+	spin(loops);
+	do {
+		loops *= 2;
+		start = now_us();
+		spin(loops);
+		elapsed = now_us() - start;
+	} while (elapsed < 200000);
+	loops_per_us = loops / elapsed;
+}
+
+static void uinput_open(void)
+{
+	struct uinput_user_dev dev;
+
+	uinput_fd = open("/dev/uinput", O_WRONLY);
+	if (uinput_fd < 0)
+		uinput_fd = open("/dev/input/uinput", O_WRONLY);
+	if (uinput_fd < 0)
+		die("uinput");
+
+	memset(&dev, 0, sizeof(dev));
+	strcpy(dev.name, "hybrid-replay");
+	dev.id.bustype = BUS_VIRTUAL;
+	if (ioctl(uinput_fd, UI_SET_EVBIT, EV_KEY) < 0 ||
+	    ioctl(uinput_fd, UI_SET_KEYBIT, KEY_F24) < 0 ||
+	    write(uinput_fd, &dev, sizeof(dev)) != sizeof(dev) ||
+	    ioctl(uinput_fd, UI_DEV_CREATE) < 0)
+		die("uinput");
+	/* let the input handlers connect to the new device */
+	sleep(1);
+}
+
+static void uinput_event(int type, int code, int value)
+{
+	struct input_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.type = type;
+	ev.code = code;
+	ev.value = value;
+	if (write(uinput_fd, &ev, sizeof(ev)) != sizeof(ev))
+		die("uinput write");
+}
+
+static void uinput_key(void)
+{
+	uinput_event(EV_KEY, KEY_F24, 1);
+	uinput_event(EV_SYN, SYN_REPORT, 0);
+	uinput_event(EV_KEY, KEY_F24, 0);
+	uinput_event(EV_SYN, SYN_REPORT, 0);
+}
+
+static void synthetic_trace(void)
+{
+	int round, frame;
+
+	for (round = 0; round < 10; round++) {
+		for (frame = 0; frame < 30; frame++) {
+			bursts[nr_bursts].work_us = 6000;
+			bursts[nr_bursts].idle_us = 10700;
+			bursts[nr_bursts].input = frame == 0;
+			nr_bursts++;
+		}
+		bursts[nr_bursts - 1].idle_us = 1000000;
+	}
+}
+
+static void read_trace(const char *file)
+{
+	char line[128], word[16];
+	FILE *f = fopen(file, "r");
+	int n;
+
+	if (!f)
+		die(file);
+	while (fgets(line, sizeof(line), f) && nr_bursts < MAX_BURSTS) {
+		struct burst *b = &bursts[nr_bursts];
+
+		if (line[0] == '#')
+			continue;
+		n = sscanf(line, "%u %u %15s", &b->work_us, &b->idle_us, word);
+		if (n < 2)
+			continue;
+		b->input = n == 3 && !strcmp(word, "input");
+		nr_bursts++;
+	}
+	fclose(f);
+}
+
+static void read_power(const char *file)
+{
+	unsigned int freq;
+	double mw;
+	FILE *f = fopen(file, "r");
+	int i;
+
+	if (!f)
+		die(file);
+	while (fscanf(f, "%u %lf", &freq, &mw) == 2)
+		for (i = 0; i < nr_freqs; i++)
+			if (freqs[i] == freq)
+				power[i] = mw;
+	fclose(f);
+	for (i = 0; i < nr_freqs; i++)
+		if (power[i] == 0) {
+			fprintf(stderr, "no power for %u kHz in %s\n",
+				freqs[i], file);
+			exit(1);
+		}
+	have_power = 1;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void replay(const char *gov)
+{
+	static double late[MAX_BURSTS];
+	unsigned long long before[MAX_FREQS], after[MAX_FREQS];
+	unsigned long trans_before, trans_after;
+	unsigned int fmax = 0;
+	double start, sum = 0, energy = 0, ref = 0, p;
+	int i;
+
+	write_file(cpufreq_file("scaling_governor"), gov);
+	sleep(1);
+	read_stats(before, &trans_before);
+
+	for (i = 0; i < nr_bursts; i++) {
+		if (bursts[i].input && uinput_fd >= 0)
+			uinput_key();
+		start = now_us();
+		spin(bursts[i].work_us * loops_per_us);
+		late[i] = now_us() - start - bursts[i].work_us;
+		if (late[i] < 0)
+			late[i] = 0;
+		sum += late[i];
+		usleep(bursts[i].idle_us);
+	}
+
+	read_stats(after, &trans_after);
+	for (i = 0; i < nr_freqs; i++)
+		if (freqs[i] > fmax)
+			fmax = freqs[i];
+	for (i = 0; i < nr_freqs; i++) {
+		if (have_power)
+			p = power[i];
+		else
+			p = (double)freqs[i] * freqs[i] * freqs[i] /
+				((double)fmax * fmax * fmax);
+		/* time_in_state counts 10ms units */
+		energy += (after[i] - before[i]) * 10 * p;
+		ref += (after[i] - before[i]) * 10;
+	}
+
+	qsort(late, nr_bursts, sizeof(late[0]), cmp_double);
+	printf("%-12s %10.0f %10.0f %10.0f %12.1f%s %8lu\n", gov,
+	       sum / nr_bursts, late[nr_bursts * 95 / 100],
+	       late[nr_bursts - 1],
+	       have_power ? energy / 1000 : 100 * energy / ref,
+	       have_power ? "mJ" : "%", trans_after - trans_before);
+}
+
+int main(int argc, char **argv)
+{
+	char *govs = "ondemand,hybrid", *power_file = NULL, *gov;
+	char saved[64];
+	int opt, print = 0, i;
+	unsigned long long t[MAX_FREQS];
+	unsigned long trans;
+	cpu_set_t set;
+
+	while ((opt = getopt(argc, argv, "c:g:p:S")) != -1) {
+		switch (opt) {
+		case 'c':
+			cpu = atoi(optarg);
+			break;
+		case 'g':
+			govs = optarg;
+			break;
+		case 'p':
+			power_file = optarg;
+			break;
+		case 'S':
+			print = 1;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-c cpu] [-g gov,...] "
+				"[-p power_table] [-S] [trace]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	if (optind < argc)
+		read_trace(argv[optind]);
+	else
+		synthetic_trace();
+
+	if (print) {
+		for (i = 0; i < nr_bursts; i++)
+			printf("%u %u%s\n", bursts[i].work_us,
+			       bursts[i].idle_us,
+			       bursts[i].input ? " input" : "");
+		return 0;
+	}
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if (sched_setaffinity(0, sizeof(set), &set))
+		die("sched_setaffinity");
+
+	read_stats(t, &trans);
+	if (power_file)
+		read_power(power_file);
+	for (i = 0; i < nr_bursts; i++)
+		if (bursts[i].input) {
+			uinput_open();
+			break;
+		}
+
+	read_governor(saved, sizeof(saved));
+	calibrate();
+
+	printf("%d bursts on cpu%d, %.0f loops/us at the maximum frequency\n\n",
+	       nr_bursts, cpu, loops_per_us);
+	printf("%-12s %10s %10s %10s %13s %8s\n", "governor", "late us",
+	       "p95 us", "max us", "energy", "trans");
+	for (gov = strtok(govs, ","); gov; gov = strtok(NULL, ","))
+		replay(gov);
+
+	write_file(cpufreq_file("scaling_governor"), saved);
+	if (uinput_fd >= 0) {
+		ioctl(uinput_fd, UI_DEV_DESTROY);
+		close(uinput_fd);
+	}
+	return 0;
+}
@@ -0,0 +1,136 @@
+#!/bin/sh
+#
+# yaffs2-mounttime.sh - measure how long yaffs2 takes to mount on nandsim
+#
+# Loads nandsim with page read, program and erase delays, fills a yaffs2
+# file system on it with files, and then times three kinds of mount:
+#
+#	checkpoint	the state is read back from the checkpoint that the
+#			last unmount wrote, as after a clean shutdown
+#	scan		the checkpoint is ignored (no-checkpoint-read) and every
+#			chunk's tags are read, as after an unclean shutdown
+#	readahead	the same scan with scan-readahead, which reads the
+#			next block's tags while the last one is processed
+#
+# The readahead scan only overlaps anything on an SMP machine: nandsim
+# simulates its delays by busy waiting.
+#
+# Also reports whether the background thread writes a checkpoint by itself
+# once the file system has been idle for yaffs_bg_checkpoint seconds, so
+# that a crash after that would still mount from the checkpoint.
+#
+# Usage: yaffs2-mounttime.sh [-f files] [-k KiB per file] [-r rounds]
+#
+# Must be run as root, with nandsim and yaffs2 built as modules or not
+# loaded yet. Any mtd devices must be free, and nandsim is unloaded on exit.
+
+FILES=200
+KIB=256
+ROUNDS=3
+MNT=/tmp/yaffs2-mounttime.$$
+PARAMS=/sys/module/yaffs/parameters
+
+while getopts f:k:r: opt; do
+	case $opt in
+	f) FILES=$OPTARG ;;
+	k) KIB=$OPTARG ;;
+	r) ROUNDS=$OPTARG ;;
+	*) echo "usage: $0 [-f files] [-k KiB per file] [-r rounds]" >&2
+	   exit 1 ;;
+	esac
+done
+
+die() {
+	echo "$0: $*" >&2
+	exit 1
+}
+
+cleanup() {
+	umount $MNT 2>/dev/null
+	rmdir $MNT 2>/dev/null
+	rmmod nandsim 2>/dev/null
+}
+trap cleanup EXIT
+
+now() {
+	date +%s.%N
+}
+
+# 256MiB of 2KiB pages, 25us page reads, 200us programs, 2ms erases
+modprobe nandsim first_id_byte=0x20 second_id_byte=0xaa \
+	third_id_byte=0x00 fourth_id_byte=0x15 do_delays=1 \
+	access_delay=25 programm_delay=200 erase_delay=2 ||
+	die "cannot load nandsim"
+modprobe yaffs 2>/dev/null
+
+MTD=$(sed -n 's/^mtd\([0-9]*\):.*"NAND simulator.*/\1/p' /proc/mtd | head -1)
+[ -n "$MTD" ] || die "no nandsim partition in /proc/mtd"
+DEV=/dev/mtdblock$MTD
+[ -b $DEV ] || die "$DEV does not exist"
+
+mkdir -p $MNT || die "cannot create $MNT"
+
+echo "filling $FILES files of ${KIB}KiB..."
+mount -t yaffs2 $DEV $MNT || die "cannot mount $DEV"
+i=0
+while [ $i -lt $FILES ]; do
+	dd if=/dev/zero of=$MNT/f$i bs=1k count=$KIB 2>/dev/null ||
+		die "cannot fill $MNT"
+	i=$((i + 1))
+done
+# rewrite some of them, so that the scan has deleted chunks to deal with
+i=0
+while [ $i -lt $FILES ]; do
+	dd if=/dev/zero of=$MNT/f$i bs=1k count=$((KIB / 2)) \
+		conv=notrunc 2>/dev/null
+	i=$((i + 3))
+done
+umount $MNT
+
+timed_mount() {
+	local start end
+
+	sync
+	echo 3 > /proc/sys/vm/drop_caches
+	start=$(now)
+	mount -t yaffs2 ${1:+-o $1} $DEV $MNT || die "cannot mount $DEV"
+	end=$(now)
+	umount $MNT
+	echo "$end - $start" | bc
+}
+
+printf "%-12s" mount
+r=1
+while [ $r -le $ROUNDS ]; do
+	printf " %9s" "round $r"
+	r=$((r + 1))
+done
+printf "\n"
+
+for mode in checkpoint scan readahead; do
+	case $mode in
+	checkpoint) opts= ;;
+	scan) opts=no-checkpoint-read ;;
+	readahead) opts=no-checkpoint-read,scan-readahead ;;
+	esac
+	printf "%-12s" $mode
+	r=1
+	while [ $r -le $ROUNDS ]; do
+		printf " %9.3f" $(timed_mount $opts)
+		r=$((r + 1))
+	done
+	printf "\n"
+done
+
+# Dirty the file system without syncing, wait for it to go idle and see
+# whether a checkpoint got written without anyone asking for one.
+if [ -r $PARAMS/yaffs_bg_checkpoint ]; then
+	idle=$(cat $PARAMS/yaffs_bg_checkpoint)
+	mount -t yaffs2 $DEV $MNT || die "cannot mount $DEV"
+	echo dirty > $MNT/dirty
+	sleep $((idle + 2))
+	grep -q "^isCheckpointed\.* 1$" /proc/yaffs 2>/dev/null &&
+		result=yes || result=no
+	echo "checkpointed after ${idle}s idle: $result"
+	umount $MNT
+fi
@@ -0,0 +1,231 @@
+/*
+ * yaffs2-rwbench.c - measure how yaffs2 page reads scale with readers
+ *
+ * Each reader thread reads its own file over and over, dropping the file
+ * from the page cache before each pass so that every page goes through
+ * yaffs' readpage. Optional writer threads keep rewriting and syncing
+ * files of their own at the same time, which keeps the device busy with
+ * allocation and garbage collection.
+ *
+ * With a single device wide lock the total read rate stays flat as readers
+ * are added. With readpage taking the lock shared it should grow with the
+ * readers, up to what the flash itself can deliver. Everything else still
+ * takes the lock exclusively: writers, and the garbage collection they
+ * cause, hold all reads up and are serialised with each other.
+ *
+ * nandsim makes a convenient device, eg. for 128MiB of 2KiB pages:
+ *
+ *	modprobe nandsim first_id_byte=0x20 second_id_byte=0xa1 \
+ *		third_id_byte=0x00 fourth_id_byte=0x15
+ *	mount -t yaffs2 /dev/mtdblock0 /mnt
+ *
+ * Build: gcc -O2 -Wall -pthread -o yaffs2-rwbench yaffs2-rwbench.c
+ * Usage: yaffs2-rwbench -d dir [-t max_readers] [-w writers] [-m MiB]
+ *			 [-s seconds]
+ */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#define MAX_THREADS	64
+#define BLOCK		4096
+
+static const char *dir;
+static int file_mb = 4;
+static int run_seconds = 5;
+static volatile int stop;
+
+struct worker {
+	pthread_t thread;
+	char path[256];
+	unsigned long long bytes;
+};
+
+static struct worker readers[MAX_THREADS], writers[MAX_THREADS];
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void fill_file(const char *path)
+{
+	char buf[BLOCK];
+	int fd, i;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		die(path);
+	for (i = 0; i < file_mb * 1024 * 1024 / BLOCK; i++) {
+		memset(buf, i, sizeof(buf));
+		if (write(fd, buf, sizeof(buf)) != sizeof(buf))
+			die("write");
+	}
+	if (fsync(fd))
+		die("fsync");
+	close(fd);
+}
+
+static void *reader_fn(void *arg)
+{
+	struct worker *w = arg;
+	char buf[BLOCK];
+	ssize_t n = 0;
+	int fd;
+
+	fd = open(w->path, O_RDONLY);
+	if (fd < 0)
+		die(w->path);
+	while (!stop) {
+		/* make every page of the next pass miss the page cache */
+		posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+		if (lseek(fd, 0, SEEK_SET) < 0)
+			die("lseek");
+		while (!stop && (n = read(fd, buf, sizeof(buf))) > 0)
+			w->bytes += n;
+		if (n < 0)
+			die("read");
+	}
+	close(fd);
+	return NULL;
+}
+
+static void *writer_fn(void *arg)
+{
+	struct worker *w = arg;
+	char buf[BLOCK];
+	int fd, i = 0;
+
+	fd = open(w->path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		die(w->path);
+	while (!stop) {
+		memset(buf, i, sizeof(buf));
+		if (pwrite(fd, buf, sizeof(buf), (off_t)i * BLOCK) < 0)
+			die("pwrite");
+		w->bytes += sizeof(buf);
+		/* rewrite in place, so the old chunks need collecting */
+		if (++i == file_mb * 1024 * 1024 / BLOCK) {
+			i = 0;
+			if (fsync(fd))
+				die("fsync");
+		}
+	}
+	close(fd);
+	return NULL;
+}
+
+static void run(int nr_readers, int nr_writers, double *read_rate,
+		double *write_rate)
+{
+	unsigned long long rd = 0, wr = 0;
+	double start;
+	int i;
+
+	stop = 0;
+	start = now();
+	for (i = 0; i < nr_writers; i++) {
+		writers[i].bytes = 0;
+		if (pthread_create(&writers[i].thread, NULL, writer_fn,
+				   &writers[i]))
+			die("pthread_create");
+	}
+	for (i = 0; i < nr_readers; i++) {
+		readers[i].bytes = 0;
+		if (pthread_create(&readers[i].thread, NULL, reader_fn,
+				   &readers[i]))
+			die("pthread_create");
+	}
+	sleep(run_seconds);
+	stop = 1;
+	for (i = 0; i < nr_readers; i++) {
+		pthread_join(readers[i].thread, NULL);
+		rd += readers[i].bytes;
+	}
+	for (i = 0; i < nr_writers; i++) {
+		pthread_join(writers[i].thread, NULL);
+		wr += writers[i].bytes;
+	}
+
+	*read_rate = rd / (now() - start) / 1048576;
+	*write_rate = wr / (now() - start) / 1048576;
+}
+
+int main(int argc, char **argv)
+{
+	int max_readers = 8, nr_writers = 0, opt, n, i;
+	double base = 0, rd, wr;
+
+	while ((opt = getopt(argc, argv, "d:t:w:m:s:")) != -1) {
+		switch (opt) {
+		case 'd':
+			dir = optarg;
+			break;
+		case 't':
+			max_readers = atoi(optarg);
+			break;
+		case 'w':
+			nr_writers = atoi(optarg);
+			break;
+		case 'm':
+			file_mb = atoi(optarg);
+			break;
+		case 's':
+			run_seconds = atoi(optarg);
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (!dir || max_readers < 1 || max_readers > MAX_THREADS ||
+	    nr_writers < 0 || nr_writers > MAX_THREADS || file_mb < 1 ||
+	    run_seconds < 1)
+		goto usage;
+
+	for (i = 0; i < max_readers; i++) {
+		snprintf(readers[i].path, sizeof(readers[i].path),
+			 "%s/rwbench-r%d", dir, i);
+		fill_file(readers[i].path);
+	}
+	for (i = 0; i < nr_writers; i++)
+		snprintf(writers[i].path, sizeof(writers[i].path),
+			 "%s/rwbench-w%d", dir, i);
+
+	printf("%7s %7s %12s %7s %12s\n", "readers", "writers", "read MiB/s",
+	       "scale", "write MiB/s");
+	for (n = 1; n <= max_readers; n *= 2) {
+		run(n, nr_writers, &rd, &wr);
+		if (!base)
+			base = rd;
+		printf("%7d %7d %12.2f %7.2f %12.2f\n", n, nr_writers, rd,
+		       rd / base, wr);
+		if (n < max_readers && n * 2 > max_readers)
+			n = max_readers / 2;
+	}
+
+	for (i = 0; i < max_readers; i++)
+		unlink(readers[i].path);
+	for (i = 0; i < nr_writers; i++)
+		unlink(writers[i].path);
+	return 0;
+
+usage:
+	fprintf(stderr, "usage: %s -d dir [-t max_readers] [-w writers] "
+		"[-m MiB] [-s seconds]\n", argv[0]);
+	return 1;
+}
@@ -39,6 +39,8 @@ struct slabinfo {
 	unsigned long flush_free_list, flush_free_list_objects, flush_free_list_remote;
 	unsigned long flush_rfree_list, flush_rfree_list_objects;
 	unsigned long flush_slab_free, flush_slab_partial;
+	unsigned long queue_grow, queue_shrink, partial;
+	int hiwater;
 	int numa[MAX_NODES];
 	int numa_partial[MAX_NODES];
 } slabinfo[MAX_SLABS];
@@ -411,6 +413,11 @@ void slab_stats(struct slabinfo *s)
 	printf("FlushR:%8lu, objects %8lu\n",
 		s->flush_rfree_list,
 		s->flush_rfree_list_objects);
+	printf("Queue: hiwater %5d, grown %8lu, shrunk %8lu, partial %lu\n",
+		s->hiwater,
+		s->queue_grow,
+		s->queue_shrink,
+		s->partial);
 }
 
 void report(struct slabinfo *s)
@@ -897,6 +904,10 @@ void read_slab_dir(void)
 			slab->flush_rfree_list_objects = get_obj("flush_rfree_list_objects");
 			slab->flush_slab_free = get_obj("flush_slab_free");
 			slab->flush_slab_partial = get_obj("flush_slab_partial");
+			slab->queue_grow = get_obj("queue_grow");
+			slab->queue_shrink = get_obj("queue_shrink");
+			slab->partial = get_obj("partial");
+			slab->hiwater = get_obj("hiwater");
 
 			chdir("..");
 			slab++;
@@ -28,6 +28,23 @@ static inline void bfq_init_entity(struct bfq_entity *entity,
 	entity->sched_data = &bfqg->sched_data;
 }
 
+/*
+ * Charge @time spent weight-raised by @bfqq to the group it belongs to.
+ * The toplevel group has no entity of its own, so its queues have no parent.
+ */
+static inline void bfq_group_account_raising(struct bfq_queue *bfqq,
+					     unsigned long time)
+{
+	struct bfq_entity *parent = bfqq->entity.parent;
+	struct bfq_group *bfqg;
+
+	if (parent != NULL)
+		bfqg = container_of(parent, struct bfq_group, entity);
+	else
+		bfqg = bfqq->bfqd->root_group;
+	bfqg->raising_time += time;
+}
+
 static struct bfqio_cgroup *cgroup_to_bfqio(struct cgroup *cgroup)
 {
 	return container_of(cgroup_subsys_state(cgroup, bfqio_subsys_id),
@@ -550,6 +567,32 @@ SHOW_FUNCTION(ioprio);
 SHOW_FUNCTION(ioprio_class);
 #undef SHOW_FUNCTION
 
+/*
+ * Time, in msec, that the queues of the cgroup spent weight-raised, summed
+ * over all the devices.  Periods still in progress are not counted yet.
+ */
+static u64 bfqio_cgroup_raised_time_read(struct cgroup *cgroup,
+					 struct cftype *cftype)
+{
+	struct bfqio_cgroup *bgrp;
+	struct bfq_group *bfqg;
+	struct hlist_node *n;
+	u64 ret = 0;
+
+	if (!cgroup_lock_live_group(cgroup))
+		return -ENODEV;
+
+	bgrp = cgroup_to_bfqio(cgroup);
+	rcu_read_lock();
+	hlist_for_each_entry_rcu(bfqg, n, &bgrp->group_data, group_node)
+		ret += jiffies_to_msecs(bfqg->raising_time);
+	rcu_read_unlock();
+
+	cgroup_unlock();
+
+	return ret;
+}
+
 #define STORE_FUNCTION(__VAR, __MIN, __MAX)				\
 static int bfqio_cgroup_##__VAR##_write(struct cgroup *cgroup,		\
 					struct cftype *cftype,		\
@@ -602,6 +645,10 @@ static struct cftype bfqio_files[] = {
 		.read_u64 = bfqio_cgroup_ioprio_class_read,
 		.write_u64 = bfqio_cgroup_ioprio_class_write,
 	},
+	{
+		.name = "raised_time",
+		.read_u64 = bfqio_cgroup_raised_time_read,
+	},
 };
 
 static int bfqio_populate(struct cgroup_subsys *subsys, struct cgroup *cgroup)
@@ -718,6 +765,11 @@ struct cgroup_subsys bfqio_subsys = {
 	.subsys_id = bfqio_subsys_id,
 };
 #else
+static inline void bfq_group_account_raising(struct bfq_queue *bfqq,
+					     unsigned long time)
+{
+}
+
 static inline void bfq_init_entity(struct bfq_entity *entity,
 				   struct bfq_group *bfqg)
 {
@@ -109,6 +109,7 @@ static DEFINE_IDA(cic_index_ida);
 #define BFQ_HW_QUEUE_SAMPLES	32
 
 #define BFQQ_SEEKY(bfqq) ((bfqq)->seek_mean > (8 * 1024))
+#define BFQQ_CLOSE_THR	 (sector_t)(8 * 1024)
 
 /* Min samples used for peak rate estimation (for autotuning). */
 #define BFQ_PEAK_RATE_SAMPLES	32
@@ -127,6 +128,22 @@ static DEFINE_IDA(cic_index_ida);
 #include "bfq-sched.c"
 #include "bfq-cgroup.c"
 
+static inline dev_t bfq_trace_devt(struct bfq_data *bfqd)
+{
+	struct device *dev = bfqd->queue->backing_dev_info.dev;
+
+	return dev != NULL ? dev->devt : 0;
+}
+
+/* Convert a rate in fixed point sectors per usec into sectors per second. */
+static inline u64 bfq_rate_to_sps(u64 rate)
+{
+	return (rate * USEC_PER_SEC) >> BFQ_RATE_SHIFT;
+}
+
+#define CREATE_TRACE_POINTS
+#include "bfq_trace.h"
+
 #define bfq_class_idle(cfqq)	((bfqq)->entity.ioprio_class ==\
 				 IOPRIO_CLASS_IDLE)
 
@@ -283,6 +300,75 @@ static struct request *bfq_find_next_rq(struct bfq_data *bfqd,
 	return bfq_choose_req(bfqd, next, prev);
 }
 
+static struct bfq_queue *
+bfq_rq_pos_tree_lookup(struct bfq_data *bfqd, struct rb_root *root,
+		       sector_t sector, struct rb_node **ret_parent,
+		       struct rb_node ***rb_link)
+{
+	struct rb_node **p, *parent;
+	struct bfq_queue *bfqq = NULL;
+
+	parent = NULL;
+	p = &root->rb_node;
+	while (*p) {
+		struct rb_node **n;
+
+		parent = *p;
+		bfqq = rb_entry(parent, struct bfq_queue, pos_node);
+
+		/*
+		 * Sort strictly based on sector.  Smallest to the left,
+		 * largest to the right.
+		 */
+		if (sector > blk_rq_pos(bfqq->next_rq))
+			n = &(*p)->rb_right;
+		else if (sector < blk_rq_pos(bfqq->next_rq))
+			n = &(*p)->rb_left;
+		else
+			break;
+		p = n;
+		bfqq = NULL;
+	}
+
+	*ret_parent = parent;
+	if (rb_link)
+		*rb_link = p;
+
+	bfq_log(bfqd, "rq_pos_tree_lookup %llu: returning %d",
+		(unsigned long long)sector, bfqq != NULL ? bfqq->pid : 0);
+
+	return bfqq;
+}
+
+/*
+ * Keep @bfqq on the request-position tree, keyed by its next request,
+ * for as long as it is a sync queue with requests pending.
+ */
+static void bfq_rq_pos_tree_add(struct bfq_data *bfqd, struct bfq_queue *bfqq)
+{
+	struct rb_node **p, *parent;
+	struct bfq_queue *__bfqq;
+
+	if (bfqq->pos_root != NULL) {
+		rb_erase(&bfqq->pos_node, bfqq->pos_root);
+		bfqq->pos_root = NULL;
+	}
+
+	if (!bfq_bfqq_sync(bfqq) || bfq_class_idle(bfqq))
+		return;
+	if (bfqq->next_rq == NULL)
+		return;
+
+	bfqq->pos_root = &bfqd->rq_pos_tree;
+	__bfqq = bfq_rq_pos_tree_lookup(bfqd, bfqq->pos_root,
+			blk_rq_pos(bfqq->next_rq), &parent, &p);
+	if (__bfqq == NULL) {
+		rb_link_node(&bfqq->pos_node, parent, p);
+		rb_insert_color(&bfqq->pos_node, bfqq->pos_root);
+	} else
+		bfqq->pos_root = NULL;
+}
+
 static void bfq_del_rq_rb(struct request *rq)
 {
 	struct bfq_queue *bfqq = RQ_BFQQ(rq);
@@ -347,6 +433,58 @@ static void bfq_updated_next_req(struct bfq_data *bfqd,
 	bfq_activate_bfqq(bfqd, bfqq);
 }
 
+/*
+ * Start a weight-raising period for @bfqq, lasting @duration jiffies.  The
+ * new weight is applied when the queue is next activated.
+ */
+static void bfq_start_raising(struct bfq_data *bfqd, struct bfq_queue *bfqq,
+			      unsigned int duration, int soft_rt)
+{
+	bfqq->raising_coeff = bfqd->bfq_raising_coeff;
+	bfqq->raising_cur_max_time = duration;
+	bfqq->raising_start = bfqq->last_rais_start_finish = jiffies;
+	bfqq->raising_periods++;
+	bfqd->raising_periods[soft_rt]++;
+	if (soft_rt)
+		bfq_mark_bfqq_soft_rt(bfqq);
+	else
+		bfq_clear_bfqq_soft_rt(bfqq);
+	bfqq->entity.ioprio_changed = 1;
+}
+
+/*
+ * Charge the current weight-raising period of @bfqq, up to now, to the
+ * queue, the device and the group of the queue.
+ */
+static unsigned long bfq_account_raising(struct bfq_data *bfqd,
+					 struct bfq_queue *bfqq)
+{
+	unsigned long raised = jiffies - bfqq->raising_start;
+
+	bfqq->raising_time += raised;
+	bfqd->raising_time += raised;
+	bfq_group_account_raising(bfqq, raised);
+	return raised;
+}
+
+/*
+ * End the weight-raising period of @bfqq and account for the time it
+ * lasted.  The caller is responsible for applying the new weight if the
+ * queue is already active.
+ */
+static void bfq_end_raising(struct bfq_data *bfqd, struct bfq_queue *bfqq)
+{
+	unsigned long raised = bfq_account_raising(bfqd, bfqq);
+
+	bfq_clear_bfqq_soft_rt(bfqq);
+	bfqq->raising_coeff = 1;
+	bfqq->last_rais_start_finish = jiffies;
+	bfqq->entity.ioprio_changed = 1;
+
+	bfq_log_bfqq(bfqd, bfqq, "wrais ending after %u msec",
+		     jiffies_to_msecs(raised));
+}
+
 static void bfq_add_rq_rb(struct request *rq)
 {
 	struct bfq_queue *bfqq = RQ_BFQQ(rq);
@@ -354,6 +492,7 @@ static void bfq_add_rq_rb(struct request *rq)
 	struct bfq_data *bfqd = bfqq->bfqd;
 	struct request *__alias, *next_rq;
 	unsigned long old_raising_coeff = bfqq->raising_coeff;
+	int idle_for_long_time, soft_rt;
 
 	bfq_log_bfqq(bfqd, bfqq, "add_rq_rb %d", rq_is_sync(rq));
 	bfqq->queued[rq_is_sync(rq)]++;
@@ -373,25 +512,48 @@ static void bfq_add_rq_rb(struct request *rq)
 	BUG_ON(next_rq == NULL);
 	bfqq->next_rq = next_rq;
 
+	/*
+	 * Adjust the position of the queue, if next_rq changed.
+	 */
+	if (next_rq == rq)
+		bfq_rq_pos_tree_add(bfqd, bfqq);
+
 	if (!bfq_bfqq_busy(bfqq)) {
 		entity->budget = max_t(bfq_service_t, bfqq->max_budget,
 				       bfq_serv_to_charge(next_rq, bfqq));
 
 		if (! bfqd->low_latency)
 			goto add_bfqq_busy;
+
 		/*
-		 * If the queue is not being boosted and has been idle
-		 * for enough time, start a boosting period
+		 * A queue restarting after having been idle for long is
+		 * deemed interactive, one that comes back no earlier than
+		 * its service rate allows for a soft real-time application
+		 * is deemed soft real-time.  Both get a boosting period;
+		 * the one of a soft real-time queue is short, but renewed
+		 * as long as the queue keeps behaving as such.
 		 */
-		if(old_raising_coeff == 1 &&
- 		    bfqq->last_rais_start_finish +
- 		    bfqd->bfq_raising_min_idle_time < jiffies) {
- 			bfqq->raising_coeff = bfqd->bfq_raising_coeff;
- 			entity->ioprio_changed = 1;
- 			bfq_log_bfqq(bfqd, bfqq,
- 				     "wrais starting at %lu msec",
- 				     bfqq->last_rais_start_finish);
-  		}
+		idle_for_long_time = bfqq->last_rais_start_finish +
+			bfqd->bfq_raising_min_idle_time < jiffies;
+		soft_rt = bfqd->bfq_raising_max_softrt_rate > 0 &&
+			bfqq->soft_rt_next_start < jiffies;
+
+		if (old_raising_coeff == 1 && (idle_for_long_time || soft_rt)) {
+			bfq_start_raising(bfqd, bfqq, idle_for_long_time ?
+					  bfqd->bfq_raising_max_time :
+					  bfqd->bfq_raising_rt_max_time,
+					  !idle_for_long_time);
+			bfq_log_bfqq(bfqd, bfqq,
+				     "wrais starting, %s, for %u msec",
+				     idle_for_long_time ? "interactive" :
+				     "soft rt", jiffies_to_msecs(
+				     bfqq->raising_cur_max_time));
+		} else if (old_raising_coeff > 1 && bfq_bfqq_soft_rt(bfqq)) {
+			if (soft_rt)
+				bfqq->last_rais_start_finish = jiffies;
+			else
+				bfq_end_raising(bfqd, bfqq);
+		}
 add_bfqq_busy:
 		bfq_add_bfqq_busy(bfqd, bfqq);
 	} else
@@ -400,10 +562,12 @@ add_bfqq_busy:
  	if (! bfqd->low_latency)
  		return;
  
- 	if(old_raising_coeff == 1 ||
- 	   (bfqd->bfq_raising_max_softrt_rate > 0 &&
- 		bfqq->soft_rt_next_start < jiffies))
- 		bfqq->last_rais_start_finish = jiffies;
+	/*
+	 * Outside boosting periods, keep track of the last arrival, to
+	 * tell how long the queue has been idle when it next restarts.
+	 */
+	if (bfqq->raising_coeff == 1)
+		bfqq->last_rais_start_finish = jiffies;
 }
 
 static void bfq_reposition_rq_rb(struct bfq_queue *bfqq, struct request *rq)
@@ -459,6 +623,7 @@ static void bfq_remove_request(struct request *rq)
 	if (bfqq->next_rq == rq) {
 		bfqq->next_rq = bfq_find_next_rq(bfqd, bfqq, rq);
 		bfq_updated_next_req(bfqd, bfqq);
+		bfq_rq_pos_tree_add(bfqd, bfqq);
 	}
 
 	list_del_init(&rq->queuelist);
@@ -887,6 +1052,9 @@ static int bfq_update_peak_rate(struct bfq_data *bfqd, struct bfq_queue *bfqq,
 	 * the peak rate estimation.
 	 */
 	if (usecs > 20000) {
+		u64 sample = bw;
+		int changed = 0;
+
 		if (bw > bfqd->peak_rate ||
 		   (!BFQQ_SEEKY(bfqq) &&
 		    reason == BFQ_BFQQ_BUDGET_TIMEOUT)) {
@@ -900,7 +1068,7 @@ static int bfq_update_peak_rate(struct bfq_data *bfqd, struct bfq_queue *bfqq,
 			bfqd->peak_rate *= 7;
 			do_div(bfqd->peak_rate, 8);
 			bfqd->peak_rate += bw;
-			update = 1;
+			update = changed = 1;
 			bfq_log(bfqd, "new peak_rate=%llu", bfqd->peak_rate);
 		}
 
@@ -916,6 +1084,7 @@ static int bfq_update_peak_rate(struct bfq_data *bfqd, struct bfq_queue *bfqq,
 			bfq_log(bfqd, "new max_budget=%lu",
 				bfqd->bfq_max_budget);
 		}
+		trace_bfq_peak_rate(bfqd, sample, usecs, changed);
 	}
 
 	/*
@@ -949,6 +1118,23 @@ static int bfq_update_peak_rate(struct bfq_data *bfqd, struct bfq_queue *bfqq,
 	return expected > (4 * bfqq->entity.budget) / 3;
 }
 
+/*
+ * Keep a running average of the fraction of their budgets that queues use
+ * before expiring, in thousandths, with the same 7/8 low-pass filter as
+ * the peak rate.
+ */
+static void bfq_update_slice_util(struct bfq_data *bfqd, bfq_service_t budget,
+				  bfq_service_t service)
+{
+	unsigned long util;
+
+	if (budget == 0)
+		return;
+
+	util = min_t(unsigned long, service, budget) * 1000 / budget;
+	bfqd->slice_util = (7 * bfqd->slice_util + util) / 8;
+}
+
 /**
  * bfq_bfqq_expire - expire a queue.
  * @bfqd: device owning the queue.
@@ -985,6 +1171,8 @@ static void bfq_bfqq_expire(struct bfq_data *bfqd,
 			    enum bfqq_expiration reason)
 {
 	int slow;
+	bfq_service_t budget = bfqq->entity.budget;
+	bfq_service_t service = bfqq->entity.service;
 	BUG_ON(bfqq != bfqd->active_queue);
 
 	/* Update disk peak rate for autotuning and check whether the
@@ -1019,12 +1207,22 @@ static void bfq_bfqq_expire(struct bfq_data *bfqd,
 		else
 			bfqq->soft_rt_next_start = -1; /* infinity */
 	}
+	/*
+	 * If the queue is shared between several processes, check that
+	 * they are still issuing I/O within the mean seek distance; if
+	 * not, it is time to break the queue apart again.
+	 */
+	if (bfq_bfqq_coop(bfqq) && BFQQ_SEEKY(bfqq))
+		bfq_mark_bfqq_split_coop(bfqq);
+
 	bfq_log_bfqq(bfqd, bfqq,
 		"expire (%d, slow %d, num_disp %d, idle_win %d)", reason, slow,
 		bfqq->dispatched, bfq_bfqq_idle_window(bfqq));
 
 	/* Increase, decrease or leave budget unchanged according to reason */
 	__bfq_bfqq_recalc_budget(bfqd, bfqq, reason);
+	trace_bfq_expire(bfqd, bfqq, reason, slow, budget, service);
+	bfq_update_slice_util(bfqd, budget, service);
 	__bfq_bfqq_expire(bfqd, bfqq);
 }
 
@@ -1060,13 +1258,174 @@ static inline int bfq_may_expire_for_budg_timeout(struct bfq_queue *bfqq)
 		bfq_bfqq_budget_timeout(bfqq);
 }
 
+static inline sector_t bfq_dist_from_last(struct bfq_data *bfqd,
+					  struct request *rq)
+{
+	if (blk_rq_pos(rq) >= bfqd->last_position)
+		return blk_rq_pos(rq) - bfqd->last_position;
+	else
+		return bfqd->last_position - blk_rq_pos(rq);
+}
+
+static inline int bfq_rq_close(struct bfq_data *bfqd, struct request *rq)
+{
+	return bfq_dist_from_last(bfqd, rq) <= BFQQ_CLOSE_THR;
+}
+
+/*
+ * Return the queue whose next request is the closest to the last
+ * position served on the device, if it is close enough.
+ */
+static struct bfq_queue *bfqq_close(struct bfq_data *bfqd)
+{
+	struct rb_root *root = &bfqd->rq_pos_tree;
+	struct rb_node *parent, *node;
+	struct bfq_queue *__bfqq;
+	sector_t sector = bfqd->last_position;
+
+	if (RB_EMPTY_ROOT(root))
+		return NULL;
+
+	/*
+	 * First, if we find a request starting at the end of the last
+	 * request, choose it.
+	 */
+	__bfqq = bfq_rq_pos_tree_lookup(bfqd, root, sector, &parent, NULL);
+	if (__bfqq != NULL)
+		return __bfqq;
+
+	/*
+	 * If the exact sector wasn't found, the parent of the NULL leaf
+	 * will contain the closest sector (rq_pos_tree sorted by next_request
+	 * position).
+	 */
+	__bfqq = rb_entry(parent, struct bfq_queue, pos_node);
+	if (bfq_rq_close(bfqd, __bfqq->next_rq))
+		return __bfqq;
+
+	if (blk_rq_pos(__bfqq->next_rq) < sector)
+		node = rb_next(&__bfqq->pos_node);
+	else
+		node = rb_prev(&__bfqq->pos_node);
+	if (node == NULL)
+		return NULL;
+
+	__bfqq = rb_entry(node, struct bfq_queue, pos_node);
+	if (bfq_rq_close(bfqd, __bfqq->next_rq))
+		return __bfqq;
+
+	return NULL;
+}
+
+/*
+ * bfq_close_cooperator - look for a queue cooperating with @cur_bfqq.
+ * @bfqd: the device data.
+ * @cur_bfqq: the active queue, just run out of requests.
+ *
+ * Several processes reading interleaved parts of the same region, each
+ * from its own queue, look sequential to the device only if their
+ * requests are served together: idling on each queue in turn destroys
+ * that.  A queue with a request pending close to where the active one
+ * stopped is such a cooperator, if both are sync, sequential, and would
+ * be served in the same class and group, so that merging them does not
+ * alter the service they get.
+ */
+static struct bfq_queue *bfq_close_cooperator(struct bfq_data *bfqd,
+					      struct bfq_queue *cur_bfqq)
+{
+	struct bfq_queue *bfqq;
+
+	/*
+	 * A valid cooperator must be sync and sequential, the same goes
+	 * for the queue it would be merged with.
+	 */
+	if (!bfq_bfqq_sync(cur_bfqq) || BFQQ_SEEKY(cur_bfqq))
+		return NULL;
+
+	bfqq = bfqq_close(bfqd);
+	if (bfqq == NULL || bfqq == cur_bfqq)
+		return NULL;
+
+	if (bfqq->entity.sched_data != cur_bfqq->entity.sched_data)
+		return NULL;
+	if (bfqq->entity.ioprio_class != cur_bfqq->entity.ioprio_class)
+		return NULL;
+	if (!bfq_bfqq_sync(bfqq) || BFQQ_SEEKY(bfqq))
+		return NULL;
+
+	return bfqq;
+}
+
+/*
+ * The references a queue gets from the processes using it, as opposed
+ * to the ones from its allocated requests and from the scheduler.
+ */
+static int bfqq_process_refs(struct bfq_queue *bfqq)
+{
+	int process_refs, io_refs;
+
+	io_refs = bfqq->allocated[READ] + bfqq->allocated[WRITE];
+	process_refs = atomic_read(&bfqq->ref) - io_refs - bfqq->entity.on_st;
+	BUG_ON(process_refs < 0);
+	return process_refs;
+}
+
+/*
+ * Schedule @bfqq and @new_bfqq to be merged.  The merge itself is done
+ * by bfq_set_request(), in the context of each of the processes, when
+ * they allocate their next request.
+ */
+static void bfq_setup_merge(struct bfq_queue *bfqq, struct bfq_queue *new_bfqq)
+{
+	int process_refs, new_process_refs;
+	struct bfq_queue *__bfqq;
+
+	/*
+	 * If there are no process references on the new_bfqq, then it is
+	 * unsafe to follow the ->new_bfqq chain as other bfqq's in the chain
+	 * may have dropped their last reference (not just their last process
+	 * reference).
+	 */
+	if (!bfqq_process_refs(new_bfqq))
+		return;
+
+	/* Avoid a circular list and skip interim queue merges. */
+	while ((__bfqq = new_bfqq->new_bfqq) != NULL) {
+		if (__bfqq == bfqq)
+			return;
+		new_bfqq = __bfqq;
+	}
+
+	process_refs = bfqq_process_refs(bfqq);
+	new_process_refs = bfqq_process_refs(new_bfqq);
+	/*
+	 * If the process for the bfqq has gone away, there is no
+	 * sense in merging the queues.
+	 */
+	if (process_refs == 0 || new_process_refs == 0)
+		return;
+
+	/*
+	 * Merge in the direction of the lesser amount of work.
+	 */
+	if (new_process_refs >= process_refs) {
+		bfqq->new_bfqq = new_bfqq;
+		atomic_add(process_refs, &new_bfqq->ref);
+	} else {
+		new_bfqq->new_bfqq = bfqq;
+		atomic_add(new_process_refs, &bfqq->ref);
+	}
+	bfq_log_bfqq(bfqq->bfqd, bfqq, "scheduling merge with queue %d",
+		     new_bfqq->pid);
+}
+
 /*
  * Select a queue for service.  If we have a current active queue,
  * check whether to continue servicing it, or retrieve and set a new one.
  */
 static struct bfq_queue *bfq_select_queue(struct bfq_data *bfqd)
 {
-	struct bfq_queue *bfqq;
+	struct bfq_queue *bfqq, *new_bfqq;
 	struct request *next_rq;
 	enum bfqq_expiration reason = BFQ_BFQQ_BUDGET_TIMEOUT;
 
@@ -1115,11 +1474,26 @@ static struct bfq_queue *bfq_select_queue(struct bfq_data *bfqd)
 	}
 
 	/*
-	 * No requests pending.  If the active queue still has
-	 * requests in flight or is idling for a new request, then keep it.
+	 * No requests pending.  If another queue has a request waiting
+	 * close to where the active one stopped, the two are likely to be
+	 * cooperating: schedule them to be merged, so that their requests
+	 * end up in the same queue, and don't idle on a queue the process
+	 * is about to leave.
 	 */
-	if (timer_pending(&bfqd->idle_slice_timer) ||
-	    (bfqq->dispatched != 0 && bfq_bfqq_idle_window(bfqq))) {
+	new_bfqq = bfq_close_cooperator(bfqd, bfqq);
+	if (new_bfqq != NULL) {
+		if (bfqq->new_bfqq == NULL)
+			bfq_setup_merge(bfqq, new_bfqq);
+		if (timer_pending(&bfqd->idle_slice_timer)) {
+			bfq_clear_bfqq_wait_request(bfqq);
+			del_timer(&bfqd->idle_slice_timer);
+		}
+	} else if (timer_pending(&bfqd->idle_slice_timer) ||
+		   (bfqq->dispatched != 0 && bfq_bfqq_idle_window(bfqq))) {
+		/*
+		 * If the active queue still has requests in flight or
+		 * is idling for a new request, then keep it.
+		 */
 		bfqq = NULL;
 		goto keep_queue;
 	}
@@ -1175,10 +1549,10 @@ static int __bfq_dispatch_requests(struct bfq_data *bfqd,
 			struct bfq_entity *entity = &bfqq->entity;
 
 			bfq_log_bfqq(bfqd, bfqq,
-				"raising period dur %llu/%lu msec, "
-				"old raising coeff %lu, w %lu(%lu)",
+				"raising period dur %llu/%u msec, "
+				"old raising coeff %u, w %u(%u)",
 				jiffies - bfqq->last_rais_start_finish,
-				bfqd->bfq_raising_max_time,
+				bfqq->raising_cur_max_time,
 				bfqq->raising_coeff,
 				bfqq->entity.weight, bfqq->entity.orig_weight);
 
@@ -1192,11 +1566,8 @@ static int __bfq_dispatch_requests(struct bfq_data *bfqd,
 			 * of this weight-raising period, stop it
 			 */
 			if (jiffies - bfqq->last_rais_start_finish >
-				bfqd->bfq_raising_max_time) {
-				bfqq->raising_coeff = 1;
-				bfqq->last_rais_start_finish = jiffies;
-
-				entity->ioprio_changed = 1;
+				bfqq->raising_cur_max_time) {
+				bfq_end_raising(bfqd, bfqq);
 				__bfq_entity_update_weight_prio(
 					bfq_entity_service_tree(entity),
 					entity);
@@ -1347,11 +1718,37 @@ static void bfq_put_queue(struct bfq_queue *bfqq)
 	BUG_ON(bfq_bfqq_busy(bfqq));
 	BUG_ON(bfqd->active_queue == bfqq);
 
-	bfq_log_bfqq(bfqd, bfqq, "put_queue: %p freed", bfqq);
+	if (bfqq->raising_coeff > 1)
+		bfq_account_raising(bfqd, bfqq);
+	bfq_log_bfqq(bfqd, bfqq, "put_queue: %p freed, raised %u msec "
+		     "in %u periods", bfqq,
+		     jiffies_to_msecs(bfqq->raising_time),
+		     bfqq->raising_periods);
 
 	kmem_cache_free(bfq_pool, bfqq);
 }
 
+static void bfq_put_cooperator(struct bfq_queue *bfqq)
+{
+	struct bfq_queue *__bfqq, *next;
+
+	/*
+	 * If this queue was scheduled to merge with another queue, be
+	 * sure to drop the reference taken on that queue (and others in
+	 * the merge chain).  See bfq_setup_merge and bfq_merge_bfqqs.
+	 */
+	__bfqq = bfqq->new_bfqq;
+	while (__bfqq != NULL) {
+		if (__bfqq == bfqq) {
+			WARN(1, "bfqq->new_bfqq loop detected.\n");
+			break;
+		}
+		next = __bfqq->new_bfqq;
+		bfq_put_queue(__bfqq);
+		__bfqq = next;
+	}
+}
+
 static void bfq_exit_bfqq(struct bfq_data *bfqd, struct bfq_queue *bfqq)
 {
 	if (bfqq == bfqd->active_queue) {
@@ -1360,6 +1757,9 @@ static void bfq_exit_bfqq(struct bfq_data *bfqd, struct bfq_queue *bfqq)
 	}
 
 	bfq_log_bfqq(bfqd, bfqq, "exit_bfqq: %p, %d", bfqq, bfqq->ref);
+
+	bfq_put_cooperator(bfqq);
+
 	bfq_put_queue(bfqq);
 }
 
@@ -1508,6 +1908,8 @@ retry:
 		bfqq->raising_coeff = 1;
 		bfqq->last_rais_start_finish = 0;
 		bfqq->soft_rt_next_start = -1;
+		bfqq->raising_time = 0;
+		bfqq->raising_periods = 0;
 
 		bfq_log_bfqq(bfqd, bfqq, "allocated");
 	}
@@ -1886,6 +2288,41 @@ static void bfq_put_request(struct request *rq)
 	}
 }
 
+static struct bfq_queue *bfq_merge_bfqqs(struct bfq_data *bfqd,
+					 struct cfq_io_context *cic,
+					 struct bfq_queue *bfqq)
+{
+	bfq_log_bfqq(bfqd, bfqq, "merging with queue %d",
+		     bfqq->new_bfqq->pid);
+	cic_set_bfqq(cic, bfqq->new_bfqq, 1);
+	bfq_mark_bfqq_coop(bfqq->new_bfqq);
+	bfq_put_queue(bfqq);
+	return cic_to_bfqq(cic, 1);
+}
+
+/*
+ * Returns NULL if a new bfqq should be allocated, or the old bfqq if this
+ * was the last process referring to said bfqq.
+ */
+static struct bfq_queue *bfq_split_bfqq(struct cfq_io_context *cic,
+					struct bfq_queue *bfqq)
+{
+	bfq_log_bfqq(bfqq->bfqd, bfqq, "splitting queue");
+	if (bfqq_process_refs(bfqq) == 1) {
+		bfqq->pid = current->pid;
+		bfq_clear_bfqq_coop(bfqq);
+		bfq_clear_bfqq_split_coop(bfqq);
+		return bfqq;
+	}
+
+	cic_set_bfqq(cic, NULL, 1);
+
+	bfq_put_cooperator(bfqq);
+
+	bfq_put_queue(bfqq);
+	return NULL;
+}
+
 /*
  * Allocate bfq data structures associated with this request.
  */
@@ -1911,6 +2348,7 @@ static int bfq_set_request(struct request_queue *q, struct request *rq,
 
 	bfqg = bfq_cic_update_cgroup(cic);
 
+new_queue:
 	bfqq = cic_to_bfqq(cic, is_sync);
 	if (bfqq == NULL) {
 		bfqq = bfq_get_queue(bfqd, bfqg, is_sync, cic->ioc, gfp_mask);
@@ -1918,6 +2356,25 @@ static int bfq_set_request(struct request_queue *q, struct request *rq,
 			goto queue_fail;
 
 		cic_set_bfqq(cic, bfqq, is_sync);
+	} else {
+		/*
+		 * If the queue was seeky for too long, break it apart.
+		 */
+		if (bfq_bfqq_coop(bfqq) && bfq_bfqq_split_coop(bfqq)) {
+			bfq_log_bfqq(bfqd, bfqq, "breaking apart bfqq");
+			bfqq = bfq_split_bfqq(cic, bfqq);
+			if (bfqq == NULL)
+				goto new_queue;
+		}
+
+		/*
+		 * Check to see if this queue is scheduled to merge with
+		 * another closely cooperating queue.  The merging of queues
+		 * happens here as it must be done in process context.
+		 * The reference on new_bfqq was taken in bfq_setup_merge.
+		 */
+		if (bfqq->new_bfqq != NULL)
+			bfqq = bfq_merge_bfqqs(bfqd, cic, bfqq);
 	}
 
 	bfqq->allocated[rw]++;
@@ -2137,6 +2594,8 @@ static void *bfq_init_queue(struct request_queue *q)
 	INIT_LIST_HEAD(&bfqd->active_list);
 	INIT_LIST_HEAD(&bfqd->idle_list);
 
+	bfqd->rq_pos_tree = RB_ROOT;
+
 	bfqd->hw_tag = 1;
 
 	bfqd->bfq_max_budget = bfq_default_max_budget;
@@ -2156,6 +2615,7 @@ static void *bfq_init_queue(struct request_queue *q)
 
 	bfqd->bfq_raising_coeff = 20;
 	bfqd->bfq_raising_max_time = msecs_to_jiffies(7500);
+	bfqd->bfq_raising_rt_max_time = msecs_to_jiffies(300);
 	bfqd->bfq_raising_min_idle_time = msecs_to_jiffies(2000);
 	bfqd->bfq_raising_max_softrt_rate = 7000;
 
@@ -2202,27 +2662,97 @@ static ssize_t bfq_var_store(unsigned int *var, const char *page, size_t count)
 	return count;
 }
 
+/* Total time @bfqq has spent weight-raised, current period included. */
+static unsigned int bfq_bfqq_raised_msecs(struct bfq_queue *bfqq)
+{
+	unsigned long raised = bfqq->raising_time;
+
+	if (bfqq->raising_coeff > 1)
+		raised += jiffies - bfqq->raising_start;
+	return jiffies_to_msecs(raised);
+}
+
+static ssize_t bfq_weights_show_list(struct list_head *list, char *page,
+				     ssize_t num_char)
+{
+	struct bfq_queue *bfqq;
+
+	list_for_each_entry(bfqq, list, bfqq_list) {
+		if (num_char > PAGE_SIZE - 64)
+			break;
+		num_char += sprintf(page + num_char,
+			"pid%d: weight %hu, raised %u msec in %u periods\n",
+			bfqq->pid,
+			bfqq->entity.weight,
+			bfq_bfqq_raised_msecs(bfqq),
+			bfqq->raising_periods);
+	}
+	return num_char;
+}
+
 static ssize_t bfq_weights_show(struct elevator_queue *e, char *page)
 {
-        struct bfq_queue *bfqq;
 	struct bfq_data *bfqd = e->elevator_data;
 	ssize_t num_char = 0;
 
-        num_char += sprintf(page + num_char, "Active:\n");
-        list_for_each_entry(bfqq, &bfqd->active_list, bfqq_list) {
-                num_char += sprintf(page + num_char, "pid%d: weight %hu\n",
-			bfqq->pid,
-			bfqq->entity.weight);
-        }
-        num_char += sprintf(page + num_char, "Idle:\n");
-        list_for_each_entry(bfqq, &bfqd->idle_list, bfqq_list) {
-                num_char += sprintf(page + num_char, "pid%d: weight %hu\n",
-			bfqq->pid,
-			bfqq->entity.weight);
-        }
+	spin_lock_irq(bfqd->queue->queue_lock);
+	num_char += sprintf(page + num_char, "Active:\n");
+	num_char = bfq_weights_show_list(&bfqd->active_list, page, num_char);
+	num_char += sprintf(page + num_char, "Idle:\n");
+	num_char = bfq_weights_show_list(&bfqd->idle_list, page, num_char);
+	spin_unlock_irq(bfqd->queue->queue_lock);
 	return num_char;
 }
 
+static ssize_t bfq_raising_stats_show(struct elevator_queue *e, char *page)
+{
+	struct bfq_data *bfqd = e->elevator_data;
+	struct list_head *lists[] = { &bfqd->active_list, &bfqd->idle_list };
+	struct bfq_queue *bfqq;
+	u64 raised;
+	int nr_raised = 0, i;
+
+	spin_lock_irq(bfqd->queue->queue_lock);
+	raised = bfqd->raising_time;
+	for (i = 0; i < ARRAY_SIZE(lists); i++)
+		list_for_each_entry(bfqq, lists[i], bfqq_list) {
+			if (bfqq->raising_coeff > 1) {
+				raised += jiffies - bfqq->raising_start;
+				nr_raised++;
+			}
+		}
+	spin_unlock_irq(bfqd->queue->queue_lock);
+
+	return sprintf(page, "interactive periods: %lu\n"
+		       "soft rt periods: %lu\n"
+		       "raised queues: %d\n"
+		       "raised time: %u msec\n",
+		       bfqd->raising_periods[0], bfqd->raising_periods[1],
+		       nr_raised, jiffies_to_msecs((unsigned long)raised));
+}
+
+static ssize_t bfq_peak_rate_show(struct elevator_queue *e, char *page)
+{
+	struct bfq_data *bfqd = e->elevator_data;
+
+	return sprintf(page, "%llu\n",
+		       (unsigned long long)bfq_rate_to_sps(bfqd->peak_rate));
+}
+
+static ssize_t bfq_cur_max_budget_show(struct elevator_queue *e, char *page)
+{
+	struct bfq_data *bfqd = e->elevator_data;
+
+	return sprintf(page, "%lu\n", bfqd->bfq_max_budget);
+}
+
+static ssize_t bfq_slice_util_show(struct elevator_queue *e, char *page)
+{
+	struct bfq_data *bfqd = e->elevator_data;
+
+	return sprintf(page, "%lu\n", bfqd->slice_util / 10);
+}
+
 #define SHOW_FUNCTION(__FUNC, __VAR, __CONV)				\
 static ssize_t __FUNC(struct elevator_queue *e, char *page)		\
 {									\
@@ -2245,6 +2775,7 @@ SHOW_FUNCTION(bfq_timeout_async_show, bfqd->bfq_timeout[BLK_RW_ASYNC], 1);
 SHOW_FUNCTION(bfq_low_latency_show, bfqd->low_latency, 0);
 SHOW_FUNCTION(bfq_raising_coeff_show, bfqd->bfq_raising_coeff, 0);
 SHOW_FUNCTION(bfq_raising_max_time_show, bfqd->bfq_raising_max_time, 1);
+SHOW_FUNCTION(bfq_raising_rt_max_time_show, bfqd->bfq_raising_rt_max_time, 1);
 SHOW_FUNCTION(bfq_raising_min_idle_time_show, bfqd->bfq_raising_min_idle_time,
 	1);
 SHOW_FUNCTION(bfq_raising_max_softrt_rate_show,
@@ -2285,6 +2816,8 @@ STORE_FUNCTION(bfq_raising_coeff_store, &bfqd->bfq_raising_coeff, 1,
  		INT_MAX, 0);
 STORE_FUNCTION(bfq_raising_max_time_store, &bfqd->bfq_raising_max_time, 0,
  		INT_MAX, 1);
+STORE_FUNCTION(bfq_raising_rt_max_time_store, &bfqd->bfq_raising_rt_max_time,
+		0, INT_MAX, 1);
 STORE_FUNCTION(bfq_raising_min_idle_time_store,
  	       &bfqd->bfq_raising_min_idle_time, 0, INT_MAX, 1);
 STORE_FUNCTION(bfq_raising_max_softrt_rate_store,
@@ -2363,6 +2896,8 @@ static ssize_t bfq_low_latency_store(struct elevator_queue *e,
 
 #define BFQ_ATTR(name) \
 	__ATTR(name, S_IRUGO|S_IWUSR, bfq_##name##_show, bfq_##name##_store)
+#define BFQ_ATTR_RO(name) \
+	__ATTR(name, S_IRUGO, bfq_##name##_show, NULL)
 
 static struct elv_fs_entry bfq_attrs[] = {
 	BFQ_ATTR(quantum),
@@ -2378,9 +2913,14 @@ static struct elv_fs_entry bfq_attrs[] = {
 	BFQ_ATTR(low_latency),
 	BFQ_ATTR(raising_coeff),
 	BFQ_ATTR(raising_max_time),
+	BFQ_ATTR(raising_rt_max_time),
 	BFQ_ATTR(raising_min_idle_time),
 	BFQ_ATTR(raising_max_softrt_rate),
 	BFQ_ATTR(weights),
+	BFQ_ATTR_RO(raising_stats),
+	BFQ_ATTR_RO(peak_rate),
+	BFQ_ATTR_RO(cur_max_budget),
+	BFQ_ATTR_RO(slice_util),
 	__ATTR_NULL
 };
 
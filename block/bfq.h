@@ -180,12 +180,17 @@ struct bfq_group;
  * @unplug_work: delayed work to restart dispatching on the request queue.
  * @active_queue: bfq_queue under service.
  * @active_cic: cfq_io_context (cic) associated with the @active_queue.
+ * @rq_pos_tree: rbtree of the sync queues with pending requests, sorted by
+ *               the position of their next request; used to look for
+ *               cooperating queues.
  * @last_position: on-disk position of the last served request.
  * @last_budget_start: beginning of the last budget.
  * @last_idling_start: beginning of the last idle slice.
  * @peak_rate: peak transfer rate observed for a budget.
  * @peak_rate_samples: number of samples used to calculate @peak_rate.
  * @bfq_max_budget: maximum budget allotted to a bfq_queue before rescheduling.
+ * @slice_util: running average of the fraction of their budget that queues
+ *              use before expiring, in thousandths.
  * @cic_index: use small consequent indexes as radix tree keys to reduce depth
  * @cic_list: list of all the cics active on the bfq_data device.
  * @group_list: list of all the bfq_groups active on the device.
@@ -210,10 +215,17 @@ struct bfq_group;
  * @bfq_raising_coeff: Maximum factor by which the weight of a boosted
  *                            queue is multiplied
  * @bfq_raising_max_time: maximum duration of a weight-raising period (jiffies)
+ * @bfq_raising_rt_max_time: maximum duration of a weight-raising period for
+ *			     soft real-time queues, renewed as long as the
+ *			     queue keeps behaving as such (jiffies)
  * @bfq_raising_min_idle_time: minimum idle period after which weight-raising
  *			       may be reactivated for a queue (in jiffies)
  * @bfq_raising_max_softrt_rate: max service-rate for a soft real-time queue,
  *			         sectors per seconds
+ * @raising_periods: number of weight-raising periods started, for
+ *		     interactive (index 0) and soft real-time (index 1)
+ *		     queues.
+ * @raising_time: total time spent weight-raised by the queues (jiffies).
  *
  * All the fields are protected by the @queue lock.
  */
@@ -239,6 +251,8 @@ struct bfq_data {
 	struct bfq_queue *active_queue;
 	struct cfq_io_context *active_cic;
 
+	struct rb_root rq_pos_tree;
+
 	sector_t last_position;
 
 	ktime_t last_budget_start;
@@ -246,6 +260,7 @@ struct bfq_data {
 	int peak_rate_samples;
 	u64 peak_rate;
 	bfq_service_t bfq_max_budget;
+	unsigned long slice_util;
 
 	unsigned int cic_index;
 	struct list_head cic_list;
@@ -269,8 +284,13 @@ struct bfq_data {
 	/* parameters of the low_latency heuristics */
 	unsigned int bfq_raising_coeff;
 	unsigned int bfq_raising_max_time;
+	unsigned int bfq_raising_rt_max_time;
 	unsigned int bfq_raising_min_idle_time;
 	unsigned int bfq_raising_max_softrt_rate;
+
+	/* weight-raising statistics */
+	unsigned long raising_periods[2];
+	u64 raising_time;
 };
 
 /**
@@ -296,8 +316,19 @@ struct bfq_data {
  * @seek_mean: mean seek distance
  * @last_request_pos: position of the last request enqueued
  * @pid: pid of the process owning the queue, used for logging purposes.
- * @last_rais_start_time: last (idle -> weight-raised) transition attempt
- * @high_weight_budget: number of sectors left to serve with boosted weight
+ * @pos_node: request-position tree member (see bfq_data's @rq_pos_tree).
+ * @pos_root: request-position tree root, %NULL if not on the tree.
+ * @new_bfqq: shared bfq_queue this queue is scheduled to be merged into.
+ * @last_rais_start_finish: start of the current weight-raising period, or
+ *			    last (idle -> weight-raised) transition attempt.
+ * @soft_rt_next_start: earliest time at which the queue may be considered
+ *			soft real-time when it becomes busy again.
+ * @raising_coeff: current weight-raising factor, 1 if not raised.
+ * @raising_cur_max_time: duration of the current weight-raising period.
+ * @raising_start: beginning of the current weight-raising period, renewals
+ *		   of soft real-time periods included.
+ * @raising_time: total time spent weight-raised, current period excluded.
+ * @raising_periods: number of weight-raising periods started.
  *
  * A bfq_queue is a leaf request queue; it can be associated to an io_context
  * or more (if it is an async one).  @cgroup holds a reference to the
@@ -338,9 +369,19 @@ struct bfq_queue {
 
 	pid_t pid;
 
+	struct rb_node pos_node;
+	struct rb_root *pos_root;
+	struct bfq_queue *new_bfqq;
+
 	/* weight-raising fileds */
  	u64 last_rais_start_finish, soft_rt_next_start;
  	unsigned int raising_coeff;
+	unsigned int raising_cur_max_time;
+	unsigned long raising_start;
+
+	/* weight-raising statistics */
+	unsigned long raising_time;
+	unsigned int raising_periods;
 };
 
 enum bfqq_state_flags {
@@ -352,6 +393,9 @@ enum bfqq_state_flags {
 	BFQ_BFQQ_FLAG_prio_changed,	/* task priority has changed */
 	BFQ_BFQQ_FLAG_sync,		/* synchronous queue */
 	BFQ_BFQQ_FLAG_budget_new,	/* no completion with this budget */
+	BFQ_BFQQ_FLAG_coop,		/* bfqq is shared */
+	BFQ_BFQQ_FLAG_split_coop,	/* shared bfqq will be splitted */
+	BFQ_BFQQ_FLAG_soft_rt,		/* weight-raised as soft real-time */
 };
 
 #define BFQ_BFQQ_FNS(name)						\
@@ -376,6 +420,9 @@ BFQ_BFQQ_FNS(idle_window);
 BFQ_BFQQ_FNS(prio_changed);
 BFQ_BFQQ_FNS(sync);
 BFQ_BFQQ_FNS(budget_new);
+BFQ_BFQQ_FNS(coop);
+BFQ_BFQQ_FNS(split_coop);
+BFQ_BFQQ_FNS(soft_rt);
 #undef BFQ_BFQQ_FNS
 
 /* Logging facilities. */
@@ -410,6 +457,8 @@ enum bfqq_expiration {
  * @async_idle_bfqq: async queue for the idle class (ioprio is ignored).
  * @my_entity: pointer to @entity, %NULL for the toplevel group; used
  *             to avoid too many special cases during group creation/migration.
+ * @raising_time: time the queues of the group spent weight-raised, counted
+ *                when their weight-raising periods end (jiffies).
  *
  * Each (device, cgroup) pair has its own bfq_group, i.e., for each cgroup
  * there is a set of bfq_groups, each one collecting the lower-level
@@ -435,6 +484,8 @@ struct bfq_group {
 	struct bfq_queue *async_idle_bfqq;
 
 	struct bfq_entity *my_entity;
+
+	unsigned long raising_time;
 };
 
 /**
@@ -0,0 +1,118 @@
+/*
+ * BFQ: tracepoints for the budget and peak rate feedback.
+ *
+ * Licensed under the GPL-2 as detailed in the accompanying COPYING.BFQ file.
+ */
+
+#if !defined(_BFQ_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _BFQ_TRACE_H
+
+#include <linux/tracepoint.h>
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM bfq
+#define TRACE_INCLUDE_FILE bfq_trace
+
+#define show_bfqq_expiration(reason)					\
+	__print_symbolic(reason,					\
+		{ BFQ_BFQQ_TOO_IDLE,		"too_idle" },		\
+		{ BFQ_BFQQ_BUDGET_TIMEOUT,	"budget_timeout" },	\
+		{ BFQ_BFQQ_BUDGET_EXHAUSTED,	"budget_exhausted" },	\
+		{ BFQ_BFQQ_NO_MORE_REQUESTS,	"no_more_requests" })
+
+/*
+ * The device helpers used below, bfq_trace_devt() and bfq_rate_to_sps(),
+ * are defined in bfq-iosched.c before this file is included.
+ *
+ * A queue expired: @budget is the budget it had been assigned, @service
+ * what it used of it, and @next_budget the budget the feedback computed
+ * for its next slice.  @peak_rate is the device peak rate estimate after
+ * the slice was taken into account, in sectors per second.
+ */
+TRACE_EVENT(bfq_expire,
+
+	TP_PROTO(struct bfq_data *bfqd, struct bfq_queue *bfqq,
+		 enum bfqq_expiration reason, int slow,
+		 bfq_service_t budget, bfq_service_t service),
+
+	TP_ARGS(bfqd, bfqq, reason, slow, budget, service),
+
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(pid_t, pid)
+		__field(int, sync)
+		__field(int, reason)
+		__field(int, slow)
+		__field(unsigned long, budget)
+		__field(unsigned long, service)
+		__field(unsigned long, next_budget)
+		__field(unsigned long, max_budget)
+		__field(u64, peak_rate)
+	),
+
+	TP_fast_assign(
+		__entry->dev = bfq_trace_devt(bfqd);
+		__entry->pid = bfqq->pid;
+		__entry->sync = bfq_bfqq_sync(bfqq);
+		__entry->reason = reason;
+		__entry->slow = slow;
+		__entry->budget = budget;
+		__entry->service = service;
+		__entry->next_budget = bfqq->max_budget;
+		__entry->max_budget = bfqd->bfq_max_budget;
+		__entry->peak_rate = bfq_rate_to_sps(bfqd->peak_rate);
+	),
+
+	TP_printk("dev=%d,%d pid=%d %s reason=%s slow=%d budget=%lu "
+		  "service=%lu next_budget=%lu max_budget=%lu peak_rate=%llu",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->pid,
+		  __entry->sync ? "sync" : "async",
+		  show_bfqq_expiration(__entry->reason), __entry->slow,
+		  __entry->budget, __entry->service, __entry->next_budget,
+		  __entry->max_budget, __entry->peak_rate)
+);
+
+/*
+ * A slice long enough to be used as a peak rate sample ended: @bw is the
+ * rate it was served at, in sectors per second.  @updated tells whether
+ * it changed the estimate, which is smoothed over the samples.
+ */
+TRACE_EVENT(bfq_peak_rate,
+
+	TP_PROTO(struct bfq_data *bfqd, u64 bw, u64 usecs, int updated),
+
+	TP_ARGS(bfqd, bw, usecs, updated),
+
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(u64, bw)
+		__field(u64, usecs)
+		__field(int, updated)
+		__field(int, samples)
+		__field(u64, peak_rate)
+		__field(unsigned long, max_budget)
+	),
+
+	TP_fast_assign(
+		__entry->dev = bfq_trace_devt(bfqd);
+		__entry->bw = bfq_rate_to_sps(bw);
+		__entry->usecs = usecs;
+		__entry->updated = updated;
+		__entry->samples = bfqd->peak_rate_samples;
+		__entry->peak_rate = bfq_rate_to_sps(bfqd->peak_rate);
+		__entry->max_budget = bfqd->bfq_max_budget;
+	),
+
+	TP_printk("dev=%d,%d bw=%llu usecs=%llu updated=%d samples=%d "
+		  "peak_rate=%llu max_budget=%lu",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->bw,
+		  __entry->usecs, __entry->updated, __entry->samples,
+		  __entry->peak_rate, __entry->max_budget)
+);
+
+#endif /* _BFQ_TRACE_H */
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#include <trace/define_trace.h>
@@ -16,16 +16,48 @@
 #include <linux/tick.h>
 #include <linux/init.h>
 #include <linux/workqueue.h>
+#include <linux/input.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+#include <linux/timer.h>
+#include <trace/events/sched.h>
+#include "cpufreq_sampler.h"
 
 #define TRANSITION_LATENCY_LIMIT	(10 * 1000 * 1000)
 
+/* What made the governor boost a cpu ahead of its load. */
+enum {
+	HYBRID_BOOST_INPUT,		/* input event, e.g. a touch */
+	HYBRID_BOOST_WAKEUP,		/* burst of task wakeups */
+};
+
+#define CREATE_TRACE_POINTS
+#include "cpufreq_hybrid_trace.h"
+
 static atomic_t active_count = ATOMIC_INIT(0);
 
 struct cpufreq_hybrid_cpuinfo {
 	struct cpufreq_policy *policy;
-	struct delayed_work work;
+	struct cpufreq_sampler sampler;
 	u64 prev_idle_time;
 	u64 prev_wall_time;
+	/*
+	 * timer_mutex serializes the sampling work, the boosts and the
+	 * limit changes; enable is only set while the governor runs on
+	 * this cpu.
+	 */
+	struct mutex timer_mutex;
+	int enable;
+	// exponentially weighted load history, in percent
+	unsigned int load_avg;
+	// tasks woken on this cpu since the last sample
+	atomic_t wakeups;
+	// HYBRID_BOOST_* bits of the boosts queued on boost_work
+	unsigned long boost_pending;
+	// no sample may lower the frequency below the boost before this
+	unsigned long boost_until;
+	struct work_struct boost_work;
+	struct timer_list boost_timer;
 };
 
 static DEFINE_PER_CPU(struct cpufreq_hybrid_cpuinfo, cpuinfo);
@@ -36,6 +68,9 @@ static struct workqueue_struct *work_queue;
 #define DEFAULT_UP_THRESHOLD		(80)
 #define DEFAULT_DOWN_THRESHOLD		(20)
 #define DEFAULT_OPTIMAL_LOAD		(50)
+#define DEFAULT_BOOST_DURATION		(100) // ms
+#define DEFAULT_WAKEUP_BOOST		(16) // wakeups per sample
+#define DEFAULT_HISTORY_WEIGHT		(50) // percent
 
 #define MIN_LATENCY_MULTIPLIER		(100)
 #define LATENCY_MULTIPLIER		(1000)
@@ -45,25 +80,75 @@ struct cpufreq_hybrid_tuners {
     unsigned int up_threshold;
     unsigned int down_threshold;
     unsigned int optimal_load;
+    unsigned int boost_freq;
+    unsigned int boost_duration;
+    unsigned int wakeup_boost;
+    unsigned int history_weight;
 } tuners = {
     .sample_rate		= DEFAULT_SAMPLE_RATE,
     .up_threshold 		= DEFAULT_UP_THRESHOLD,
     .down_threshold		= DEFAULT_DOWN_THRESHOLD,
     .optimal_load 		= DEFAULT_OPTIMAL_LOAD,
+    .boost_freq			= 0, // policy->max
+    .boost_duration		= DEFAULT_BOOST_DURATION,
+    .wakeup_boost		= DEFAULT_WAKEUP_BOOST,
+    .history_weight		= DEFAULT_HISTORY_WEIGHT,
 };
 
-static void cpufreq_hybrid_work( struct work_struct *work )
+static unsigned int cpufreq_hybrid_boost_freq(struct cpufreq_policy *policy)
+{
+	if (tuners.boost_freq == 0)
+		return policy->max;
+
+	return clamp(tuners.boost_freq, policy->min, policy->max);
+}
+
+/*
+ * Predict the load of the next window from the last one and the load
+ * history, and fold the last one into the history.  A rising load is
+ * expected to keep rising, by half of what it gained on the history; a
+ * falling one is only trusted halfway, so that a short pause doesn't
+ * throw away the frequency a busy task will need again right after.
+ * With a history_weight of 0 the prediction is the last load.
+ */
+static unsigned int cpufreq_hybrid_predict_load(
+		struct cpufreq_hybrid_cpuinfo *this_cpuinfo,
+		unsigned int perc_load)
+{
+	unsigned int load_avg = this_cpuinfo->load_avg;
+	unsigned int weight = tuners.history_weight;
+	unsigned int pred_load;
+
+	if (perc_load >= load_avg)
+		pred_load = min(perc_load + (perc_load - load_avg) / 2, 100u);
+	else
+		pred_load = (perc_load + load_avg + 1) / 2;
+
+	this_cpuinfo->load_avg = (weight * load_avg +
+				  (100 - weight) * perc_load + 50) / 100;
+
+	return pred_load;
+}
+
+static void cpufreq_hybrid_work(struct cpufreq_sampler *sampler)
 {
 	u64 idle_time;
 	u64 wall_time;
 	unsigned int delta_idle_time;
 	unsigned int delta_wall_time;
 	unsigned int perc_load;
+	unsigned int pred_load;
+	unsigned int floor_freq;
 	unsigned int target_freq;
+	unsigned int cur_freq;
+	unsigned int wakeups;
+	unsigned long delay = tuners.sample_rate;
 	unsigned int cpu = smp_processor_id();
 	struct cpufreq_hybrid_cpuinfo *this_cpuinfo = &per_cpu(cpuinfo, cpu);
 	struct cpufreq_policy *policy = this_cpuinfo->policy;
 
+	mutex_lock(&this_cpuinfo->timer_mutex);
+
 	// sample data
 	idle_time = get_cpu_idle_time_us(cpu, &wall_time);
 	delta_idle_time = (unsigned int) cputime64_sub(idle_time, this_cpuinfo->prev_idle_time);
@@ -75,31 +160,358 @@ static void cpufreq_hybrid_work( struct work_struct *work )
 	else
 		perc_load = (100 * (delta_wall_time - delta_idle_time)) / delta_wall_time;
 
-	if (((perc_load > tuners.up_threshold) && (policy->cur < policy->max)) ||
-	    ((perc_load < tuners.down_threshold) && (policy->cur > policy->min) )) {
+	pred_load = cpufreq_hybrid_predict_load(this_cpuinfo, perc_load);
+
+	// while boosted, don't go below the boost frequency
+	floor_freq = policy->min;
+	if (time_before(jiffies, this_cpuinfo->boost_until))
+		floor_freq = cpufreq_hybrid_boost_freq(policy);
+
+	cur_freq = target_freq = policy->cur;
+	if (((pred_load > tuners.up_threshold) && (policy->cur < policy->max)) ||
+	    ((pred_load < tuners.down_threshold) && (policy->cur > floor_freq))) {
 
-		target_freq = (perc_load * policy->cur) / tuners.optimal_load;
+		target_freq = (pred_load * policy->cur) / tuners.optimal_load;
 
 		if (target_freq > policy->max)
 			target_freq = policy->max;
-		if (target_freq < policy->min)
-			target_freq = policy->min;
+		if (target_freq < floor_freq)
+			target_freq = floor_freq;
 
 		// we want to get at least the frequency we calculated
 		// therefore CPUFREQ_RELATION_L is used in all cases
 		// (see linux/cpufreq.h)
 		__cpufreq_driver_target(policy, target_freq, CPUFREQ_RELATION_L);
+
+		// still ramping up: look again sooner than usual
+		if (target_freq > cur_freq && target_freq < policy->max)
+			delay = max(delay / 2, 1UL);
 	}
 
+	// the wakeup burst count starts again with each sample
+	wakeups = atomic_xchg(&this_cpuinfo->wakeups, 0);
+	trace_cpufreq_hybrid_sample(cpu, perc_load, this_cpuinfo->load_avg,
+				    pred_load, wakeups, policy->cur,
+				    target_freq);
+
 	// Schedule next sample
 	this_cpuinfo->prev_idle_time = get_cpu_idle_time_us(cpu, &this_cpuinfo->prev_wall_time);
-	queue_delayed_work_on(cpu, work_queue, &this_cpuinfo->work, tuners.sample_rate);
+	cpufreq_sampler_queue(sampler, delay);
+
+	mutex_unlock(&this_cpuinfo->timer_mutex);
+}
+
+/*
+ * The sampler skipped a sample of an idle cpu: restart the load
+ * measurement from now, or the next sample would average a burst with
+ * the idle time before it.
+ */
+static void cpufreq_hybrid_skip(struct cpufreq_sampler *sampler)
+{
+	unsigned int cpu = sampler->cpu;
+	struct cpufreq_hybrid_cpuinfo *this_cpuinfo = &per_cpu(cpuinfo, cpu);
+
+	this_cpuinfo->prev_idle_time =
+		get_cpu_idle_time_us(cpu, &this_cpuinfo->prev_wall_time);
+}
+
+/*
+ * Raise the frequency of a cpu to the boost frequency right away, rather
+ * than waiting for the next sample to see the load, and keep it there
+ * for the length of the boost.
+ */
+static void cpufreq_hybrid_boost(struct work_struct *work)
+{
+	struct cpufreq_hybrid_cpuinfo *this_cpuinfo =
+		container_of(work, struct cpufreq_hybrid_cpuinfo, boost_work);
+	unsigned long *pending = &this_cpuinfo->boost_pending;
+	struct cpufreq_policy *policy;
+	unsigned long duration = 0;
+	unsigned int boost_freq;
+	int reason = HYBRID_BOOST_INPUT;
+
+	if (test_and_clear_bit(HYBRID_BOOST_INPUT, pending))
+		duration = msecs_to_jiffies(tuners.boost_duration);
+	// a wakeup burst only lasts until the next sample can judge it
+	if (test_and_clear_bit(HYBRID_BOOST_WAKEUP, pending) &&
+	    duration < tuners.sample_rate) {
+		duration = tuners.sample_rate;
+		reason = HYBRID_BOOST_WAKEUP;
+	}
+	if (!duration)
+		return;
+
+	mutex_lock(&this_cpuinfo->timer_mutex);
+	if (!this_cpuinfo->enable)
+		goto out;
+
+	policy = this_cpuinfo->policy;
+	if (time_after(jiffies + duration, this_cpuinfo->boost_until))
+		this_cpuinfo->boost_until = jiffies + duration;
+
+	boost_freq = cpufreq_hybrid_boost_freq(policy);
+	trace_cpufreq_hybrid_boost(policy->cpu, reason, policy->cur, boost_freq,
+				   jiffies_to_msecs(duration));
+	if (policy->cur < boost_freq)
+		__cpufreq_driver_target(policy, boost_freq, CPUFREQ_RELATION_L);
+out:
+	mutex_unlock(&this_cpuinfo->timer_mutex);
+}
+
+static void cpufreq_hybrid_boost_timer(unsigned long cpu)
+{
+	struct cpufreq_hybrid_cpuinfo *this_cpuinfo = &per_cpu(cpuinfo, cpu);
+
+	if (this_cpuinfo->enable)
+		queue_work_on(cpu, work_queue, &this_cpuinfo->boost_work);
+}
+
+/*
+ * Called for each task wakeup, with the runqueue of @p locked: as the
+ * workqueue can't be woken from here, a burst of wakeups arms a timer
+ * which queues the boost instead.
+ */
+static void cpufreq_hybrid_wakeup(void *data, struct task_struct *p,
+				  int success)
+{
+	struct cpufreq_hybrid_cpuinfo *this_cpuinfo;
+
+	if (!success || !tuners.wakeup_boost)
+		return;
+
+	this_cpuinfo = &per_cpu(cpuinfo, task_cpu(p));
+	if (!this_cpuinfo->enable)
+		return;
+
+	if (atomic_inc_return(&this_cpuinfo->wakeups) < tuners.wakeup_boost)
+		return;
+
+	if (!test_and_set_bit(HYBRID_BOOST_WAKEUP,
+			      &this_cpuinfo->boost_pending))
+		mod_timer(&this_cpuinfo->boost_timer, jiffies);
+}
+
+/*
+ * Any input event, such as a touch or a key press, means the user is
+ * waiting for what comes next: boost all the cpus.
+ */
+static void cpufreq_hybrid_input_event(struct input_handle *handle,
+				       unsigned int type, unsigned int code,
+				       int value)
+{
+	struct cpufreq_hybrid_cpuinfo *this_cpuinfo;
+	unsigned int cpu;
+
+	if (type == EV_SYN || type == EV_MSC || !tuners.boost_duration)
+		return;
+
+	for_each_online_cpu(cpu) {
+		this_cpuinfo = &per_cpu(cpuinfo, cpu);
+		if (!this_cpuinfo->enable)
+			continue;
+		if (!test_and_set_bit(HYBRID_BOOST_INPUT,
+				      &this_cpuinfo->boost_pending))
+			queue_work_on(cpu, work_queue,
+				      &this_cpuinfo->boost_work);
+	}
+}
+
+static int cpufreq_hybrid_input_connect(struct input_handler *handler,
+					struct input_dev *dev,
+					const struct input_device_id *id)
+{
+	struct input_handle *handle;
+	int error;
+
+	handle = kzalloc(sizeof(*handle), GFP_KERNEL);
+	if (!handle)
+		return -ENOMEM;
+
+	handle->dev = dev;
+	handle->handler = handler;
+	handle->name = "cpufreq_hybrid";
+
+	error = input_register_handle(handle);
+	if (error)
+		goto err_register;
+
+	error = input_open_device(handle);
+	if (error)
+		goto err_open;
+
+	return 0;
+
+err_open:
+	input_unregister_handle(handle);
+err_register:
+	kfree(handle);
+	return error;
+}
+
+static void cpufreq_hybrid_input_disconnect(struct input_handle *handle)
+{
+	input_close_device(handle);
+	input_unregister_handle(handle);
+	kfree(handle);
+}
+
+static const struct input_device_id cpufreq_hybrid_ids[] = {
+	{
+		.flags = INPUT_DEVICE_ID_MATCH_EVBIT,
+		.evbit = { BIT_MASK(EV_KEY) },
+	},
+	{
+		.flags = INPUT_DEVICE_ID_MATCH_EVBIT,
+		.evbit = { BIT_MASK(EV_ABS) },
+	},
+	{ },
+};
+
+static struct input_handler cpufreq_hybrid_input_handler = {
+	.event		= cpufreq_hybrid_input_event,
+	.connect	= cpufreq_hybrid_input_connect,
+	.disconnect	= cpufreq_hybrid_input_disconnect,
+	.name		= "cpufreq_hybrid",
+	.id_table	= cpufreq_hybrid_ids,
+};
+
+/* cpufreq_hybrid Governor Tunables */
+#define show_one(file_name, object)					\
+static ssize_t show_##file_name						\
+(struct kobject *kobj, struct attribute *attr, char *buf)		\
+{									\
+	return sprintf(buf, "%u\n", tuners.object);			\
+}
+show_one(up_threshold, up_threshold);
+show_one(down_threshold, down_threshold);
+show_one(optimal_load, optimal_load);
+show_one(boost_freq, boost_freq);
+show_one(boost_duration, boost_duration);
+show_one(wakeup_boost, wakeup_boost);
+show_one(history_weight, history_weight);
+
+static ssize_t show_sample_rate(struct kobject *kobj,
+				struct attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", jiffies_to_usecs(tuners.sample_rate));
+}
+
+#define store_one(file_name, object, min, max)				\
+static ssize_t store_##file_name					\
+(struct kobject *a, struct attribute *b, const char *buf, size_t count)	\
+{									\
+	unsigned int input;						\
+									\
+	if (sscanf(buf, "%u", &input) != 1)				\
+		return -EINVAL;						\
+	if (input < (min) || input > (max))				\
+		return -EINVAL;						\
+	tuners.object = input;						\
+	return count;							\
+}
+store_one(up_threshold, up_threshold, 1, 100);
+store_one(down_threshold, down_threshold, 0, 99);
+store_one(optimal_load, optimal_load, 1, 100);
+store_one(boost_freq, boost_freq, 0, UINT_MAX);
+store_one(boost_duration, boost_duration, 0, 10000);
+store_one(wakeup_boost, wakeup_boost, 0, UINT_MAX);
+store_one(history_weight, history_weight, 0, 99);
+
+static ssize_t store_sample_rate(struct kobject *a, struct attribute *b,
+				 const char *buf, size_t count)
+{
+	unsigned int input;
+
+	if (sscanf(buf, "%u", &input) != 1)
+		return -EINVAL;
+
+	tuners.sample_rate = max(usecs_to_jiffies(input), 1UL);
+	return count;
+}
+
+define_one_global_rw(sample_rate);
+define_one_global_rw(up_threshold);
+define_one_global_rw(down_threshold);
+define_one_global_rw(optimal_load);
+define_one_global_rw(boost_freq);
+define_one_global_rw(boost_duration);
+define_one_global_rw(wakeup_boost);
+define_one_global_rw(history_weight);
+
+static struct attribute *hybrid_attributes[] = {
+	&sample_rate.attr,
+	&up_threshold.attr,
+	&down_threshold.attr,
+	&optimal_load.attr,
+	&boost_freq.attr,
+	&boost_duration.attr,
+	&wakeup_boost.attr,
+	&history_weight.attr,
+	NULL
+};
+
+static struct attribute_group hybrid_attr_group = {
+	.attrs = hybrid_attributes,
+	.name = "hybrid",
+};
+
+/*
+ * Without tracepoints there's no wakeup hook: the governor runs without
+ * the wakeup boost rather than not at all.
+ */
+static int wakeup_hooked;
+
+static void cpufreq_hybrid_unhook_wakeup(void)
+{
+	if (!wakeup_hooked)
+		return;
+	unregister_trace_sched_wakeup(cpufreq_hybrid_wakeup, NULL);
+	tracepoint_synchronize_unregister();
+	wakeup_hooked = 0;
+}
+
+static int cpufreq_hybrid_hooks_start(void)
+{
+	int rc;
+
+	rc = sysfs_create_group(cpufreq_global_kobject, &hybrid_attr_group);
+	if (rc)
+		return rc;
+
+	rc = register_trace_sched_wakeup(cpufreq_hybrid_wakeup, NULL);
+	if (rc == -ENOSYS)
+		printk(KERN_INFO "cpufreq_hybrid: no tracepoints, "
+		       "wakeup boost disabled\n");
+	else if (rc)
+		goto err_wakeup;
+	else
+		wakeup_hooked = 1;
+
+	rc = input_register_handler(&cpufreq_hybrid_input_handler);
+	if (rc)
+		goto err_input;
+
+	return 0;
+
+err_input:
+	cpufreq_hybrid_unhook_wakeup();
+err_wakeup:
+	sysfs_remove_group(cpufreq_global_kobject, &hybrid_attr_group);
+	return rc;
+}
+
+static void cpufreq_hybrid_hooks_stop(void)
+{
+	input_unregister_handler(&cpufreq_hybrid_input_handler);
+	cpufreq_hybrid_unhook_wakeup();
+	sysfs_remove_group(cpufreq_global_kobject, &hybrid_attr_group);
 }
 
 static int cpufreq_governor_hybrid(struct cpufreq_policy *policy, unsigned int event)
 {
 	struct cpufreq_hybrid_cpuinfo *this_cpuinfo = &per_cpu(cpuinfo, policy->cpu);
-		
+	int rc;
+
 	switch (event) {
 	case CPUFREQ_GOV_START:
 		if ((!cpu_online(policy->cpu)) || (!policy->cur))
@@ -127,28 +539,50 @@ static int cpufreq_governor_hybrid(struct cpufreq_policy *policy, unsigned int e
 			tuners.sample_rate = usecs_to_jiffies(
 			    max(min_sampling_rate, latency * LATENCY_MULTIPLIER));
 			printk(KERN_DEBUG "Setting sample rate to %u jiffies\n", tuners.sample_rate);
-			// create sysfs entries here
+
+			// sysfs entries, input and wakeup hooks
+			rc = cpufreq_hybrid_hooks_start();
+			if (rc) {
+				atomic_dec(&active_count);
+				return rc;
+			}
 		}
 
-		INIT_DELAYED_WORK_DEFERRABLE(&this_cpuinfo->work, cpufreq_hybrid_work);
-		queue_delayed_work_on(policy->cpu, work_queue, &this_cpuinfo->work, tuners.sample_rate);
+		mutex_lock(&this_cpuinfo->timer_mutex);
+		this_cpuinfo->load_avg = 0;
+		this_cpuinfo->boost_pending = 0;
+		this_cpuinfo->boost_until = jiffies;
+		atomic_set(&this_cpuinfo->wakeups, 0);
+		this_cpuinfo->enable = 1;
+		mutex_unlock(&this_cpuinfo->timer_mutex);
+
+		cpufreq_sampler_start(&this_cpuinfo->sampler, policy,
+				      work_queue, cpufreq_hybrid_work,
+				      cpufreq_hybrid_skip, tuners.sample_rate);
 		break;
 
 	case CPUFREQ_GOV_STOP:
 		printk(KERN_DEBUG "Stopping hybrid governor for cpu %u\n", policy->cpu);
-		cancel_delayed_work_sync(&this_cpuinfo->work);
+		mutex_lock(&this_cpuinfo->timer_mutex);
+		this_cpuinfo->enable = 0;
+		mutex_unlock(&this_cpuinfo->timer_mutex);
 
-		// remove sysfs entries when last governor is stopped
-		if (atomic_dec_and_test(&active_count)) {
-			// remove sysfs entries here
-		}
+		del_timer_sync(&this_cpuinfo->boost_timer);
+		cancel_work_sync(&this_cpuinfo->boost_work);
+		cpufreq_sampler_stop(&this_cpuinfo->sampler);
+
+		// remove sysfs entries and hooks when last governor is stopped
+		if (atomic_dec_and_test(&active_count))
+			cpufreq_hybrid_hooks_stop();
 		break;
 
 	case CPUFREQ_GOV_LIMITS:
+		mutex_lock(&this_cpuinfo->timer_mutex);
 		if (policy->max < this_cpuinfo->policy->max)
 		    __cpufreq_driver_target(this_cpuinfo->policy, policy->max, CPUFREQ_RELATION_H);
 		else if (policy->min > this_cpuinfo->policy->cur)
 		    __cpufreq_driver_target(this_cpuinfo->policy, policy->min, CPUFREQ_RELATION_L);
+		mutex_unlock(&this_cpuinfo->timer_mutex);
 		break;
 
 	default:
@@ -169,13 +603,31 @@ struct cpufreq_governor cpufreq_gov_hybrid = {
 
 static int __init cpufreq_gov_hybrid_init(void)
 {
+	struct cpufreq_hybrid_cpuinfo *this_cpuinfo;
+	unsigned int cpu;
+
+	for_each_possible_cpu(cpu) {
+		this_cpuinfo = &per_cpu(cpuinfo, cpu);
+		mutex_init(&this_cpuinfo->timer_mutex);
+		INIT_WORK(&this_cpuinfo->boost_work, cpufreq_hybrid_boost);
+		setup_timer(&this_cpuinfo->boost_timer,
+			    cpufreq_hybrid_boost_timer, cpu);
+	}
+
 	work_queue = create_rt_workqueue("khybrid");
 	return cpufreq_register_governor(&cpufreq_gov_hybrid);
 }
 
 static void __exit cpufreq_gov_hybrid_exit(void)
 {
+	unsigned int cpu;
+
 	cpufreq_unregister_governor(&cpufreq_gov_hybrid);
+
+	// a wakeup may have armed a timer on a cpu already stopped
+	for_each_possible_cpu(cpu)
+		del_timer_sync(&per_cpu(cpuinfo, cpu).boost_timer);
+
 	destroy_workqueue(work_queue);
 }
 
@@ -0,0 +1,104 @@
+/*
+ *  drivers/cpufreq/cpufreq_hybrid_trace.h
+ *
+ *  Tracepoints for the decisions of the 'hybrid' cpufreq governor.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#if !defined(_CPUFREQ_HYBRID_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _CPUFREQ_HYBRID_TRACE_H
+
+#include <linux/tracepoint.h>
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM cpufreq_hybrid
+#define TRACE_INCLUDE_FILE cpufreq_hybrid_trace
+
+#define show_hybrid_boost_reason(reason)				\
+	__print_symbolic(reason,					\
+		{ HYBRID_BOOST_INPUT,		"input" },		\
+		{ HYBRID_BOOST_WAKEUP,		"wakeup" })
+
+/*
+ * A sample was taken: @load is the load measured over the last window,
+ * @load_avg the load history it was folded into and @pred_load the load
+ * predicted for the next window, all in percent.  @wakeups counts the
+ * tasks woken on the cpu during the window.  @target is the frequency
+ * asked for, or @cur if the governor left it alone.
+ */
+TRACE_EVENT(cpufreq_hybrid_sample,
+
+	TP_PROTO(unsigned int cpu, unsigned int load, unsigned int load_avg,
+		 unsigned int pred_load, unsigned int wakeups,
+		 unsigned int cur, unsigned int target),
+
+	TP_ARGS(cpu, load, load_avg, pred_load, wakeups, cur, target),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, cpu)
+		__field(unsigned int, load)
+		__field(unsigned int, load_avg)
+		__field(unsigned int, pred_load)
+		__field(unsigned int, wakeups)
+		__field(unsigned int, cur)
+		__field(unsigned int, target)
+	),
+
+	TP_fast_assign(
+		__entry->cpu = cpu;
+		__entry->load = load;
+		__entry->load_avg = load_avg;
+		__entry->pred_load = pred_load;
+		__entry->wakeups = wakeups;
+		__entry->cur = cur;
+		__entry->target = target;
+	),
+
+	TP_printk("cpu=%u load=%u load_avg=%u pred_load=%u wakeups=%u "
+		  "cur=%u target=%u",
+		  __entry->cpu, __entry->load, __entry->load_avg,
+		  __entry->pred_load, __entry->wakeups, __entry->cur,
+		  __entry->target)
+);
+
+/*
+ * The cpu was boosted to at least @freq for @duration ms, ahead of the
+ * load it is expected to see.
+ */
+TRACE_EVENT(cpufreq_hybrid_boost,
+
+	TP_PROTO(unsigned int cpu, int reason, unsigned int cur,
+		 unsigned int freq, unsigned int duration),
+
+	TP_ARGS(cpu, reason, cur, freq, duration),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, cpu)
+		__field(int, reason)
+		__field(unsigned int, cur)
+		__field(unsigned int, freq)
+		__field(unsigned int, duration)
+	),
+
+	TP_fast_assign(
+		__entry->cpu = cpu;
+		__entry->reason = reason;
+		__entry->cur = cur;
+		__entry->freq = freq;
+		__entry->duration = duration;
+	),
+
+	TP_printk("cpu=%u reason=%s cur=%u freq=%u duration=%u",
+		  __entry->cpu, show_hybrid_boost_reason(__entry->reason),
+		  __entry->cur, __entry->freq, __entry->duration)
+);
+
+#endif /* _CPUFREQ_HYBRID_TRACE_H */
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#include <trace/define_trace.h>
@@ -22,6 +22,7 @@
 #include <linux/tick.h>
 #include <linux/ktime.h>
 #include <linux/sched.h>
+#include "cpufreq_sampler.h"
 
 /*
  * dbs is used in this file as a shortform for demandbased switching
@@ -56,7 +57,8 @@ static unsigned int min_sampling_rate;
 #define MIN_LATENCY_MULTIPLIER			(100)
 #define TRANSITION_LATENCY_LIMIT		(10 * 1000 * 1000)
 
-static void do_dbs_timer(struct work_struct *work);
+static void do_dbs_timer(struct cpufreq_sampler *sampler);
+static void dbs_skip_sample(struct cpufreq_sampler *sampler);
 static int cpufreq_governor_dbs(struct cpufreq_policy *policy,
 				unsigned int event);
 
@@ -79,7 +81,7 @@ struct cpu_dbs_info_s {
 	cputime64_t prev_cpu_wall;
 	cputime64_t prev_cpu_nice;
 	struct cpufreq_policy *cur_policy;
-	struct delayed_work work;
+	struct cpufreq_sampler sampler;
 	struct cpufreq_frequency_table *freq_table;
 	unsigned int freq_lo;
 	unsigned int freq_lo_jiffies;
@@ -637,11 +639,10 @@ static void dbs_check_cpu(struct cpu_dbs_info_s *this_dbs_info)
 	}
 }
 
-static void do_dbs_timer(struct work_struct *work)
+static void do_dbs_timer(struct cpufreq_sampler *sampler)
 {
 	struct cpu_dbs_info_s *dbs_info =
-		container_of(work, struct cpu_dbs_info_s, work.work);
-	unsigned int cpu = dbs_info->cpu;
+		container_of(sampler, struct cpu_dbs_info_s, sampler);
 	int sample_type = dbs_info->sample_type;
 
 	/* We want all CPUs to do sampling nearly on same jiffy */
@@ -667,10 +668,34 @@ static void do_dbs_timer(struct work_struct *work)
 		__cpufreq_driver_target(dbs_info->cur_policy,
 			dbs_info->freq_lo, CPUFREQ_RELATION_H);
 	}
-	queue_delayed_work_on(cpu, kondemand_wq, &dbs_info->work, delay);
+	cpufreq_sampler_queue(&dbs_info->sampler, delay);
 	mutex_unlock(&dbs_info->timer_mutex);
 }
 
+/*
+ * The sampler skipped a sample of an idle policy: restart the load
+ * measurement from now, or the next sample would average a burst with
+ * the idle time before it.
+ */
+static void dbs_skip_sample(struct cpufreq_sampler *sampler)
+{
+	struct cpu_dbs_info_s *dbs_info =
+		container_of(sampler, struct cpu_dbs_info_s, sampler);
+	unsigned int j;
+
+	for_each_cpu(j, dbs_info->cur_policy->cpus) {
+		struct cpu_dbs_info_s *j_dbs_info;
+		j_dbs_info = &per_cpu(od_cpu_dbs_info, j);
+
+		j_dbs_info->prev_cpu_idle = get_cpu_idle_time(j,
+						&j_dbs_info->prev_cpu_wall);
+		j_dbs_info->prev_cpu_iowait = get_cpu_iowait_time(j,
+						&j_dbs_info->prev_cpu_wall);
+		if (dbs_tuners_ins.ignore_nice)
+			j_dbs_info->prev_cpu_nice = kstat_cpu(j).cpustat.nice;
+	}
+}
+
 static inline void dbs_timer_init(struct cpu_dbs_info_s *dbs_info)
 {
 	/* We want all CPUs to do sampling nearly on same jiffy */
@@ -678,14 +703,14 @@ static inline void dbs_timer_init(struct cpu_dbs_info_s *dbs_info)
 	delay -= jiffies % delay;
 
 	dbs_info->sample_type = DBS_NORMAL_SAMPLE;
-	INIT_DELAYED_WORK_DEFERRABLE(&dbs_info->work, do_dbs_timer);
-	queue_delayed_work_on(dbs_info->cpu, kondemand_wq, &dbs_info->work,
-		delay);
+	cpufreq_sampler_start(&dbs_info->sampler, dbs_info->cur_policy,
+			      kondemand_wq, do_dbs_timer, dbs_skip_sample,
+			      delay);
 }
 
 static inline void dbs_timer_exit(struct cpu_dbs_info_s *dbs_info)
 {
-	cancel_delayed_work_sync(&dbs_info->work);
+	cpufreq_sampler_stop(&dbs_info->sampler);
 }
 
 /*
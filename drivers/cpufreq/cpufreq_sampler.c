@@ -0,0 +1,213 @@
+/*
+ *  drivers/cpufreq/cpufreq_sampler.c
+ *
+ *  Load sampling shared by the cpufreq governors: deferrable, cpu-bound
+ *  sampling that leaves idle cpus alone.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/init.h>
+#include <linux/cpumask.h>
+#include <linux/percpu.h>
+#include <linux/hrtimer.h>
+#include <linux/tick.h>
+#include "cpufreq_sampler.h"
+
+/*
+ * A cpu busy for less than 1/2^SAMPLER_IDLE_SHIFT of the time since the
+ * last sample is considered idle.
+ */
+#define SAMPLER_IDLE_SHIFT	4
+
+struct cpufreq_sampler_cpu {
+	u64 prev_idle_time;
+	u64 prev_wall_time;
+	/* samples the governor was woken for, and samples skipped */
+	unsigned long wakeups;
+	unsigned long skipped;
+};
+
+static DEFINE_PER_CPU(struct cpufreq_sampler_cpu, sampler_cpu);
+
+/*
+ * Called from the timer, on sampler->cpu.  The idle times of the other
+ * cpus of the policy are only ever updated from here, so they are read
+ * without locking, the same way the governors do.
+ */
+static int cpufreq_sampler_idle(struct cpufreq_sampler *sampler)
+{
+	struct cpufreq_policy *policy = sampler->policy;
+	struct cpufreq_sampler_cpu *sc;
+	u64 idle_time, wall_time, busy, wall;
+	int idle = 1;
+	unsigned int j;
+
+	/* a governor can't go lower, but may have to go higher */
+	if (policy->cur > policy->min)
+		return 0;
+
+	for_each_cpu(j, policy->cpus) {
+		sc = &per_cpu(sampler_cpu, j);
+		idle_time = get_cpu_idle_time_us(j, &wall_time);
+		if (idle_time == -1ULL)
+			return 0;
+
+		wall = wall_time - sc->prev_wall_time;
+		busy = wall - min(idle_time - sc->prev_idle_time, wall);
+		if (busy << SAMPLER_IDLE_SHIFT > wall)
+			idle = 0;
+
+		sc->prev_idle_time = idle_time;
+		sc->prev_wall_time = wall_time;
+	}
+
+	return idle;
+}
+
+static void cpufreq_sampler_timer(unsigned long data)
+{
+	struct cpufreq_sampler *sampler = (struct cpufreq_sampler *)data;
+	struct cpufreq_sampler_cpu *sc = &per_cpu(sampler_cpu, sampler->cpu);
+
+	if (!sampler->active)
+		return;
+
+	if (cpufreq_sampler_idle(sampler)) {
+		sc->skipped++;
+		if (sampler->skip)
+			sampler->skip(sampler);
+		mod_timer_pinned(&sampler->timer, jiffies + sampler->delay);
+		return;
+	}
+
+	sc->wakeups++;
+	queue_work_on(sampler->cpu, sampler->wq, &sampler->work);
+}
+
+static void cpufreq_sampler_work(struct work_struct *work)
+{
+	struct cpufreq_sampler *sampler =
+		container_of(work, struct cpufreq_sampler, work);
+
+	sampler->sample(sampler);
+}
+
+/**
+ * cpufreq_sampler_start - start sampling for a governor.
+ * @sampler: the sampler to start.
+ * @policy: the policy the governor runs for, sampled on @policy->cpu.
+ * @wq: the workqueue @sample is run from.
+ * @sample: the governor's sampling function.
+ * @skip: the governor's function for skipped samples, may be NULL.
+ * @delay: delay until the first sample, in jiffies.
+ */
+void cpufreq_sampler_start(struct cpufreq_sampler *sampler,
+			   struct cpufreq_policy *policy,
+			   struct workqueue_struct *wq,
+			   void (*sample)(struct cpufreq_sampler *),
+			   void (*skip)(struct cpufreq_sampler *),
+			   unsigned long delay)
+{
+	struct cpufreq_sampler_cpu *sc;
+	unsigned int j;
+
+	for_each_cpu(j, policy->cpus) {
+		sc = &per_cpu(sampler_cpu, j);
+		sc->prev_idle_time = get_cpu_idle_time_us(j,
+						&sc->prev_wall_time);
+	}
+
+	sampler->policy = policy;
+	sampler->cpu = policy->cpu;
+	sampler->wq = wq;
+	sampler->sample = sample;
+	sampler->skip = skip;
+	sampler->delay = delay;
+	INIT_WORK(&sampler->work, cpufreq_sampler_work);
+	init_timer_deferrable(&sampler->timer);
+	sampler->timer.function = cpufreq_sampler_timer;
+	sampler->timer.data = (unsigned long)sampler;
+	sampler->active = 1;
+
+	sampler->timer.expires = jiffies + delay;
+	add_timer_on(&sampler->timer, sampler->cpu);
+}
+EXPORT_SYMBOL_GPL(cpufreq_sampler_start);
+
+/**
+ * cpufreq_sampler_queue - schedule the next sample.
+ * @sampler: the sampler.
+ * @delay: delay until the next sample, in jiffies.
+ *
+ * Called by the sampling function, on @sampler->cpu.
+ */
+void cpufreq_sampler_queue(struct cpufreq_sampler *sampler,
+			   unsigned long delay)
+{
+	if (!sampler->active)
+		return;
+
+	sampler->delay = max(delay, 1UL);
+	mod_timer_pinned(&sampler->timer, jiffies + sampler->delay);
+}
+EXPORT_SYMBOL_GPL(cpufreq_sampler_queue);
+
+/**
+ * cpufreq_sampler_stop - stop sampling and wait for a sample in progress.
+ * @sampler: the sampler to stop.
+ */
+void cpufreq_sampler_stop(struct cpufreq_sampler *sampler)
+{
+	sampler->active = 0;
+	smp_mb();
+
+	del_timer_sync(&sampler->timer);
+	cancel_work_sync(&sampler->work);
+	/* the sample may have queued the next one before seeing !active */
+	del_timer_sync(&sampler->timer);
+}
+EXPORT_SYMBOL_GPL(cpufreq_sampler_stop);
+
+static ssize_t show_sampler_stats(struct kobject *kobj,
+				  struct attribute *attr, char *buf)
+{
+	struct cpufreq_sampler_cpu *sc;
+	ssize_t len;
+	unsigned int cpu;
+
+	len = sprintf(buf, "%-5s %12s %12s\n", "cpu", "wakeups", "skipped");
+	for_each_possible_cpu(cpu) {
+		sc = &per_cpu(sampler_cpu, cpu);
+		if (!sc->wakeups && !sc->skipped)
+			continue;
+		if (len >= PAGE_SIZE - 32)
+			break;
+		len += sprintf(buf + len, "%-5u %12lu %12lu\n", cpu,
+			       sc->wakeups, sc->skipped);
+	}
+
+	return len;
+}
+
+define_one_global_ro(sampler_stats);
+
+static int __init cpufreq_sampler_init(void)
+{
+	return sysfs_create_file(cpufreq_global_kobject, &sampler_stats.attr);
+}
+
+static void __exit cpufreq_sampler_exit(void)
+{
+	sysfs_remove_file(cpufreq_global_kobject, &sampler_stats.attr);
+}
+
+MODULE_DESCRIPTION("Load sampling for the cpufreq governors");
+MODULE_LICENSE("GPL");
+
+module_init(cpufreq_sampler_init);
+module_exit(cpufreq_sampler_exit);
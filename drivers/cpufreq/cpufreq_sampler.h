@@ -0,0 +1,61 @@
+/*
+ *  drivers/cpufreq/cpufreq_sampler.h
+ *
+ *  Load sampling shared by the cpufreq governors.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#ifndef _CPUFREQ_SAMPLER_H
+#define _CPUFREQ_SAMPLER_H
+
+#include <linux/cpufreq.h>
+#include <linux/timer.h>
+#include <linux/workqueue.h>
+
+/**
+ * struct cpufreq_sampler - periodic load sampling for a governor.
+ * @timer: deferrable timer, pinned to @cpu, firing at each sample.
+ * @work: runs @sample in process context.
+ * @wq: workqueue @work is queued on, bound to @cpu.
+ * @sample: the governor's sampling function.  It must call
+ *          cpufreq_sampler_queue() to get the next sample.
+ * @skip: called from the timer, on @cpu, for each skipped sample, or NULL.
+ *        The governor moves its idle and wall time baselines forward
+ *        there, so that its next sample only measures the load since.
+ * @policy: the policy the governor runs for.
+ * @cpu: the cpu sampling is done on, @policy->cpu.
+ * @delay: delay until the next sample, in jiffies.
+ * @active: set while the sampler runs.
+ *
+ * The timer being deferrable, a cpu idle under NO_HZ is not woken just
+ * to be sampled.  When a sample is due and every cpu of @policy has
+ * been idle since the last one while already at the lowest frequency,
+ * there is nothing for the governor to decide: the sample is skipped
+ * without waking its thread.
+ */
+struct cpufreq_sampler {
+	struct timer_list timer;
+	struct work_struct work;
+	struct workqueue_struct *wq;
+	void (*sample)(struct cpufreq_sampler *sampler);
+	void (*skip)(struct cpufreq_sampler *sampler);
+	struct cpufreq_policy *policy;
+	unsigned int cpu;
+	unsigned long delay;
+	int active;
+};
+
+void cpufreq_sampler_start(struct cpufreq_sampler *sampler,
+			   struct cpufreq_policy *policy,
+			   struct workqueue_struct *wq,
+			   void (*sample)(struct cpufreq_sampler *),
+			   void (*skip)(struct cpufreq_sampler *),
+			   unsigned long delay);
+void cpufreq_sampler_queue(struct cpufreq_sampler *sampler,
+			   unsigned long delay);
+void cpufreq_sampler_stop(struct cpufreq_sampler *sampler);
+
+#endif /* _CPUFREQ_SAMPLER_H */
@@ -0,0 +1,419 @@
+/*
+ * binder-pingpong.c - measure how binder round trips scale with processes
+ *
+ * Runs 1 to N client/server process pairs at once. Each client makes
+ * synchronous, empty transactions to its own server, which replies at
+ * once, so every round trip is two passes through binder_transaction()
+ * and binder_thread_read() and little else. With a single driver wide
+ * lock the total rate stays flat as pairs are added; with per process
+ * locking it should grow with the number of CPUs.
+ *
+ * Build: gcc -O2 -Wall -I.. -o binder-pingpong binder-pingpong.c
+ * Usage: binder-pingpong [-p max_pairs] [-n round_trips_per_client]
+ *
+ * The program registers itself as the context manager to hand out the
+ * server handles, so it must be run as root on a system where nothing
+ * else (servicemanager) has taken that role.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "binder.h"
+
+#define MAP_SZ		(128 * 1024)
+
+/* transactions understood by the context manager */
+#define MGR_REGISTER	1	/* { int index; flat_binder_object server } */
+#define MGR_LOOKUP	2	/* { int index } -> { flat_binder_object } */
+#define MAX_PAIRS	256
+
+struct reg_msg {
+	int index;
+	struct flat_binder_object obj;
+};
+
+static long mgr_handles[MAX_PAIRS];
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+static int binder_open_dev(void)
+{
+	struct binder_version vers;
+	int fd;
+
+	fd = open("/dev/binder", O_RDWR);
+	if (fd < 0)
+		die("/dev/binder");
+	if (ioctl(fd, BINDER_VERSION, &vers) < 0)
+		die("BINDER_VERSION");
+	if (vers.protocol_version != BINDER_CURRENT_PROTOCOL_VERSION) {
+		fprintf(stderr, "binder protocol %ld, expected %d\n",
+			vers.protocol_version,
+			BINDER_CURRENT_PROTOCOL_VERSION);
+		exit(1);
+	}
+	if (mmap(NULL, MAP_SZ, PROT_READ, MAP_PRIVATE, fd, 0) == MAP_FAILED)
+		die("mmap");
+	return fd;
+}
+
+static void binder_write(int fd, void *data, size_t len)
+{
+	struct binder_write_read bwr;
+
+	memset(&bwr, 0, sizeof(bwr));
+	bwr.write_size = len;
+	bwr.write_buffer = (unsigned long)data;
+	if (ioctl(fd, BINDER_WRITE_READ, &bwr) < 0)
+		die("BINDER_WRITE_READ write");
+}
+
+static void binder_cmd_ptr(int fd, uint32_t cmd, const void *ptr)
+{
+	struct {
+		uint32_t cmd;
+		const void *ptr;
+	} __attribute__((packed)) c = { cmd, ptr };
+
+	binder_write(fd, &c, sizeof(c));
+}
+
+static void binder_cmd_ptr_cookie(int fd, uint32_t cmd, void *ptr,
+				  void *cookie)
+{
+	struct {
+		uint32_t cmd;
+		struct binder_ptr_cookie pc;
+	} __attribute__((packed)) c = { cmd, { ptr, cookie } };
+
+	binder_write(fd, &c, sizeof(c));
+}
+
+static void binder_cmd_u32(int fd, uint32_t cmd, uint32_t arg)
+{
+	uint32_t c[2] = { cmd, arg };
+
+	binder_write(fd, c, sizeof(c));
+}
+
+/* BC_TRANSACTION or BC_REPLY, optionally freeing a received buffer first */
+static void binder_send(int fd, uint32_t cmd, long handle, uint32_t code,
+			void *data, size_t size, size_t *offs, size_t noffs,
+			const void *free_buf)
+{
+	char buf[2 * sizeof(uint32_t) + sizeof(void *) +
+		 sizeof(struct binder_transaction_data)];
+	struct binder_transaction_data tr;
+	uint32_t free_cmd = BC_FREE_BUFFER;
+	char *p = buf;
+
+	if (free_buf) {
+		memcpy(p, &free_cmd, sizeof(free_cmd));
+		p += sizeof(free_cmd);
+		memcpy(p, &free_buf, sizeof(free_buf));
+		p += sizeof(free_buf);
+	}
+
+	memset(&tr, 0, sizeof(tr));
+	tr.target.handle = handle;
+	tr.code = code;
+	tr.data_size = size;
+	tr.offsets_size = noffs * sizeof(size_t);
+	tr.data.ptr.buffer = data;
+	tr.data.ptr.offsets = offs;
+	memcpy(p, &cmd, sizeof(cmd));
+	p += sizeof(cmd);
+	memcpy(p, &tr, sizeof(tr));
+	p += sizeof(tr);
+
+	binder_write(fd, buf, p - buf);
+}
+
+/*
+ * Reads until a transaction or reply arrives and returns it in @tr,
+ * answering reference count requests for our nodes on the way.
+ */
+static uint32_t binder_wait(int fd, struct binder_transaction_data *tr)
+{
+	static char rbuf[256];
+	static char *pos, *end;
+
+	for (;;) {
+		struct binder_write_read bwr;
+		uint32_t cmd;
+
+		if (pos >= end) {
+			memset(&bwr, 0, sizeof(bwr));
+			bwr.read_size = sizeof(rbuf);
+			bwr.read_buffer = (unsigned long)rbuf;
+			if (ioctl(fd, BINDER_WRITE_READ, &bwr) < 0) {
+				if (errno == EINTR)
+					continue;
+				die("BINDER_WRITE_READ read");
+			}
+			pos = rbuf;
+			end = rbuf + bwr.read_consumed;
+			continue;
+		}
+		memcpy(&cmd, pos, sizeof(cmd));
+		pos += sizeof(cmd);
+
+		switch (cmd) {
+		case BR_TRANSACTION:
+		case BR_REPLY:
+			memcpy(tr, pos, sizeof(*tr));
+			pos += sizeof(*tr);
+			return cmd;
+		case BR_INCREFS:
+		case BR_ACQUIRE: {
+			struct binder_ptr_cookie pc;
+
+			memcpy(&pc, pos, sizeof(pc));
+			binder_cmd_ptr_cookie(fd, cmd == BR_INCREFS ?
+					      BC_INCREFS_DONE : BC_ACQUIRE_DONE,
+					      pc.ptr, pc.cookie);
+			break;
+		}
+		case BR_DEAD_REPLY:
+		case BR_FAILED_REPLY:
+			fprintf(stderr, "%d: transaction failed (%x)\n",
+				getpid(), cmd);
+			exit(1);
+		default:
+			break;
+		}
+		pos += _IOC_SIZE(cmd);
+	}
+}
+
+static void manager(int ready_fd)
+{
+	struct binder_transaction_data tr;
+	int fd = binder_open_dev();
+
+	if (ioctl(fd, BINDER_SET_CONTEXT_MGR, 0) < 0)
+		die("BINDER_SET_CONTEXT_MGR");
+	binder_cmd_u32(fd, BC_ENTER_LOOPER, 0);
+	close(ready_fd);
+
+	for (;;) {
+		const struct reg_msg *msg;
+		struct flat_binder_object obj;
+		size_t off = 0;
+
+		binder_wait(fd, &tr);
+		msg = tr.data.ptr.buffer;
+		if (msg->index < 0 || msg->index >= MAX_PAIRS) {
+			binder_send(fd, BC_REPLY, 0, 0, NULL, 0, NULL, 0,
+				    tr.data.ptr.buffer);
+			continue;
+		}
+		if (tr.code == MGR_REGISTER) {
+			mgr_handles[msg->index] = msg->obj.handle;
+			/* hold on to it past the buffer */
+			binder_cmd_u32(fd, BC_ACQUIRE, msg->obj.handle);
+			binder_send(fd, BC_REPLY, 0, 0, NULL, 0, NULL, 0,
+				    tr.data.ptr.buffer);
+			continue;
+		}
+		memset(&obj, 0, sizeof(obj));
+		obj.type = BINDER_TYPE_HANDLE;
+		obj.handle = mgr_handles[msg->index];
+		binder_send(fd, BC_REPLY, 0, 0, &obj, sizeof(obj), &off, 1,
+			    tr.data.ptr.buffer);
+	}
+}
+
+static void server(int index, int ready_fd)
+{
+	struct binder_transaction_data tr;
+	struct reg_msg msg;
+	size_t off = offsetof(struct reg_msg, obj);
+	int fd = binder_open_dev();
+
+	memset(&msg, 0, sizeof(msg));
+	msg.index = index;
+	msg.obj.type = BINDER_TYPE_BINDER;
+	msg.obj.binder = (void *)(long)(index + 1);
+	binder_send(fd, BC_TRANSACTION, 0, MGR_REGISTER, &msg, sizeof(msg),
+		    &off, 1, NULL);
+	binder_wait(fd, &tr);
+	binder_cmd_ptr(fd, BC_FREE_BUFFER, tr.data.ptr.buffer);
+	binder_cmd_u32(fd, BC_ENTER_LOOPER, 0);
+	close(ready_fd);
+
+	for (;;) {
+		binder_wait(fd, &tr);
+		binder_send(fd, BC_REPLY, 0, 0, NULL, 0, NULL, 0,
+			    tr.data.ptr.buffer);
+	}
+}
+
+static void client(int index, int go_fd, unsigned long iterations)
+{
+	struct binder_transaction_data tr;
+	const struct flat_binder_object *obj;
+	unsigned long i;
+	long handle;
+	char c;
+	int fd = binder_open_dev();
+
+	binder_send(fd, BC_TRANSACTION, 0, MGR_LOOKUP, &index, sizeof(index),
+		    NULL, 0, NULL);
+	binder_wait(fd, &tr);
+	if (tr.data_size < sizeof(*obj)) {
+		fprintf(stderr, "lookup of server %d failed\n", index);
+		exit(1);
+	}
+	obj = tr.data.ptr.buffer;
+	handle = obj->handle;
+	binder_cmd_u32(fd, BC_ACQUIRE, handle);
+	binder_cmd_ptr(fd, BC_FREE_BUFFER, tr.data.ptr.buffer);
+
+	/* start all clients of a round together */
+	if (read(go_fd, &c, 1) < 0)
+		die("read");
+
+	for (i = 0; i < iterations; i++) {
+		binder_send(fd, BC_TRANSACTION, handle, 0, NULL, 0, NULL, 0,
+			    NULL);
+		binder_wait(fd, &tr);
+		binder_cmd_ptr(fd, BC_FREE_BUFFER, tr.data.ptr.buffer);
+	}
+	exit(0);
+}
+
+/* forks @fn and waits until it closes its end of the ready pipe */
+static pid_t spawn_ready(void (*fn)(int, int), int index)
+{
+	int p[2];
+	pid_t pid;
+	char c;
+
+	if (pipe(p) < 0)
+		die("pipe");
+	pid = fork();
+	if (pid < 0)
+		die("fork");
+	if (!pid) {
+		close(p[0]);
+		fn(index, p[1]);
+		exit(0);
+	}
+	close(p[1]);
+	if (read(p[0], &c, 1) < 0)
+		die("read");
+	close(p[0]);
+	return pid;
+}
+
+static void manager_fn(int index, int ready_fd)
+{
+	manager(ready_fd);
+}
+
+static double run(int nr_pairs, unsigned long iterations)
+{
+	struct timeval start, end;
+	int go[2], i, status;
+
+	if (pipe(go) < 0)
+		die("pipe");
+	for (i = 0; i < nr_pairs; i++) {
+		pid_t pid = fork();
+
+		if (pid < 0)
+			die("fork");
+		if (!pid) {
+			close(go[1]);
+			client(i, go[0], iterations);
+		}
+	}
+	close(go[0]);
+	/* give the clients time to look up their servers */
+	sleep(1);
+
+	gettimeofday(&start, NULL);
+	close(go[1]);
+	for (i = 0; i < nr_pairs; i++) {
+		if (wait(&status) < 0)
+			die("wait");
+		if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+			fprintf(stderr, "client failed\n");
+			exit(1);
+		}
+	}
+	gettimeofday(&end, NULL);
+
+	return (end.tv_sec - start.tv_sec) +
+		(end.tv_usec - start.tv_usec) / 1e6;
+}
+
+int main(int argc, char **argv)
+{
+	pid_t pids[MAX_PAIRS + 1];
+	unsigned long iterations = 100000;
+	int max_pairs, nr_pairs, opt, i;
+	double base = 0;
+
+	max_pairs = sysconf(_SC_NPROCESSORS_ONLN) / 2;
+	if (max_pairs < 1)
+		max_pairs = 1;
+
+	while ((opt = getopt(argc, argv, "p:n:")) != -1) {
+		switch (opt) {
+		case 'p':
+			max_pairs = atoi(optarg);
+			break;
+		case 'n':
+			iterations = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (optind != argc || max_pairs < 1 || max_pairs > MAX_PAIRS ||
+	    !iterations)
+		goto usage;
+
+	pids[0] = spawn_ready(manager_fn, 0);
+	for (i = 0; i < max_pairs; i++)
+		pids[i + 1] = spawn_ready(server, i);
+
+	printf("%8s %14s %8s\n", "pairs", "round trips/s", "scale");
+	for (nr_pairs = 1; nr_pairs <= max_pairs; nr_pairs++) {
+		double secs = run(nr_pairs, iterations);
+		double rate = (double)nr_pairs * iterations / secs;
+
+		if (nr_pairs == 1)
+			base = rate;
+		printf("%8d %14.0f %8.2f\n", nr_pairs, rate, rate / base);
+	}
+
+	for (i = 0; i <= max_pairs; i++)
+		kill(pids[i], SIGTERM);
+	while (wait(NULL) > 0)
+		;
+	return 0;
+
+usage:
+	fprintf(stderr, "usage: %s [-p max_pairs] [-n round_trips_per_client]\n",
+		argv[0]);
+	return 1;
+}
@@ -0,0 +1,245 @@
+/*
+ * logger-spam.c - measure how log writes scale with writing threads
+ *
+ * Runs 1 to N threads at once, each writing small entries to a log device
+ * as fast as it can, the way liblog does: one writev() of priority, tag and
+ * message per entry. With a single log wide lock the total rate stays flat
+ * as threads are added; with lockless writers it should grow with the
+ * number of CPUs.
+ *
+ * With -r, a reader drains the log while the writers run, and checks that
+ * every entry it gets is well formed: a header whose pid and tid belong to
+ * this process and whose __pad is zero, and a payload that matches what
+ * its thread wrote. Entries lost to the reader being lapped are expected;
+ * torn or corrupted ones are reported.
+ *
+ * Build: gcc -O2 -Wall -pthread -I.. -o logger-spam logger-spam.c
+ * Usage: logger-spam [-d device] [-t max_threads] [-s seconds] [-r]
+ *
+ * Run it against a log nothing else writes to, or the reader will count
+ * other processes' entries as foreign.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "logger.h"
+
+#define MAX_THREADS	256
+#define TAG		"spam"
+
+static const char *device;
+static int run_seconds = 2;
+static volatile int stop;
+
+struct writer {
+	pthread_t thread;
+	int fd;
+	unsigned long count;
+} writers[MAX_THREADS];
+
+struct reader_stats {
+	unsigned long entries;
+	unsigned long foreign;
+	unsigned long bad;
+};
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* the message is "<tid> <seq> " padded with a pattern derived from both */
+static int format_msg(char *msg, int tid, unsigned long seq)
+{
+	int len, i;
+
+	len = sprintf(msg, "%d %lu ", tid, seq);
+	for (i = 0; i < (int)(seq % 64) + 16; i++)
+		msg[len++] = 'a' + (tid + seq + i) % 26;
+	msg[len++] = '\0';
+	return len;
+}
+
+static void *writer_fn(void *arg)
+{
+	struct writer *w = arg;
+	int tid = syscall(SYS_gettid);
+	unsigned char prio = 3;
+	char msg[128];
+	struct iovec vec[3];
+
+	vec[0].iov_base = &prio;
+	vec[0].iov_len = 1;
+	vec[1].iov_base = TAG;
+	vec[1].iov_len = sizeof(TAG);
+	vec[2].iov_base = msg;
+
+	while (!stop) {
+		vec[2].iov_len = format_msg(msg, tid, w->count);
+		if (writev(w->fd, vec, 3) < 0)
+			die("writev");
+		w->count++;
+	}
+	return NULL;
+}
+
+static int check_entry(struct logger_entry *e, int n)
+{
+	char expect[128];
+	const char *msg;
+	unsigned long seq;
+	int tid;
+
+	if (n != (int)sizeof(*e) + e->len || e->__pad)
+		return 0;
+	if (e->len < 1 + sizeof(TAG) || memcmp(e->msg + 1, TAG, sizeof(TAG)))
+		return 0;
+	msg = e->msg + 1 + sizeof(TAG);
+	if (sscanf(msg, "%d %lu ", &tid, &seq) != 2 || tid != e->tid)
+		return 0;
+	if (format_msg(expect, tid, seq) != e->len - 1 - (int)sizeof(TAG))
+		return 0;
+	return !strcmp(msg, expect);
+}
+
+static void *reader_fn(void *arg)
+{
+	struct reader_stats *st = arg;
+	unsigned char buf[LOGGER_ENTRY_MAX_LEN + 1];
+	struct logger_entry *e = (struct logger_entry *)buf;
+	int fd, n;
+
+	fd = open(device, O_RDONLY | O_NONBLOCK);
+	if (fd < 0)
+		die(device);
+	while (!stop) {
+		n = read(fd, buf, LOGGER_ENTRY_MAX_LEN);
+		if (n < 0) {
+			if (errno == EAGAIN) {
+				usleep(1000);
+				continue;
+			}
+			die("read");
+		}
+		buf[n] = '\0';
+		st->entries++;
+		if (e->pid != getpid())
+			st->foreign++;
+		else if (!check_entry(e, n))
+			st->bad++;
+	}
+	close(fd);
+	return NULL;
+}
+
+static double run(int nr_threads, int check, struct reader_stats *st)
+{
+	pthread_t reader;
+	unsigned long total = 0;
+	double start;
+	int i;
+
+	stop = 0;
+	memset(st, 0, sizeof(*st));
+	if (check && pthread_create(&reader, NULL, reader_fn, st))
+		die("pthread_create");
+	for (i = 0; i < nr_threads; i++) {
+		writers[i].count = 0;
+		writers[i].fd = open(device, O_WRONLY);
+		if (writers[i].fd < 0)
+			die(device);
+	}
+
+	start = now();
+	for (i = 0; i < nr_threads; i++)
+		if (pthread_create(&writers[i].thread, NULL, writer_fn,
+				   &writers[i]))
+			die("pthread_create");
+	sleep(run_seconds);
+	stop = 1;
+	for (i = 0; i < nr_threads; i++) {
+		pthread_join(writers[i].thread, NULL);
+		close(writers[i].fd);
+		total += writers[i].count;
+	}
+	if (check)
+		pthread_join(reader, NULL);
+
+	return total / (now() - start);
+}
+
+int main(int argc, char **argv)
+{
+	int max_threads = sysconf(_SC_NPROCESSORS_ONLN) * 2;
+	int check = 0, opt, n;
+	struct reader_stats st;
+	double base = 0, rate;
+
+	while ((opt = getopt(argc, argv, "d:t:s:r")) != -1) {
+		switch (opt) {
+		case 'd':
+			device = optarg;
+			break;
+		case 't':
+			max_threads = atoi(optarg);
+			break;
+		case 's':
+			run_seconds = atoi(optarg);
+			break;
+		case 'r':
+			check = 1;
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (max_threads < 1 || max_threads > MAX_THREADS || run_seconds < 1)
+		goto usage;
+	if (!device)
+		device = access("/dev/log/main", W_OK) ? "/dev/log_main" :
+							  "/dev/log/main";
+
+	printf("%7s %14s %7s", "threads", "entries/s", "scale");
+	if (check)
+		printf(" %10s %8s %6s", "read", "foreign", "bad");
+	printf("\n");
+
+	for (n = 1; n <= max_threads; n *= 2) {
+		rate = run(n, check, &st);
+		if (!base)
+			base = rate;
+		printf("%7d %14.0f %7.2f", n, rate, rate / base);
+		if (check)
+			printf(" %10lu %8lu %6lu", st.entries, st.foreign,
+			       st.bad);
+		printf("\n");
+		if (n < max_threads && n * 2 > max_threads)
+			n = max_threads / 2;
+	}
+	return 0;
+
+usage:
+	fprintf(stderr, "usage: %s [-d device] [-t max_threads] [-s seconds] "
+		"[-r]\n", argv[0]);
+	return 1;
+}
@@ -0,0 +1,216 @@
+/*
+ * lowmemorykiller-bench.c - measure what the lowmemorykiller costs reclaim
+ *
+ * Streams a file larger than memory through the page cache, so that the
+ * shrinkers, the lowmemorykiller among them, are called all the time, with
+ * 0 to N extra sleeping processes on the system. The killer is set up to
+ * consider itself under pressure at every call but to only kill processes
+ * with an oom_adj of 15, and the sleepers use oom_adj 0 to 14, so it never
+ * kills anything: what is measured is the cost of looking for a victim.
+ *
+ * When the killer walks every task on every call, the system time spent
+ * per megabyte read grows with the number of processes. With processes
+ * indexed by oom_adj it should stay flat.
+ *
+ * Build: gcc -O2 -Wall -o lowmemorykiller-bench lowmemorykiller-bench.c
+ * Usage: lowmemorykiller-bench -f file [-p max_procs] [-r rounds]
+ *
+ * Must be run as root. The killer's adj and minfree parameters are
+ * restored on exit. Any other process with an oom_adj of 15 (empty apps
+ * on Android) will be killed during the run.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define PARAMS		"/sys/module/lowmemorykiller/parameters/"
+#define MAX_PROCS	4096
+#define CHUNK		(1024 * 1024)
+
+static char saved_adj[256], saved_minfree[256];
+static pid_t sleepers[MAX_PROCS];
+static int nr_sleepers;
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+static void read_param(const char *name, char *buf, size_t len)
+{
+	char path[128];
+	int fd, n;
+
+	snprintf(path, sizeof(path), PARAMS "%s", name);
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		die(path);
+	n = read(fd, buf, len - 1);
+	if (n < 0)
+		die(path);
+	buf[n] = '\0';
+	close(fd);
+}
+
+static void write_param(const char *name, const char *val)
+{
+	char path[128];
+	int fd;
+
+	snprintf(path, sizeof(path), PARAMS "%s", name);
+	fd = open(path, O_WRONLY);
+	if (fd < 0 || write(fd, val, strlen(val)) < 0)
+		die(path);
+	close(fd);
+}
+
+static void restore_params(void)
+{
+	write_param("adj", saved_adj);
+	write_param("minfree", saved_minfree);
+}
+
+static void set_oom_adj(int adj)
+{
+	char buf[16];
+	int fd;
+
+	fd = open("/proc/self/oom_adj", O_WRONLY);
+	snprintf(buf, sizeof(buf), "%d", adj);
+	if (fd < 0 || write(fd, buf, strlen(buf)) < 0)
+		die("/proc/self/oom_adj");
+	close(fd);
+}
+
+static void add_sleepers(int n)
+{
+	pid_t pid;
+
+	while (nr_sleepers < n) {
+		pid = fork();
+		if (pid < 0)
+			die("fork");
+		if (!pid) {
+			set_oom_adj(nr_sleepers % 15);
+			for (;;)
+				pause();
+		}
+		sleepers[nr_sleepers++] = pid;
+	}
+}
+
+static void kill_sleepers(void)
+{
+	while (nr_sleepers > 0) {
+		kill(sleepers[--nr_sleepers], SIGKILL);
+		waitpid(sleepers[nr_sleepers], NULL, 0);
+	}
+}
+
+/* system time of all CPUs, in clock ticks, from /proc/stat */
+static unsigned long long system_ticks(void)
+{
+	unsigned long long user, nice, sys;
+	FILE *f;
+
+	f = fopen("/proc/stat", "r");
+	if (!f || fscanf(f, "cpu %llu %llu %llu", &user, &nice, &sys) != 3)
+		die("/proc/stat");
+	fclose(f);
+	return sys;
+}
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void stream(const char *file, int rounds, double *mb, double *secs,
+		   double *sys_ms)
+{
+	static char buf[CHUNK];
+	unsigned long long sys0;
+	double start;
+	long long total = 0;
+	int fd, n, r;
+
+	sys0 = system_ticks();
+	start = now();
+	for (r = 0; r < rounds; r++) {
+		fd = open(file, O_RDONLY);
+		if (fd < 0)
+			die(file);
+		while ((n = read(fd, buf, sizeof(buf))) > 0)
+			total += n;
+		if (n < 0)
+			die("read");
+		close(fd);
+	}
+	*secs = now() - start;
+	*mb = total / 1048576.0;
+	*sys_ms = (system_ticks() - sys0) * 1000.0 / sysconf(_SC_CLK_TCK);
+}
+
+int main(int argc, char **argv)
+{
+	const char *file = NULL;
+	int max_procs = 1024, rounds = 2, opt, n;
+	double mb, secs, sys_ms;
+	char minfree[32];
+
+	while ((opt = getopt(argc, argv, "f:p:r:")) != -1) {
+		switch (opt) {
+		case 'f':
+			file = optarg;
+			break;
+		case 'p':
+			max_procs = atoi(optarg);
+			break;
+		case 'r':
+			rounds = atoi(optarg);
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (!file || max_procs < 0 || max_procs > MAX_PROCS || rounds < 1)
+		goto usage;
+
+	read_param("adj", saved_adj, sizeof(saved_adj));
+	read_param("minfree", saved_minfree, sizeof(saved_minfree));
+	atexit(restore_params);
+
+	/* always under pressure, but only oom_adj 15 may be killed */
+	snprintf(minfree, sizeof(minfree), "%ld", sysconf(_SC_PHYS_PAGES));
+	write_param("adj", "15");
+	write_param("minfree", minfree);
+	set_oom_adj(0);
+
+	printf("%8s %10s %10s %14s\n", "procs", "MB/s", "sys ms", "sys ms/GB");
+	for (n = 0; n <= max_procs; n = n ? n * 2 : 64) {
+		add_sleepers(n);
+		stream(file, rounds, &mb, &secs, &sys_ms);
+		printf("%8d %10.1f %10.0f %14.1f\n", n, mb / secs, sys_ms,
+		       sys_ms * 1024 / mb);
+		if (n < max_procs && n * 2 > max_procs)
+			n = max_procs / 2;
+	}
+	kill_sleepers();
+	return 0;
+
+usage:
+	fprintf(stderr, "usage: %s -f file [-p max_procs] [-r rounds]\n",
+		argv[0]);
+	return 1;
+}
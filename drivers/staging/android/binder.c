@@ -19,7 +19,9 @@
 #include <linux/fdtable.h>
 #include <linux/file.h>
 #include <linux/fs.h>
+#include <linux/ktime.h>
 #include <linux/list.h>
+#include <linux/log2.h>
 #include <linux/miscdevice.h>
 #include <linux/mm.h>
 #include <linux/module.h>
@@ -28,16 +30,46 @@
 #include <linux/poll.h>
 #include <linux/debugfs.h>
 #include <linux/rbtree.h>
+#include <linux/rwsem.h>
 #include <linux/sched.h>
 #include <linux/seq_file.h>
 #include <linux/slab.h>
+#include <linux/spinlock.h>
 #include <linux/uaccess.h>
 #include <linux/vmalloc.h>
 
 #include "binder.h"
 
-static DEFINE_MUTEX(binder_lock);
+/*
+ * Locking:
+ *
+ * binder_main_lock is taken for reading by every ioctl and poll, so no
+ * proc or thread can be freed under them. Process teardown, the deferred
+ * flush, BINDER_THREAD_EXIT, BINDER_SET_CONTEXT_MGR and the debugfs dumps
+ * take it for writing. Everything else is protected per process:
+ *
+ * proc->lock:       refs_by_desc, refs_by_node and the counts and death
+ *                   notification of each ref.
+ * proc->alloc_lock: the buffer allocator (buffers, free_buffers,
+ *                   allocated_buffers, free_async_space and pages).
+ * proc->inner_lock: the todo lists of the proc and its threads, the
+ *                   threads and nodes trees, thread transaction stacks and
+ *                   return errors, delivered_death, the thread counts, the
+ *                   state of the proc's nodes and the transaction links of
+ *                   the proc's buffers.
+ *
+ * Nodes whose proc has died use binder_dead_nodes_lock in place of an
+ * inner_lock, see binder_node_lock(). A proc->lock may be followed by one
+ * inner_lock or the dead nodes lock; alloc_lock is never taken with either
+ * of them held. No two locks of the same kind are held at once.
+ *
+ * A thread can only pop the transaction on top of its own stack, so the
+ * transactions below it, and the from_parent links between them, stay put
+ * while it walks them.
+ */
+static DECLARE_RWSEM(binder_main_lock);
 static DEFINE_MUTEX(binder_deferred_lock);
+static DEFINE_SPINLOCK(binder_dead_nodes_lock);
 
 static HLIST_HEAD(binder_procs);
 static HLIST_HEAD(binder_deferred_list);
@@ -47,7 +79,7 @@ static struct dentry *binder_debugfs_dir_entry_root;
 static struct dentry *binder_debugfs_dir_entry_proc;
 static struct binder_node *binder_context_mgr_node;
 static uid_t binder_context_mgr_uid = -1;
-static int binder_last_id;
+static atomic_t binder_last_id;
 static struct workqueue_struct *binder_deferred_workqueue;
 
 #define BINDER_DEBUG_ENTRY(name) \
@@ -105,6 +137,15 @@ module_param_named(debug_mask, binder_debug_mask, uint, S_IWUSR | S_IRUGO);
 static int binder_debug_no_lock;
 module_param_named(proc_no_lock, binder_debug_no_lock, bool, S_IWUSR | S_IRUGO);
 
+/*
+ * Pages at the start of each process's buffer space that are mapped at
+ * mmap time and stay mapped, so that small transactions never allocate
+ * or map pages. Takes effect for processes that mmap afterwards.
+ */
+static int binder_resident_pages = 4;
+module_param_named(resident_pages, binder_resident_pages, int,
+		   S_IWUSR | S_IRUGO);
+
 static DECLARE_WAIT_QUEUE_HEAD(binder_user_error_wait);
 static int binder_stop_on_user_error;
 
@@ -146,22 +187,22 @@ enum binder_stat_types {
 };
 
 struct binder_stats {
-	int br[_IOC_NR(BR_FAILED_REPLY) + 1];
-	int bc[_IOC_NR(BC_DEAD_BINDER_DONE) + 1];
-	int obj_created[BINDER_STAT_COUNT];
-	int obj_deleted[BINDER_STAT_COUNT];
+	atomic_t br[_IOC_NR(BR_FAILED_REPLY) + 1];
+	atomic_t bc[_IOC_NR(BC_DEAD_BINDER_DONE) + 1];
+	atomic_t obj_created[BINDER_STAT_COUNT];
+	atomic_t obj_deleted[BINDER_STAT_COUNT];
 };
 
 static struct binder_stats binder_stats;
 
 static inline void binder_stats_deleted(enum binder_stat_types type)
 {
-	binder_stats.obj_deleted[type]++;
+	atomic_inc(&binder_stats.obj_deleted[type]);
 }
 
 static inline void binder_stats_created(enum binder_stat_types type)
 {
-	binder_stats.obj_created[type]++;
+	atomic_inc(&binder_stats.obj_created[type]);
 }
 
 struct binder_transaction_log_entry {
@@ -177,24 +218,27 @@ struct binder_transaction_log_entry {
 	int offsets_size;
 };
 struct binder_transaction_log {
-	int next;
+	atomic_t cur;
 	int full;
 	struct binder_transaction_log_entry entry[32];
 };
-static struct binder_transaction_log binder_transaction_log;
-static struct binder_transaction_log binder_transaction_log_failed;
+static struct binder_transaction_log binder_transaction_log = {
+	.cur = ATOMIC_INIT(-1),
+};
+static struct binder_transaction_log binder_transaction_log_failed = {
+	.cur = ATOMIC_INIT(-1),
+};
 
 static struct binder_transaction_log_entry *binder_transaction_log_add(
 	struct binder_transaction_log *log)
 {
 	struct binder_transaction_log_entry *e;
-	e = &log->entry[log->next];
-	memset(e, 0, sizeof(*e));
-	log->next++;
-	if (log->next == ARRAY_SIZE(log->entry)) {
-		log->next = 0;
+	unsigned int cur = atomic_inc_return(&log->cur);
+
+	if (cur >= ARRAY_SIZE(log->entry) - 1)
 		log->full = 1;
-	}
+	e = &log->entry[cur % ARRAY_SIZE(log->entry)];
+	memset(e, 0, sizeof(*e));
 	return e;
 }
 
@@ -210,6 +254,23 @@ struct binder_work {
 	} type;
 };
 
+/*
+ * Latency histograms, with power of two buckets in microseconds: bucket
+ * 0 counts times below 2us, bucket n times from 2^n to 2^(n+1) - 1us
+ * and the last one everything longer. A delivered transaction was either
+ * queued, because no thread was waiting for it, or woken up a waiting
+ * thread; its delay from being sent to being read goes to the queue or
+ * wakeup histogram accordingly. The handler time of a synchronous
+ * transaction is the time from it being read to the reply being sent.
+ */
+#define BINDER_LAT_BUCKETS 16
+
+struct binder_latency {
+	u32 queue[BINDER_LAT_BUCKETS];
+	u32 wakeup[BINDER_LAT_BUCKETS];
+	u32 handler[BINDER_LAT_BUCKETS];
+};
+
 struct binder_node {
 	int debug_id;
 	struct binder_work work;
@@ -222,6 +283,7 @@ struct binder_node {
 	int internal_strong_refs;
 	int local_weak_refs;
 	int local_strong_refs;
+	int tmp_refs;
 	void __user *ptr;
 	void __user *cookie;
 	unsigned has_strong_ref:1;
@@ -232,6 +294,7 @@ struct binder_node {
 	unsigned accept_fds:1;
 	unsigned min_priority:8;
 	struct list_head async_todo;
+	struct binder_latency latency;
 };
 
 struct binder_ref_death {
@@ -281,6 +344,9 @@ enum binder_deferred_state {
 
 struct binder_proc {
 	struct hlist_node proc_node;
+	struct mutex lock;
+	struct mutex alloc_lock;
+	spinlock_t inner_lock;
 	struct rb_root threads;
 	struct rb_root nodes;
 	struct rb_root refs_by_desc;
@@ -302,6 +368,13 @@ struct binder_proc {
 	struct page **pages;
 	size_t buffer_size;
 	uint32_t buffer_free;
+	int resident_pages;
+	/* allocator statistics, under alloc_lock */
+	unsigned long alloc_count;
+	unsigned long alloc_failed;
+	unsigned long alloc_mapped;
+	unsigned long pages_mapped;
+	unsigned long pages_unmapped;
 	struct list_head todo;
 	wait_queue_head_t wait;
 	struct binder_stats stats;
@@ -312,6 +385,7 @@ struct binder_proc {
 	int ready_threads;
 	long default_priority;
 	struct dentry *debugfs_entry;
+	struct binder_latency latency;
 };
 
 enum {
@@ -347,6 +421,7 @@ struct binder_transaction {
 	struct binder_thread *to_thread;
 	struct binder_transaction *to_parent;
 	unsigned need_reply:1;
+	unsigned queued:1;
 	/* unsigned is_dead:1; */	/* not used at the moment */
 
 	struct binder_buffer *buffer;
@@ -354,9 +429,20 @@ struct binder_transaction {
 	unsigned int	flags;
 	long	priority;
 	long	saved_priority;
+	/* the caller's scheduling class, and the callee's to restore */
+	unsigned int	sched_policy;
+	unsigned int	rt_priority;
+	unsigned int	saved_sched_policy;
+	unsigned int	saved_rt_priority;
 	uid_t	sender_euid;
+	ktime_t	queued_time;
+	ktime_t	deliver_time;
+	struct binder_node *handler_node; /* pinned while handled */
 };
 
+#define CREATE_TRACE_POINTS
+#include "binder_trace.h"
+
 static void
 binder_defer_work(struct binder_proc *proc, enum binder_deferred_state defer);
 
@@ -515,6 +601,65 @@ static void binder_set_nice(long nice)
 	binder_user_error("binder: %d RLIMIT_NICE not set\n", current->pid);
 }
 
+static int binder_rt_policy(unsigned int policy)
+{
+	return policy == SCHED_FIFO || policy == SCHED_RR;
+}
+
+static void binder_set_sched(unsigned int policy, unsigned int rt_priority)
+{
+	struct sched_param param = { .sched_priority = rt_priority };
+
+	if (current->policy == policy && current->rt_priority == rt_priority)
+		return;
+	binder_debug(BINDER_DEBUG_PRIORITY_CAP,
+		     "binder: %d: policy %u prio %u -> policy %u prio %u\n",
+		     current->pid, current->policy, current->rt_priority,
+		     policy, rt_priority);
+	/* inherited from, or restored to, a legitimate policy */
+	if (sched_setscheduler_nocheck(current, policy, &param))
+		binder_user_error("binder: %d: failed to set policy %u "
+				  "prio %u\n", current->pid, policy,
+				  rt_priority);
+}
+
+/*
+ * Makes the current thread run @t at the priority of its caller, or at
+ * the node's minimum priority if that is higher, remembering its own
+ * for binder_restore_priority(). Real-time callers lend their policy to
+ * synchronous calls only, so that one-way calls cannot be used to boost
+ * a server.
+ */
+static void binder_inherit_priority(struct binder_transaction *t,
+				    struct binder_node *target_node)
+{
+	int sync = !(t->flags & TF_ONE_WAY);
+
+	t->saved_priority = task_nice(current);
+	t->saved_sched_policy = current->policy;
+	t->saved_rt_priority = current->rt_priority;
+
+	if (sync && binder_rt_policy(t->sched_policy) &&
+	    (!binder_rt_policy(current->policy) ||
+	     current->rt_priority < t->rt_priority))
+		binder_set_sched(t->sched_policy, t->rt_priority);
+
+	/*
+	 * The caller was allowed to run at its nice value, so RLIMIT_NICE
+	 * of the callee does not apply to it, nor to restoring the old one.
+	 */
+	if (t->priority < target_node->min_priority && sync)
+		set_user_nice(current, t->priority);
+	else if (sync || t->saved_priority > target_node->min_priority)
+		binder_set_nice(target_node->min_priority);
+}
+
+static void binder_restore_priority(struct binder_transaction *t)
+{
+	binder_set_sched(t->saved_sched_policy, t->saved_rt_priority);
+	set_user_nice(current, t->saved_priority);
+}
+
 static size_t binder_buffer_size(struct binder_proc *proc,
 				 struct binder_buffer *buffer)
 {
@@ -549,7 +694,9 @@ static void binder_insert_free_buffer(struct binder_proc *proc,
 
 		buffer_size = binder_buffer_size(proc, buffer);
 
-		if (new_buffer_size < buffer_size)
+		/* equal sizes by address, see binder_alloc_buf() */
+		if (new_buffer_size < buffer_size ||
+		    (new_buffer_size == buffer_size && new_buffer < buffer))
 			p = &parent->rb_left;
 		else
 			p = &parent->rb_right;
@@ -621,6 +768,9 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 		     "binder: %d: %s pages %p-%p\n", proc->pid,
 		     allocate ? "allocate" : "free", start, end);
 
+	/* the resident pages are never mapped or unmapped here */
+	if (start < proc->buffer + proc->resident_pages * PAGE_SIZE)
+		start = proc->buffer + proc->resident_pages * PAGE_SIZE;
 	if (end <= start)
 		return 0;
 
@@ -676,6 +826,7 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 		}
 		/* vm_insert_page does not seem to increment the refcount */
 	}
+	proc->pages_mapped += (end - start) / PAGE_SIZE;
 	if (mm) {
 		up_write(&mm->mmap_sem);
 		mmput(mm);
@@ -683,6 +834,7 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 	return 0;
 
 free_range:
+	proc->pages_unmapped += (end - start) / PAGE_SIZE;
 	for (page_addr = end - PAGE_SIZE; page_addr >= start;
 	     page_addr -= PAGE_SIZE) {
 		page = &proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
@@ -714,12 +866,14 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 	size_t buffer_size;
 	struct rb_node *best_fit = NULL;
 	void *has_page_addr;
+	void *start_page_addr;
 	void *end_page_addr;
 	size_t size;
 
 	if (proc->vma == NULL) {
 		printk(KERN_ERR "binder: %d: binder_alloc_buf, no vma\n",
 		       proc->pid);
+		proc->alloc_failed++;
 		return NULL;
 	}
 
@@ -729,6 +883,7 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 	if (size < data_size || size < offsets_size) {
 		binder_user_error("binder: %d: got transaction with invalid "
 			"size %zd-%zd\n", proc->pid, data_size, offsets_size);
+		proc->alloc_failed++;
 		return NULL;
 	}
 
@@ -737,33 +892,34 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 		binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
 			     "binder: %d: binder_alloc_buf size %zd"
 			     "failed, no async space left\n", proc->pid, size);
+		proc->alloc_failed++;
 		return NULL;
 	}
 
+	/*
+	 * Best fit, and the lowest address among equally good fits: this
+	 * keeps small buffers packed at the start of the buffer space,
+	 * in the resident pages.
+	 */
 	while (n) {
 		buffer = rb_entry(n, struct binder_buffer, rb_node);
 		BUG_ON(!buffer->free);
 		buffer_size = binder_buffer_size(proc, buffer);
 
-		if (size < buffer_size) {
+		if (size <= buffer_size) {
 			best_fit = n;
 			n = n->rb_left;
-		} else if (size > buffer_size)
+		} else
 			n = n->rb_right;
-		else {
-			best_fit = n;
-			break;
-		}
 	}
 	if (best_fit == NULL) {
 		printk(KERN_ERR "binder: %d: binder_alloc_buf size %zd failed, "
 		       "no address space\n", proc->pid, size);
+		proc->alloc_failed++;
 		return NULL;
 	}
-	if (n == NULL) {
-		buffer = rb_entry(best_fit, struct binder_buffer, rb_node);
-		buffer_size = binder_buffer_size(proc, buffer);
-	}
+	buffer = rb_entry(best_fit, struct binder_buffer, rb_node);
+	buffer_size = binder_buffer_size(proc, buffer);
 
 	binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
 		     "binder: %d: binder_alloc_buf size %zd got buff"
@@ -771,19 +927,24 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 
 	has_page_addr =
 		(void *)(((uintptr_t)buffer->data + buffer_size) & PAGE_MASK);
-	if (n == NULL) {
-		if (size + sizeof(struct binder_buffer) + 4 >= buffer_size)
-			buffer_size = size; /* no room for other buffers */
-		else
-			buffer_size = size + sizeof(struct binder_buffer);
-	}
+	if (size + sizeof(struct binder_buffer) + 4 >= buffer_size)
+		buffer_size = size; /* no room for other buffers */
+	else
+		buffer_size = size + sizeof(struct binder_buffer);
 	end_page_addr =
 		(void *)PAGE_ALIGN((uintptr_t)buffer->data + buffer_size);
 	if (end_page_addr > has_page_addr)
 		end_page_addr = has_page_addr;
-	if (binder_update_page_range(proc, 1,
-	    (void *)PAGE_ALIGN((uintptr_t)buffer->data), end_page_addr, NULL))
-		return NULL;
+	start_page_addr = (void *)PAGE_ALIGN((uintptr_t)buffer->data);
+	if (end_page_addr > start_page_addr &&
+	    end_page_addr > proc->buffer + proc->resident_pages * PAGE_SIZE) {
+		proc->alloc_mapped++;
+		if (binder_update_page_range(proc, 1, start_page_addr,
+					     end_page_addr, NULL)) {
+			proc->alloc_failed++;
+			return NULL;
+		}
+	}
 
 	rb_erase(best_fit, &proc->free_buffers);
 	buffer->free = 0;
@@ -800,6 +961,7 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 	buffer->data_size = data_size;
 	buffer->offsets_size = offsets_size;
 	buffer->async_transaction = is_async;
+	buffer->allow_user_free = 0;
 	if (is_async) {
 		proc->free_async_space -= size + sizeof(struct binder_buffer);
 		binder_debug(BINDER_DEBUG_BUFFER_ALLOC_ASYNC,
@@ -807,6 +969,8 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 			     "async free %zd\n", proc->pid, size,
 			     proc->free_async_space);
 	}
+	proc->alloc_count++;
+	trace_binder_alloc_buf(proc, buffer);
 
 	return buffer;
 }
@@ -881,6 +1045,7 @@ static void binder_free_buf(struct binder_proc *proc,
 	binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
 		     "binder: %d: binder_free_buf %p size %zd buffer"
 		     "_size %zd\n", proc->pid, buffer, size, buffer_size);
+	trace_binder_free_buf(proc, buffer);
 
 	BUG_ON(buffer->free);
 	BUG_ON(size > buffer_size);
@@ -923,6 +1088,24 @@ static void binder_free_buf(struct binder_proc *proc,
 	binder_insert_free_buffer(proc, buffer);
 }
 
+/*
+ * Locks the state of @node: the inner_lock of its proc, or the dead nodes
+ * lock once the proc is gone. Returns the lock, which stays valid when the
+ * node is freed under it.
+ */
+static spinlock_t *binder_node_lock(struct binder_node *node)
+{
+	spinlock_t *lock;
+
+	if (node->proc)
+		lock = &node->proc->inner_lock;
+	else
+		lock = &binder_dead_nodes_lock;
+	spin_lock(lock);
+	return lock;
+}
+
+/* Called with proc->inner_lock held. */
 static struct binder_node *binder_get_node(struct binder_proc *proc,
 					   void __user *ptr)
 {
@@ -942,14 +1125,25 @@ static struct binder_node *binder_get_node(struct binder_proc *proc,
 	return NULL;
 }
 
+/*
+ * Returns the node of @proc for @ptr, creating it if it does not exist
+ * yet, with a temporary reference that keeps it from being freed until
+ * binder_put_node().
+ */
 static struct binder_node *binder_new_node(struct binder_proc *proc,
 					   void __user *ptr,
-					   void __user *cookie)
+					   void __user *cookie,
+					   unsigned long flags)
 {
 	struct rb_node **p = &proc->nodes.rb_node;
 	struct rb_node *parent = NULL;
-	struct binder_node *node;
+	struct binder_node *node, *new_node;
+
+	new_node = kzalloc(sizeof(*node), GFP_KERNEL);
+	if (new_node == NULL)
+		return NULL;
 
+	spin_lock(&proc->inner_lock);
 	while (*p) {
 		parent = *p;
 		node = rb_entry(parent, struct binder_node, rb_node);
@@ -958,23 +1152,30 @@ static struct binder_node *binder_new_node(struct binder_proc *proc,
 			p = &(*p)->rb_left;
 		else if (ptr > node->ptr)
 			p = &(*p)->rb_right;
-		else
-			return NULL;
+		else {
+			node->tmp_refs++;
+			spin_unlock(&proc->inner_lock);
+			kfree(new_node);
+			return node;
+		}
 	}
 
-	node = kzalloc(sizeof(*node), GFP_KERNEL);
-	if (node == NULL)
-		return NULL;
+	node = new_node;
 	binder_stats_created(BINDER_STAT_NODE);
-	rb_link_node(&node->rb_node, parent, p);
-	rb_insert_color(&node->rb_node, &proc->nodes);
-	node->debug_id = ++binder_last_id;
+	node->debug_id = atomic_inc_return(&binder_last_id);
 	node->proc = proc;
 	node->ptr = ptr;
 	node->cookie = cookie;
+	node->min_priority = flags & FLAT_BINDER_FLAG_PRIORITY_MASK;
+	node->accept_fds = !!(flags & FLAT_BINDER_FLAG_ACCEPTS_FDS);
+	node->tmp_refs = 1;
 	node->work.type = BINDER_WORK_NODE;
 	INIT_LIST_HEAD(&node->work.entry);
 	INIT_LIST_HEAD(&node->async_todo);
+	rb_link_node(&node->rb_node, parent, p);
+	rb_insert_color(&node->rb_node, &proc->nodes);
+	spin_unlock(&proc->inner_lock);
+
 	binder_debug(BINDER_DEBUG_INTERNAL_REFS,
 		     "binder: %d:%d node %d u%p c%p created\n",
 		     proc->pid, current->pid, node->debug_id,
@@ -982,8 +1183,73 @@ static struct binder_node *binder_new_node(struct binder_proc *proc,
 	return node;
 }
 
-static int binder_inc_node(struct binder_node *node, int strong, int internal,
-			   struct list_head *target_list)
+/* Frees @node if nothing refers to it any more. Called with it locked. */
+static void binder_try_free_node(struct binder_node *node)
+{
+	if (node->proc && (node->has_strong_ref || node->has_weak_ref))
+		return;
+	if (!hlist_empty(&node->refs) || node->local_strong_refs ||
+	    node->local_weak_refs || node->tmp_refs)
+		return;
+
+	list_del_init(&node->work.entry);
+	if (node->proc) {
+		rb_erase(&node->rb_node, &node->proc->nodes);
+		binder_debug(BINDER_DEBUG_INTERNAL_REFS,
+			     "binder: refless node %d deleted\n",
+			     node->debug_id);
+	} else {
+		hlist_del(&node->dead_node);
+		binder_debug(BINDER_DEBUG_INTERNAL_REFS,
+			     "binder: dead node %d deleted\n",
+			     node->debug_id);
+	}
+	kfree(node);
+	binder_stats_deleted(BINDER_STAT_NODE);
+}
+
+static void binder_put_node(struct binder_node *node)
+{
+	spinlock_t *lock = binder_node_lock(node);
+
+	BUG_ON(node->tmp_refs <= 0);
+	node->tmp_refs--;
+	binder_try_free_node(node);
+	spin_unlock(lock);
+}
+
+static void binder_latency_add(u32 *hist, s64 ns)
+{
+	s64 us = ns / NSEC_PER_USEC;
+	int bucket = 0;
+
+	if (us >= 2)
+		bucket = min_t(int, ilog2((u64)us), BINDER_LAT_BUCKETS - 1);
+	hist[bucket]++;
+}
+
+/*
+ * Accounts the handler time of @t, a synchronous transaction to @proc that
+ * has been replied to or will never be. Called with proc->inner_lock held.
+ */
+static void binder_handler_done(struct binder_proc *proc,
+				struct binder_transaction *t)
+{
+	struct binder_node *node = t->handler_node;
+	s64 ns;
+
+	if (node == NULL)
+		return;
+	ns = ktime_to_ns(ktime_sub(ktime_get(), t->deliver_time));
+	binder_latency_add(proc->latency.handler, ns);
+	binder_latency_add(node->latency.handler, ns);
+	t->handler_node = NULL;
+	node->tmp_refs--;
+	binder_try_free_node(node);
+}
+
+static int __binder_inc_node(struct binder_node *node, int strong,
+			     int internal, struct list_head *target_list)
 {
 	if (strong) {
 		if (internal) {
@@ -1017,7 +1283,19 @@ static int binder_inc_node(struct binder_node *node, int strong, int internal,
 	return 0;
 }
 
-static int binder_dec_node(struct binder_node *node, int strong, int internal)
+static int binder_inc_node(struct binder_node *node, int strong, int internal,
+			   struct list_head *target_list)
+{
+	spinlock_t *lock = binder_node_lock(node);
+	int ret;
+
+	ret = __binder_inc_node(node, strong, internal, target_list);
+	spin_unlock(lock);
+	return ret;
+}
+
+static int __binder_dec_node(struct binder_node *node, int strong,
+			     int internal)
 {
 	if (strong) {
 		if (internal)
@@ -1037,29 +1315,21 @@ static int binder_dec_node(struct binder_node *node, int strong, int internal)
 			list_add_tail(&node->work.entry, &node->proc->todo);
 			wake_up_interruptible(&node->proc->wait);
 		}
-	} else {
-		if (hlist_empty(&node->refs) && !node->local_strong_refs &&
-		    !node->local_weak_refs) {
-			list_del_init(&node->work.entry);
-			if (node->proc) {
-				rb_erase(&node->rb_node, &node->proc->nodes);
-				binder_debug(BINDER_DEBUG_INTERNAL_REFS,
-					     "binder: refless node %d deleted\n",
-					     node->debug_id);
-			} else {
-				hlist_del(&node->dead_node);
-				binder_debug(BINDER_DEBUG_INTERNAL_REFS,
-					     "binder: dead node %d deleted\n",
-					     node->debug_id);
-			}
-			kfree(node);
-			binder_stats_deleted(BINDER_STAT_NODE);
-		}
-	}
+	} else
+		binder_try_free_node(node);
 
 	return 0;
 }
 
+static int binder_dec_node(struct binder_node *node, int strong, int internal)
+{
+	spinlock_t *lock = binder_node_lock(node);
+	int ret;
+
+	ret = __binder_dec_node(node, strong, internal);
+	spin_unlock(lock);
+	return ret;
+}
 
 static struct binder_ref *binder_get_ref(struct binder_proc *proc,
 					 uint32_t desc)
@@ -1103,7 +1373,7 @@ static struct binder_ref *binder_get_ref_for_node(struct binder_proc *proc,
 	if (new_ref == NULL)
 		return NULL;
 	binder_stats_created(BINDER_STAT_REF);
-	new_ref->debug_id = ++binder_last_id;
+	new_ref->debug_id = atomic_inc_return(&binder_last_id);
 	new_ref->proc = proc;
 	new_ref->node = node;
 	rb_link_node(&new_ref->rb_node_node, parent, p);
@@ -1132,7 +1402,10 @@ static struct binder_ref *binder_get_ref_for_node(struct binder_proc *proc,
 	rb_link_node(&new_ref->rb_node_desc, parent, p);
 	rb_insert_color(&new_ref->rb_node_desc, &proc->refs_by_desc);
 	if (node) {
+		spinlock_t *lock = binder_node_lock(node);
+
 		hlist_add_head(&new_ref->node_entry, &node->refs);
+		spin_unlock(lock);
 
 		binder_debug(BINDER_DEBUG_INTERNAL_REFS,
 			     "binder: %d new ref %d desc %d for "
@@ -1147,8 +1420,11 @@ static struct binder_ref *binder_get_ref_for_node(struct binder_proc *proc,
 	return new_ref;
 }
 
+/* Called with ref->proc->lock held. */
 static void binder_delete_ref(struct binder_ref *ref)
 {
+	spinlock_t *lock;
+
 	binder_debug(BINDER_DEBUG_INTERNAL_REFS,
 		     "binder: %d delete ref %d desc %d for "
 		     "node %d\n", ref->proc->pid, ref->debug_id,
@@ -1156,16 +1432,20 @@ static void binder_delete_ref(struct binder_ref *ref)
 
 	rb_erase(&ref->rb_node_desc, &ref->proc->refs_by_desc);
 	rb_erase(&ref->rb_node_node, &ref->proc->refs_by_node);
+	lock = binder_node_lock(ref->node);
 	if (ref->strong)
-		binder_dec_node(ref->node, 1, 1);
+		__binder_dec_node(ref->node, 1, 1);
 	hlist_del(&ref->node_entry);
-	binder_dec_node(ref->node, 0, 1);
+	__binder_dec_node(ref->node, 0, 1);
+	spin_unlock(lock);
 	if (ref->death) {
 		binder_debug(BINDER_DEBUG_DEAD_BINDER,
 			     "binder: %d delete ref %d desc %d "
 			     "has death notification\n", ref->proc->pid,
 			     ref->debug_id, ref->desc);
+		spin_lock(&ref->proc->inner_lock);
 		list_del(&ref->death->work.entry);
+		spin_unlock(&ref->proc->inner_lock);
 		kfree(ref->death);
 		binder_stats_deleted(BINDER_STAT_DEATH);
 	}
@@ -1228,19 +1508,28 @@ static int binder_dec_ref(struct binder_ref *ref, int strong)
 	return 0;
 }
 
+/* Called with target_thread->proc->inner_lock held. */
 static void binder_pop_transaction(struct binder_thread *target_thread,
 				   struct binder_transaction *t)
 {
-	if (target_thread) {
-		BUG_ON(target_thread->transaction_stack != t);
-		BUG_ON(target_thread->transaction_stack->from != target_thread);
-		target_thread->transaction_stack =
-			target_thread->transaction_stack->from_parent;
-		t->from = NULL;
-	}
+	BUG_ON(target_thread->transaction_stack != t);
+	BUG_ON(target_thread->transaction_stack->from != target_thread);
+	target_thread->transaction_stack =
+		target_thread->transaction_stack->from_parent;
+	t->from = NULL;
+}
+
+static void binder_free_transaction(struct binder_transaction *t)
+{
+	struct binder_proc *target_proc = t->to_proc;
+
 	t->need_reply = 0;
-	if (t->buffer)
-		t->buffer->transaction = NULL;
+	if (target_proc) {
+		spin_lock(&target_proc->inner_lock);
+		if (t->buffer)
+			t->buffer->transaction = NULL;
+		spin_unlock(&target_proc->inner_lock);
+	}
 	kfree(t);
 	binder_stats_deleted(BINDER_STAT_TRANSACTION);
 }
@@ -1253,6 +1542,10 @@ static void binder_send_failed_reply(struct binder_transaction *t,
 	while (1) {
 		target_thread = t->from;
 		if (target_thread) {
+			struct binder_proc *target_proc = target_thread->proc;
+			int popped = 0;
+
+			spin_lock(&target_proc->inner_lock);
 			if (target_thread->return_error != BR_OK &&
 			   target_thread->return_error2 == BR_OK) {
 				target_thread->return_error2 =
@@ -1263,19 +1556,23 @@ static void binder_send_failed_reply(struct binder_transaction *t,
 				binder_debug(BINDER_DEBUG_FAILED_TRANSACTION,
 					     "binder: send failed reply for "
 					     "transaction %d to %d:%d\n",
-					      t->debug_id, target_thread->proc->pid,
+					      t->debug_id, target_proc->pid,
 					      target_thread->pid);
 
 				binder_pop_transaction(target_thread, t);
+				popped = 1;
 				target_thread->return_error = error_code;
 				wake_up_interruptible(&target_thread->wait);
 			} else {
 				printk(KERN_ERR "binder: reply failed, target "
 					"thread, %d:%d, has error code %d "
-					"already\n", target_thread->proc->pid,
+					"already\n", target_proc->pid,
 					target_thread->pid,
 					target_thread->return_error);
 			}
+			spin_unlock(&target_proc->inner_lock);
+			if (popped)
+				binder_free_transaction(t);
 			return;
 		} else {
 			struct binder_transaction *next = t->from_parent;
@@ -1285,7 +1582,7 @@ static void binder_send_failed_reply(struct binder_transaction *t,
 				     "for transaction %d, target dead\n",
 				     t->debug_id);
 
-			binder_pop_transaction(target_thread, t);
+			binder_free_transaction(t);
 			if (next == NULL) {
 				binder_debug(BINDER_DEBUG_DEAD_BINDER,
 					     "binder: reply failed,"
@@ -1320,6 +1617,7 @@ static void binder_transaction_buffer_release(struct binder_proc *proc,
 		off_end = failed_at;
 	else
 		off_end = (void *)offp + buffer->offsets_size;
+	mutex_lock(&proc->lock);
 	for (; offp < off_end; offp++) {
 		struct flat_binder_object *fp;
 		if (*offp > buffer->data_size - sizeof(*fp) ||
@@ -1334,8 +1632,12 @@ static void binder_transaction_buffer_release(struct binder_proc *proc,
 		switch (fp->type) {
 		case BINDER_TYPE_BINDER:
 		case BINDER_TYPE_WEAK_BINDER: {
-			struct binder_node *node = binder_get_node(proc, fp->binder);
+			struct binder_node *node;
+
+			spin_lock(&proc->inner_lock);
+			node = binder_get_node(proc, fp->binder);
 			if (node == NULL) {
+				spin_unlock(&proc->inner_lock);
 				printk(KERN_ERR "binder: transaction release %d"
 				       " bad node %p\n", debug_id, fp->binder);
 				break;
@@ -1343,7 +1645,8 @@ static void binder_transaction_buffer_release(struct binder_proc *proc,
 			binder_debug(BINDER_DEBUG_TRANSACTION,
 				     "        node %d u%p\n",
 				     node->debug_id, node->ptr);
-			binder_dec_node(node, fp->type == BINDER_TYPE_BINDER, 0);
+			__binder_dec_node(node, fp->type == BINDER_TYPE_BINDER, 0);
+			spin_unlock(&proc->inner_lock);
 		} break;
 		case BINDER_TYPE_HANDLE:
 		case BINDER_TYPE_WEAK_HANDLE: {
@@ -1373,6 +1676,7 @@ static void binder_transaction_buffer_release(struct binder_proc *proc,
 			break;
 		}
 	}
+	mutex_unlock(&proc->lock);
 }
 
 static void binder_transaction(struct binder_proc *proc,
@@ -1400,15 +1704,16 @@ static void binder_transaction(struct binder_proc *proc,
 	e->offsets_size = tr->offsets_size;
 
 	if (reply) {
+		spin_lock(&proc->inner_lock);
 		in_reply_to = thread->transaction_stack;
 		if (in_reply_to == NULL) {
+			spin_unlock(&proc->inner_lock);
 			binder_user_error("binder: %d:%d got reply transaction "
 					  "with no transaction stack\n",
 					  proc->pid, thread->pid);
 			return_error = BR_FAILED_REPLY;
 			goto err_empty_call_stack;
 		}
-		binder_set_nice(in_reply_to->saved_priority);
 		if (in_reply_to->to_thread != thread) {
 			binder_user_error("binder: %d:%d got reply transaction "
 				"with bad transaction stack,"
@@ -1418,16 +1723,22 @@ static void binder_transaction(struct binder_proc *proc,
 				in_reply_to->to_proc->pid : 0,
 				in_reply_to->to_thread ?
 				in_reply_to->to_thread->pid : 0);
+			spin_unlock(&proc->inner_lock);
 			return_error = BR_FAILED_REPLY;
 			in_reply_to = NULL;
 			goto err_bad_call_stack;
 		}
 		thread->transaction_stack = in_reply_to->to_parent;
+		binder_handler_done(proc, in_reply_to);
+		spin_unlock(&proc->inner_lock);
+		binder_restore_priority(in_reply_to);
 		target_thread = in_reply_to->from;
 		if (target_thread == NULL) {
 			return_error = BR_DEAD_REPLY;
 			goto err_dead_binder;
 		}
+		target_proc = target_thread->proc;
+		spin_lock(&target_proc->inner_lock);
 		if (target_thread->transaction_stack != in_reply_to) {
 			binder_user_error("binder: %d:%d got reply transaction "
 				"with bad target transaction stack %d, "
@@ -1436,17 +1747,22 @@ static void binder_transaction(struct binder_proc *proc,
 				target_thread->transaction_stack ?
 				target_thread->transaction_stack->debug_id : 0,
 				in_reply_to->debug_id);
+			spin_unlock(&target_proc->inner_lock);
 			return_error = BR_FAILED_REPLY;
 			in_reply_to = NULL;
 			target_thread = NULL;
 			goto err_dead_binder;
 		}
-		target_proc = target_thread->proc;
+		spin_unlock(&target_proc->inner_lock);
 	} else {
+		struct binder_transaction *tmp;
+
+		mutex_lock(&proc->lock);
 		if (tr->target.handle) {
 			struct binder_ref *ref;
 			ref = binder_get_ref(proc, tr->target.handle);
 			if (ref == NULL) {
+				mutex_unlock(&proc->lock);
 				binder_user_error("binder: %d:%d got "
 					"transaction to invalid handle\n",
 					proc->pid, thread->pid);
@@ -1457,6 +1773,7 @@ static void binder_transaction(struct binder_proc *proc,
 		} else {
 			target_node = binder_context_mgr_node;
 			if (target_node == NULL) {
+				mutex_unlock(&proc->lock);
 				return_error = BR_DEAD_REPLY;
 				goto err_no_context_mgr_node;
 			}
@@ -1464,12 +1781,21 @@ static void binder_transaction(struct binder_proc *proc,
 		e->to_node = target_node->debug_id;
 		target_proc = target_node->proc;
 		if (target_proc == NULL) {
+			mutex_unlock(&proc->lock);
+			target_node = NULL;
 			return_error = BR_DEAD_REPLY;
 			goto err_dead_binder;
 		}
-		if (!(tr->flags & TF_ONE_WAY) && thread->transaction_stack) {
-			struct binder_transaction *tmp;
-			tmp = thread->transaction_stack;
+		/*
+		 * Taken while the ref still pins the node; the buffer owns
+		 * this reference once it is allocated.
+		 */
+		binder_inc_node(target_node, 1, 0, NULL);
+		mutex_unlock(&proc->lock);
+
+		spin_lock(&proc->inner_lock);
+		tmp = thread->transaction_stack;
+		if (!(tr->flags & TF_ONE_WAY) && tmp) {
 			if (tmp->to_thread != thread) {
 				binder_user_error("binder: %d:%d got new "
 					"transaction with bad transaction stack"
@@ -1478,6 +1804,7 @@ static void binder_transaction(struct binder_proc *proc,
 					tmp->to_proc ? tmp->to_proc->pid : 0,
 					tmp->to_thread ?
 					tmp->to_thread->pid : 0);
+				spin_unlock(&proc->inner_lock);
 				return_error = BR_FAILED_REPLY;
 				goto err_bad_call_stack;
 			}
@@ -1487,6 +1814,7 @@ static void binder_transaction(struct binder_proc *proc,
 				tmp = tmp->from_parent;
 			}
 		}
+		spin_unlock(&proc->inner_lock);
 	}
 	if (target_thread) {
 		e->to_thread = target_thread->pid;
@@ -1513,7 +1841,7 @@ static void binder_transaction(struct binder_proc *proc,
 	}
 	binder_stats_created(BINDER_STAT_TRANSACTION_COMPLETE);
 
-	t->debug_id = ++binder_last_id;
+	t->debug_id = atomic_inc_return(&binder_last_id);
 	e->debug_id = t->debug_id;
 
 	if (reply)
@@ -1543,18 +1871,19 @@ static void binder_transaction(struct binder_proc *proc,
 	t->code = tr->code;
 	t->flags = tr->flags;
 	t->priority = task_nice(current);
+	t->sched_policy = current->policy;
+	t->rt_priority = current->rt_priority;
+	mutex_lock(&target_proc->alloc_lock);
 	t->buffer = binder_alloc_buf(target_proc, tr->data_size,
 		tr->offsets_size, !reply && (t->flags & TF_ONE_WAY));
+	mutex_unlock(&target_proc->alloc_lock);
 	if (t->buffer == NULL) {
 		return_error = BR_FAILED_REPLY;
 		goto err_binder_alloc_buf_failed;
 	}
-	t->buffer->allow_user_free = 0;
 	t->buffer->debug_id = t->debug_id;
 	t->buffer->transaction = t;
 	t->buffer->target_node = target_node;
-	if (target_node)
-		binder_inc_node(target_node, 1, 0, NULL);
 
 	offp = (size_t *)(t->buffer->data + ALIGN(tr->data_size, sizeof(void *)));
 
@@ -1594,15 +1923,20 @@ static void binder_transaction(struct binder_proc *proc,
 		case BINDER_TYPE_BINDER:
 		case BINDER_TYPE_WEAK_BINDER: {
 			struct binder_ref *ref;
-			struct binder_node *node = binder_get_node(proc, fp->binder);
+			struct binder_node *node;
+
+			spin_lock(&proc->inner_lock);
+			node = binder_get_node(proc, fp->binder);
+			if (node)
+				node->tmp_refs++;
+			spin_unlock(&proc->inner_lock);
 			if (node == NULL) {
-				node = binder_new_node(proc, fp->binder, fp->cookie);
+				node = binder_new_node(proc, fp->binder,
+						       fp->cookie, fp->flags);
 				if (node == NULL) {
 					return_error = BR_FAILED_REPLY;
 					goto err_binder_new_node_failed;
 				}
-				node->min_priority = fp->flags & FLAT_BINDER_FLAG_PRIORITY_MASK;
-				node->accept_fds = !!(fp->flags & FLAT_BINDER_FLAG_ACCEPTS_FDS);
 			}
 			if (fp->cookie != node->cookie) {
 				binder_user_error("binder: %d:%d sending u%p "
@@ -1610,11 +1944,15 @@ static void binder_transaction(struct binder_proc *proc,
 					proc->pid, thread->pid,
 					fp->binder, node->debug_id,
 					fp->cookie, node->cookie);
+				binder_put_node(node);
 				return_error = BR_FAILED_REPLY;
 				goto err_binder_get_ref_for_node_failed;
 			}
+			mutex_lock(&target_proc->lock);
 			ref = binder_get_ref_for_node(target_proc, node);
 			if (ref == NULL) {
+				mutex_unlock(&target_proc->lock);
+				binder_put_node(node);
 				return_error = BR_FAILED_REPLY;
 				goto err_binder_get_ref_for_node_failed;
 			}
@@ -1630,11 +1968,20 @@ static void binder_transaction(struct binder_proc *proc,
 				     "        node %d u%p -> ref %d desc %d\n",
 				     node->debug_id, node->ptr, ref->debug_id,
 				     ref->desc);
+			mutex_unlock(&target_proc->lock);
+			binder_put_node(node);
 		} break;
 		case BINDER_TYPE_HANDLE:
 		case BINDER_TYPE_WEAK_HANDLE: {
-			struct binder_ref *ref = binder_get_ref(proc, fp->handle);
+			struct binder_ref *ref, *new_ref;
+			struct binder_node *node;
+			int ref_debug_id, ref_desc;
+			spinlock_t *lock;
+
+			mutex_lock(&proc->lock);
+			ref = binder_get_ref(proc, fp->handle);
 			if (ref == NULL) {
+				mutex_unlock(&proc->lock);
 				binder_user_error("binder: %d:%d got "
 					"transaction with invalid "
 					"handle, %ld\n", proc->pid,
@@ -1642,32 +1989,47 @@ static void binder_transaction(struct binder_proc *proc,
 				return_error = BR_FAILED_REPLY;
 				goto err_binder_get_ref_failed;
 			}
-			if (ref->node->proc == target_proc) {
+			node = ref->node;
+			if (node->proc == target_proc) {
 				if (fp->type == BINDER_TYPE_HANDLE)
 					fp->type = BINDER_TYPE_BINDER;
 				else
 					fp->type = BINDER_TYPE_WEAK_BINDER;
-				fp->binder = ref->node->ptr;
-				fp->cookie = ref->node->cookie;
-				binder_inc_node(ref->node, fp->type == BINDER_TYPE_BINDER, 0, NULL);
+				fp->binder = node->ptr;
+				fp->cookie = node->cookie;
+				binder_inc_node(node, fp->type == BINDER_TYPE_BINDER, 0, NULL);
 				binder_debug(BINDER_DEBUG_TRANSACTION,
 					     "        ref %d desc %d -> node %d u%p\n",
-					     ref->debug_id, ref->desc, ref->node->debug_id,
-					     ref->node->ptr);
-			} else {
-				struct binder_ref *new_ref;
-				new_ref = binder_get_ref_for_node(target_proc, ref->node);
-				if (new_ref == NULL) {
-					return_error = BR_FAILED_REPLY;
-					goto err_binder_get_ref_for_node_failed;
-				}
-				fp->handle = new_ref->desc;
-				binder_inc_ref(new_ref, fp->type == BINDER_TYPE_HANDLE, NULL);
-				binder_debug(BINDER_DEBUG_TRANSACTION,
-					     "        ref %d desc %d -> ref %d desc %d (node %d)\n",
-					     ref->debug_id, ref->desc, new_ref->debug_id,
-					     new_ref->desc, ref->node->debug_id);
+					     ref->debug_id, ref->desc, node->debug_id,
+					     node->ptr);
+				mutex_unlock(&proc->lock);
+				break;
 			}
+			/* keep the node while no ref of ours is locked */
+			lock = binder_node_lock(node);
+			node->tmp_refs++;
+			spin_unlock(lock);
+			ref_debug_id = ref->debug_id;
+			ref_desc = ref->desc;
+			mutex_unlock(&proc->lock);
+
+			mutex_lock(&target_proc->lock);
+			new_ref = binder_get_ref_for_node(target_proc, node);
+			if (new_ref == NULL) {
+				mutex_unlock(&target_proc->lock);
+				binder_put_node(node);
+				return_error = BR_FAILED_REPLY;
+				goto err_binder_get_ref_for_node_failed;
+			}
+			fp->handle = new_ref->desc;
+			binder_inc_ref(new_ref, fp->type == BINDER_TYPE_HANDLE,
+				       NULL);
+			binder_debug(BINDER_DEBUG_TRANSACTION,
+				     "        ref %d desc %d -> ref %d desc %d (node %d)\n",
+				     ref_debug_id, ref_desc, new_ref->debug_id,
+				     new_ref->desc, node->debug_id);
+			mutex_unlock(&target_proc->lock);
+			binder_put_node(node);
 		} break;
 
 		case BINDER_TYPE_FD: {
@@ -1716,29 +2078,48 @@ static void binder_transaction(struct binder_proc *proc,
 			goto err_bad_object_type;
 		}
 	}
-	if (reply) {
-		BUG_ON(t->buffer->async_transaction != 0);
-		binder_pop_transaction(target_thread, in_reply_to);
-	} else if (!(t->flags & TF_ONE_WAY)) {
+	t->work.type = BINDER_WORK_TRANSACTION;
+	tcomplete->type = BINDER_WORK_TRANSACTION_COMPLETE;
+	spin_lock(&proc->inner_lock);
+	if (!reply && !(t->flags & TF_ONE_WAY)) {
 		BUG_ON(t->buffer->async_transaction != 0);
 		t->need_reply = 1;
 		t->from_parent = thread->transaction_stack;
 		thread->transaction_stack = t;
+	}
+	list_add_tail(&tcomplete->entry, &thread->todo);
+	spin_unlock(&proc->inner_lock);
+
+	spin_lock(&target_proc->inner_lock);
+	if (target_thread)
+		t->queued = !(target_thread->looper &
+			      BINDER_LOOPER_STATE_WAITING);
+	else
+		t->queued = !target_proc->ready_threads;
+	if (reply) {
+		BUG_ON(t->buffer->async_transaction != 0);
+		binder_pop_transaction(target_thread, in_reply_to);
+		trace_binder_reply(t, NULL);
 	} else {
-		BUG_ON(target_node == NULL);
-		BUG_ON(t->buffer->async_transaction != 1);
-		if (target_node->has_async_transaction) {
-			target_list = &target_node->async_todo;
-			target_wait = NULL;
-		} else
-			target_node->has_async_transaction = 1;
+		if (t->flags & TF_ONE_WAY) {
+			BUG_ON(target_node == NULL);
+			BUG_ON(t->buffer->async_transaction != 1);
+			if (target_node->has_async_transaction) {
+				target_list = &target_node->async_todo;
+				target_wait = NULL;
+				t->queued = 1;
+			} else
+				target_node->has_async_transaction = 1;
+		}
+		trace_binder_transaction(t, target_node);
 	}
-	t->work.type = BINDER_WORK_TRANSACTION;
+	t->queued_time = ktime_get();
 	list_add_tail(&t->work.entry, target_list);
-	tcomplete->type = BINDER_WORK_TRANSACTION_COMPLETE;
-	list_add_tail(&tcomplete->entry, &thread->todo);
 	if (target_wait)
 		wake_up_interruptible(target_wait);
+	spin_unlock(&target_proc->inner_lock);
+	if (reply)
+		binder_free_transaction(in_reply_to);
 	return;
 
 err_get_unused_fd_failed:
@@ -1751,8 +2132,13 @@ err_bad_object_type:
 err_bad_offset:
 err_copy_data_failed:
 	binder_transaction_buffer_release(target_proc, t->buffer, offp);
+	target_node = NULL; /* its reference went with the buffer */
+	spin_lock(&target_proc->inner_lock);
 	t->buffer->transaction = NULL;
+	spin_unlock(&target_proc->inner_lock);
+	mutex_lock(&target_proc->alloc_lock);
 	binder_free_buf(target_proc, t->buffer);
+	mutex_unlock(&target_proc->alloc_lock);
 err_binder_alloc_buf_failed:
 	kfree(tcomplete);
 	binder_stats_deleted(BINDER_STAT_TRANSACTION_COMPLETE);
@@ -1761,6 +2147,8 @@ err_alloc_tcomplete_failed:
 	binder_stats_deleted(BINDER_STAT_TRANSACTION);
 err_alloc_t_failed:
 err_bad_call_stack:
+	if (target_node)
+		binder_dec_node(target_node, 1, 0);
 err_empty_call_stack:
 err_dead_binder:
 err_invalid_target_handle:
@@ -1776,12 +2164,20 @@ err_no_context_mgr_node:
 		*fe = *e;
 	}
 
-	BUG_ON(thread->return_error != BR_OK);
-	if (in_reply_to) {
+	spin_lock(&proc->inner_lock);
+	/* a failed reply to an earlier call may have come in meanwhile */
+	if (thread->return_error != BR_OK &&
+	    thread->return_error2 == BR_OK) {
+		thread->return_error2 = thread->return_error;
+		thread->return_error = BR_OK;
+	}
+	if (in_reply_to)
 		thread->return_error = BR_TRANSACTION_COMPLETE;
-		binder_send_failed_reply(in_reply_to, return_error);
-	} else
+	else
 		thread->return_error = return_error;
+	spin_unlock(&proc->inner_lock);
+	if (in_reply_to)
+		binder_send_failed_reply(in_reply_to, return_error);
 }
 
 int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
@@ -1796,9 +2192,9 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			return -EFAULT;
 		ptr += sizeof(uint32_t);
 		if (_IOC_NR(cmd) < ARRAY_SIZE(binder_stats.bc)) {
-			binder_stats.bc[_IOC_NR(cmd)]++;
-			proc->stats.bc[_IOC_NR(cmd)]++;
-			thread->stats.bc[_IOC_NR(cmd)]++;
+			atomic_inc(&binder_stats.bc[_IOC_NR(cmd)]);
+			atomic_inc(&proc->stats.bc[_IOC_NR(cmd)]);
+			atomic_inc(&thread->stats.bc[_IOC_NR(cmd)]);
 		}
 		switch (cmd) {
 		case BC_INCREFS:
@@ -1812,6 +2208,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			if (get_user(target, (uint32_t __user *)ptr))
 				return -EFAULT;
 			ptr += sizeof(uint32_t);
+			mutex_lock(&proc->lock);
 			if (target == 0 && binder_context_mgr_node &&
 			    (cmd == BC_INCREFS || cmd == BC_ACQUIRE)) {
 				ref = binder_get_ref_for_node(proc,
@@ -1827,6 +2224,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			} else
 				ref = binder_get_ref(proc, target);
 			if (ref == NULL) {
+				mutex_unlock(&proc->lock);
 				binder_user_error("binder: %d:%d refcou"
 					"nt change on invalid ref %d\n",
 					proc->pid, thread->pid, target);
@@ -1855,6 +2253,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				     "binder: %d:%d %s ref %d desc %d s %d w %d for node %d\n",
 				     proc->pid, thread->pid, debug_string, ref->debug_id,
 				     ref->desc, ref->strong, ref->weak, ref->node->debug_id);
+			mutex_unlock(&proc->lock);
 			break;
 		}
 		case BC_INCREFS_DONE:
@@ -1869,8 +2268,10 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			if (get_user(cookie, (void * __user *)ptr))
 				return -EFAULT;
 			ptr += sizeof(void *);
+			spin_lock(&proc->inner_lock);
 			node = binder_get_node(proc, node_ptr);
 			if (node == NULL) {
+				spin_unlock(&proc->inner_lock);
 				binder_user_error("binder: %d:%d "
 					"%s u%p no match\n",
 					proc->pid, thread->pid,
@@ -1888,6 +2289,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 					"BC_INCREFS_DONE" : "BC_ACQUIRE_DONE",
 					node_ptr, node->debug_id,
 					cookie, node->cookie);
+				spin_unlock(&proc->inner_lock);
 				break;
 			}
 			if (cmd == BC_ACQUIRE_DONE) {
@@ -1897,6 +2299,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 						"no pending acquire request\n",
 						proc->pid, thread->pid,
 						node->debug_id);
+					spin_unlock(&proc->inner_lock);
 					break;
 				}
 				node->pending_strong_ref = 0;
@@ -1907,16 +2310,21 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 						"no pending increfs request\n",
 						proc->pid, thread->pid,
 						node->debug_id);
+					spin_unlock(&proc->inner_lock);
 					break;
 				}
 				node->pending_weak_ref = 0;
 			}
-			binder_dec_node(node, cmd == BC_ACQUIRE_DONE, 0);
+			node->tmp_refs++;
+			__binder_dec_node(node, cmd == BC_ACQUIRE_DONE, 0);
 			binder_debug(BINDER_DEBUG_USER_REFS,
 				     "binder: %d:%d %s node %d ls %d lw %d\n",
 				     proc->pid, thread->pid,
 				     cmd == BC_INCREFS_DONE ? "BC_INCREFS_DONE" : "BC_ACQUIRE_DONE",
 				     node->debug_id, node->local_strong_refs, node->local_weak_refs);
+			node->tmp_refs--;
+			binder_try_free_node(node);
+			spin_unlock(&proc->inner_lock);
 			break;
 		}
 		case BC_ATTEMPT_ACQUIRE:
@@ -1934,20 +2342,28 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				return -EFAULT;
 			ptr += sizeof(void *);
 
+			mutex_lock(&proc->alloc_lock);
 			buffer = binder_buffer_lookup(proc, data_ptr);
 			if (buffer == NULL) {
+				mutex_unlock(&proc->alloc_lock);
 				binder_user_error("binder: %d:%d "
 					"BC_FREE_BUFFER u%p no match\n",
 					proc->pid, thread->pid, data_ptr);
 				break;
 			}
 			if (!buffer->allow_user_free) {
+				mutex_unlock(&proc->alloc_lock);
 				binder_user_error("binder: %d:%d "
 					"BC_FREE_BUFFER u%p matched "
 					"unreturned buffer\n",
 					proc->pid, thread->pid, data_ptr);
 				break;
 			}
+			/* a second BC_FREE_BUFFER must not find it again */
+			buffer->allow_user_free = 0;
+			mutex_unlock(&proc->alloc_lock);
+
+			spin_lock(&proc->inner_lock);
 			binder_debug(BINDER_DEBUG_FREE_BUFFER,
 				     "binder: %d:%d BC_FREE_BUFFER u%p found buffer %d for %s transaction\n",
 				     proc->pid, thread->pid, data_ptr, buffer->debug_id,
@@ -1964,8 +2380,11 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				else
 					list_move_tail(buffer->target_node->async_todo.next, &thread->todo);
 			}
+			spin_unlock(&proc->inner_lock);
 			binder_transaction_buffer_release(proc, buffer, NULL);
+			mutex_lock(&proc->alloc_lock);
 			binder_free_buf(proc, buffer);
+			mutex_unlock(&proc->alloc_lock);
 			break;
 		}
 
@@ -1984,6 +2403,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			binder_debug(BINDER_DEBUG_THREADS,
 				     "binder: %d:%d BC_REGISTER_LOOPER\n",
 				     proc->pid, thread->pid);
+			spin_lock(&proc->inner_lock);
 			if (thread->looper & BINDER_LOOPER_STATE_ENTERED) {
 				thread->looper |= BINDER_LOOPER_STATE_INVALID;
 				binder_user_error("binder: %d:%d ERROR:"
@@ -2000,6 +2420,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				proc->requested_threads--;
 				proc->requested_threads_started++;
 			}
+			spin_unlock(&proc->inner_lock);
 			thread->looper |= BINDER_LOOPER_STATE_REGISTERED;
 			break;
 		case BC_ENTER_LOOPER:
@@ -2035,8 +2456,10 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			if (get_user(cookie, (void __user * __user *)ptr))
 				return -EFAULT;
 			ptr += sizeof(void *);
+			mutex_lock(&proc->lock);
 			ref = binder_get_ref(proc, target);
 			if (ref == NULL) {
+				mutex_unlock(&proc->lock);
 				binder_user_error("binder: %d:%d %s "
 					"invalid ref %d\n",
 					proc->pid, thread->pid,
@@ -2063,11 +2486,15 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 						"FICATION death notific"
 						"ation already set\n",
 						proc->pid, thread->pid);
+					mutex_unlock(&proc->lock);
 					break;
 				}
 				death = kzalloc(sizeof(*death), GFP_KERNEL);
 				if (death == NULL) {
+					mutex_unlock(&proc->lock);
+					spin_lock(&proc->inner_lock);
 					thread->return_error = BR_ERROR;
+					spin_unlock(&proc->inner_lock);
 					binder_debug(BINDER_DEBUG_FAILED_TRANSACTION,
 						     "binder: %d:%d "
 						     "BC_REQUEST_DEATH_NOTIFICATION failed\n",
@@ -2077,6 +2504,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				binder_stats_created(BINDER_STAT_DEATH);
 				INIT_LIST_HEAD(&death->work.entry);
 				death->cookie = cookie;
+				spin_lock(&proc->inner_lock);
 				ref->death = death;
 				if (ref->node->proc == NULL) {
 					ref->death->work.type = BINDER_WORK_DEAD_BINDER;
@@ -2087,6 +2515,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 						wake_up_interruptible(&proc->wait);
 					}
 				}
+				spin_unlock(&proc->inner_lock);
 			} else {
 				if (ref->death == NULL) {
 					binder_user_error("binder: %d:%"
@@ -2094,6 +2523,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 						"CATION death notificat"
 						"ion not active\n",
 						proc->pid, thread->pid);
+					mutex_unlock(&proc->lock);
 					break;
 				}
 				death = ref->death;
@@ -2105,8 +2535,10 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 						"%p != %p\n",
 						proc->pid, thread->pid,
 						death->cookie, cookie);
+					mutex_unlock(&proc->lock);
 					break;
 				}
+				spin_lock(&proc->inner_lock);
 				ref->death = NULL;
 				if (list_empty(&death->work.entry)) {
 					death->work.type = BINDER_WORK_CLEAR_DEATH_NOTIFICATION;
@@ -2120,7 +2552,9 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 					BUG_ON(death->work.type != BINDER_WORK_DEAD_BINDER);
 					death->work.type = BINDER_WORK_DEAD_BINDER_AND_CLEAR;
 				}
+				spin_unlock(&proc->inner_lock);
 			}
+			mutex_unlock(&proc->lock);
 		} break;
 		case BC_DEAD_BINDER_DONE: {
 			struct binder_work *w;
@@ -2130,6 +2564,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				return -EFAULT;
 
 			ptr += sizeof(void *);
+			spin_lock(&proc->inner_lock);
 			list_for_each_entry(w, &proc->delivered_death, entry) {
 				struct binder_ref_death *tmp_death = container_of(w, struct binder_ref_death, work);
 				if (tmp_death->cookie == cookie) {
@@ -2141,6 +2576,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				     "binder: %d:%d BC_DEAD_BINDER_DONE %p found %p\n",
 				     proc->pid, thread->pid, cookie, death);
 			if (death == NULL) {
+				spin_unlock(&proc->inner_lock);
 				binder_user_error("binder: %d:%d BC_DEAD"
 					"_BINDER_DONE %p not found\n",
 					proc->pid, thread->pid, cookie);
@@ -2157,6 +2593,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 					wake_up_interruptible(&proc->wait);
 				}
 			}
+			spin_unlock(&proc->inner_lock);
 		} break;
 
 		default:
@@ -2173,9 +2610,9 @@ void binder_stat_br(struct binder_proc *proc, struct binder_thread *thread,
 		    uint32_t cmd)
 {
 	if (_IOC_NR(cmd) < ARRAY_SIZE(binder_stats.br)) {
-		binder_stats.br[_IOC_NR(cmd)]++;
-		proc->stats.br[_IOC_NR(cmd)]++;
-		thread->stats.br[_IOC_NR(cmd)]++;
+		atomic_inc(&binder_stats.br[_IOC_NR(cmd)]);
+		atomic_inc(&proc->stats.br[_IOC_NR(cmd)]);
+		atomic_inc(&thread->stats.br[_IOC_NR(cmd)]);
 	}
 }
 
@@ -2210,22 +2647,30 @@ static int binder_thread_read(struct binder_proc *proc,
 	}
 
 retry:
+	spin_lock(&proc->inner_lock);
 	wait_for_proc_work = thread->transaction_stack == NULL &&
 				list_empty(&thread->todo);
 
 	if (thread->return_error != BR_OK && ptr < end) {
+		uint32_t return_error = thread->return_error;
+
 		if (thread->return_error2 != BR_OK) {
-			if (put_user(thread->return_error2, (uint32_t __user *)ptr))
+			uint32_t return_error2 = thread->return_error2;
+
+			spin_unlock(&proc->inner_lock);
+			if (put_user(return_error2, (uint32_t __user *)ptr))
 				return -EFAULT;
 			ptr += sizeof(uint32_t);
 			if (ptr == end)
 				goto done;
+			spin_lock(&proc->inner_lock);
 			thread->return_error2 = BR_OK;
 		}
-		if (put_user(thread->return_error, (uint32_t __user *)ptr))
+		thread->return_error = BR_OK;
+		spin_unlock(&proc->inner_lock);
+		if (put_user(return_error, (uint32_t __user *)ptr))
 			return -EFAULT;
 		ptr += sizeof(uint32_t);
-		thread->return_error = BR_OK;
 		goto done;
 	}
 
@@ -2233,7 +2678,8 @@ retry:
 	thread->looper |= BINDER_LOOPER_STATE_WAITING;
 	if (wait_for_proc_work)
 		proc->ready_threads++;
-	mutex_unlock(&binder_lock);
+	spin_unlock(&proc->inner_lock);
+	up_read(&binder_main_lock);
 	if (wait_for_proc_work) {
 		if (!(thread->looper & (BINDER_LOOPER_STATE_REGISTERED |
 					BINDER_LOOPER_STATE_ENTERED))) {
@@ -2257,10 +2703,12 @@ retry:
 		} else
 			ret = wait_event_interruptible(thread->wait, binder_has_thread_work(thread));
 	}
-	mutex_lock(&binder_lock);
+	down_read(&binder_main_lock);
+	spin_lock(&proc->inner_lock);
 	if (wait_for_proc_work)
 		proc->ready_threads--;
 	thread->looper &= ~BINDER_LOOPER_STATE_WAITING;
+	spin_unlock(&proc->inner_lock);
 
 	if (ret)
 		return ret;
@@ -2271,24 +2719,60 @@ retry:
 		struct binder_work *w;
 		struct binder_transaction *t = NULL;
 
+		spin_lock(&proc->inner_lock);
 		if (!list_empty(&thread->todo))
 			w = list_first_entry(&thread->todo, struct binder_work, entry);
 		else if (!list_empty(&proc->todo) && wait_for_proc_work)
 			w = list_first_entry(&proc->todo, struct binder_work, entry);
 		else {
+			spin_unlock(&proc->inner_lock);
 			if (ptr - buffer == 4 && !(thread->looper & BINDER_LOOPER_STATE_NEED_RETURN)) /* no data added */
 				goto retry;
 			break;
 		}
 
-		if (end - ptr < sizeof(tr) + 4)
+		if (end - ptr < sizeof(tr) + 4) {
+			spin_unlock(&proc->inner_lock);
 			break;
+		}
 
 		switch (w->type) {
 		case BINDER_WORK_TRANSACTION: {
+			struct binder_node *target_node;
+			struct binder_latency *lat;
+			ktime_t now = ktime_get();
+			s64 delay;
+
 			t = container_of(w, struct binder_transaction, work);
+			list_del_init(&w->entry);
+			BUG_ON(t->buffer == NULL);
+			target_node = t->buffer->target_node;
+			delay = ktime_to_ns(ktime_sub(now, t->queued_time));
+			lat = &proc->latency;
+			binder_latency_add(t->queued ? lat->queue : lat->wakeup,
+					   delay);
+			if (target_node) {
+				lat = &target_node->latency;
+				binder_latency_add(t->queued ? lat->queue :
+						   lat->wakeup, delay);
+			}
+			trace_binder_transaction_received(t, thread, delay,
+							  t->queued);
+			if (target_node && !(t->flags & TF_ONE_WAY)) {
+				t->to_parent = thread->transaction_stack;
+				t->to_thread = thread;
+				thread->transaction_stack = t;
+				t->deliver_time = now;
+				t->handler_node = target_node;
+				target_node->tmp_refs++;
+			} else
+				t->buffer->transaction = NULL;
+			spin_unlock(&proc->inner_lock);
 		} break;
 		case BINDER_WORK_TRANSACTION_COMPLETE: {
+			list_del(&w->entry);
+			spin_unlock(&proc->inner_lock);
+
 			cmd = BR_TRANSACTION_COMPLETE;
 			if (put_user(cmd, (uint32_t __user *)ptr))
 				return -EFAULT;
@@ -2299,7 +2783,6 @@ retry:
 				     "binder: %d:%d BR_TRANSACTION_COMPLETE\n",
 				     proc->pid, thread->pid);
 
-			list_del(&w->entry);
 			kfree(w);
 			binder_stats_deleted(BINDER_STAT_TRANSACTION_COMPLETE);
 		} break;
@@ -2309,6 +2792,15 @@ retry:
 			const char *cmd_name;
 			int strong = node->internal_strong_refs || node->local_strong_refs;
 			int weak = !hlist_empty(&node->refs) || node->local_weak_refs || strong;
+			void __user *node_ptr = node->ptr;
+			void __user *node_cookie = node->cookie;
+			int node_debug_id = node->debug_id;
+
+			/*
+			 * The node is only stable under the lock: the whole
+			 * state transition is done here and user space is
+			 * told about it after unlocking.
+			 */
 			if (weak && !node->has_weak_ref) {
 				cmd = BR_INCREFS;
 				cmd_name = "BR_INCREFS";
@@ -2331,23 +2823,26 @@ retry:
 				node->has_weak_ref = 0;
 			}
 			if (cmd != BR_NOOP) {
+				/* more to tell: stays queued until BR_NOOP */
+				spin_unlock(&proc->inner_lock);
 				if (put_user(cmd, (uint32_t __user *)ptr))
 					return -EFAULT;
 				ptr += sizeof(uint32_t);
-				if (put_user(node->ptr, (void * __user *)ptr))
+				if (put_user(node_ptr, (void * __user *)ptr))
 					return -EFAULT;
 				ptr += sizeof(void *);
-				if (put_user(node->cookie, (void * __user *)ptr))
+				if (put_user(node_cookie, (void * __user *)ptr))
 					return -EFAULT;
 				ptr += sizeof(void *);
 
 				binder_stat_br(proc, thread, cmd);
 				binder_debug(BINDER_DEBUG_USER_REFS,
 					     "binder: %d:%d %s %d u%p c%p\n",
-					     proc->pid, thread->pid, cmd_name, node->debug_id, node->ptr, node->cookie);
+					     proc->pid, thread->pid, cmd_name,
+					     node_debug_id, node_ptr, node_cookie);
 			} else {
 				list_del_init(&w->entry);
-				if (!weak && !strong) {
+				if (!weak && !strong && !node->tmp_refs) {
 					binder_debug(BINDER_DEBUG_INTERNAL_REFS,
 						     "binder: %d:%d node %d u%p c%p deleted\n",
 						     proc->pid, thread->pid, node->debug_id,
@@ -2361,23 +2856,36 @@ retry:
 						     proc->pid, thread->pid, node->debug_id, node->ptr,
 						     node->cookie);
 				}
+				spin_unlock(&proc->inner_lock);
 			}
 		} break;
 		case BINDER_WORK_DEAD_BINDER:
 		case BINDER_WORK_DEAD_BINDER_AND_CLEAR:
 		case BINDER_WORK_CLEAR_DEATH_NOTIFICATION: {
 			struct binder_ref_death *death;
+			void __user *cookie;
 			uint32_t cmd;
 
 			death = container_of(w, struct binder_ref_death, work);
-			if (w->type == BINDER_WORK_CLEAR_DEATH_NOTIFICATION)
+			cookie = death->cookie;
+			if (w->type == BINDER_WORK_CLEAR_DEATH_NOTIFICATION) {
 				cmd = BR_CLEAR_DEATH_NOTIFICATION_DONE;
-			else
+				list_del(&w->entry);
+			} else {
 				cmd = BR_DEAD_BINDER;
+				list_move(&w->entry, &proc->delivered_death);
+				death = NULL;
+			}
+			spin_unlock(&proc->inner_lock);
+			if (death) {
+				kfree(death);
+				binder_stats_deleted(BINDER_STAT_DEATH);
+			}
+
 			if (put_user(cmd, (uint32_t __user *)ptr))
 				return -EFAULT;
 			ptr += sizeof(uint32_t);
-			if (put_user(death->cookie, (void * __user *)ptr))
+			if (put_user(cookie, (void * __user *)ptr))
 				return -EFAULT;
 			ptr += sizeof(void *);
 			binder_debug(BINDER_DEBUG_DEATH_NOTIFICATION,
@@ -2386,34 +2894,24 @@ retry:
 				      cmd == BR_DEAD_BINDER ?
 				      "BR_DEAD_BINDER" :
 				      "BR_CLEAR_DEATH_NOTIFICATION_DONE",
-				      death->cookie);
+				      cookie);
 
-			if (w->type == BINDER_WORK_CLEAR_DEATH_NOTIFICATION) {
-				list_del(&w->entry);
-				kfree(death);
-				binder_stats_deleted(BINDER_STAT_DEATH);
-			} else
-				list_move(&w->entry, &proc->delivered_death);
 			if (cmd == BR_DEAD_BINDER)
 				goto done; /* DEAD_BINDER notifications can cause transactions */
 		} break;
+		default:
+			spin_unlock(&proc->inner_lock);
+			break;
 		}
 
 		if (!t)
 			continue;
 
-		BUG_ON(t->buffer == NULL);
 		if (t->buffer->target_node) {
 			struct binder_node *target_node = t->buffer->target_node;
 			tr.target.ptr = target_node->ptr;
 			tr.cookie =  target_node->cookie;
-			t->saved_priority = task_nice(current);
-			if (t->priority < target_node->min_priority &&
-			    !(t->flags & TF_ONE_WAY))
-				binder_set_nice(t->priority);
-			else if (!(t->flags & TF_ONE_WAY) ||
-				 t->saved_priority > target_node->min_priority)
-				binder_set_nice(target_node->min_priority);
+			binder_inherit_priority(t, target_node);
 			cmd = BR_TRANSACTION;
 		} else {
 			tr.target.ptr = NULL;
@@ -2440,14 +2938,6 @@ retry:
 					ALIGN(t->buffer->data_size,
 					    sizeof(void *));
 
-		if (put_user(cmd, (uint32_t __user *)ptr))
-			return -EFAULT;
-		ptr += sizeof(uint32_t);
-		if (copy_to_user(ptr, &tr, sizeof(tr)))
-			return -EFAULT;
-		ptr += sizeof(tr);
-
-		binder_stat_br(proc, thread, cmd);
 		binder_debug(BINDER_DEBUG_TRANSACTION,
 			     "binder: %d:%d %s %d %d:%d, cmd %d"
 			     "size %zd-%zd ptr %p-%p\n",
@@ -2459,35 +2949,42 @@ retry:
 			     t->buffer->data_size, t->buffer->offsets_size,
 			     tr.data.ptr.buffer, tr.data.ptr.offsets);
 
-		list_del(&t->work.entry);
+		/* from here on another thread may free the buffer */
 		t->buffer->allow_user_free = 1;
-		if (cmd == BR_TRANSACTION && !(t->flags & TF_ONE_WAY)) {
-			t->to_parent = thread->transaction_stack;
-			t->to_thread = thread;
-			thread->transaction_stack = t;
-		} else {
-			t->buffer->transaction = NULL;
+		if (cmd != BR_TRANSACTION || (t->flags & TF_ONE_WAY)) {
 			kfree(t);
 			binder_stats_deleted(BINDER_STAT_TRANSACTION);
 		}
+
+		if (put_user(cmd, (uint32_t __user *)ptr))
+			return -EFAULT;
+		ptr += sizeof(uint32_t);
+		if (copy_to_user(ptr, &tr, sizeof(tr)))
+			return -EFAULT;
+		ptr += sizeof(tr);
+
+		binder_stat_br(proc, thread, cmd);
 		break;
 	}
 
 done:
 
 	*consumed = ptr - buffer;
+	spin_lock(&proc->inner_lock);
 	if (proc->requested_threads + proc->ready_threads == 0 &&
 	    proc->requested_threads_started < proc->max_threads &&
 	    (thread->looper & (BINDER_LOOPER_STATE_REGISTERED |
 	     BINDER_LOOPER_STATE_ENTERED)) /* the user-space code fails to */
 	     /*spawn a new thread if we leave this out */) {
 		proc->requested_threads++;
+		spin_unlock(&proc->inner_lock);
 		binder_debug(BINDER_DEBUG_THREADS,
 			     "binder: %d:%d BR_SPAWN_LOOPER\n",
 			     proc->pid, thread->pid);
 		if (put_user(BR_SPAWN_LOOPER, (uint32_t __user *)buffer))
 			return -EFAULT;
-	}
+	} else
+		spin_unlock(&proc->inner_lock);
 	return 0;
 }
 
@@ -2519,9 +3016,14 @@ static void binder_release_work(struct list_head *list)
 static struct binder_thread *binder_get_thread(struct binder_proc *proc)
 {
 	struct binder_thread *thread = NULL;
-	struct rb_node *parent = NULL;
-	struct rb_node **p = &proc->threads.rb_node;
+	struct binder_thread *new_thread = NULL;
+	struct rb_node *parent;
+	struct rb_node **p;
 
+	spin_lock(&proc->inner_lock);
+retry:
+	parent = NULL;
+	p = &proc->threads.rb_node;
 	while (*p) {
 		parent = *p;
 		thread = rb_entry(parent, struct binder_thread, rb_node);
@@ -2534,9 +3036,16 @@ static struct binder_thread *binder_get_thread(struct binder_proc *proc)
 			break;
 	}
 	if (*p == NULL) {
-		thread = kzalloc(sizeof(*thread), GFP_KERNEL);
-		if (thread == NULL)
-			return NULL;
+		if (new_thread == NULL) {
+			spin_unlock(&proc->inner_lock);
+			new_thread = kzalloc(sizeof(*thread), GFP_KERNEL);
+			if (new_thread == NULL)
+				return NULL;
+			spin_lock(&proc->inner_lock);
+			goto retry;
+		}
+		thread = new_thread;
+		new_thread = NULL;
 		binder_stats_created(BINDER_STAT_THREAD);
 		thread->proc = proc;
 		thread->pid = current->pid;
@@ -2548,6 +3057,8 @@ static struct binder_thread *binder_get_thread(struct binder_proc *proc)
 		thread->return_error = BR_OK;
 		thread->return_error2 = BR_OK;
 	}
+	spin_unlock(&proc->inner_lock);
+	kfree(new_thread);
 	return thread;
 }
 
@@ -2571,6 +3082,9 @@ static int binder_free_thread(struct binder_proc *proc,
 			     (t->to_thread == thread) ? "in" : "out");
 
 		if (t->to_thread == thread) {
+			spin_lock(&proc->inner_lock);
+			binder_handler_done(proc, t);
+			spin_unlock(&proc->inner_lock);
 			t->to_proc = NULL;
 			t->to_thread = NULL;
 			if (t->buffer) {
@@ -2599,12 +3113,14 @@ static unsigned int binder_poll(struct file *filp,
 	struct binder_thread *thread = NULL;
 	int wait_for_proc_work;
 
-	mutex_lock(&binder_lock);
+	down_read(&binder_main_lock);
 	thread = binder_get_thread(proc);
 
+	spin_lock(&proc->inner_lock);
 	wait_for_proc_work = thread->transaction_stack == NULL &&
 		list_empty(&thread->todo) && thread->return_error == BR_OK;
-	mutex_unlock(&binder_lock);
+	spin_unlock(&proc->inner_lock);
+	up_read(&binder_main_lock);
 
 	if (wait_for_proc_work) {
 		if (binder_has_proc_work(proc, thread))
@@ -2629,6 +3145,8 @@ static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 	struct binder_thread *thread;
 	unsigned int size = _IOC_SIZE(cmd);
 	void __user *ubuf = (void __user *)arg;
+	int exclusive = cmd == BINDER_SET_CONTEXT_MGR ||
+			cmd == BINDER_THREAD_EXIT;
 
 	/*printk(KERN_INFO "binder_ioctl: %d:%d %x %lx\n", proc->pid, current->pid, cmd, arg);*/
 
@@ -2636,7 +3154,10 @@ static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 	if (ret)
 		return ret;
 
-	mutex_lock(&binder_lock);
+	if (exclusive)
+		down_write(&binder_main_lock);
+	else
+		down_read(&binder_main_lock);
 	thread = binder_get_thread(proc);
 	if (thread == NULL) {
 		ret = -ENOMEM;
@@ -2688,12 +3209,18 @@ static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 		}
 		break;
 	}
-	case BINDER_SET_MAX_THREADS:
-		if (copy_from_user(&proc->max_threads, ubuf, sizeof(proc->max_threads))) {
+	case BINDER_SET_MAX_THREADS: {
+		int max_threads;
+
+		if (copy_from_user(&max_threads, ubuf, sizeof(max_threads))) {
 			ret = -EINVAL;
 			goto err;
 		}
+		spin_lock(&proc->inner_lock);
+		proc->max_threads = max_threads;
+		spin_unlock(&proc->inner_lock);
 		break;
+	}
 	case BINDER_SET_CONTEXT_MGR:
 		if (binder_context_mgr_node != NULL) {
 			printk(KERN_ERR "binder: BINDER_SET_CONTEXT_MGR already set\n");
@@ -2711,15 +3238,18 @@ static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 			}
 		} else
 			binder_context_mgr_uid = current->cred->euid;
-		binder_context_mgr_node = binder_new_node(proc, NULL, NULL);
+		binder_context_mgr_node = binder_new_node(proc, NULL, NULL, 0);
 		if (binder_context_mgr_node == NULL) {
 			ret = -ENOMEM;
 			goto err;
 		}
+		spin_lock(&proc->inner_lock);
 		binder_context_mgr_node->local_weak_refs++;
 		binder_context_mgr_node->local_strong_refs++;
 		binder_context_mgr_node->has_strong_ref = 1;
 		binder_context_mgr_node->has_weak_ref = 1;
+		spin_unlock(&proc->inner_lock);
+		binder_put_node(binder_context_mgr_node);
 		break;
 	case BINDER_THREAD_EXIT:
 		binder_debug(BINDER_DEBUG_THREADS, "binder: %d:%d exit\n",
@@ -2745,7 +3275,10 @@ static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 err:
 	if (thread)
 		thread->looper &= ~BINDER_LOOPER_STATE_NEED_RETURN;
-	mutex_unlock(&binder_lock);
+	if (exclusive)
+		up_write(&binder_main_lock);
+	else
+		up_read(&binder_main_lock);
 	wait_event_interruptible(binder_user_error_wait, binder_stop_on_user_error < 2);
 	if (ret && ret != -ERESTARTSYS)
 		printk(KERN_INFO "binder: %d:%d ioctl %x %lx returned %d\n", proc->pid, current->pid, cmd, arg, ret);
@@ -2787,6 +3320,7 @@ static int binder_mmap(struct file *filp, struct vm_area_struct *vma)
 	struct binder_proc *proc = filp->private_data;
 	const char *failure_string;
 	struct binder_buffer *buffer;
+	int resident_pages;
 
 	if ((vma->vm_end - vma->vm_start) > SZ_4M)
 		vma->vm_end = vma->vm_start + SZ_4M;
@@ -2838,11 +3372,16 @@ static int binder_mmap(struct file *filp, struct vm_area_struct *vma)
 	vma->vm_ops = &binder_vm_ops;
 	vma->vm_private_data = proc;
 
-	if (binder_update_page_range(proc, 1, proc->buffer, proc->buffer + PAGE_SIZE, vma)) {
+	resident_pages = clamp(binder_resident_pages, 1,
+			       (int)(proc->buffer_size / PAGE_SIZE));
+	if (binder_update_page_range(proc, 1, proc->buffer,
+				     proc->buffer + resident_pages * PAGE_SIZE,
+				     vma)) {
 		ret = -ENOMEM;
 		failure_string = "alloc small buf";
 		goto err_alloc_small_buf_failed;
 	}
+	proc->resident_pages = resident_pages;
 	buffer = proc->buffer;
 	INIT_LIST_HEAD(&proc->buffers);
 	list_add(&buffer->entry, &proc->buffers);
@@ -2883,16 +3422,19 @@ static int binder_open(struct inode *nodp, struct file *filp)
 		return -ENOMEM;
 	get_task_struct(current);
 	proc->tsk = current;
+	mutex_init(&proc->lock);
+	mutex_init(&proc->alloc_lock);
+	spin_lock_init(&proc->inner_lock);
 	INIT_LIST_HEAD(&proc->todo);
 	init_waitqueue_head(&proc->wait);
 	proc->default_priority = task_nice(current);
-	mutex_lock(&binder_lock);
+	down_write(&binder_main_lock);
 	binder_stats_created(BINDER_STAT_PROC);
 	hlist_add_head(&proc->proc_node, &binder_procs);
 	proc->pid = current->group_leader->pid;
 	INIT_LIST_HEAD(&proc->delivered_death);
 	filp->private_data = proc;
-	mutex_unlock(&binder_lock);
+	up_write(&binder_main_lock);
 
 	if (binder_debugfs_dir_entry_proc) {
 		char strbuf[11];
@@ -2984,7 +3526,9 @@ static void binder_deferred_release(struct binder_proc *proc)
 			node->proc = NULL;
 			node->local_strong_refs = 0;
 			node->local_weak_refs = 0;
+			spin_lock(&binder_dead_nodes_lock);
 			hlist_add_head(&node->dead_node, &binder_dead_nodes);
+			spin_unlock(&binder_dead_nodes_lock);
 
 			hlist_for_each_entry(ref, pos, &node->refs, node_entry) {
 				incoming_refs++;
@@ -3005,12 +3549,14 @@ static void binder_deferred_release(struct binder_proc *proc)
 		}
 	}
 	outgoing_refs = 0;
+	mutex_lock(&proc->lock);
 	while ((n = rb_first(&proc->refs_by_desc))) {
 		struct binder_ref *ref = rb_entry(n, struct binder_ref,
 						  rb_node_desc);
 		outgoing_refs++;
 		binder_delete_ref(ref);
 	}
+	mutex_unlock(&proc->lock);
 	binder_release_work(&proc->todo);
 	buffers = 0;
 
@@ -3072,7 +3618,7 @@ static void binder_deferred_func(struct work_struct *work)
 
 	int defer;
 	do {
-		mutex_lock(&binder_lock);
+		down_write(&binder_main_lock);
 		mutex_lock(&binder_deferred_lock);
 		if (!hlist_empty(&binder_deferred_list)) {
 			proc = hlist_entry(binder_deferred_list.first,
@@ -3099,7 +3645,7 @@ static void binder_deferred_func(struct work_struct *work)
 		if (defer & BINDER_DEFERRED_RELEASE)
 			binder_deferred_release(proc); /* frees proc */
 
-		mutex_unlock(&binder_lock);
+		up_write(&binder_main_lock);
 		if (files)
 			put_files_struct(files);
 	} while (proc);
@@ -3352,17 +3898,21 @@ static void print_binder_stats(struct seq_file *m, const char *prefix,
 	BUILD_BUG_ON(ARRAY_SIZE(stats->bc) !=
 		     ARRAY_SIZE(binder_command_strings));
 	for (i = 0; i < ARRAY_SIZE(stats->bc); i++) {
-		if (stats->bc[i])
+		int count = atomic_read(&stats->bc[i]);
+
+		if (count)
 			seq_printf(m, "%s%s: %d\n", prefix,
-				   binder_command_strings[i], stats->bc[i]);
+				   binder_command_strings[i], count);
 	}
 
 	BUILD_BUG_ON(ARRAY_SIZE(stats->br) !=
 		     ARRAY_SIZE(binder_return_strings));
 	for (i = 0; i < ARRAY_SIZE(stats->br); i++) {
-		if (stats->br[i])
+		int count = atomic_read(&stats->br[i]);
+
+		if (count)
 			seq_printf(m, "%s%s: %d\n", prefix,
-				   binder_return_strings[i], stats->br[i]);
+				   binder_return_strings[i], count);
 	}
 
 	BUILD_BUG_ON(ARRAY_SIZE(stats->obj_created) !=
@@ -3370,11 +3920,13 @@ static void print_binder_stats(struct seq_file *m, const char *prefix,
 	BUILD_BUG_ON(ARRAY_SIZE(stats->obj_created) !=
 		     ARRAY_SIZE(stats->obj_deleted));
 	for (i = 0; i < ARRAY_SIZE(stats->obj_created); i++) {
-		if (stats->obj_created[i] || stats->obj_deleted[i])
+		int created = atomic_read(&stats->obj_created[i]);
+		int deleted = atomic_read(&stats->obj_deleted[i]);
+
+		if (created || deleted)
 			seq_printf(m, "%s%s: active %d total %d\n", prefix,
 				binder_objstat_strings[i],
-				stats->obj_created[i] - stats->obj_deleted[i],
-				stats->obj_created[i]);
+				created - deleted, created);
 	}
 }
 
@@ -3383,7 +3935,8 @@ static void print_binder_proc_stats(struct seq_file *m,
 {
 	struct binder_work *w;
 	struct rb_node *n;
-	int count, strong, weak;
+	int count, strong, weak, i;
+	size_t largest;
 
 	seq_printf(m, "proc %d\n", proc->pid);
 	count = 0;
@@ -3416,6 +3969,25 @@ static void print_binder_proc_stats(struct seq_file *m,
 		count++;
 	seq_printf(m, "  buffers: %d\n", count);
 
+	count = 0;
+	largest = 0;
+	for (n = rb_first(&proc->free_buffers); n != NULL; n = rb_next(n)) {
+		count++;
+		largest = binder_buffer_size(proc, rb_entry(n,
+					struct binder_buffer, rb_node));
+	}
+	seq_printf(m, "  free buffers: %d largest %zd\n", count, largest);
+	count = 0;
+	for (i = 0; proc->pages && i < proc->buffer_size / PAGE_SIZE; i++)
+		if (proc->pages[i])
+			count++;
+	seq_printf(m, "  pages: %d resident %d\n", count,
+		   proc->resident_pages);
+	seq_printf(m, "  allocs: %lu failed %lu mapping %lu\n",
+		   proc->alloc_count, proc->alloc_failed, proc->alloc_mapped);
+	seq_printf(m, "  pages mapped: %lu unmapped %lu\n",
+		   proc->pages_mapped, proc->pages_unmapped);
+
 	count = 0;
 	list_for_each_entry(w, &proc->todo, entry) {
 		switch (w->type) {
@@ -3440,7 +4012,7 @@ static int binder_state_show(struct seq_file *m, void *unused)
 	int do_lock = !binder_debug_no_lock;
 
 	if (do_lock)
-		mutex_lock(&binder_lock);
+		down_write(&binder_main_lock);
 
 	seq_puts(m, "binder state:\n");
 
@@ -3452,7 +4024,7 @@ static int binder_state_show(struct seq_file *m, void *unused)
 	hlist_for_each_entry(proc, pos, &binder_procs, proc_node)
 		print_binder_proc(m, proc, 1);
 	if (do_lock)
-		mutex_unlock(&binder_lock);
+		up_write(&binder_main_lock);
 	return 0;
 }
 
@@ -3463,7 +4035,7 @@ static int binder_stats_show(struct seq_file *m, void *unused)
 	int do_lock = !binder_debug_no_lock;
 
 	if (do_lock)
-		mutex_lock(&binder_lock);
+		down_write(&binder_main_lock);
 
 	seq_puts(m, "binder stats:\n");
 
@@ -3472,7 +4044,7 @@ static int binder_stats_show(struct seq_file *m, void *unused)
 	hlist_for_each_entry(proc, pos, &binder_procs, proc_node)
 		print_binder_proc_stats(m, proc);
 	if (do_lock)
-		mutex_unlock(&binder_lock);
+		up_write(&binder_main_lock);
 	return 0;
 }
 
@@ -3483,27 +4055,77 @@ static int binder_transactions_show(struct seq_file *m, void *unused)
 	int do_lock = !binder_debug_no_lock;
 
 	if (do_lock)
-		mutex_lock(&binder_lock);
+		down_write(&binder_main_lock);
 
 	seq_puts(m, "binder transactions:\n");
 	hlist_for_each_entry(proc, pos, &binder_procs, proc_node)
 		print_binder_proc(m, proc, 0);
 	if (do_lock)
-		mutex_unlock(&binder_lock);
+		up_write(&binder_main_lock);
 	return 0;
 }
 
+static void print_binder_latency_hist(struct seq_file *m, const char *name,
+				      u32 *hist)
+{
+	int i, last = -1;
+
+	for (i = 0; i < BINDER_LAT_BUCKETS; i++)
+		if (hist[i])
+			last = i;
+	if (last < 0)
+		return;
+	seq_printf(m, "    %-8s", name);
+	for (i = 0; i <= last; i++)
+		seq_printf(m, " %u", hist[i]);
+	seq_puts(m, "\n");
+}
+
+static void print_binder_latency(struct seq_file *m, const char *prefix,
+				 struct binder_latency *lat)
+{
+	int i;
+
+	for (i = 0; i < BINDER_LAT_BUCKETS; i++)
+		if (lat->queue[i] || lat->wakeup[i] || lat->handler[i])
+			break;
+	if (i == BINDER_LAT_BUCKETS)
+		return;
+	seq_printf(m, "  %s latency, us <2 <4 <8 ... >=%d:\n", prefix,
+		   1 << (BINDER_LAT_BUCKETS - 1));
+	print_binder_latency_hist(m, "queue", lat->queue);
+	print_binder_latency_hist(m, "wakeup", lat->wakeup);
+	print_binder_latency_hist(m, "handler", lat->handler);
+}
+
+static void print_binder_proc_latency(struct seq_file *m,
+				      struct binder_proc *proc)
+{
+	struct rb_node *n;
+	char name[24];
+
+	print_binder_latency(m, "proc", &proc->latency);
+	for (n = rb_first(&proc->nodes); n != NULL; n = rb_next(n)) {
+		struct binder_node *node = rb_entry(n, struct binder_node,
+						    rb_node);
+
+		snprintf(name, sizeof(name), "node %d", node->debug_id);
+		print_binder_latency(m, name, &node->latency);
+	}
+}
+
 static int binder_proc_show(struct seq_file *m, void *unused)
 {
 	struct binder_proc *proc = m->private;
 	int do_lock = !binder_debug_no_lock;
 
 	if (do_lock)
-		mutex_lock(&binder_lock);
+		down_write(&binder_main_lock);
 	seq_puts(m, "binder proc state:\n");
 	print_binder_proc(m, proc, 1);
+	print_binder_proc_latency(m, proc);
 	if (do_lock)
-		mutex_unlock(&binder_lock);
+		up_write(&binder_main_lock);
 	return 0;
 }
 
@@ -3521,13 +4143,15 @@ static void print_binder_transaction_log_entry(struct seq_file *m,
 static int binder_transaction_log_show(struct seq_file *m, void *unused)
 {
 	struct binder_transaction_log *log = m->private;
+	unsigned int next = (atomic_read(&log->cur) + 1) %
+			    ARRAY_SIZE(log->entry);
 	int i;
 
 	if (log->full) {
-		for (i = log->next; i < ARRAY_SIZE(log->entry); i++)
+		for (i = next; i < ARRAY_SIZE(log->entry); i++)
 			print_binder_transaction_log_entry(m, &log->entry[i]);
 	}
-	for (i = 0; i < log->next; i++)
+	for (i = 0; i < next; i++)
 		print_binder_transaction_log_entry(m, &log->entry[i]);
 	return 0;
 }
@@ -0,0 +1,144 @@
+/* drivers/staging/android/binder_trace.h
+ *
+ * Copyright (C) 2008 Google, Inc.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#if !defined(_BINDER_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _BINDER_TRACE_H
+
+#include <linux/tracepoint.h>
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM binder
+#define TRACE_INCLUDE_FILE binder_trace
+
+struct binder_buffer;
+struct binder_node;
+struct binder_proc;
+struct binder_thread;
+struct binder_transaction;
+
+DECLARE_EVENT_CLASS(binder_transaction_class,
+
+	TP_PROTO(struct binder_transaction *t, struct binder_node *target_node),
+
+	TP_ARGS(t, target_node),
+
+	TP_STRUCT__entry(
+		__field(int, debug_id)
+		__field(int, target_node)
+		__field(int, to_proc)
+		__field(int, to_thread)
+		__field(unsigned int, code)
+		__field(unsigned int, flags)
+		__field(size_t, data_size)
+	),
+
+	TP_fast_assign(
+		__entry->debug_id = t->debug_id;
+		__entry->target_node = target_node ? target_node->debug_id : 0;
+		__entry->to_proc = t->to_proc->pid;
+		__entry->to_thread = t->to_thread ? t->to_thread->pid : 0;
+		__entry->code = t->code;
+		__entry->flags = t->flags;
+		__entry->data_size = t->buffer->data_size;
+	),
+
+	TP_printk("transaction=%d dest_node=%d dest_proc=%d dest_thread=%d "
+		  "flags=0x%x code=0x%x size=%zd",
+		  __entry->debug_id, __entry->target_node, __entry->to_proc,
+		  __entry->to_thread, __entry->flags, __entry->code,
+		  __entry->data_size)
+);
+
+/* a call is queued to the target */
+DEFINE_EVENT(binder_transaction_class, binder_transaction,
+	TP_PROTO(struct binder_transaction *t, struct binder_node *target_node),
+	TP_ARGS(t, target_node)
+);
+
+/* a reply is queued to the caller */
+DEFINE_EVENT(binder_transaction_class, binder_reply,
+	TP_PROTO(struct binder_transaction *t, struct binder_node *target_node),
+	TP_ARGS(t, target_node)
+);
+
+/* a thread takes a call or reply off its todo list */
+TRACE_EVENT(binder_transaction_received,
+
+	TP_PROTO(struct binder_transaction *t, struct binder_thread *thread,
+		 s64 delay_ns, int queued),
+
+	TP_ARGS(t, thread, delay_ns, queued),
+
+	TP_STRUCT__entry(
+		__field(int, debug_id)
+		__field(int, thread)
+		__field(s64, delay_ns)
+		__field(int, queued)
+	),
+
+	TP_fast_assign(
+		__entry->debug_id = t->debug_id;
+		__entry->thread = thread->pid;
+		__entry->delay_ns = delay_ns;
+		__entry->queued = queued;
+	),
+
+	TP_printk("transaction=%d thread=%d delay=%lldns %s",
+		  __entry->debug_id, __entry->thread,
+		  (long long)__entry->delay_ns,
+		  __entry->queued ? "queued" : "woken")
+);
+
+DECLARE_EVENT_CLASS(binder_buffer_class,
+
+	TP_PROTO(struct binder_proc *proc, struct binder_buffer *buf),
+
+	TP_ARGS(proc, buf),
+
+	TP_STRUCT__entry(
+		__field(int, proc)
+		__field(void *, buffer)
+		__field(size_t, data_size)
+		__field(size_t, offsets_size)
+	),
+
+	TP_fast_assign(
+		__entry->proc = proc->pid;
+		__entry->buffer = buf;
+		__entry->data_size = buf->data_size;
+		__entry->offsets_size = buf->offsets_size;
+	),
+
+	TP_printk("proc=%d buffer=%p data_size=%zd offsets_size=%zd",
+		  __entry->proc, __entry->buffer, __entry->data_size,
+		  __entry->offsets_size)
+);
+
+DEFINE_EVENT(binder_buffer_class, binder_alloc_buf,
+	TP_PROTO(struct binder_proc *proc, struct binder_buffer *buf),
+	TP_ARGS(proc, buf)
+);
+
+DEFINE_EVENT(binder_buffer_class, binder_free_buf,
+	TP_PROTO(struct binder_proc *proc, struct binder_buffer *buf),
+	TP_ARGS(proc, buf)
+);
+
+#endif /* _BINDER_TRACE_H */
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#include <trace/define_trace.h>
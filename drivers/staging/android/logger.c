@@ -24,6 +24,8 @@
 #include <linux/uaccess.h>
 #include <linux/poll.h>
 #include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/stddef.h>
 #include <linux/time.h>
 #include "logger.h"
 
@@ -33,16 +35,28 @@
  * struct logger_log - represents a specific log, such as 'main' or 'radio'
  *
  * This structure lives from module insertion until module removal, so it does
- * not need additional reference counting. The structure is protected by the
- * mutex 'mutex'.
+ * not need additional reference counting. The offsets and the list of readers
+ * are protected by the spinlock 'lock'. The buffer itself is not: writers copy
+ * their payload into space they reserved under the lock, and readers check
+ * after copying an entry out that no writer reserved over it meanwhile.
+ *
+ * Entries between w_off and r_end are reserved but may still be in the
+ * middle of being written. Readers only ever see entries before w_off.
+ *
+ * 'wraps' counts how many times r_end went past the end of the buffer, so
+ * that a reader can tell a writer went all the way around the log even if
+ * that put it back at the same offset.
  */
 struct logger_log {
 	unsigned char 		*buffer;/* the ring buffer itself */
 	struct miscdevice	misc;	/* misc device representing the log */
 	wait_queue_head_t	wq;	/* wait queue for readers */
+	wait_queue_head_t	commit_wq; /* writers waiting for a commit */
 	struct list_head	readers; /* this log's readers */
-	struct mutex		mutex;	/* mutex protecting buffer */
-	size_t			w_off;	/* current write head offset */
+	spinlock_t		lock;	/* lock protecting the offsets */
+	size_t			w_off;	/* end of committed entries */
+	size_t			r_end;	/* end of reserved entries */
+	unsigned long		wraps;	/* times r_end wrapped around */
 	size_t			head;	/* new readers start here */
 	size_t			size;	/* size of the log */
 };
@@ -51,7 +65,7 @@ struct logger_log {
  * struct logger_reader - a logging device open for reading
  *
  * This object lives from open to release, so we don't need additional
- * reference counting. The structure is protected by log->mutex.
+ * reference counting. The structure is protected by log->lock.
  */
 struct logger_reader {
 	struct logger_log	*log;	/* associated log */
@@ -62,6 +76,13 @@ struct logger_reader {
 /* logger_offset - returns index 'n' into the log via (optimized) modulus */
 #define logger_offset(n)	((n) & (log->size - 1))
 
+/*
+ * An entry is reserved with LOGGER_ENTRY_PENDING in its __pad field, and the
+ * field is cleared once its payload is complete. Readers never see an entry
+ * before that, so to them __pad is always zero, as it always was.
+ */
+#define LOGGER_ENTRY_PENDING	0x8000
+
 /*
  * file_get_log - Given a file structure, return the associated log
  *
@@ -89,7 +110,7 @@ static inline struct logger_log *file_get_log(struct file *file)
  * get_entry_len - Grabs the length of the payload of the next entry starting
  * from 'off'.
  *
- * Caller needs to hold log->mutex.
+ * Caller needs to hold log->lock.
  */
 static __u32 get_entry_len(struct logger_log *log, size_t off)
 {
@@ -108,25 +129,66 @@ static __u32 get_entry_len(struct logger_log *log, size_t off)
 }
 
 /*
- * do_read_log_to_user - reads exactly 'count' bytes from 'log' into the
- * user-space buffer 'buf'. Returns 'count' on success.
+ * set_entry_pad - sets the __pad field of the entry starting at 'off'
  *
- * Caller must hold log->mutex.
+ * Caller needs to hold log->lock.
  */
-static ssize_t do_read_log_to_user(struct logger_log *log,
-				   struct logger_reader *reader,
-				   char __user *buf,
-				   size_t count)
+static void set_entry_pad(struct logger_log *log, size_t off, __u16 val)
+{
+	off = logger_offset(off + offsetof(struct logger_entry, __pad));
+
+	switch (log->size - off) {
+	case 1:
+		memcpy(log->buffer + off, &val, 1);
+		memcpy(log->buffer, ((char *) &val) + 1, 1);
+		break;
+	default:
+		memcpy(log->buffer + off, &val, 2);
+	}
+}
+
+/*
+ * get_entry_pad - returns the __pad field of the entry starting at 'off'
+ *
+ * Caller needs to hold log->lock.
+ */
+static __u16 get_entry_pad(struct logger_log *log, size_t off)
+{
+	__u16 val;
+
+	off = logger_offset(off + offsetof(struct logger_entry, __pad));
+
+	switch (log->size - off) {
+	case 1:
+		memcpy(&val, log->buffer + off, 1);
+		memcpy(((char *) &val) + 1, log->buffer, 1);
+		break;
+	default:
+		memcpy(&val, log->buffer + off, 2);
+	}
+
+	return val;
+}
+
+/*
+ * do_read_log_to_user - reads exactly 'count' bytes from 'log', starting at
+ * 'off', into the user-space buffer 'buf'. Returns 'count' on success.
+ *
+ * The caller does not hold log->lock, and must check afterwards that no
+ * writer reserved the space that was read.
+ */
+static ssize_t do_read_log_to_user(struct logger_log *log, size_t off,
+				   char __user *buf, size_t count)
 {
 	size_t len;
 
 	/*
 	 * We read from the log in two disjoint operations. First, we read from
-	 * the current read head offset up to 'count' bytes or to the end of
-	 * the log, whichever comes first.
+	 * the given offset up to 'count' bytes or to the end of the log,
+	 * whichever comes first.
 	 */
-	len = min(count, log->size - reader->r_off);
-	if (copy_to_user(buf, log->buffer + reader->r_off, len))
+	len = min(count, log->size - off);
+	if (copy_to_user(buf, log->buffer + off, len))
 		return -EFAULT;
 
 	/*
@@ -137,8 +199,6 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
 		if (copy_to_user(buf + len, log->buffer, count - len))
 			return -EFAULT;
 
-	reader->r_off = logger_offset(reader->r_off + count);
-
 	return count;
 }
 
@@ -153,12 +213,20 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
  *
  * Optimal read size is LOGGER_ENTRY_MAX_LEN. Will set errno to EINVAL if read
  * buffer is insufficient to hold next entry.
+ *
+ * The entry is copied out without holding log->lock. If a writer reserved
+ * its space in the meantime, the writer has already pulled us forward and
+ * what we copied may be torn, so we read the new next entry instead. Writers
+ * that lapped us exactly once leave us at the same offset, but have bumped
+ * log->wraps.
  */
 static ssize_t logger_read(struct file *file, char __user *buf,
 			   size_t count, loff_t *pos)
 {
 	struct logger_reader *reader = file->private_data;
 	struct logger_log *log = reader->log;
+	unsigned long wraps;
+	size_t off;
 	ssize_t ret;
 	DEFINE_WAIT(wait);
 
@@ -166,9 +234,9 @@ start:
 	while (1) {
 		prepare_to_wait(&log->wq, &wait, TASK_INTERRUPTIBLE);
 
-		mutex_lock(&log->mutex);
+		spin_lock(&log->lock);
 		ret = (log->w_off == reader->r_off);
-		mutex_unlock(&log->mutex);
+		spin_unlock(&log->lock);
 		if (!ret)
 			break;
 
@@ -189,26 +257,38 @@ start:
 	if (ret)
 		return ret;
 
-	mutex_lock(&log->mutex);
+	spin_lock(&log->lock);
 
 	/* is there still something to read or did we race? */
 	if (unlikely(log->w_off == reader->r_off)) {
-		mutex_unlock(&log->mutex);
+		spin_unlock(&log->lock);
 		goto start;
 	}
 
-	/* get the size of the next entry */
-	ret = get_entry_len(log, reader->r_off);
-	if (count < ret) {
-		ret = -EINVAL;
-		goto out;
-	}
+	/* get the offset and size of the next entry */
+	off = reader->r_off;
+	wraps = log->wraps;
+	ret = get_entry_len(log, off);
+	spin_unlock(&log->lock);
+
+	if (count < ret)
+		return -EINVAL;
 
 	/* get exactly one entry from the log */
-	ret = do_read_log_to_user(log, reader, buf, ret);
+	ret = do_read_log_to_user(log, off, buf, ret);
+	if (unlikely(ret < 0))
+		return ret;
 
-out:
-	mutex_unlock(&log->mutex);
+	spin_lock(&log->lock);
+
+	/* were we lapped, or did another read of this file beat us? */
+	if (unlikely(reader->r_off != off || log->wraps != wraps)) {
+		spin_unlock(&log->lock);
+		goto start;
+	}
+	reader->r_off = logger_offset(off + ret);
+
+	spin_unlock(&log->lock);
 
 	return ret;
 }
@@ -217,7 +297,7 @@ out:
  * get_next_entry - return the offset of the first valid entry at least 'len'
  * bytes after 'off'.
  *
- * Caller must hold log->mutex.
+ * Caller must hold log->lock.
  */
 static size_t get_next_entry(struct logger_log *log, size_t off, size_t len)
 {
@@ -249,85 +329,226 @@ static inline int clock_interval(size_t a, size_t b, size_t c)
 	return 0;
 }
 
+/*
+ * is_lapped - is 'off' about to be overwritten by 'len' bytes reserved at the
+ * end of the reserved entries?
+ *
+ * An offset equal to r_end is normally that of a reader who read everything,
+ * and is left alone. But while entries are pending, such a reader is at
+ * w_off instead, and an offset at r_end points at the oldest entry.
+ *
+ * The caller needs to hold log->lock.
+ */
+static inline int is_lapped(struct logger_log *log, size_t off, size_t len)
+{
+	size_t old = log->r_end;
+
+	if (off == old)
+		return log->w_off != old;
+
+	return clock_interval(old, logger_offset(old + len), off);
+}
+
 /*
  * fix_up_readers - walk the list of all readers and "fix up" any who were
  * lapped by the writer; also do the same for the default "start head".
  * We do this by "pulling forward" the readers and start head to the first
  * entry after the new write head.
  *
- * The caller needs to hold log->mutex.
+ * The caller needs to hold log->lock.
  */
 static void fix_up_readers(struct logger_log *log, size_t len)
 {
-	size_t old = log->w_off;
-	size_t new = logger_offset(old + len);
 	struct logger_reader *reader;
 
-	if (clock_interval(old, new, log->head))
+	if (is_lapped(log, log->head, len))
 		log->head = get_next_entry(log, log->head, len);
 
 	list_for_each_entry(reader, &log->readers, list)
-		if (clock_interval(old, new, reader->r_off))
+		if (is_lapped(log, reader->r_off, len))
 			reader->r_off = get_next_entry(log, reader->r_off, len);
 }
 
 /*
- * do_write_log - writes 'len' bytes from 'buf' to 'log'
+ * must_wait_commit - would reserving 'len' bytes overwrite a pending entry?
+ *
+ * A writer who stalls in copy_from_user() can be lapped by the others. The
+ * margin of one entry keeps get_next_entry() from pulling a reader past w_off
+ * into the pending entries.
  *
- * The caller needs to hold log->mutex.
+ * Called with or without log->lock; in the latter case the answer is only a
+ * hint and must be checked again under the lock.
  */
-static void do_write_log(struct logger_log *log, const void *buf, size_t count)
+static inline int must_wait_commit(struct logger_log *log, size_t len)
+{
+	size_t w_off = ACCESS_ONCE(log->w_off);
+	size_t r_end = ACCESS_ONCE(log->r_end);
+
+	if (w_off == r_end)
+		return 0;
+
+	return clock_interval(r_end,
+			      logger_offset(r_end + len + LOGGER_ENTRY_MAX_LEN),
+			      w_off);
+}
+
+/*
+ * do_write_log - writes 'count' bytes from 'buf' to 'log' at 'off'
+ *
+ * The caller needs to have reserved the space.
+ */
+static void do_write_log(struct logger_log *log, size_t off,
+			 const void *buf, size_t count)
 {
 	size_t len;
 
-	len = min(count, log->size - log->w_off);
-	memcpy(log->buffer + log->w_off, buf, len);
+	len = min(count, log->size - off);
+	memcpy(log->buffer + off, buf, len);
 
 	if (count != len)
 		memcpy(log->buffer, buf + len, count - len);
-
-	log->w_off = logger_offset(log->w_off + count);
-
 }
 
 /*
- * do_write_log_user - writes 'len' bytes from the user-space buffer 'buf' to
- * the log 'log'
+ * do_write_log_user - writes 'count' bytes from the user-space buffer 'buf' to
+ * the log 'log' at 'off'
  *
- * The caller needs to hold log->mutex.
+ * The caller needs to have reserved the space.
  *
  * Returns 'count' on success, negative error code on failure.
  */
-static ssize_t do_write_log_from_user(struct logger_log *log,
+static ssize_t do_write_log_from_user(struct logger_log *log, size_t off,
 				      const void __user *buf, size_t count)
 {
 	size_t len;
 
-	len = min(count, log->size - log->w_off);
-	if (len && copy_from_user(log->buffer + log->w_off, buf, len))
+	len = min(count, log->size - off);
+	if (len && copy_from_user(log->buffer + off, buf, len))
 		return -EFAULT;
 
 	if (count != len)
 		if (copy_from_user(log->buffer, buf + len, count - len))
 			return -EFAULT;
 
-	log->w_off = logger_offset(log->w_off + count);
-
 	return count;
 }
 
+/*
+ * do_clear_log - zeroes 'count' bytes of 'log' at 'off'
+ *
+ * The caller needs to have reserved the space.
+ */
+static void do_clear_log(struct logger_log *log, size_t off, size_t count)
+{
+	size_t len;
+
+	len = min(count, log->size - off);
+	memset(log->buffer + off, 0, len);
+
+	if (count != len)
+		memset(log->buffer, 0, count - len);
+}
+
+/*
+ * logger_reserve - reserves space for the entry 'header' at the end of the
+ * reserved entries and writes the header there, marked pending. Returns the
+ * offset of the entry.
+ *
+ * Pending entries are invisible to readers, but their headers are valid, so
+ * fix_up_readers() can step over them.
+ */
+static size_t logger_reserve(struct logger_log *log,
+			     struct logger_entry *header)
+{
+	size_t len = sizeof(struct logger_entry) + header->len;
+	size_t off;
+
+	spin_lock(&log->lock);
+
+	while (unlikely(must_wait_commit(log, len))) {
+		spin_unlock(&log->lock);
+		wait_event(log->commit_wq, !must_wait_commit(log, len));
+		spin_lock(&log->lock);
+	}
+
+	/*
+	 * Fix up any readers, pulling them forward to the first readable
+	 * entry after (what will be) the new end of the reserved entries.
+	 */
+	fix_up_readers(log, len);
+
+	off = log->r_end;
+	header->__pad = LOGGER_ENTRY_PENDING;
+	do_write_log(log, off, header, sizeof(struct logger_entry));
+	log->r_end = logger_offset(off + len);
+	if (log->r_end < off)
+		log->wraps++;
+
+	spin_unlock(&log->lock);
+
+	return off;
+}
+
+/*
+ * logger_commit - makes the entry at 'off' complete, and with it any entries
+ * after w_off that were only waiting for this one. Returns nonzero if that
+ * made new entries visible to readers.
+ *
+ * If 'failed' is set, the entry is dropped if it is still the last one
+ * reserved, or else committed with a zeroed payload: the entries after it
+ * need it to stay in place.
+ */
+static int logger_commit(struct logger_log *log, size_t off, int failed)
+{
+	size_t orig;
+	int woken, wake_writers;
+
+	spin_lock(&log->lock);
+
+	if (unlikely(failed)) {
+		size_t hdr = sizeof(struct logger_entry);
+		size_t len = get_entry_len(log, off);
+
+		if (logger_offset(off + len) == log->r_end) {
+			log->r_end = off;
+			goto out;
+		}
+		do_clear_log(log, logger_offset(off + hdr), len - hdr);
+	}
+
+	set_entry_pad(log, off, 0);
+
+out:
+	orig = log->w_off;
+	while (log->w_off != log->r_end && !get_entry_pad(log, log->w_off))
+		log->w_off = logger_offset(log->w_off +
+					   get_entry_len(log, log->w_off));
+	woken = log->w_off != orig;
+	wake_writers = waitqueue_active(&log->commit_wq);
+
+	spin_unlock(&log->lock);
+
+	if (unlikely(wake_writers))
+		wake_up(&log->commit_wq);
+
+	return woken;
+}
+
 /*
  * logger_aio_write - our write method, implementing support for write(),
  * writev(), and aio_write(). Writes are our fast path, and we try to optimize
  * them above all else.
+ *
+ * Writers only take log->lock to reserve their entry and to commit it. The
+ * payload is copied in between, concurrently with other writers and readers.
  */
 ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 			 unsigned long nr_segs, loff_t ppos)
 {
 	struct logger_log *log = file_get_log(iocb->ki_filp);
-	size_t orig = log->w_off;
 	struct logger_entry header;
 	struct timespec now;
+	size_t entry, off;
 	ssize_t ret = 0;
 
 	now = current_kernel_time();
@@ -342,17 +563,8 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 	if (unlikely(!header.len))
 		return 0;
 
-	mutex_lock(&log->mutex);
-
-	/*
-	 * Fix up any readers, pulling them forward to the first readable
-	 * entry after (what will be) the new write offset. We do this now
-	 * because if we partially fail, we can end up with clobbered log
-	 * entries that encroach on readable buffer.
-	 */
-	fix_up_readers(log, sizeof(struct logger_entry) + header.len);
-
-	do_write_log(log, &header, sizeof(struct logger_entry));
+	entry = logger_reserve(log, &header);
+	off = logger_offset(entry + sizeof(struct logger_entry));
 
 	while (nr_segs-- > 0) {
 		size_t len;
@@ -362,21 +574,21 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 		len = min_t(size_t, iov->iov_len, header.len - ret);
 
 		/* write out this segment's payload */
-		nr = do_write_log_from_user(log, iov->iov_base, len);
+		nr = do_write_log_from_user(log, off, iov->iov_base, len);
 		if (unlikely(nr < 0)) {
-			log->w_off = orig;
-			mutex_unlock(&log->mutex);
+			if (logger_commit(log, entry, 1))
+				wake_up_interruptible(&log->wq);
 			return nr;
 		}
 
+		off = logger_offset(off + nr);
 		iov++;
 		ret += nr;
 	}
 
-	mutex_unlock(&log->mutex);
-
 	/* wake up any blocked readers */
-	wake_up_interruptible(&log->wq);
+	if (logger_commit(log, entry, 0))
+		wake_up_interruptible(&log->wq);
 
 	return ret;
 }
@@ -411,10 +623,10 @@ static int logger_open(struct inode *inode, struct file *file)
 		reader->log = log;
 		INIT_LIST_HEAD(&reader->list);
 
-		mutex_lock(&log->mutex);
+		spin_lock(&log->lock);
 		reader->r_off = log->head;
 		list_add_tail(&reader->list, &log->readers);
-		mutex_unlock(&log->mutex);
+		spin_unlock(&log->lock);
 
 		file->private_data = reader;
 	} else
@@ -432,7 +644,11 @@ static int logger_release(struct inode *ignored, struct file *file)
 {
 	if (file->f_mode & FMODE_READ) {
 		struct logger_reader *reader = file->private_data;
+		struct logger_log *log = reader->log;
+
+		spin_lock(&log->lock);
 		list_del(&reader->list);
+		spin_unlock(&log->lock);
 		kfree(reader);
 	}
 
@@ -462,10 +678,10 @@ static unsigned int logger_poll(struct file *file, poll_table *wait)
 
 	poll_wait(file, &log->wq, wait);
 
-	mutex_lock(&log->mutex);
+	spin_lock(&log->lock);
 	if (log->w_off != reader->r_off)
 		ret |= POLLIN | POLLRDNORM;
-	mutex_unlock(&log->mutex);
+	spin_unlock(&log->lock);
 
 	return ret;
 }
@@ -476,7 +692,7 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 	struct logger_reader *reader;
 	long ret = -ENOTTY;
 
-	mutex_lock(&log->mutex);
+	spin_lock(&log->lock);
 
 	switch (cmd) {
 	case LOGGER_GET_LOG_BUF_SIZE:
@@ -516,7 +732,7 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 		break;
 	}
 
-	mutex_unlock(&log->mutex);
+	spin_unlock(&log->lock);
 
 	return ret;
 }
@@ -548,9 +764,11 @@ static struct logger_log VAR = { \
 		.parent = NULL, \
 	}, \
 	.wq = __WAIT_QUEUE_HEAD_INITIALIZER(VAR .wq), \
+	.commit_wq = __WAIT_QUEUE_HEAD_INITIALIZER(VAR .commit_wq), \
 	.readers = LIST_HEAD_INIT(VAR .readers), \
-	.mutex = __MUTEX_INITIALIZER(VAR .mutex), \
+	.lock = __SPIN_LOCK_UNLOCKED(VAR .lock), \
 	.w_off = 0, \
+	.r_end = 0, \
 	.head = 0, \
 	.size = SIZE, \
 };
@@ -16,6 +16,17 @@
  * percentage of the cached memory is locked this can be very inaccurate
  * and processes may not get killed until the normal oom killer is triggered.
  *
+ * Processes are kept in lists by oom_adj value, updated as they start, exit
+ * and have their oom_adj written, so that picking a victim only looks at the
+ * processes with the highest oom_adj instead of at every task.
+ *
+ * User-space can get an early warning from /dev/lowmem_pressure, which
+ * reports a pressure level computed from the same watermarks raised by
+ * notify_margin percent (25 by default), and becomes readable in poll()
+ * when the level rises. While it is open, kill_delay_ms gives its readers
+ * that many milliseconds to free memory once the free memory first drops
+ * below a watermark, before the killer acts on it.
+ *
  * Copyright (C) 2007-2008 Google, Inc.
  *
  * This software is licensed under the terms of the GNU General Public
@@ -35,6 +46,14 @@
 #include <linux/oom.h>
 #include <linux/sched.h>
 #include <linux/notifier.h>
+#include <linux/spinlock.h>
+#include <linux/miscdevice.h>
+#include <linux/fs.h>
+#include <linux/poll.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h>
+#include <linux/math64.h>
+#include "lowmemorykiller.h"
 
 static uint32_t lowmem_debug_level = 2;
 static int lowmem_adj[6] = {
@@ -52,9 +71,42 @@ static size_t lowmem_minfree[6] = {
 };
 static int lowmem_minfree_size = 4;
 
+static int lowmem_notify_margin = 25;
+static unsigned int lowmem_kill_delay_ms;
+
 static struct task_struct *lowmem_deathpending;
 static unsigned long lowmem_deathpending_timeout;
 
+/*
+ * Pressure notification state. The level is updated on every shrinker call
+ * and every read, and readers are woken when a shrinker call raises it. The
+ * grace window applies to killing at lowmem_kill_adj or above, and starts
+ * over when the pressure gets deeper. lowmem_kill_adj and lowmem_kill_after
+ * go together and are only accessed under lowmem_procs_lock.
+ */
+static DECLARE_WAIT_QUEUE_HEAD(lowmem_pressure_wait);
+static int lowmem_pressure_level;
+static atomic_t lowmem_pressure_listeners = ATOMIC_INIT(0);
+static atomic_long_t lowmem_scanned = ATOMIC_LONG_INIT(0);
+static int lowmem_kill_adj = OOM_ADJUST_MAX + 1;
+static unsigned long lowmem_kill_after;
+
+struct lowmem_reader {
+	int		level;		/* level last read */
+	unsigned long	scanned;	/* lowmem_scanned at last read */
+	unsigned long	time;		/* jiffies at last read */
+};
+
+/*
+ * The index of processes by oom_adj: signal_structs, linked by their
+ * lowmem_node, in one list per value from OOM_DISABLE to OOM_ADJUST_MAX.
+ * A process is in it from fork to the exit of its last thread. The lock
+ * nests inside siglock and tasklist_lock, which are taken from interrupts.
+ */
+#define LOWMEM_NR_ADJ	(OOM_ADJUST_MAX - OOM_DISABLE + 1)
+static struct list_head lowmem_procs[LOWMEM_NR_ADJ];
+static DEFINE_SPINLOCK(lowmem_procs_lock);
+
 #define lowmem_print(level, x...)			\
 	do {						\
 		if (lowmem_debug_level >= (level))	\
@@ -68,32 +120,216 @@ static struct notifier_block task_nb = {
 	.notifier_call	= task_notify_func,
 };
 
+static struct list_head *lowmem_procs_list(int oom_adj)
+{
+	return &lowmem_procs[clamp(oom_adj, OOM_DISABLE, OOM_ADJUST_MAX) -
+			     OOM_DISABLE];
+}
+
+/*
+ * lowmem_index - adds the process of 'task' to the list for its oom_adj, or
+ * moves it there. Does nothing if the process is not indexed and 'add' is
+ * not set. Caller must hold lowmem_procs_lock.
+ */
+static void lowmem_index(struct task_struct *task, int add)
+{
+	struct signal_struct *sig = task->signal;
+
+	if (list_empty(&sig->lowmem_node) && !add)
+		return;
+	list_move_tail(&sig->lowmem_node, lowmem_procs_list(sig->oom_adj));
+}
+
 static int
 task_notify_func(struct notifier_block *self, unsigned long val, void *data)
 {
 	struct task_struct *task = data;
+	unsigned long flags;
 
-	if (task == lowmem_deathpending)
-		lowmem_deathpending = NULL;
+	switch (val) {
+	case TASK_FREE:
+		if (task == lowmem_deathpending)
+			lowmem_deathpending = NULL;
+		break;
+	case TASK_NEW_PROCESS:
+	case TASK_OOM_ADJ:
+		spin_lock_irqsave(&lowmem_procs_lock, flags);
+		lowmem_index(task, val == TASK_NEW_PROCESS);
+		spin_unlock_irqrestore(&lowmem_procs_lock, flags);
+		break;
+	case TASK_EXIT_PROCESS:
+		spin_lock_irqsave(&lowmem_procs_lock, flags);
+		list_del_init(&task->signal->lowmem_node);
+		spin_unlock_irqrestore(&lowmem_procs_lock, flags);
+		break;
+	}
 
 	return NOTIFY_OK;
 }
 
+/* Processes looked at per hold of lowmem_procs_lock */
+#define LOWMEM_BATCH	32
+
+/*
+ * lowmem_proc_batch - takes a reference to a thread of each of up to
+ * LOWMEM_BATCH processes of the list for 'oom_adj', after skipping the first
+ * 'skip' of them, and returns how many it took.
+ *
+ * Caller must hold tasklist_lock. Since the processes are indexed, their
+ * last thread has not got to exit yet, and curr_target is a thread that was
+ * not released. Nothing else is taken under lowmem_procs_lock: it nests
+ * inside siglock, so task_lock() must not nest inside it.
+ */
+static int lowmem_proc_batch(int oom_adj, int skip, struct task_struct **tasks)
+{
+	struct signal_struct *sig;
+	int nr = 0;
+
+	spin_lock_irq(&lowmem_procs_lock);
+	list_for_each_entry(sig, lowmem_procs_list(oom_adj), lowmem_node) {
+		if (skip) {
+			skip--;
+			continue;
+		}
+		tasks[nr] = sig->curr_target;
+		get_task_struct(tasks[nr]);
+		if (++nr == LOWMEM_BATCH)
+			break;
+	}
+	spin_unlock_irq(&lowmem_procs_lock);
+
+	return nr;
+}
+
+/*
+ * lowmem_proc_size - returns the rss of the process of 'p', and in 'task'
+ * one of its threads that still has the mm, or zero if none has.
+ *
+ * Caller must hold tasklist_lock, so that the threads are not released.
+ */
+static int lowmem_proc_size(struct task_struct *p, struct task_struct **task)
+{
+	struct task_struct *t = p;
+	int tasksize;
+
+	do {
+		task_lock(t);
+		if (t->mm) {
+			tasksize = get_mm_rss(t->mm);
+			task_unlock(t);
+			*task = t;
+			return tasksize;
+		}
+		task_unlock(t);
+	} while_each_thread(p, t);
+
+	return 0;
+}
+
+static int lowmem_array_size(void)
+{
+	int array_size = ARRAY_SIZE(lowmem_adj);
+
+	if (lowmem_adj_size < array_size)
+		array_size = lowmem_adj_size;
+	if (lowmem_minfree_size < array_size)
+		array_size = lowmem_minfree_size;
+	return array_size;
+}
+
+/* lowmem_min_adj - the lowest oom_adj to kill at, OOM_ADJUST_MAX + 1 if none */
+static int lowmem_min_adj(int other_free, int other_file, int array_size)
+{
+	int i;
+
+	for (i = 0; i < array_size; i++) {
+		if (other_free < lowmem_minfree[i] &&
+		    other_file < lowmem_minfree[i])
+			return lowmem_adj[i];
+	}
+	return OOM_ADJUST_MAX + 1;
+}
+
+/*
+ * lowmem_level - the pressure level: the number of watermarks, raised by
+ * notify_margin percent, both free and file memory are below.
+ */
+static int lowmem_level(int other_free, int other_file, int array_size)
+{
+	int margin = 100 + lowmem_notify_margin;
+	size_t minfree;
+	int i;
+
+	for (i = 0; i < array_size; i++) {
+		minfree = lowmem_minfree[i] * margin / 100;
+		if (other_free < minfree && other_file < minfree)
+			return array_size - i;
+	}
+	return 0;
+}
+
+static void lowmem_set_level(int level)
+{
+	int old = lowmem_pressure_level;
+
+	lowmem_pressure_level = level;
+	if (level > old)
+		wake_up_interruptible(&lowmem_pressure_wait);
+}
+
+/*
+ * lowmem_kill_deferred - returns nonzero if killing at 'min_adj' has to wait
+ * for the grace window, to let pressure readers free memory first.
+ */
+static int lowmem_kill_deferred(int min_adj)
+{
+	unsigned long flags;
+	int deferred;
+
+	if (!lowmem_kill_delay_ms || !atomic_read(&lowmem_pressure_listeners))
+		return 0;
+
+	spin_lock_irqsave(&lowmem_procs_lock, flags);
+	if (min_adj < lowmem_kill_adj) {
+		lowmem_kill_adj = min_adj;
+		lowmem_kill_after = jiffies +
+				    msecs_to_jiffies(lowmem_kill_delay_ms);
+	}
+	deferred = time_before(jiffies, lowmem_kill_after);
+	spin_unlock_irqrestore(&lowmem_procs_lock, flags);
+
+	return deferred;
+}
+
+/* lowmem_kill_reset - closes the grace window once the pressure is gone */
+static void lowmem_kill_reset(void)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&lowmem_procs_lock, flags);
+	lowmem_kill_adj = OOM_ADJUST_MAX + 1;
+	spin_unlock_irqrestore(&lowmem_procs_lock, flags);
+}
+
 static int lowmem_shrink(struct shrinker *s, int nr_to_scan, gfp_t gfp_mask)
 {
 	struct task_struct *p;
 	struct task_struct *selected = NULL;
 	int rem = 0;
 	int tasksize;
-	int i;
-	int min_adj = OOM_ADJUST_MAX + 1;
+	int min_adj;
 	int selected_tasksize = 0;
 	int selected_oom_adj;
-	int array_size = ARRAY_SIZE(lowmem_adj);
+	int oom_adj;
+	int array_size = lowmem_array_size();
 	int other_free = global_page_state(NR_FREE_PAGES);
 	int other_file = global_page_state(NR_FILE_PAGES) -
 						global_page_state(NR_SHMEM);
 
+	lowmem_set_level(lowmem_level(other_free, other_file, array_size));
+	if (nr_to_scan > 0)
+		atomic_long_add(nr_to_scan, &lowmem_scanned);
+
 	/*
 	 * If we already have a death outstanding, then
 	 * bail out right away; indicating to vmscan
@@ -105,17 +341,9 @@ static int lowmem_shrink(struct shrinker *s, int nr_to_scan, gfp_t gfp_mask)
 	    time_before_eq(jiffies, lowmem_deathpending_timeout))
 		return 0;
 
-	if (lowmem_adj_size < array_size)
-		array_size = lowmem_adj_size;
-	if (lowmem_minfree_size < array_size)
-		array_size = lowmem_minfree_size;
-	for (i = 0; i < array_size; i++) {
-		if (other_free < lowmem_minfree[i] &&
-		    other_file < lowmem_minfree[i]) {
-			min_adj = lowmem_adj[i];
-			break;
-		}
-	}
+	min_adj = lowmem_min_adj(other_free, other_file, array_size);
+	if (min_adj == OOM_ADJUST_MAX + 1)
+		lowmem_kill_reset();
 	if (nr_to_scan > 0)
 		lowmem_print(3, "lowmem_shrink %d, %x, ofree %d %d, ma %d\n",
 			     nr_to_scan, gfp_mask, other_free, other_file,
@@ -129,42 +357,42 @@ static int lowmem_shrink(struct shrinker *s, int nr_to_scan, gfp_t gfp_mask)
 			     nr_to_scan, gfp_mask, rem);
 		return rem;
 	}
+	if (lowmem_kill_deferred(min_adj)) {
+		lowmem_print(4, "lowmem_shrink %d, %x, deferred, return %d\n",
+			     nr_to_scan, gfp_mask, rem);
+		return rem;
+	}
 	selected_oom_adj = min_adj;
 
+	/*
+	 * Only look at the processes with the highest oom_adj that have any
+	 * memory, and pick the largest of them. Their sizes are read in
+	 * batches, outside lowmem_procs_lock.
+	 */
 	read_lock(&tasklist_lock);
-	for_each_process(p) {
-		struct mm_struct *mm;
-		struct signal_struct *sig;
-		int oom_adj;
-
-		task_lock(p);
-		mm = p->mm;
-		sig = p->signal;
-		if (!mm || !sig) {
-			task_unlock(p);
-			continue;
-		}
-		oom_adj = sig->oom_adj;
-		if (oom_adj < min_adj) {
-			task_unlock(p);
-			continue;
-		}
-		tasksize = get_mm_rss(mm);
-		task_unlock(p);
-		if (tasksize <= 0)
-			continue;
-		if (selected) {
-			if (oom_adj < selected_oom_adj)
-				continue;
-			if (oom_adj == selected_oom_adj &&
-			    tasksize <= selected_tasksize)
-				continue;
-		}
-		selected = p;
-		selected_tasksize = tasksize;
-		selected_oom_adj = oom_adj;
-		lowmem_print(2, "select %d (%s), adj %d, size %d, to kill\n",
-			     p->pid, p->comm, oom_adj, tasksize);
+	for (oom_adj = OOM_ADJUST_MAX; oom_adj >= min_adj && !selected;
+	     oom_adj--) {
+		struct task_struct *batch[LOWMEM_BATCH];
+		int skip = 0, nr, i;
+
+		do {
+			nr = lowmem_proc_batch(oom_adj, skip, batch);
+			skip += nr;
+			for (i = 0; i < nr; i++) {
+				tasksize = lowmem_proc_size(batch[i], &p);
+				put_task_struct(batch[i]);
+				if (tasksize <= 0)
+					continue;
+				if (selected && tasksize <= selected_tasksize)
+					continue;
+				selected = p;
+				selected_tasksize = tasksize;
+				selected_oom_adj = oom_adj;
+				lowmem_print(2, "select %d (%s), adj %d, "
+					     "size %d, to kill\n", p->pid,
+					     p->comm, oom_adj, tasksize);
+			}
+		} while (nr == LOWMEM_BATCH);
 	}
 	if (selected) {
 		lowmem_print(1, "send sigkill to %d (%s), adj %d, size %d\n",
@@ -186,17 +414,138 @@ static struct shrinker lowmem_shrinker = {
 	.seeks = DEFAULT_SEEKS * 16
 };
 
+static int lowmem_pressure_open(struct inode *inode, struct file *file)
+{
+	struct lowmem_reader *reader;
+
+	reader = kzalloc(sizeof(*reader), GFP_KERNEL);
+	if (!reader)
+		return -ENOMEM;
+	reader->scanned = atomic_long_read(&lowmem_scanned);
+	reader->time = jiffies;
+	file->private_data = reader;
+	atomic_inc(&lowmem_pressure_listeners);
+
+	return nonseekable_open(inode, file);
+}
+
+static int lowmem_pressure_release(struct inode *inode, struct file *file)
+{
+	atomic_dec(&lowmem_pressure_listeners);
+	kfree(file->private_data);
+	return 0;
+}
+
+/*
+ * lowmem_pressure_read - returns the current struct lowmem_pressure. Never
+ * blocks: use poll() to wait for the level to rise.
+ */
+static ssize_t lowmem_pressure_read(struct file *file, char __user *buf,
+				    size_t count, loff_t *pos)
+{
+	struct lowmem_reader *reader = file->private_data;
+	struct lowmem_pressure pressure;
+	int array_size = lowmem_array_size();
+	int other_free = global_page_state(NR_FREE_PAGES);
+	int other_file = global_page_state(NR_FILE_PAGES) -
+						global_page_state(NR_SHMEM);
+	unsigned long scanned = atomic_long_read(&lowmem_scanned);
+	unsigned long now = jiffies;
+	u64 scan_rate;
+
+	if (count < sizeof(pressure))
+		return -EINVAL;
+
+	pressure.level = lowmem_level(other_free, other_file, array_size);
+	pressure.nr_levels = array_size;
+	pressure.min_adj = lowmem_min_adj(other_free, other_file, array_size);
+	pressure.free_pages = other_free;
+	pressure.file_pages = other_file;
+	/* in 64 bits: pages times HZ overflows a 32-bit long */
+	scan_rate = div64_u64((u64)(scanned - reader->scanned) * HZ,
+			      max(now - reader->time, 1UL));
+	pressure.scan_rate = min_t(u64, scan_rate, UINT_MAX);
+
+	lowmem_set_level(pressure.level);
+	reader->level = pressure.level;
+	reader->scanned = scanned;
+	reader->time = now;
+
+	if (copy_to_user(buf, &pressure, sizeof(pressure)))
+		return -EFAULT;
+	return sizeof(pressure);
+}
+
+static unsigned int lowmem_pressure_poll(struct file *file, poll_table *wait)
+{
+	struct lowmem_reader *reader = file->private_data;
+
+	poll_wait(file, &lowmem_pressure_wait, wait);
+	if (lowmem_pressure_level > reader->level)
+		return POLLIN | POLLRDNORM;
+	return 0;
+}
+
+static const struct file_operations lowmem_pressure_fops = {
+	.owner = THIS_MODULE,
+	.open = lowmem_pressure_open,
+	.release = lowmem_pressure_release,
+	.read = lowmem_pressure_read,
+	.poll = lowmem_pressure_poll,
+};
+
+static struct miscdevice lowmem_pressure_misc = {
+	.minor = MISC_DYNAMIC_MINOR,
+	.name = LOWMEM_PRESSURE_DEV,
+	.fops = &lowmem_pressure_fops,
+};
+
 static int __init lowmem_init(void)
 {
+	struct task_struct *p;
+	int i;
+
+	for (i = 0; i < LOWMEM_NR_ADJ; i++)
+		INIT_LIST_HEAD(&lowmem_procs[i]);
 	task_free_register(&task_nb);
+
+	/*
+	 * Index the processes started before the notifier was registered.
+	 * Forks are excluded by tasklist_lock. A process whose last thread
+	 * is exiting has already decremented live, or will unindex itself
+	 * after us.
+	 */
+	read_lock(&tasklist_lock);
+	spin_lock_irq(&lowmem_procs_lock);
+	for_each_process(p)
+		if (atomic_read(&p->signal->live) &&
+		    list_empty(&p->signal->lowmem_node))
+			lowmem_index(p, 1);
+	spin_unlock_irq(&lowmem_procs_lock);
+	read_unlock(&tasklist_lock);
+
 	register_shrinker(&lowmem_shrinker);
+	if (misc_register(&lowmem_pressure_misc))
+		printk(KERN_ERR "lowmemorykiller: failed to register "
+		       "pressure device\n");
 	return 0;
 }
 
 static void __exit lowmem_exit(void)
 {
+	struct signal_struct *sig, *tmp;
+	int i;
+
+	misc_deregister(&lowmem_pressure_misc);
 	unregister_shrinker(&lowmem_shrinker);
 	task_free_unregister(&task_nb);
+
+	spin_lock_irq(&lowmem_procs_lock);
+	for (i = 0; i < LOWMEM_NR_ADJ; i++)
+		list_for_each_entry_safe(sig, tmp, &lowmem_procs[i],
+					 lowmem_node)
+			list_del_init(&sig->lowmem_node);
+	spin_unlock_irq(&lowmem_procs_lock);
 }
 
 module_param_named(cost, lowmem_shrinker.seeks, int, S_IRUGO | S_IWUSR);
@@ -205,6 +554,9 @@ module_param_array_named(adj, lowmem_adj, int, &lowmem_adj_size,
 module_param_array_named(minfree, lowmem_minfree, uint, &lowmem_minfree_size,
 			 S_IRUGO | S_IWUSR);
 module_param_named(debug_level, lowmem_debug_level, uint, S_IRUGO | S_IWUSR);
+module_param_named(notify_margin, lowmem_notify_margin, int, S_IRUGO | S_IWUSR);
+module_param_named(kill_delay_ms, lowmem_kill_delay_ms, uint,
+		   S_IRUGO | S_IWUSR);
 
 module_init(lowmem_init);
 module_exit(lowmem_exit);
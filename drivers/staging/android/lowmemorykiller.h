@@ -0,0 +1,40 @@
+/* drivers/staging/android/lowmemorykiller.h
+ *
+ * Copyright (C) 2007-2008 Google, Inc.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#ifndef _LINUX_LOWMEMORYKILLER_H
+#define _LINUX_LOWMEMORYKILLER_H
+
+#include <linux/types.h>
+
+#define LOWMEM_PRESSURE_DEV	"lowmem_pressure"
+
+/*
+ * What a read() of the pressure device returns. The level is 0 when there
+ * is no pressure, and otherwise counts the minfree watermarks, raised by
+ * notify_margin percent, that both free and file memory are below: the
+ * deepest one gives the highest level. poll() reports POLLIN once the level
+ * is higher than the one last read from the same file.
+ */
+struct lowmem_pressure {
+	__u32		level;		/* pressure level, 0 for none */
+	__u32		nr_levels;	/* number of watermarks */
+	__s32		min_adj;	/* lowest oom_adj the killer kills */
+	__u32		free_pages;	/* free pages */
+	__u32		file_pages;	/* page cache pages, less shmem */
+	__u32		scan_rate;	/* pages the killer was asked to free
+					   per second, since the last read */
+};
+
+#endif /* _LINUX_LOWMEMORYKILLER_H */
@@ -21,10 +21,13 @@
 #include <linux/blkdev.h>
 #include <linux/buffer_head.h>
 #include <linux/device.h>
+#include <linux/freezer.h>
 #include <linux/genhd.h>
 #include <linux/highmem.h>
+#include <linux/hash.h>
+#include <linux/jhash.h>
+#include <linux/kthread.h>
 #include <linux/slab.h>
-#include <linux/lzo.h>
 #include <linux/string.h>
 #include <linux/swap.h>
 #include <linux/swapops.h>
@@ -38,6 +41,18 @@ static struct ramzswap *devices;
 
 /* Module params (documentation at end) */
 static unsigned int num_devices;
+static char *compressor = (char *)default_compressor;
+static int dedup;
+
+static struct kmem_cache *dedup_node_cache;
+
+/* Entry of the duplicate index, see rzs_dedup_find() */
+struct rzs_dedup_node {
+	struct hlist_node hash;
+	struct page *page;
+	u32 offset;
+	u32 checksum;
+};
 
 static int rzs_test_flag(struct ramzswap *rzs, u32 index,
 			enum rzs_pageflags flag)
@@ -57,18 +72,19 @@ static void rzs_clear_flag(struct ramzswap *rzs, u32 index,
 	rzs->table[index].flags &= ~BIT(flag);
 }
 
-static int page_zero_filled(void *ptr)
+static int page_same_filled(void *ptr, unsigned long *element)
 {
 	unsigned int pos;
 	unsigned long *page;
 
 	page = (unsigned long *)ptr;
 
-	for (pos = 0; pos != PAGE_SIZE / sizeof(*page); pos++) {
-		if (page[pos])
+	for (pos = 1; pos != PAGE_SIZE / sizeof(*page); pos++) {
+		if (page[pos] != page[0])
 			return 0;
 	}
 
+	*element = page[0];
 	return 1;
 }
 
@@ -158,14 +174,205 @@ static void ramzswap_ioctl_get_stats(struct ramzswap *rzs,
 #endif /* CONFIG_RAMZSWAP_STATS */
 }
 
+static void ramzswap_ioctl_get_stats_ext(struct ramzswap *rzs,
+			struct ramzswap_ioctl_stats_ext *e)
+{
+	e->version = RZS_STATS_EXT_VERSION;
+
+#if defined(CONFIG_RAMZSWAP_STATS)
+	{
+	struct ramzswap_stats *rs = &rzs->stats;
+
+	e->pages_pattern = rs->pages_pattern;
+	e->pages_dedup = rs->pages_dedup;
+	e->pages_backed = rs->pages_backed;
+	e->bd_reads = rzs_stat64_read(rzs, &rs->bd_reads);
+	e->bd_writes = rzs_stat64_read(rzs, &rs->bd_writes);
+	e->pages_compacted = rzs_stat64_read(rzs, &rs->pages_compacted);
+	e->objs_compacted = rzs_stat64_read(rzs, &rs->objs_compacted);
+	}
+#endif /* CONFIG_RAMZSWAP_STATS */
+}
+
+static struct hlist_head *rzs_dedup_bucket(struct ramzswap *rzs,
+						u32 checksum)
+{
+	return &rzs->dedup_table[hash_32(checksum, rzs->dedup_shift)];
+}
+
+/* Called with dedup_lock held */
+static void rzs_dedup_remove(struct ramzswap *rzs, u32 checksum,
+				struct page *page, u32 offset)
+{
+	struct rzs_dedup_node *node;
+	struct hlist_node *pos;
+
+	hlist_for_each_entry(node, pos, rzs_dedup_bucket(rzs, checksum), hash) {
+		if (node->page == page && node->offset == offset) {
+			hlist_del(&node->hash);
+			kmem_cache_free(dedup_node_cache, node);
+			return;
+		}
+	}
+}
+
+/* Called with dedup_lock held */
+static void rzs_dedup_move(struct ramzswap *rzs, u32 checksum,
+			struct page *page, u32 offset,
+			struct page *newpage, u32 newoffset)
+{
+	struct rzs_dedup_node *node;
+	struct hlist_node *pos;
+
+	hlist_for_each_entry(node, pos, rzs_dedup_bucket(rzs, checksum), hash) {
+		if (node->page == page && node->offset == offset) {
+			node->page = newpage;
+			node->offset = newoffset;
+			return;
+		}
+	}
+}
+
+/*
+ * Index a newly stored object so that later copies of the same page can
+ * share it. Failure to allocate the index node is harmless: the object
+ * is just not shared.
+ */
+static void rzs_dedup_insert(struct ramzswap *rzs, u32 checksum,
+				struct page *page, u32 offset)
+{
+	struct rzs_dedup_node *node;
+
+	node = kmem_cache_alloc(dedup_node_cache, GFP_NOIO | __GFP_NOWARN);
+	if (!node)
+		return;
+
+	node->page = page;
+	node->offset = offset;
+	node->checksum = checksum;
+
+	spin_lock(&rzs->dedup_lock);
+	hlist_add_head(&node->hash, rzs_dedup_bucket(rzs, checksum));
+	spin_unlock(&rzs->dedup_lock);
+}
+
+/*
+ * Drop a reference to the compressed object at <page, offset>, freeing
+ * it when the last table entry using it goes away. Returns the
+ * compressed length of the object.
+ */
+static u32 rzs_obj_put(struct ramzswap *rzs, struct page *page, u32 offset)
+{
+	u32 clen, refcount = 0;
+	struct zobj_header *zheader;
+	void *obj;
+
+	obj = kmap_atomic(page, KM_USER1) + offset;
+	zheader = obj;
+	clen = xv_get_object_size(obj) - rzs_zheader_size(rzs);
+
+	if (rzs->dedup) {
+		spin_lock(&rzs->dedup_lock);
+		refcount = --zheader->refcount;
+		if (!refcount)
+			rzs_dedup_remove(rzs, zheader->checksum, page, offset);
+		spin_unlock(&rzs->dedup_lock);
+	}
+
+	kunmap_atomic(obj, KM_USER1);
+
+	if (refcount) {
+		rzs_stat_dec(&rzs->stats.pages_dedup);
+	} else {
+		xv_free(rzs->mem_pool, page, offset);
+		rzs->stats.compr_size -= clen;
+	}
+
+	return clen;
+}
+
+/*
+ * Look for an already stored copy of the page at user_mem. Candidates
+ * come from the checksum index and are confirmed by decompressing them
+ * into the stream buffer, which is still cheaper than compressing the
+ * page. On success a reference to the object is returned in <page,
+ * offset> and its compressed length in clen.
+ *
+ * On a checksum collision 0 is returned with the reference to the
+ * candidate still held in <page, offset>. Called with user_mem mapped
+ * atomically, so the caller drops it with rzs_obj_put() once it can
+ * take the device mutex.
+ */
+static int rzs_dedup_find(struct ramzswap *rzs, struct rzs_stream *stream,
+			void *user_mem, u32 checksum, struct page **page,
+			u32 *offset, unsigned int *clen)
+{
+	int ret;
+	struct hlist_node *pos;
+	struct rzs_dedup_node *node;
+	struct zobj_header *zheader;
+	unsigned int dlen = PAGE_SIZE;
+	unsigned char *cmem;
+
+	*page = NULL;
+
+	spin_lock(&rzs->dedup_lock);
+	hlist_for_each_entry(node, pos, rzs_dedup_bucket(rzs, checksum), hash) {
+		if (node->checksum != checksum)
+			continue;
+
+		*page = node->page;
+		*offset = node->offset;
+		zheader = kmap_atomic(*page, KM_USER1) + *offset;
+		zheader->refcount++;
+		kunmap_atomic(zheader, KM_USER1);
+		break;
+	}
+	spin_unlock(&rzs->dedup_lock);
+
+	if (!*page)
+		return 0;
+
+	cmem = kmap_atomic(*page, KM_USER1) + *offset;
+	*clen = xv_get_object_size(cmem) - rzs_zheader_size(rzs);
+	ret = crypto_comp_decompress(stream->tfm,
+					cmem + rzs_zheader_size(rzs),
+					*clen, stream->buffer, &dlen);
+	kunmap_atomic(cmem, KM_USER1);
+
+	if (!ret && dlen == PAGE_SIZE &&
+			!memcmp(stream->buffer, user_mem, PAGE_SIZE))
+		return 1;
+
+	/* checksum collision */
+	return 0;
+}
+
 static void ramzswap_free_page(struct ramzswap *rzs, size_t index)
 {
 	u32 clen;
-	void *obj;
 
 	struct page *page = rzs->table[index].page;
 	u32 offset = rzs->table[index].offset;
 
+	rzs_clear_flag(rzs, index, RZS_IDLE);
+	rzs_clear_flag(rzs, index, RZS_WB);
+
+	if (rzs_test_flag(rzs, index, RZS_WRITTEN)) {
+		clear_bit(rzs->table[index].wb_index, rzs->wb_bitmap);
+		rzs_clear_flag(rzs, index, RZS_WRITTEN);
+		rzs_stat_dec(&rzs->stats.pages_backed);
+		rzs->table[index].wb_index = 0;
+		return;
+	}
+
+	if (rzs_test_flag(rzs, index, RZS_PATTERN)) {
+		rzs_clear_flag(rzs, index, RZS_PATTERN);
+		rzs_stat_dec(&rzs->stats.pages_pattern);
+		rzs->table[index].element = 0;
+		return;
+	}
+
 	if (unlikely(!page)) {
 		/*
 		 * No memory is allocated for zero filled pages.
@@ -186,29 +393,33 @@ static void ramzswap_free_page(struct ramzswap *rzs, size_t index)
 		goto out;
 	}
 
-	obj = kmap_atomic(page, KM_USER0) + offset;
-	clen = xv_get_object_size(obj) - sizeof(struct zobj_header);
-	kunmap_atomic(obj, KM_USER0);
-
-	xv_free(rzs->mem_pool, page, offset);
+	clen = rzs_obj_put(rzs, page, offset);
 	if (clen <= PAGE_SIZE / 2)
 		rzs_stat_dec(&rzs->stats.good_compress);
+	goto out_stored;
 
 out:
 	rzs->stats.compr_size -= clen;
+out_stored:
 	rzs_stat_dec(&rzs->stats.pages_stored);
 
 	rzs->table[index].page = NULL;
 	rzs->table[index].offset = 0;
 }
 
-static int handle_zero_page(struct bio *bio)
+static int handle_pattern_page(struct bio *bio, unsigned long element)
 {
-	void *user_mem;
+	unsigned int pos;
+	unsigned long *user_mem;
 	struct page *page = bio->bi_io_vec[0].bv_page;
 
 	user_mem = kmap_atomic(page, KM_USER0);
-	memset(user_mem, 0, PAGE_SIZE);
+	if (!element) {
+		memset(user_mem, 0, PAGE_SIZE);
+	} else {
+		for (pos = 0; pos != PAGE_SIZE / sizeof(*user_mem); pos++)
+			user_mem[pos] = element;
+	}
 	kunmap_atomic(user_mem, KM_USER0);
 
 	flush_dcache_page(page);
@@ -261,13 +472,93 @@ static int handle_ramzswap_fault(struct ramzswap *rzs, struct bio *bio)
 	return 0;
 }
 
+/*
+ * Get the compression stream of the current CPU. We may be preempted or
+ * migrated after choosing it, in which case the stream mutex serializes
+ * us against its other user.
+ */
+static struct rzs_stream *rzs_stream_get(struct ramzswap *rzs)
+{
+	struct rzs_stream *stream;
+
+	stream = per_cpu_ptr(rzs->streams, get_cpu());
+	put_cpu();
+
+	mutex_lock(&stream->lock);
+	return stream;
+}
+
+static void rzs_stream_put(struct rzs_stream *stream)
+{
+	mutex_unlock(&stream->lock);
+}
+
+/* Is the slot's data held in memory (as opposed to nowhere or on disk) */
+static int rzs_slot_in_ram(struct ramzswap *rzs, size_t index)
+{
+	if (rzs_test_flag(rzs, index, RZS_PATTERN) ||
+			rzs_test_flag(rzs, index, RZS_WRITTEN))
+		return 0;
+
+	return rzs->table[index].page != NULL;
+}
+
+static sector_t rzs_wb_sector(struct ramzswap *rzs, unsigned long wb_index)
+{
+	if (rzs->wb_sectors)
+		return rzs->wb_sectors[wb_index];
+
+	return (sector_t)wb_index << SECTORS_PER_PAGE_SHIFT;
+}
+
+static void rzs_bdev_read_endio(struct bio *bio, int err)
+{
+	struct bio *parent = bio->bi_private;
+
+	if (!err) {
+		flush_dcache_page(parent->bi_io_vec[0].bv_page);
+		set_bit(BIO_UPTODATE, &parent->bi_flags);
+	}
+	bio_endio(parent, err);
+	bio_put(bio);
+}
+
+/*
+ * Swap-in of a page that was written back: read it from the backing
+ * device straight into the page of the original request, which is
+ * completed when that read completes.
+ */
+static int rzs_bdev_read(struct ramzswap *rzs, struct bio *parent,
+			sector_t sector)
+{
+	struct bio *bio;
+
+	bio = bio_alloc(GFP_NOIO, 1);
+	bio->bi_bdev = rzs->wb_bdev;
+	bio->bi_sector = sector;
+	bio->bi_end_io = rzs_bdev_read_endio;
+	bio->bi_private = parent;
+
+	if (!bio_add_page(bio, parent->bi_io_vec[0].bv_page, PAGE_SIZE, 0)) {
+		bio_put(bio);
+		rzs_stat64_inc(rzs, &rzs->stats.failed_reads);
+		bio_io_error(parent);
+		return 0;
+	}
+
+	rzs_stat64_inc(rzs, &rzs->stats.bd_reads);
+	submit_bio(READ, bio);
+	return 0;
+}
+
 static int ramzswap_read(struct ramzswap *rzs, struct bio *bio)
 {
 	int ret;
 	u32 index;
-	size_t clen;
+	unsigned int clen;
+	sector_t sector;
+	struct rzs_stream *stream = NULL;
 	struct page *page;
-	struct zobj_header *zheader;
 	unsigned char *user_mem, *cmem;
 
 	rzs_stat64_inc(rzs, &rzs->stats.num_reads);
@@ -275,16 +566,50 @@ static int ramzswap_read(struct ramzswap *rzs, struct bio *bio)
 	page = bio->bi_io_vec[0].bv_page;
 	index = bio->bi_sector >> SECTORS_PER_PAGE_SHIFT;
 
-	if (rzs_test_flag(rzs, index, RZS_ZERO))
-		return handle_zero_page(bio);
+again:
+	read_lock(&rzs->table_lock);
+
+	rzs_clear_flag(rzs, index, RZS_IDLE);
+
+	if (rzs_test_flag(rzs, index, RZS_ZERO)) {
+		ret = handle_pattern_page(bio, 0);
+		goto out_unlock;
+	}
+
+	if (rzs_test_flag(rzs, index, RZS_PATTERN)) {
+		ret = handle_pattern_page(bio, rzs->table[index].element);
+		goto out_unlock;
+	}
+
+	if (rzs_test_flag(rzs, index, RZS_WRITTEN)) {
+		sector = rzs_wb_sector(rzs, rzs->table[index].wb_index);
+		read_unlock(&rzs->table_lock);
+		if (stream)
+			rzs_stream_put(stream);
+		return rzs_bdev_read(rzs, bio, sector);
+	}
 
 	/* Requested page is not present in compressed area */
-	if (!rzs->table[index].page)
-		return handle_ramzswap_fault(rzs, bio);
+	if (!rzs->table[index].page) {
+		ret = handle_ramzswap_fault(rzs, bio);
+		goto out_unlock;
+	}
 
 	/* Page is stored uncompressed since it's incompressible */
-	if (unlikely(rzs_test_flag(rzs, index, RZS_UNCOMPRESSED)))
-		return handle_uncompressed_page(rzs, bio);
+	if (unlikely(rzs_test_flag(rzs, index, RZS_UNCOMPRESSED))) {
+		ret = handle_uncompressed_page(rzs, bio);
+		goto out_unlock;
+	}
+
+	/*
+	 * Only decompression needs a stream. Its mutex can't be taken
+	 * under table_lock, and the slot may change while we wait for it.
+	 */
+	if (!stream) {
+		read_unlock(&rzs->table_lock);
+		stream = rzs_stream_get(rzs);
+		goto again;
+	}
 
 	user_mem = kmap_atomic(page, KM_USER0);
 	clen = PAGE_SIZE;
@@ -292,16 +617,19 @@ static int ramzswap_read(struct ramzswap *rzs, struct bio *bio)
 	cmem = kmap_atomic(rzs->table[index].page, KM_USER1) +
 			rzs->table[index].offset;
 
-	ret = lzo1x_decompress_safe(
-		cmem + sizeof(*zheader),
-		xv_get_object_size(cmem) - sizeof(*zheader),
+	ret = crypto_comp_decompress(stream->tfm,
+		cmem + rzs_zheader_size(rzs),
+		xv_get_object_size(cmem) - rzs_zheader_size(rzs),
 		user_mem, &clen);
 
 	kunmap_atomic(user_mem, KM_USER0);
 	kunmap_atomic(cmem, KM_USER1);
 
+	read_unlock(&rzs->table_lock);
+	rzs_stream_put(stream);
+
 	/* should NEVER happen */
-	if (unlikely(ret != LZO_E_OK)) {
+	if (unlikely(ret || clen != PAGE_SIZE)) {
 		pr_err("Decompression failed! err=%d, page=%u\n",
 			ret, index);
 		rzs_stat64_inc(rzs, &rzs->stats.failed_reads);
@@ -317,15 +645,23 @@ static int ramzswap_read(struct ramzswap *rzs, struct bio *bio)
 out:
 	bio_io_error(bio);
 	return 0;
+
+out_unlock:
+	read_unlock(&rzs->table_lock);
+	if (stream)
+		rzs_stream_put(stream);
+	return ret;
 }
 
 static int ramzswap_write(struct ramzswap *rzs, struct bio *bio)
 {
-	int ret;
-	u32 offset, index;
-	size_t clen;
+	int ret, wb_kick = 0;
+	u32 offset, index, checksum = 0;
+	unsigned int clen;
+	unsigned long element;
 	struct zobj_header *zheader;
-	struct page *page, *page_store;
+	struct rzs_stream *stream;
+	struct page *page, *page_store = NULL, *page_dup = NULL;
 	unsigned char *user_mem, *cmem, *src;
 
 	rzs_stat64_inc(rzs, &rzs->stats.num_writes);
@@ -333,29 +669,70 @@ static int ramzswap_write(struct ramzswap *rzs, struct bio *bio)
 	page = bio->bi_io_vec[0].bv_page;
 	index = bio->bi_sector >> SECTORS_PER_PAGE_SHIFT;
 
-	src = rzs->compress_buffer;
-
-	mutex_lock(&rzs->lock);
+	stream = rzs_stream_get(rzs);
+	src = stream->buffer;
 
 	user_mem = kmap_atomic(page, KM_USER0);
-	if (page_zero_filled(user_mem)) {
+	if (page_same_filled(user_mem, &element)) {
 		kunmap_atomic(user_mem, KM_USER0);
+		rzs_stream_put(stream);
+
+		mutex_lock(&rzs->lock);
+		/* Need to free the previous page, if any */
+		ramzswap_free_page(rzs, index);
+		if (!element) {
+			rzs_stat_inc(&rzs->stats.pages_zero);
+			rzs_set_flag(rzs, index, RZS_ZERO);
+		} else {
+			rzs_stat_inc(&rzs->stats.pages_pattern);
+			rzs_set_flag(rzs, index, RZS_PATTERN);
+			rzs->table[index].element = element;
+		}
 		mutex_unlock(&rzs->lock);
-		rzs_stat_inc(&rzs->stats.pages_zero);
-		rzs_set_flag(rzs, index, RZS_ZERO);
 
 		set_bit(BIO_UPTODATE, &bio->bi_flags);
 		bio_endio(bio, 0);
 		return 0;
 	}
 
-	ret = lzo1x_1_compress(user_mem, PAGE_SIZE, src, &clen,
-				rzs->compress_workmem);
+	if (rzs->dedup) {
+		checksum = jhash2((u32 *)user_mem, PAGE_SIZE / sizeof(u32), 0);
+		if (rzs_dedup_find(rzs, stream, user_mem, checksum,
+					&page_dup, &offset, &clen)) {
+			kunmap_atomic(user_mem, KM_USER0);
+			rzs_stream_put(stream);
+
+			mutex_lock(&rzs->lock);
+			ramzswap_free_page(rzs, index);
+			rzs->table[index].page = page_dup;
+			rzs->table[index].offset = offset;
+			rzs_stat_inc(&rzs->stats.pages_dedup);
+			rzs_stat_inc(&rzs->stats.pages_stored);
+			if (clen <= PAGE_SIZE / 2)
+				rzs_stat_inc(&rzs->stats.good_compress);
+			mutex_unlock(&rzs->lock);
+
+			set_bit(BIO_UPTODATE, &bio->bi_flags);
+			bio_endio(bio, 0);
+			return 0;
+		}
+	}
+
+	clen = 2 * PAGE_SIZE;
+	ret = crypto_comp_compress(stream->tfm, user_mem, PAGE_SIZE,
+					src, &clen);
 
 	kunmap_atomic(user_mem, KM_USER0);
 
-	if (unlikely(ret != LZO_E_OK)) {
+	/* Drop the candidate of a checksum collision, see rzs_dedup_find() */
+	if (unlikely(page_dup)) {
+		mutex_lock(&rzs->lock);
+		rzs_obj_put(rzs, page_dup, offset);
 		mutex_unlock(&rzs->lock);
+	}
+
+	if (unlikely(ret)) {
+		rzs_stream_put(stream);
 		pr_err("Compression failed! err=%d\n", ret);
 		rzs_stat64_inc(rzs, &rzs->stats.failed_writes);
 		goto out;
@@ -370,13 +747,20 @@ static int ramzswap_write(struct ramzswap *rzs, struct bio *bio)
 		clen = PAGE_SIZE;
 		page_store = alloc_page(GFP_NOIO | __GFP_HIGHMEM);
 		if (unlikely(!page_store)) {
-			mutex_unlock(&rzs->lock);
+			rzs_stream_put(stream);
 			pr_info("Error allocating memory for incompressible "
 				"page: %u\n", index);
 			rzs_stat64_inc(rzs, &rzs->stats.failed_writes);
 			goto out;
 		}
+	}
 
+	mutex_lock(&rzs->lock);
+
+	/* Need to free the previous page, if any */
+	ramzswap_free_page(rzs, index);
+
+	if (unlikely(page_store)) {
 		offset = 0;
 		rzs_set_flag(rzs, index, RZS_UNCOMPRESSED);
 		rzs_stat_inc(&rzs->stats.pages_expand);
@@ -385,12 +769,13 @@ static int ramzswap_write(struct ramzswap *rzs, struct bio *bio)
 		goto memstore;
 	}
 
-	if (xv_malloc(rzs->mem_pool, clen + sizeof(*zheader),
+	if (xv_malloc(rzs->mem_pool, clen + rzs_zheader_size(rzs),
 			&rzs->table[index].page, &offset,
 			GFP_NOIO | __GFP_HIGHMEM)) {
 		mutex_unlock(&rzs->lock);
+		rzs_stream_put(stream);
 		pr_info("Error allocating memory for compressed "
-			"page: %u, size=%zu\n", index, clen);
+			"page: %u, size=%u\n", index, clen);
 		rzs_stat64_inc(rzs, &rzs->stats.failed_writes);
 		goto out;
 	}
@@ -401,20 +786,24 @@ memstore:
 	cmem = kmap_atomic(rzs->table[index].page, KM_USER1) +
 			rzs->table[index].offset;
 
-#if 0
-	/* Back-reference needed for memory defragmentation */
 	if (!rzs_test_flag(rzs, index, RZS_UNCOMPRESSED)) {
 		zheader = (struct zobj_header *)cmem;
+		/* Back-reference needed for memory defragmentation */
 		zheader->table_idx = index;
-		cmem += sizeof(*zheader);
+		if (rzs->dedup) {
+			zheader->checksum = checksum;
+			zheader->refcount = 1;
+		}
+		cmem += rzs_zheader_size(rzs);
 	}
-#endif
 
 	memcpy(cmem, src, clen);
 
 	kunmap_atomic(cmem, KM_USER1);
 	if (unlikely(rzs_test_flag(rzs, index, RZS_UNCOMPRESSED)))
 		kunmap_atomic(src, KM_USER0);
+	else if (rzs->dedup)
+		rzs_dedup_insert(rzs, checksum, rzs->table[index].page, offset);
 
 	/* Update stats */
 	rzs->stats.compr_size += clen;
@@ -422,7 +811,21 @@ memstore:
 	if (clen <= PAGE_SIZE / 2)
 		rzs_stat_inc(&rzs->stats.good_compress);
 
+	/* incompressible pages go to the backing device right away */
+	if (unlikely(page_store) && rzs->wb_thread) {
+		if (kfifo_in(&rzs->wb_queue, &index, sizeof(index)) !=
+				sizeof(index))
+			rzs->wb_overflow = 1;
+		wb_kick = 1;
+	}
+
 	mutex_unlock(&rzs->lock);
+	rzs_stream_put(stream);
+
+	if (wb_kick) {
+		rzs->wb_kick = 1;
+		wake_up(&rzs->wb_wait);
+	}
 
 	set_bit(BIO_UPTODATE, &bio->bi_flags);
 	bio_endio(bio, 0);
@@ -433,6 +836,484 @@ out:
 	return 0;
 }
 
+static void rzs_bdev_write_endio(struct bio *bio, int err)
+{
+	complete(bio->bi_private);
+}
+
+static int rzs_bdev_write(struct ramzswap *rzs, struct page *page,
+			unsigned long wb_index)
+{
+	int ret;
+	struct bio *bio;
+	DECLARE_COMPLETION_ONSTACK(done);
+
+	bio = bio_alloc(GFP_NOIO, 1);
+	bio->bi_bdev = rzs->wb_bdev;
+	bio->bi_sector = rzs_wb_sector(rzs, wb_index);
+	bio->bi_end_io = rzs_bdev_write_endio;
+	bio->bi_private = &done;
+
+	if (!bio_add_page(bio, page, PAGE_SIZE, 0)) {
+		bio_put(bio);
+		return -EIO;
+	}
+
+	submit_bio(WRITE, bio);
+	wait_for_completion(&done);
+
+	ret = test_bit(BIO_UPTODATE, &bio->bi_flags) ? 0 : -EIO;
+	bio_put(bio);
+
+	return ret;
+}
+
+/* Only the writeback thread allocates, so a search hint is enough */
+static unsigned long rzs_wb_alloc(struct ramzswap *rzs)
+{
+	unsigned long wb_index;
+
+	wb_index = find_next_zero_bit(rzs->wb_bitmap, rzs->wb_nr_pages,
+					rzs->wb_hint);
+	if (wb_index >= rzs->wb_nr_pages)
+		wb_index = find_first_zero_bit(rzs->wb_bitmap,
+						rzs->wb_nr_pages);
+	if (wb_index >= rzs->wb_nr_pages)
+		return ULONG_MAX;
+
+	set_bit(wb_index, rzs->wb_bitmap);
+	rzs->wb_hint = wb_index + 1;
+	return wb_index;
+}
+
+/*
+ * Move the page in the given slot to the backing device. The page is
+ * copied out under the locks and written without them. The slot is then
+ * switched over to the backing device only if, in the meantime, it was
+ * not freed or rewritten (both clear RZS_WB) and, for idle writeback,
+ * not read (which clears RZS_IDLE).
+ */
+static int rzs_writeback_slot(struct ramzswap *rzs, size_t index, int idle)
+{
+	int ret = 0;
+	u32 offset;
+	unsigned long wb_index;
+	unsigned int clen = PAGE_SIZE;
+	struct rzs_stream *stream;
+	struct page *page;
+	unsigned char *src, *dst;
+
+	stream = rzs_stream_get(rzs);
+	mutex_lock(&rzs->lock);
+
+	if (!rzs_slot_in_ram(rzs, index) ||
+			(idle && !rzs_test_flag(rzs, index, RZS_IDLE))) {
+		mutex_unlock(&rzs->lock);
+		rzs_stream_put(stream);
+		return 0;
+	}
+
+	page = rzs->table[index].page;
+	offset = rzs->table[index].offset;
+
+	/* Reads update flags under the read lock, so exclude them */
+	write_lock(&rzs->table_lock);
+	rzs_set_flag(rzs, index, RZS_WB);
+	write_unlock(&rzs->table_lock);
+
+	read_lock(&rzs->table_lock);
+	dst = kmap_atomic(rzs->wb_buf, KM_USER0);
+	src = kmap_atomic(page, KM_USER1) + offset;
+	if (rzs_test_flag(rzs, index, RZS_UNCOMPRESSED))
+		memcpy(dst, src, PAGE_SIZE);
+	else
+		ret = crypto_comp_decompress(stream->tfm,
+			src + rzs_zheader_size(rzs),
+			xv_get_object_size(src) - rzs_zheader_size(rzs),
+			dst, &clen);
+	kunmap_atomic(src, KM_USER1);
+	kunmap_atomic(dst, KM_USER0);
+	read_unlock(&rzs->table_lock);
+
+	mutex_unlock(&rzs->lock);
+	rzs_stream_put(stream);
+
+	if (ret || clen != PAGE_SIZE) {
+		ret = -EIO;
+		goto out;
+	}
+
+	wb_index = rzs_wb_alloc(rzs);
+	if (wb_index == ULONG_MAX) {
+		ret = -ENOSPC;
+		goto out;
+	}
+
+	ret = rzs_bdev_write(rzs, rzs->wb_buf, wb_index);
+	if (ret) {
+		clear_bit(wb_index, rzs->wb_bitmap);
+		goto out;
+	}
+	rzs_stat64_inc(rzs, &rzs->stats.bd_writes);
+
+	mutex_lock(&rzs->lock);
+	write_lock(&rzs->table_lock);
+	if (rzs_test_flag(rzs, index, RZS_WB) &&
+			(!idle || rzs_test_flag(rzs, index, RZS_IDLE)) &&
+			rzs->table[index].page == page &&
+			rzs->table[index].offset == offset) {
+		ramzswap_free_page(rzs, index);
+		rzs->table[index].wb_index = wb_index;
+		rzs_set_flag(rzs, index, RZS_WRITTEN);
+		rzs_stat_inc(&rzs->stats.pages_backed);
+	} else {
+		clear_bit(wb_index, rzs->wb_bitmap);
+	}
+	write_unlock(&rzs->table_lock);
+	mutex_unlock(&rzs->lock);
+	return 0;
+
+out:
+	mutex_lock(&rzs->lock);
+	write_lock(&rzs->table_lock);
+	rzs_clear_flag(rzs, index, RZS_WB);
+	write_unlock(&rzs->table_lock);
+	mutex_unlock(&rzs->lock);
+	return ret;
+}
+
+/*
+ * Write back every incompressible page or, for an idle scan, every page
+ * not accessed since the previous idle scan, and mark all pages that
+ * stay in memory idle for the next one.
+ */
+static void rzs_writeback_scan(struct ramzswap *rzs, int idle)
+{
+	size_t index;
+	int full = 0;
+
+	/* Slot 0 is the swap header */
+	for (index = 1; index < rzs->disksize >> PAGE_SHIFT; index++) {
+		if (kthread_should_stop())
+			break;
+
+		if (!rzs_slot_in_ram(rzs, index))
+			continue;
+
+		if (!full && (idle ? rzs_test_flag(rzs, index, RZS_IDLE) :
+			rzs_test_flag(rzs, index, RZS_UNCOMPRESSED))) {
+			if (rzs_writeback_slot(rzs, index, idle) == -ENOSPC)
+				full = 1;
+		}
+
+		if (idle) {
+			mutex_lock(&rzs->lock);
+			write_lock(&rzs->table_lock);
+			if (rzs_slot_in_ram(rzs, index))
+				rzs_set_flag(rzs, index, RZS_IDLE);
+			write_unlock(&rzs->table_lock);
+			mutex_unlock(&rzs->lock);
+		} else if (full) {
+			break;
+		}
+
+		cond_resched();
+	}
+}
+
+/*
+ * Write back the incompressible pages queued by ramzswap_write(), or
+ * all of them if some could not be queued.
+ */
+static void rzs_writeback_queued(struct ramzswap *rzs)
+{
+	u32 index;
+	int overflow;
+
+	while (!kthread_should_stop()) {
+		mutex_lock(&rzs->lock);
+		if (kfifo_out(&rzs->wb_queue, &index, sizeof(index)) !=
+				sizeof(index)) {
+			overflow = rzs->wb_overflow;
+			rzs->wb_overflow = 0;
+			mutex_unlock(&rzs->lock);
+
+			if (overflow)
+				rzs_writeback_scan(rzs, 0);
+			return;
+		}
+		mutex_unlock(&rzs->lock);
+
+		/* The slot may have been rewritten since it was queued */
+		if (!rzs_test_flag(rzs, index, RZS_UNCOMPRESSED))
+			continue;
+
+		if (rzs_writeback_slot(rzs, index, 0) == -ENOSPC) {
+			mutex_lock(&rzs->lock);
+			kfifo_reset(&rzs->wb_queue);
+			rzs->wb_overflow = 0;
+			mutex_unlock(&rzs->lock);
+			return;
+		}
+
+		cond_resched();
+	}
+}
+
+static int rzs_writeback_thread(void *data)
+{
+	struct ramzswap *rzs = data;
+	unsigned long next_idle_scan = jiffies + rzs->idle_age * HZ;
+
+	set_freezable();
+
+	while (!kthread_should_stop()) {
+		long timeout = MAX_SCHEDULE_TIMEOUT;
+
+		if (rzs->idle_age)
+			timeout = max_t(long, next_idle_scan - jiffies, 0);
+
+		wait_event_freezable_timeout(rzs->wb_wait,
+			rzs->wb_kick || kthread_should_stop(), timeout);
+
+		if (rzs->wb_kick) {
+			rzs->wb_kick = 0;
+			rzs_writeback_queued(rzs);
+		}
+
+		if (rzs->idle_age && time_after_eq(jiffies, next_idle_scan)) {
+			rzs_writeback_scan(rzs, 1);
+			next_idle_scan = jiffies + rzs->idle_age * HZ;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * An object can be moved if exactly one table entry uses it, the one
+ * its back-reference points to. Objects shared by deduplication, or
+ * whose first user went away, are left alone.
+ */
+static int rzs_obj_movable(struct ramzswap *rzs, struct page *page,
+			u32 offset, u32 *index)
+{
+	int ret = 0;
+	struct zobj_header *zheader;
+
+	zheader = kmap_atomic(page, KM_USER0) + offset;
+	*index = zheader->table_idx;
+
+	if ((!rzs->dedup || zheader->refcount == 1) &&
+			*index < rzs->disksize >> PAGE_SHIFT &&
+			rzs_slot_in_ram(rzs, *index) &&
+			!rzs_test_flag(rzs, *index, RZS_UNCOMPRESSED) &&
+			rzs->table[*index].page == page &&
+			rzs->table[*index].offset == offset)
+		ret = 1;
+
+	kunmap_atomic(zheader, KM_USER0);
+	return ret;
+}
+
+/*
+ * Move all objects out of an isolated xvmalloc page. Called with the
+ * device mutex, table_lock and dedup_lock held, so that neither the
+ * table nor the object refcounts change meanwhile.
+ *
+ * Returns 1 if the page was freed, 0 if it could not be emptied and
+ * -ENOMEM if there was no room left in the other pages of the pool.
+ */
+static int rzs_compact_page(struct ramzswap *rzs, struct page *page)
+{
+	int ret = 0;
+	u32 index, offset, size, newoffset;
+	struct page *newpage;
+	struct zobj_header *zheader;
+	void *src, *dst;
+
+	/* Do not move anything unless the whole page can be freed */
+	for (offset = xv_next_object(rzs->mem_pool, page, 0); offset;
+	     offset = xv_next_object(rzs->mem_pool, page, offset + 1)) {
+		if (!rzs_obj_movable(rzs, page, offset, &index))
+			goto out;
+	}
+
+	while ((offset = xv_next_object(rzs->mem_pool, page, 0))) {
+		rzs_obj_movable(rzs, page, offset, &index);
+
+		src = kmap_atomic(page, KM_USER0) + offset;
+		size = xv_get_object_size(src);
+		kunmap_atomic(src, KM_USER0);
+
+		/* Never grow the pool here: only use existing free space */
+		if (xv_malloc(rzs->mem_pool, size, &newpage, &newoffset,
+				GFP_NOWAIT)) {
+			ret = -ENOMEM;
+			goto out;
+		}
+
+		src = kmap_atomic(page, KM_USER0) + offset;
+		dst = kmap_atomic(newpage, KM_USER1) + newoffset;
+		memcpy(dst, src, size);
+		zheader = dst;
+		if (rzs->dedup)
+			rzs_dedup_move(rzs, zheader->checksum, page, offset,
+					newpage, newoffset);
+		kunmap_atomic(dst, KM_USER1);
+		kunmap_atomic(src, KM_USER0);
+
+		rzs->table[index].page = newpage;
+		rzs->table[index].offset = newoffset;
+		xv_free(rzs->mem_pool, page, offset);
+		rzs_stat64_inc(rzs, &rzs->stats.objs_compacted);
+	}
+
+out:
+	if (xv_putback_page(rzs->mem_pool, page)) {
+		rzs_stat64_inc(rzs, &rzs->stats.pages_compacted);
+		return 1;
+	}
+
+	return ret;
+}
+
+/*
+ * Free sparsely used xvmalloc pages by moving their objects to other
+ * pages of the pool. Looks at no more than nr_scan pages, one at a time
+ * so that swap I/O is only held off for the duration of a single page.
+ * The shrinker must not wait for the device mutex as it may be called
+ * from an allocation done with it held.
+ *
+ * Some pages can never be emptied (shared objects, or objects that only
+ * fit in another sparse page) and keep coming back in the round-robin,
+ * so the pass also stops after a full round of the pool freed nothing.
+ *
+ * Returns the number of pages freed.
+ */
+static unsigned long rzs_compact(struct ramzswap *rzs, unsigned long nr_scan,
+				int trylock)
+{
+	int ret;
+	unsigned long freed = 0, scanned = 0, nr_pages, prev_scan;
+	struct page *page;
+
+	while (nr_scan) {
+		if (!trylock)
+			mutex_lock(&rzs->lock);
+		else if (!mutex_trylock(&rzs->lock))
+			break;
+
+		if (!rzs->init_done) {
+			mutex_unlock(&rzs->lock);
+			break;
+		}
+
+		nr_pages = xv_get_total_size_bytes(rzs->mem_pool) >> PAGE_SHIFT;
+		if (scanned >= nr_pages) {
+			mutex_unlock(&rzs->lock);
+			break;
+		}
+
+		prev_scan = nr_scan;
+		page = xv_isolate_page(rzs->mem_pool, compact_max_used,
+					&nr_scan);
+		scanned += prev_scan - nr_scan;
+		if (!page) {
+			mutex_unlock(&rzs->lock);
+			break;
+		}
+
+		write_lock(&rzs->table_lock);
+		spin_lock(&rzs->dedup_lock);
+		ret = rzs_compact_page(rzs, page);
+		spin_unlock(&rzs->dedup_lock);
+		write_unlock(&rzs->table_lock);
+		mutex_unlock(&rzs->lock);
+
+		if (ret < 0)
+			break;
+		if (ret) {
+			freed += ret;
+			scanned = 0;
+		}
+
+		cond_resched();
+	}
+
+	return freed;
+}
+
+/* Pages that compaction could free at best */
+static unsigned long rzs_compactable_pages(struct ramzswap *rzs)
+{
+	unsigned long total, used, nr = 0;
+
+	if (!mutex_trylock(&rzs->lock))
+		return 0;
+
+	if (rzs->init_done) {
+		total = xv_get_total_size_bytes(rzs->mem_pool) >> PAGE_SHIFT;
+		used = DIV_ROUND_UP(xv_get_used_size_bytes(rzs->mem_pool),
+					PAGE_SIZE);
+		if (total > used)
+			nr = total - used;
+	}
+
+	mutex_unlock(&rzs->lock);
+	return nr;
+}
+
+static int rzs_shrink(struct shrinker *shrinker, int nr_to_scan,
+			gfp_t gfp_mask)
+{
+	int i;
+	unsigned long nr = 0;
+
+	for (i = 0; i < num_devices; i++) {
+		if (nr_to_scan)
+			rzs_compact(&devices[i], nr_to_scan, 1);
+		nr += rzs_compactable_pages(&devices[i]);
+	}
+
+	return min_t(unsigned long, nr, INT_MAX);
+}
+
+static struct shrinker rzs_shrinker = {
+	.shrink = rzs_shrink,
+	.seeks = DEFAULT_SEEKS,
+};
+
+static ssize_t compact_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	struct ramzswap *rzs = dev_to_disk(dev)->private_data;
+	unsigned long nr_pages;
+
+	mutex_lock(&rzs->lock);
+	if (!rzs->init_done) {
+		mutex_unlock(&rzs->lock);
+		return -ENXIO;
+	}
+	nr_pages = xv_get_total_size_bytes(rzs->mem_pool) >> PAGE_SHIFT;
+	mutex_unlock(&rzs->lock);
+
+	/* A single pass over the pool */
+	rzs_compact(rzs, nr_pages, 0);
+	return len;
+}
+
+static DEVICE_ATTR(compact, S_IWUSR, NULL, compact_store);
+
+static struct attribute *ramzswap_disk_attrs[] = {
+	&dev_attr_compact.attr,
+	NULL,
+};
+
+static struct attribute_group ramzswap_disk_attr_group = {
+	.attrs = ramzswap_disk_attrs,
+};
+
 /*
  * Check if request is within bounds and page aligned.
  */
@@ -484,25 +1365,264 @@ static int ramzswap_make_request(struct request_queue *queue, struct bio *bio)
 	return ret;
 }
 
+static void rzs_free_streams(struct ramzswap *rzs)
+{
+	unsigned int cpu;
+
+	if (!rzs->streams)
+		return;
+
+	for_each_possible_cpu(cpu) {
+		struct rzs_stream *stream = per_cpu_ptr(rzs->streams, cpu);
+
+		if (stream->tfm)
+			crypto_free_comp(stream->tfm);
+		free_pages((unsigned long)stream->buffer, 1);
+	}
+
+	free_percpu(rzs->streams);
+	rzs->streams = NULL;
+}
+
+static int rzs_alloc_streams(struct ramzswap *rzs)
+{
+	unsigned int cpu;
+
+	rzs->streams = alloc_percpu(struct rzs_stream);
+	if (!rzs->streams)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu) {
+		struct rzs_stream *stream = per_cpu_ptr(rzs->streams, cpu);
+
+		mutex_init(&stream->lock);
+		stream->buffer = (void *)__get_free_pages(GFP_KERNEL |
+							__GFP_ZERO, 1);
+		if (!stream->buffer)
+			return -ENOMEM;
+
+		stream->tfm = crypto_alloc_comp(rzs->compressor, 0, 0);
+		if (IS_ERR(stream->tfm)) {
+			int ret = PTR_ERR(stream->tfm);
+
+			stream->tfm = NULL;
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Map every page of a backing file to its on-disk sector, the same way
+ * swapon does it. Pages that are not PAGE_SIZE aligned and contiguous on
+ * disk are skipped.
+ */
+static int rzs_map_backing_file(struct ramzswap *rzs, struct inode *inode)
+{
+	unsigned blkbits = inode->i_blkbits;
+	unsigned blocks_per_page = PAGE_SIZE >> blkbits;
+	sector_t probe_block = 0;
+	sector_t last_block = i_size_read(inode) >> blkbits;
+	unsigned long nr_pages = 0;
+
+	rzs->wb_sectors = vmalloc((last_block / blocks_per_page) *
+					sizeof(*rzs->wb_sectors));
+	if (!rzs->wb_sectors)
+		return -ENOMEM;
+
+	while (probe_block + blocks_per_page <= last_block) {
+		unsigned block_in_page;
+		sector_t first_block;
+
+		first_block = bmap(inode, probe_block);
+		if (!first_block)
+			return -EINVAL;
+
+		if (first_block & (blocks_per_page - 1)) {
+			probe_block++;
+			continue;
+		}
+
+		for (block_in_page = 1; block_in_page < blocks_per_page;
+					block_in_page++) {
+			sector_t block;
+
+			block = bmap(inode, probe_block + block_in_page);
+			if (!block)
+				return -EINVAL;
+			if (block != first_block + block_in_page)
+				break;
+		}
+		if (block_in_page != blocks_per_page) {
+			probe_block++;
+			continue;
+		}
+
+		rzs->wb_sectors[nr_pages++] = first_block << (blkbits - 9);
+		probe_block += blocks_per_page;
+	}
+
+	rzs->wb_nr_pages = nr_pages;
+	return 0;
+}
+
+static void rzs_backing_close(struct ramzswap *rzs)
+{
+	if (rzs->wb_thread) {
+		kthread_stop(rzs->wb_thread);
+		rzs->wb_thread = NULL;
+	}
+
+	if (rzs->wb_file) {
+		struct inode *inode = rzs->wb_file->f_mapping->host;
+
+		if (S_ISBLK(inode->i_mode)) {
+			bd_release(rzs->wb_bdev);
+		} else {
+			mutex_lock(&inode->i_mutex);
+			inode->i_flags &= ~S_SWAPFILE;
+			mutex_unlock(&inode->i_mutex);
+		}
+		filp_close(rzs->wb_file, NULL);
+		rzs->wb_file = NULL;
+	}
+	rzs->wb_bdev = NULL;
+
+	vfree(rzs->wb_sectors);
+	rzs->wb_sectors = NULL;
+	vfree(rzs->wb_bitmap);
+	rzs->wb_bitmap = NULL;
+	if (rzs->wb_buf) {
+		__free_page(rzs->wb_buf);
+		rzs->wb_buf = NULL;
+	}
+	kfifo_free(&rzs->wb_queue);
+
+	rzs->wb_nr_pages = 0;
+	rzs->wb_hint = 0;
+	rzs->wb_kick = 0;
+	rzs->wb_overflow = 0;
+}
+
+static int rzs_backing_open(struct ramzswap *rzs)
+{
+	int ret;
+	size_t bitmap_size;
+	struct file *file;
+	struct inode *inode;
+
+	file = filp_open(rzs->backing_path, O_RDWR | O_LARGEFILE, 0);
+	if (IS_ERR(file)) {
+		pr_err("Error opening backing device %s\n", rzs->backing_path);
+		return PTR_ERR(file);
+	}
+	inode = file->f_mapping->host;
+
+	if (S_ISBLK(inode->i_mode)) {
+		struct block_device *bdev = I_BDEV(inode);
+
+		ret = bd_claim(bdev, rzs);
+		if (ret) {
+			pr_err("Backing device %s is busy\n",
+				rzs->backing_path);
+			filp_close(file, NULL);
+			return ret;
+		}
+		rzs->wb_file = file;
+		rzs->wb_bdev = bdev;
+		rzs->wb_nr_pages = i_size_read(inode) >> PAGE_SHIFT;
+	} else if (S_ISREG(inode->i_mode)) {
+		mutex_lock(&inode->i_mutex);
+		if (IS_SWAPFILE(inode)) {
+			mutex_unlock(&inode->i_mutex);
+			pr_err("Backing file %s is busy\n", rzs->backing_path);
+			filp_close(file, NULL);
+			return -EBUSY;
+		}
+		inode->i_flags |= S_SWAPFILE;
+		mutex_unlock(&inode->i_mutex);
+
+		rzs->wb_file = file;
+		rzs->wb_bdev = inode->i_sb->s_bdev;
+		if (i_size_read(inode) < PAGE_SIZE) {
+			pr_err("Backing device %s is too small\n",
+				rzs->backing_path);
+			ret = -EINVAL;
+			goto fail;
+		}
+		ret = rzs_map_backing_file(rzs, inode);
+		if (ret) {
+			pr_err("Backing file %s has holes\n",
+				rzs->backing_path);
+			goto fail;
+		}
+	} else {
+		pr_err("%s is not a block device or regular file\n",
+			rzs->backing_path);
+		filp_close(file, NULL);
+		return -EINVAL;
+	}
+
+	if (!rzs->wb_nr_pages) {
+		pr_err("Backing device %s is too small\n", rzs->backing_path);
+		ret = -EINVAL;
+		goto fail;
+	}
+
+	bitmap_size = BITS_TO_LONGS(rzs->wb_nr_pages) * sizeof(long);
+	rzs->wb_bitmap = vmalloc(bitmap_size);
+	rzs->wb_buf = alloc_page(GFP_KERNEL);
+	if (!rzs->wb_bitmap || !rzs->wb_buf ||
+			kfifo_alloc(&rzs->wb_queue, wb_queue_len * sizeof(u32),
+					GFP_KERNEL)) {
+		ret = -ENOMEM;
+		goto fail;
+	}
+	memset(rzs->wb_bitmap, 0, bitmap_size);
+
+	rzs->wb_thread = kthread_run(rzs_writeback_thread, rzs, "%s_wb",
+					rzs->disk->disk_name);
+	if (IS_ERR(rzs->wb_thread)) {
+		ret = PTR_ERR(rzs->wb_thread);
+		rzs->wb_thread = NULL;
+		goto fail;
+	}
+
+	pr_info("Using %s as backing device (%lu pages)\n",
+		rzs->backing_path, rzs->wb_nr_pages);
+	return 0;
+
+fail:
+	rzs_backing_close(rzs);
+	return ret;
+}
+
 static void reset_device(struct ramzswap *rzs)
 {
 	size_t index;
 
-	/* Do not accept any new I/O request */
+	/* Do not accept any new I/O request, nor compaction */
+	mutex_lock(&rzs->lock);
 	rzs->init_done = 0;
+	mutex_unlock(&rzs->lock);
 
-	/* Free various per-device buffers */
-	kfree(rzs->compress_workmem);
-	free_pages((unsigned long)rzs->compress_buffer, 1);
+	/* Stop writeback before tearing down the table */
+	rzs_backing_close(rzs);
 
-	rzs->compress_workmem = NULL;
-	rzs->compress_buffer = NULL;
+	/* Free various per-device buffers */
+	rzs_free_streams(rzs);
 
 	/* Free all pages that are still in this ramzswap device */
-	for (index = 0; index < rzs->disksize >> PAGE_SHIFT; index++) {
+	for (index = 0; rzs->table &&
+			index < rzs->disksize >> PAGE_SHIFT; index++) {
 		struct page *page;
 		u16 offset;
 
+		if (rzs_test_flag(rzs, index, RZS_PATTERN) ||
+				rzs_test_flag(rzs, index, RZS_WRITTEN))
+			continue;
+
 		page = rzs->table[index].page;
 		offset = rzs->table[index].offset;
 
@@ -512,12 +1632,15 @@ static void reset_device(struct ramzswap *rzs)
 		if (unlikely(rzs_test_flag(rzs, index, RZS_UNCOMPRESSED)))
 			__free_page(page);
 		else
-			xv_free(rzs->mem_pool, page, offset);
+			rzs_obj_put(rzs, page, offset);
 	}
 
 	vfree(rzs->table);
 	rzs->table = NULL;
 
+	vfree(rzs->dedup_table);
+	rzs->dedup_table = NULL;
+
 	xv_destroy_pool(rzs->mem_pool);
 	rzs->mem_pool = NULL;
 
@@ -525,6 +1648,8 @@ static void reset_device(struct ramzswap *rzs)
 	memset(&rzs->stats, 0, sizeof(rzs->stats));
 
 	rzs->disksize = 0;
+	rzs->backing_path[0] = '\0';
+	rzs->idle_age = 0;
 }
 
 static int ramzswap_ioctl_init_device(struct ramzswap *rzs)
@@ -541,17 +1666,10 @@ static int ramzswap_ioctl_init_device(struct ramzswap *rzs)
 
 	ramzswap_set_disksize(rzs, totalram_pages << PAGE_SHIFT);
 
-	rzs->compress_workmem = kzalloc(LZO1X_MEM_COMPRESS, GFP_KERNEL);
-	if (!rzs->compress_workmem) {
-		pr_err("Error allocating compressor working memory!\n");
-		ret = -ENOMEM;
-		goto fail;
-	}
-
-	rzs->compress_buffer = (void *)__get_free_pages(__GFP_ZERO, 1);
-	if (!rzs->compress_buffer) {
-		pr_err("Error allocating compressor buffer space\n");
-		ret = -ENOMEM;
+	ret = rzs_alloc_streams(rzs);
+	if (ret) {
+		pr_err("Error allocating %s compression streams\n",
+			rzs->compressor);
 		goto fail;
 	}
 
@@ -566,6 +1684,23 @@ static int ramzswap_ioctl_init_device(struct ramzswap *rzs)
 	}
 	memset(rzs->table, 0, num_pages * sizeof(*rzs->table));
 
+	rzs->dedup = dedup;
+	if (rzs->dedup) {
+		size_t i;
+
+		/* about one bucket per four swap slots */
+		rzs->dedup_shift = ilog2(max_t(size_t, num_pages >> 2, 256));
+		rzs->dedup_table = vmalloc(sizeof(*rzs->dedup_table) <<
+						rzs->dedup_shift);
+		if (!rzs->dedup_table) {
+			pr_err("Error allocating deduplication index\n");
+			ret = -ENOMEM;
+			goto fail;
+		}
+		for (i = 0; i < 1 << rzs->dedup_shift; i++)
+			INIT_HLIST_HEAD(&rzs->dedup_table[i]);
+	}
+
 	page = alloc_page(__GFP_ZERO);
 	if (!page) {
 		pr_err("Error allocating swap header page\n");
@@ -591,6 +1726,12 @@ static int ramzswap_ioctl_init_device(struct ramzswap *rzs)
 		goto fail;
 	}
 
+	if (rzs->backing_path[0]) {
+		ret = rzs_backing_open(rzs);
+		if (ret)
+			goto fail;
+	}
+
 	rzs->init_done = 1;
 
 	pr_debug("Initialization done!\n");
@@ -611,6 +1752,18 @@ static int ramzswap_ioctl_reset_device(struct ramzswap *rzs)
 	return 0;
 }
 
+static int ramzswap_set_compressor(struct ramzswap *rzs, const char *name)
+{
+	if (!crypto_has_comp(name, 0, 0)) {
+		pr_info("Unknown compressor: %s\n", name);
+		return -EINVAL;
+	}
+
+	strlcpy(rzs->compressor, name, sizeof(rzs->compressor));
+	pr_info("Compressor set to %s\n", rzs->compressor);
+	return 0;
+}
+
 static int ramzswap_ioctl(struct block_device *bdev, fmode_t mode,
 			unsigned int cmd, unsigned long arg)
 {
@@ -655,6 +1808,68 @@ static int ramzswap_ioctl(struct block_device *bdev, fmode_t mode,
 		kfree(stats);
 		break;
 	}
+	case RZSIO_GET_STATS_EXT:
+	{
+		struct ramzswap_ioctl_stats_ext stats;
+
+		if (!rzs->init_done) {
+			ret = -ENOTTY;
+			goto out;
+		}
+		memset(&stats, 0, sizeof(stats));
+		ramzswap_ioctl_get_stats_ext(rzs, &stats);
+		if (copy_to_user((void *)arg, &stats, sizeof(stats))) {
+			ret = -EFAULT;
+			goto out;
+		}
+		break;
+	}
+	case RZSIO_SET_COMPRESSOR:
+	{
+		struct ramzswap_ioctl_compressor comp;
+
+		if (rzs->init_done) {
+			ret = -EBUSY;
+			goto out;
+		}
+		if (copy_from_user(&comp, (void *)arg, sizeof(comp))) {
+			ret = -EFAULT;
+			goto out;
+		}
+		comp.name[sizeof(comp.name) - 1] = '\0';
+		ret = ramzswap_set_compressor(rzs, comp.name);
+		break;
+	}
+	case RZSIO_GET_COMPRESSOR:
+	{
+		struct ramzswap_ioctl_compressor comp;
+
+		memset(&comp, 0, sizeof(comp));
+		strlcpy(comp.name, rzs->compressor, sizeof(comp.name));
+		if (copy_to_user((void *)arg, &comp, sizeof(comp)))
+			ret = -EFAULT;
+		break;
+	}
+	case RZSIO_SET_BACKING_DEV:
+	{
+		struct ramzswap_ioctl_backing backing;
+
+		if (rzs->init_done) {
+			ret = -EBUSY;
+			goto out;
+		}
+		if (copy_from_user(&backing, (void *)arg, sizeof(backing))) {
+			ret = -EFAULT;
+			goto out;
+		}
+		backing.path[sizeof(backing.path) - 1] = '\0';
+		strlcpy(rzs->backing_path, backing.path,
+			sizeof(rzs->backing_path));
+		rzs->idle_age = backing.idle_age;
+		pr_info("Backing device set to %s (idle age %u s)\n",
+			rzs->backing_path, rzs->idle_age);
+		break;
+	}
 	case RZSIO_INIT:
 		ret = ramzswap_ioctl_init_device(rzs);
 		break;
@@ -687,7 +1902,9 @@ void ramzswap_slot_free_notify(struct block_device *bdev, unsigned long index)
 	struct ramzswap *rzs;
 
 	rzs = bdev->bd_disk->private_data;
+	write_lock(&rzs->table_lock);
 	ramzswap_free_page(rzs, index);
+	write_unlock(&rzs->table_lock);
 	rzs_stat64_inc(rzs, &rzs->stats.notify_free);
 
 	return;
@@ -704,7 +1921,11 @@ static int create_device(struct ramzswap *rzs, int device_id)
 	int ret = 0;
 
 	mutex_init(&rzs->lock);
+	rwlock_init(&rzs->table_lock);
+	init_waitqueue_head(&rzs->wb_wait);
 	spin_lock_init(&rzs->stat64_lock);
+	spin_lock_init(&rzs->dedup_lock);
+	strlcpy(rzs->compressor, compressor, sizeof(rzs->compressor));
 
 	rzs->queue = blk_alloc_queue(GFP_KERNEL);
 	if (!rzs->queue) {
@@ -742,6 +1963,11 @@ static int create_device(struct ramzswap *rzs, int device_id)
 
 	add_disk(rzs->disk);
 
+	if (sysfs_create_group(&disk_to_dev(rzs->disk)->kobj,
+				&ramzswap_disk_attr_group))
+		pr_warning("Error creating sysfs group for device %d\n",
+			device_id);
+
 	rzs->init_done = 0;
 
 out:
@@ -751,6 +1977,8 @@ out:
 static void destroy_device(struct ramzswap *rzs)
 {
 	if (rzs->disk) {
+		sysfs_remove_group(&disk_to_dev(rzs->disk)->kobj,
+				&ramzswap_disk_attr_group);
 		del_gendisk(rzs->disk);
 		put_disk(rzs->disk);
 	}
@@ -770,11 +1998,17 @@ static int __init ramzswap_init(void)
 		goto out;
 	}
 
+	dedup_node_cache = KMEM_CACHE(rzs_dedup_node, 0);
+	if (!dedup_node_cache) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
 	ramzswap_major = register_blkdev(0, "ramzswap");
 	if (ramzswap_major <= 0) {
 		pr_warning("Unable to get major number\n");
 		ret = -EBUSY;
-		goto out;
+		goto free_cache;
 	}
 
 	if (!num_devices) {
@@ -796,6 +2030,8 @@ static int __init ramzswap_init(void)
 			goto free_devices;
 	}
 
+	register_shrinker(&rzs_shrinker);
+
 	return 0;
 
 free_devices:
@@ -803,6 +2039,8 @@ free_devices:
 		destroy_device(&devices[--dev_id]);
 unregister:
 	unregister_blkdev(ramzswap_major, "ramzswap");
+free_cache:
+	kmem_cache_destroy(dedup_node_cache);
 out:
 	return ret;
 }
@@ -812,6 +2050,8 @@ static void __exit ramzswap_exit(void)
 	int i;
 	struct ramzswap *rzs;
 
+	unregister_shrinker(&rzs_shrinker);
+
 	for (i = 0; i < num_devices; i++) {
 		rzs = &devices[i];
 
@@ -823,12 +2063,19 @@ static void __exit ramzswap_exit(void)
 	unregister_blkdev(ramzswap_major, "ramzswap");
 
 	kfree(devices);
+	kmem_cache_destroy(dedup_node_cache);
 	pr_debug("Cleanup done!\n");
 }
 
 module_param(num_devices, uint, 0);
 MODULE_PARM_DESC(num_devices, "Number of ramzswap devices");
 
+module_param(dedup, bool, 0);
+MODULE_PARM_DESC(dedup, "Share one object between identical pages");
+
+module_param(compressor, charp, 0);
+MODULE_PARM_DESC(compressor, "Default compression algorithm (crypto API name)");
+
 module_init(ramzswap_init);
 module_exit(ramzswap_exit);
 
@@ -17,6 +17,10 @@
 
 #include <linux/spinlock.h>
 #include <linux/mutex.h>
+#include <linux/wait.h>
+#include <linux/percpu.h>
+#include <linux/crypto.h>
+#include <linux/kfifo.h>
 
 #include "ramzswap_ioctl.h"
 #include "xvmalloc.h"
@@ -32,11 +36,16 @@ static const unsigned max_num_devices = 32;
  *
  * It stores back-reference to table entry which points to this
  * object. This is required to support memory defragmentation.
+ *
+ * Identical pages share a single object when deduplication is enabled:
+ * refcount is the number of table entries pointing to it and checksum
+ * is the hash of the uncompressed page used to find it again. Without
+ * deduplication these two fields are not stored, see rzs_zheader_size().
  */
 struct zobj_header {
-#if 0
 	u32 table_idx;
-#endif
+	u32 checksum;
+	u32 refcount;
 };
 
 /*-- Configurable parameters */
@@ -44,12 +53,28 @@ struct zobj_header {
 /* Default ramzswap disk size: 25% of total RAM */
 static const unsigned default_disksize_perc_ram = 25;
 
+/* Default compression algorithm, see RZSIO_SET_COMPRESSOR */
+static const char default_compressor[] = "lzo";
+
 /*
  * Pages that compress to size greater than this are stored
  * uncompressed in memory.
  */
 static const unsigned max_zpage_size = PAGE_SIZE / 4 * 3;
 
+/*
+ * Number of incompressible pages queued for writeback. When the queue
+ * overflows, the writeback thread falls back to scanning the table.
+ */
+static const unsigned wb_queue_len = 256;
+
+/*
+ * Compaction only empties xvmalloc pages with at most this many bytes
+ * allocated: moving objects out of fuller pages costs more copying than
+ * the page is worth.
+ */
+static const unsigned compact_max_used = PAGE_SIZE / 2;
+
 /*
  * NOTE: max_zpage_size must be less than or equal to:
  *   XV_MAX_ALLOC_SIZE - sizeof(struct zobj_header)
@@ -71,6 +96,18 @@ enum rzs_pageflags {
 	/* Page consists entirely of zeros */
 	RZS_ZERO,
 
+	/* Page is filled with a single repeated word, kept in table.element */
+	RZS_PATTERN,
+
+	/* Page is stored on the backing device, at table.wb_index */
+	RZS_WRITTEN,
+
+	/* Page was not accessed since the last idle scan */
+	RZS_IDLE,
+
+	/* Page is being written to the backing device */
+	RZS_WB,
+
 	__NR_RZS_PAGEFLAGS,
 };
 
@@ -81,7 +118,11 @@ enum rzs_pageflags {
  * These table entries must fit exactly in a page.
  */
 struct table {
-	struct page *page;
+	union {
+		struct page *page;
+		unsigned long element;	/* RZS_PATTERN pages */
+		unsigned long wb_index;	/* RZS_WRITTEN pages */
+	};
 	u16 offset;
 	u8 count;	/* object ref count (not yet used) */
 	u8 flags;
@@ -100,22 +141,88 @@ struct ramzswap_stats {
 	u64 invalid_io;		/* non-swap I/O requests */
 	u64 notify_free;	/* no. of swap slot free notifications */
 	u32 pages_zero;		/* no. of zero filled pages */
+	u32 pages_pattern;	/* no. of pages filled with a repeated word */
+	u32 pages_dedup;	/* no. of pages sharing another's object */
 	u32 pages_stored;	/* no. of pages currently stored */
 	u32 good_compress;	/* % of pages with compression ratio<=50% */
 	u32 pages_expand;	/* % of incompressible pages */
+	u32 pages_backed;	/* no. of pages on the backing device */
+	u64 bd_reads;		/* pages read from the backing device */
+	u64 bd_writes;		/* pages written to the backing device */
+	u64 pages_compacted;	/* xvmalloc pages freed by compaction */
+	u64 objs_compacted;	/* objects moved by compaction */
 #endif
 };
 
+/*
+ * Compression workspace. One is allocated per possible CPU so that
+ * swap-outs issued from different CPUs compress in parallel. The mutex
+ * is only contended when a writer gets preempted or migrated while it
+ * holds the stream of its CPU.
+ *
+ * The crypto transform may keep per-request state (deflate does), so
+ * swap-ins decompress on a stream as well.
+ */
+struct rzs_stream {
+	struct mutex lock;
+	struct crypto_comp *tfm;
+	void *buffer;
+};
+
 struct ramzswap {
 	struct xv_pool *mem_pool;
-	void *compress_workmem;
-	void *compress_buffer;
+	struct rzs_stream __percpu *streams;
 	struct table *table;
 	spinlock_t stat64_lock;	/* protect 64-bit stats */
+	/*
+	 * Serializes xvmalloc allocation and table updates. Compression
+	 * itself is done outside of it, on a per-CPU stream.
+	 */
 	struct mutex lock;
 	struct request_queue *queue;
 	struct gendisk *disk;
 	int init_done;
+	/* crypto API algorithm, can only be changed before init */
+	char compressor[RZS_MAX_COMPRESSOR_NAME];
+
+	/*
+	 * Index of compressed objects by checksum, used to find duplicate
+	 * pages. Allocated only if deduplication is enabled. dedup_lock
+	 * protects the index and the refcount in each object's header.
+	 */
+	int dedup;
+	struct hlist_head *dedup_table;
+	unsigned int dedup_shift;
+	spinlock_t dedup_lock;
+
+	/*
+	 * Readers of a table entry (swap-in) hold table_lock for reading.
+	 * Freeing or moving an object that a concurrent swap-in may be
+	 * using (slot free notification, writeback, compaction) holds it
+	 * for writing.
+	 */
+	rwlock_t table_lock;
+
+	/*
+	 * Optional backing device for incompressible and idle pages. For
+	 * a regular file, wb_sectors maps its pages to sectors of wb_bdev,
+	 * like the swap extents of a swapfile.
+	 */
+	char backing_path[RZS_MAX_BACKING_PATH];
+	unsigned int idle_age;		/* seconds, 0: disabled */
+	struct file *wb_file;
+	struct block_device *wb_bdev;
+	sector_t *wb_sectors;
+	unsigned long *wb_bitmap;	/* allocated backing pages */
+	unsigned long wb_nr_pages;
+	unsigned long wb_hint;
+	struct task_struct *wb_thread;
+	struct page *wb_buf;		/* writeback thread's bounce page */
+	wait_queue_head_t wb_wait;
+	int wb_kick;			/* incompressible pages pending */
+	/* slots of incompressible pages, under the device mutex */
+	struct kfifo wb_queue;
+	int wb_overflow;		/* pages were not queued */
 	/*
 	 * This is limit on amount of *uncompressed* worth of data
 	 * we can hold. When backing swap device is provided, it is
@@ -128,6 +235,14 @@ struct ramzswap {
 
 /*-- */
 
+/* Size of the header of the compressed objects of a device */
+static inline size_t rzs_zheader_size(struct ramzswap *rzs)
+{
+	if (rzs->dedup)
+		return sizeof(struct zobj_header);
+	return offsetof(struct zobj_header, checksum);
+}
+
 /* Debugging and Stats */
 #if defined(CONFIG_RAMZSWAP_STATS)
 static void rzs_stat_inc(u32 *v)
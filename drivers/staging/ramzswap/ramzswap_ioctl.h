@@ -34,9 +34,54 @@ struct ramzswap_ioctl_stats {
 	u64 mem_used_total;
 } __attribute__ ((packed, aligned(4)));
 
+/*
+ * Stats added after struct ramzswap_ioctl_stats, which is left as is for
+ * existing tools. New fields are only ever appended, with version bumped
+ * so that userspace can tell which ones the kernel filled in.
+ */
+#define RZS_STATS_EXT_VERSION	1
+
+struct ramzswap_ioctl_stats_ext {
+	u32 version;		/* RZS_STATS_EXT_VERSION */
+	u32 pages_pattern;	/* no. of pages filled with a repeated word */
+	u32 pages_dedup;	/* no. of pages sharing another's object */
+	u32 pages_backed;	/* no. of pages on the backing device */
+	u64 bd_reads;		/* pages read from the backing device */
+	u64 bd_writes;		/* pages written to the backing device */
+	u64 pages_compacted;	/* memory pages freed by compaction */
+	u64 objs_compacted;	/* objects moved by compaction */
+} __attribute__ ((packed, aligned(4)));
+
+#define RZS_MAX_COMPRESSOR_NAME	64
+#define RZS_MAX_BACKING_PATH	256
+
+/*
+ * Name of a crypto API compression algorithm ("lzo", "lz4", "deflate"...)
+ * used to compress the pages of a device.
+ */
+struct ramzswap_ioctl_compressor {
+	char name[RZS_MAX_COMPRESSOR_NAME];
+};
+
+/*
+ * Block device or regular file that receives incompressible pages and
+ * pages not accessed for idle_age seconds (0 disables idle writeback).
+ * A file must be fully allocated, as for swapon.
+ */
+struct ramzswap_ioctl_backing {
+	char path[RZS_MAX_BACKING_PATH];
+	u32 idle_age;
+};
+
 #define RZSIO_SET_DISKSIZE_KB	_IOW('z', 0, size_t)
 #define RZSIO_GET_STATS		_IOR('z', 1, struct ramzswap_ioctl_stats)
 #define RZSIO_INIT		_IO('z', 2)
 #define RZSIO_RESET		_IO('z', 3)
+#define RZSIO_SET_COMPRESSOR	\
+		_IOW('z', 4, struct ramzswap_ioctl_compressor)
+#define RZSIO_GET_COMPRESSOR	\
+		_IOR('z', 5, struct ramzswap_ioctl_compressor)
+#define RZSIO_SET_BACKING_DEV	_IOW('z', 6, struct ramzswap_ioctl_backing)
+#define RZSIO_GET_STATS_EXT	_IOR('z', 7, struct ramzswap_ioctl_stats_ext)
 
 #endif
@@ -30,6 +30,12 @@ static void stat_dec(u64 *value)
 	*value = *value - 1;
 }
 
+static void page_used_add(struct xv_pool *pool, struct page *page, int bytes)
+{
+	set_page_private(page, page_private(page) + bytes);
+	pool->used_bytes += bytes;
+}
+
 static int test_flag(struct block_header *block, enum blockflags flag)
 {
 	return block->prev & BIT(flag);
@@ -285,8 +291,10 @@ static int grow_pool(struct xv_pool *pool, gfp_t flags)
 		return -ENOMEM;
 
 	stat_inc(&pool->total_pages);
+	set_page_private(page, 0);
 
 	spin_lock(&pool->lock);
+	list_add_tail(&page->lru, &pool->pages);
 	block = get_ptr_atomic(page, 0, KM_USER0);
 
 	block->size = PAGE_SIZE - XV_ALIGN;
@@ -317,6 +325,7 @@ struct xv_pool *xv_create_pool(void)
 		return NULL;
 
 	spin_lock_init(&pool->lock);
+	INIT_LIST_HEAD(&pool->pages);
 
 	return pool;
 }
@@ -361,7 +370,7 @@ int xv_malloc(struct xv_pool *pool, u32 size, struct page **page,
 
 	if (!*page) {
 		spin_unlock(&pool->lock);
-		if (flags & GFP_NOWAIT)
+		if (!(flags & __GFP_WAIT))
 			return -ENOMEM;
 		error = grow_pool(pool, flags);
 		if (unlikely(error))
@@ -405,6 +414,7 @@ int xv_malloc(struct xv_pool *pool, u32 size, struct page **page,
 
 	block->size = origsize;
 	clear_flag(block, BLOCK_FREE);
+	page_used_add(pool, *page, size + XV_ALIGN);
 
 	put_ptr_atomic(block, KM_USER0);
 	spin_unlock(&pool->lock);
@@ -419,6 +429,7 @@ int xv_malloc(struct xv_pool *pool, u32 size, struct page **page,
  */
 void xv_free(struct xv_pool *pool, struct page *page, u32 offset)
 {
+	int isolated;
 	void *page_start;
 	struct block_header *block, *tmpblock;
 
@@ -433,6 +444,10 @@ void xv_free(struct xv_pool *pool, struct page *page, u32 offset)
 	BUG_ON(test_flag(block, BLOCK_FREE));
 
 	block->size = ALIGN(block->size, XV_ALIGN);
+	page_used_add(pool, page, -(block->size + XV_ALIGN));
+
+	/* Free blocks of an isolated page are not on the freelists */
+	isolated = page == pool->isolated;
 
 	tmpblock = BLOCK_NEXT(block);
 	if (offset + block->size + XV_ALIGN == PAGE_SIZE)
@@ -444,7 +459,7 @@ void xv_free(struct xv_pool *pool, struct page *page, u32 offset)
 		 * Blocks smaller than XV_MIN_ALLOC_SIZE
 		 * are not inserted in any free list.
 		 */
-		if (tmpblock->size >= XV_MIN_ALLOC_SIZE) {
+		if (tmpblock->size >= XV_MIN_ALLOC_SIZE && !isolated) {
 			remove_block(pool, page,
 				    offset + block->size + XV_ALIGN, tmpblock,
 				    get_index_for_insert(tmpblock->size));
@@ -458,7 +473,7 @@ void xv_free(struct xv_pool *pool, struct page *page, u32 offset)
 						get_blockprev(block));
 		offset = offset - tmpblock->size - XV_ALIGN;
 
-		if (tmpblock->size >= XV_MIN_ALLOC_SIZE)
+		if (tmpblock->size >= XV_MIN_ALLOC_SIZE && !isolated)
 			remove_block(pool, page, offset, tmpblock,
 				    get_index_for_insert(tmpblock->size));
 
@@ -467,7 +482,8 @@ void xv_free(struct xv_pool *pool, struct page *page, u32 offset)
 	}
 
 	/* No used objects in this page. Free it. */
-	if (block->size == PAGE_SIZE - XV_ALIGN) {
+	if (block->size == PAGE_SIZE - XV_ALIGN && !isolated) {
+		list_del(&page->lru);
 		put_ptr_atomic(page_start, KM_USER0);
 		spin_unlock(&pool->lock);
 
@@ -477,7 +493,7 @@ void xv_free(struct xv_pool *pool, struct page *page, u32 offset)
 	}
 
 	set_flag(block, BLOCK_FREE);
-	if (block->size >= XV_MIN_ALLOC_SIZE)
+	if (block->size >= XV_MIN_ALLOC_SIZE && !isolated)
 		insert_block(pool, page, offset, block);
 
 	if (offset + block->size + XV_ALIGN != PAGE_SIZE) {
@@ -505,3 +521,136 @@ u64 xv_get_total_size_bytes(struct xv_pool *pool)
 {
 	return pool->total_pages << PAGE_SHIFT;
 }
+
+/*
+ * Returns memory allocated to objects, including block headers
+ */
+u64 xv_get_used_size_bytes(struct xv_pool *pool)
+{
+	return pool->used_bytes;
+}
+
+static struct block_header *next_block_in_page(void *page_start,
+					u32 *offset, struct block_header *block)
+{
+	*offset += ALIGN(block->size, XV_ALIGN) + XV_ALIGN;
+	if (*offset >= PAGE_SIZE)
+		return NULL;
+	return (struct block_header *)((char *)page_start + *offset);
+}
+
+/**
+ * xv_isolate_page - pick a page to compact
+ * @pool: pool to pick the page from
+ * @max_used: maximum number of bytes allocated in the page
+ * @nr_scan: number of pages to look at, decremented for each one
+ *
+ * Pages are looked at round-robin. The free blocks of the selected page
+ * are taken off the freelists, so that its objects can be moved out of
+ * it with xv_malloc() and then freed, after which xv_putback_page()
+ * releases the page. Only one page per pool may be isolated at a time.
+ *
+ * Returns NULL if no page within the scan budget qualifies.
+ */
+struct page *xv_isolate_page(struct xv_pool *pool, u32 max_used,
+			unsigned long *nr_scan)
+{
+	u32 offset = 0;
+	void *page_start;
+	struct page *page = NULL, *tmppage;
+	struct block_header *block;
+
+	spin_lock(&pool->lock);
+	BUG_ON(pool->isolated);
+
+	while (*nr_scan && !list_empty(&pool->pages)) {
+		tmppage = list_first_entry(&pool->pages, struct page, lru);
+		list_move_tail(&tmppage->lru, &pool->pages);
+		(*nr_scan)--;
+
+		if (page_private(tmppage) <= max_used) {
+			page = tmppage;
+			break;
+		}
+	}
+
+	if (!page)
+		goto out;
+
+	page_start = get_ptr_atomic(page, 0, KM_USER0);
+	block = page_start;
+	do {
+		if (test_flag(block, BLOCK_FREE) &&
+				block->size >= XV_MIN_ALLOC_SIZE)
+			remove_block(pool, page, offset, block,
+				    get_index_for_insert(block->size));
+	} while ((block = next_block_in_page(page_start, &offset, block)));
+	put_ptr_atomic(page_start, KM_USER0);
+
+	pool->isolated = page;
+out:
+	spin_unlock(&pool->lock);
+	return page;
+}
+
+/*
+ * Returns offset of the first object at or after the given offset in an
+ * isolated page, or 0 if there is no such object.
+ */
+u32 xv_next_object(struct xv_pool *pool, struct page *page, u32 offset)
+{
+	u32 pos = 0, found = 0;
+	void *page_start;
+	struct block_header *block;
+
+	spin_lock(&pool->lock);
+	page_start = get_ptr_atomic(page, 0, KM_USER0);
+	block = page_start;
+	do {
+		if (!test_flag(block, BLOCK_FREE) && pos + XV_ALIGN >= offset) {
+			found = pos + XV_ALIGN;
+			break;
+		}
+	} while ((block = next_block_in_page(page_start, &pos, block)));
+	put_ptr_atomic(page_start, KM_USER0);
+	spin_unlock(&pool->lock);
+
+	return found;
+}
+
+/*
+ * Release a page isolated with xv_isolate_page(). Returns 1 if the page
+ * was empty and has been freed, 0 if its free blocks were put back on
+ * the freelists.
+ */
+int xv_putback_page(struct xv_pool *pool, struct page *page)
+{
+	u32 offset = 0;
+	void *page_start;
+	struct block_header *block;
+
+	spin_lock(&pool->lock);
+	BUG_ON(pool->isolated != page);
+	pool->isolated = NULL;
+
+	if (!page_private(page)) {
+		list_del(&page->lru);
+		spin_unlock(&pool->lock);
+
+		__free_page(page);
+		stat_dec(&pool->total_pages);
+		return 1;
+	}
+
+	page_start = get_ptr_atomic(page, 0, KM_USER0);
+	block = page_start;
+	do {
+		if (test_flag(block, BLOCK_FREE) &&
+				block->size >= XV_MIN_ALLOC_SIZE)
+			insert_block(pool, page, offset, block);
+	} while ((block = next_block_in_page(page_start, &offset, block)));
+	put_ptr_atomic(page_start, KM_USER0);
+
+	spin_unlock(&pool->lock);
+	return 0;
+}
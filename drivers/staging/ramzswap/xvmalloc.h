@@ -26,5 +26,11 @@ void xv_free(struct xv_pool *pool, struct page *page, u32 offset);
 
 u32 xv_get_object_size(void *obj);
 u64 xv_get_total_size_bytes(struct xv_pool *pool);
+u64 xv_get_used_size_bytes(struct xv_pool *pool);
+
+struct page *xv_isolate_page(struct xv_pool *pool, u32 max_used,
+			unsigned long *nr_scan);
+u32 xv_next_object(struct xv_pool *pool, struct page *page, u32 offset);
+int xv_putback_page(struct xv_pool *pool, struct page *page);
 
 #endif
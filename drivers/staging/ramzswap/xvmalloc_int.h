@@ -14,6 +14,7 @@
 #define _XV_MALLOC_INT_H_
 
 #include <linux/kernel.h>
+#include <linux/list.h>
 #include <linux/types.h>
 
 /* User configurable params */
@@ -79,8 +80,18 @@ struct xv_pool {
 
 	struct freelist_entry freelist[NUM_FREE_LISTS];
 
+	/*
+	 * All pages of the pool, linked through page->lru. page->private
+	 * holds the number of bytes allocated in the page, headers included.
+	 */
+	struct list_head pages;
+
+	/* Page being compacted: none of its free space is on the freelists */
+	struct page *isolated;
+
 	/* stats */
 	u64 total_pages;
+	u64 used_bytes;
 };
 
 #endif
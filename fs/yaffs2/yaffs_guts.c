@@ -33,10 +33,11 @@
 #include "yaffs_nameval.h"
 #include "yaffs_allocator.h"
 
-/* Note YAFFS_GC_GOOD_ENOUGH must be <= YAFFS_GC_PASSIVE_THRESHOLD */
-#define YAFFS_GC_GOOD_ENOUGH 2
 #define YAFFS_GC_PASSIVE_THRESHOLD 4
 
+/* Erased blocks background gc keeps in hand beyond what aggressive gc needs */
+#define YAFFS_GC_BACKGROUND_RESERVE 4
+
 #include "yaffs_ecc.h"
 
 
@@ -85,6 +86,8 @@ static int yaffs_AllocateChunk(yaffs_Device *dev, int useReserve,
 
 static void yaffs_CheckObjectDetailsLoaded(yaffs_Object *in);
 
+static void yaffs_GCIndexUpdate(yaffs_Device *dev, yaffs_BlockInfo *bi);
+
 static void yaffs_InvalidateWholeChunkCache(yaffs_Object *in);
 static void yaffs_InvalidateChunkCache(yaffs_Object *object, int chunkId);
 
@@ -526,6 +529,7 @@ static void yaffs_RetireBlock(yaffs_Device *dev, int blockInNAND)
 	bi->blockState = YAFFS_BLOCK_STATE_DEAD;
 	bi->gcPrioritise = 0;
 	bi->needsRetiring = 0;
+	yaffs_GCIndexUpdate(dev, bi);
 
 	dev->nRetiredBlocks++;
 }
@@ -559,6 +563,7 @@ void yaffs_HandleChunkError(yaffs_Device *dev, yaffs_BlockInfo *bi)
 		bi->gcPrioritise = 1;
 		dev->hasPendingPrioritisedGCs = 1;
 		bi->chunkErrorStrikes++;
+		yaffs_GCIndexUpdate(dev, bi);
 
 		if (bi->chunkErrorStrikes > 3) {
 			bi->needsRetiring = 1; /* Too many stikes, so retire this */
@@ -1026,6 +1031,7 @@ static void yaffs_SoftDeleteChunk(yaffs_Device *dev, int chunk)
 		theBlock->softDeletions++;
 		dev->nFreeChunks++;
 		yaffs2_UpdateOldestDirtySequence(dev, blockNo, theBlock);
+		yaffs_GCIndexUpdate(dev, theBlock);
 	}
 }
 
@@ -1816,12 +1822,92 @@ int yaffs_RenameObject(yaffs_Object *oldDir, const YCHAR *oldName,
 
 /*------------------------- Block Management and Page Allocation ----------------*/
 
+/*
+ * The gc victim index.
+ * Full blocks are kept in buckets by the number of pages they still have in
+ * use, and those prioritised for gc in a bucket of their own, so that gc can
+ * pick the dirtiest block without looking at every block.
+ * gcIndex holds one entry per block followed by the bucket heads. It is not
+ * part of the blockInfo since that gets checkpointed as it is.
+ */
+#define YAFFS_GC_INDEX_BUCKETS(dev) ((dev)->param.nChunksPerBlock + 2)
+#define YAFFS_GC_INDEX_PRIORITISED(dev) ((dev)->param.nChunksPerBlock + 1)
+
+static struct ylist_head *yaffs_GCIndexBucket(yaffs_Device *dev, int key)
+{
+	return &dev->gcIndex[dev->internalEndBlock - dev->internalStartBlock +
+			     1 + key];
+}
+
+/* Put a block where it belongs in the index after its state, pagesInUse,
+ * softDeletions or gcPrioritise changed.
+ */
+static void yaffs_GCIndexUpdate(yaffs_Device *dev, yaffs_BlockInfo *bi)
+{
+	struct ylist_head *entry;
+	int key;
+
+	if (!dev->gcIndex)
+		return;
+
+	entry = &dev->gcIndex[bi - dev->blockInfo];
+	ylist_del_init(entry);
+
+	if (bi->blockState != YAFFS_BLOCK_STATE_FULL)
+		return;
+
+	if (bi->gcPrioritise) {
+		key = YAFFS_GC_INDEX_PRIORITISED(dev);
+		dev->hasPendingPrioritisedGCs = 1;
+	} else {
+		key = bi->pagesInUse - bi->softDeletions;
+		if (key < 0)
+			key = 0;
+		else if (key > dev->param.nChunksPerBlock)
+			key = dev->param.nChunksPerBlock;
+	}
+
+	ylist_add_tail(entry, yaffs_GCIndexBucket(dev, key));
+}
+
+/* Index every block from scratch, eg. after a scan or checkpoint restore */
+static void yaffs_GCIndexRebuild(yaffs_Device *dev)
+{
+	int nBlocks = dev->internalEndBlock - dev->internalStartBlock + 1;
+	int i;
+
+	if (!dev->gcIndex)
+		return;
+
+	for (i = 0; i < nBlocks + YAFFS_GC_INDEX_BUCKETS(dev); i++)
+		YINIT_LIST_HEAD(&dev->gcIndex[i]);
+
+	for (i = 0; i < nBlocks; i++)
+		yaffs_GCIndexUpdate(dev, &dev->blockInfo[i]);
+}
+
+/* Find the first block in a bucket that may be collected, or 0 */
+static unsigned yaffs_GCIndexFind(yaffs_Device *dev, int key)
+{
+	struct ylist_head *i;
+	int n;
+
+	ylist_for_each(i, yaffs_GCIndexBucket(dev, key)) {
+		n = i - dev->gcIndex;
+		if (yaffs2_BlockNotDisqualifiedFromGC(dev, &dev->blockInfo[n]))
+			return n + dev->internalStartBlock;
+	}
+
+	return 0;
+}
+
 static int yaffs_InitialiseBlocks(yaffs_Device *dev)
 {
 	int nBlocks = dev->internalEndBlock - dev->internalStartBlock + 1;
 
 	dev->blockInfo = NULL;
 	dev->chunkBits = NULL;
+	dev->gcIndex = NULL;
 
 	dev->allocationBlock = -1;	/* force it to get a new one */
 
@@ -1844,9 +1930,14 @@ static int yaffs_InitialiseBlocks(yaffs_Device *dev)
 			dev->chunkBitsAlt = 0;
 	}
 
-	if (dev->blockInfo && dev->chunkBits) {
+	if (dev->blockInfo && dev->chunkBits)
+		dev->gcIndex = YMALLOC((nBlocks + YAFFS_GC_INDEX_BUCKETS(dev)) *
+					sizeof(struct ylist_head));
+
+	if (dev->blockInfo && dev->chunkBits && dev->gcIndex) {
 		memset(dev->blockInfo, 0, nBlocks * sizeof(yaffs_BlockInfo));
 		memset(dev->chunkBits, 0, dev->chunkBitmapStride * nBlocks);
+		yaffs_GCIndexRebuild(dev);
 		return YAFFS_OK;
 	}
 
@@ -1870,6 +1961,10 @@ static void yaffs_DeinitialiseBlocks(yaffs_Device *dev)
 		YFREE(dev->chunkBits);
 	dev->chunkBitsAlt = 0;
 	dev->chunkBits = NULL;
+
+	if (dev->gcIndex)
+		YFREE(dev->gcIndex);
+	dev->gcIndex = NULL;
 }
 
 void yaffs_BlockBecameDirty(yaffs_Device *dev, int blockNo)
@@ -1889,17 +1984,12 @@ void yaffs_BlockBecameDirty(yaffs_Device *dev, int blockNo)
 	yaffs2_ClearOldestDirtySequence(dev,bi);
 
 	bi->blockState = YAFFS_BLOCK_STATE_DIRTY;
+	yaffs_GCIndexUpdate(dev, bi);
 
 	/* If this is the block being garbage collected then stop gc'ing this block */
 	if(blockNo == dev->gcBlock)
 		dev->gcBlock = 0;
 
-	/* If this block is currently the best candidate for gc then drop as a candidate */
-	if(blockNo == dev->gcDirtiest){
-		dev->gcDirtiest = 0;
-		dev->gcPagesInUse = 0;
-	}
-
 	if (!bi->needsRetiring) {
 		yaffs2_InvalidateCheckpoint(dev);
 		erasedOk = yaffs_EraseBlockInNAND(dev, blockNo);
@@ -2052,6 +2142,7 @@ static int yaffs_AllocateChunk(yaffs_Device *dev, int useReserve,
 		/* If the block is full set the state to full */
 		if (dev->allocationPage >= dev->param.nChunksPerBlock) {
 			bi->blockState = YAFFS_BLOCK_STATE_FULL;
+			yaffs_GCIndexUpdate(dev, bi);
 			dev->allocationBlock = -1;
 		}
 
@@ -2090,6 +2181,7 @@ void yaffs_SkipRestOfBlock(yaffs_Device *dev)
 		yaffs_BlockInfo *bi = yaffs_GetBlockInfo(dev, dev->allocationBlock);
 		if(bi->blockState == YAFFS_BLOCK_STATE_ALLOCATING){
 			bi->blockState = YAFFS_BLOCK_STATE_FULL;
+			yaffs_GCIndexUpdate(dev, bi);
 			dev->allocationBlock = -1;
 		}
 	}
@@ -2129,9 +2221,11 @@ static int yaffs_GarbageCollectBlock(yaffs_Device *dev, int block,
 
 	/*yaffs_VerifyFreeChunks(dev); */
 
-	if(bi->blockState == YAFFS_BLOCK_STATE_FULL)
+	if(bi->blockState == YAFFS_BLOCK_STATE_FULL) {
 		bi->blockState = YAFFS_BLOCK_STATE_COLLECTING;
-	
+		yaffs_GCIndexUpdate(dev, bi);
+	}
+
 	bi->hasShrinkHeader = 0;	/* clear the flag so that the block can erase */
 
 	dev->gcDisable = 1;
@@ -2327,6 +2421,7 @@ static int yaffs_GarbageCollectBlock(yaffs_Device *dev, int block,
 		 * because checkpointing does not restore gc.
 		 */
 		bi->blockState = YAFFS_BLOCK_STATE_FULL;
+		yaffs_GCIndexUpdate(dev, bi);
 	} else {
 		/* The gc completed. */
 		/* Do any required cleanups */
@@ -2369,117 +2464,75 @@ static int yaffs_GarbageCollectBlock(yaffs_Device *dev, int block,
 }
 
 /*
- * FindBlockForgarbageCollection is used to select the dirtiest block (or close enough)
- * for garbage collection.
+ * FindBlockForgarbageCollection is used to select the dirtiest block
+ * for garbage collection. The gc index makes this cheap.
  */
 
 static unsigned yaffs_FindBlockForGarbageCollection(yaffs_Device *dev,
 					int aggressive,
 					int background)
 {
-	int i;
-	int iterations;
 	unsigned selected = 0;
 	int prioritised = 0;
-	int prioritisedExists = 0;
 	yaffs_BlockInfo *bi;
 	int threshold;
+	int key;
 
 	/* First let's see if we need to grab a prioritised block */
 	if (dev->hasPendingPrioritisedGCs && !aggressive) {
-		dev->gcDirtiest = 0;
-		bi = dev->blockInfo;
-		for (i = dev->internalStartBlock;
-			i <= dev->internalEndBlock && !selected;
-			i++) {
-
-			if (bi->gcPrioritise) {
-				prioritisedExists = 1;
-				if (bi->blockState == YAFFS_BLOCK_STATE_FULL &&
-				   yaffs2_BlockNotDisqualifiedFromGC(dev, bi)) {
-					selected = i;
-					prioritised = 1;
-				}
-			}
-			bi++;
-		}
-
-		/*
-		 * If there is a prioritised block and none was selected then
-		 * this happened because there is at least one old dirty block gumming
-		 * up the works. Let's gc the oldest dirty block.
-		 */
-
-		if(prioritisedExists &&
-			!selected &&
-			dev->oldestDirtyBlock > 0)
-			selected = dev->oldestDirtyBlock;
+		key = YAFFS_GC_INDEX_PRIORITISED(dev);
+		selected = yaffs_GCIndexFind(dev, key);
+		prioritised = selected ? 1 : 0;
 
-		if (!prioritisedExists) /* None found, so we can clear this */
+		if (ylist_empty(yaffs_GCIndexBucket(dev, key)))
+			/* None found, so we can clear this */
 			dev->hasPendingPrioritisedGCs = 0;
+		else if (!selected && dev->oldestDirtyBlock > 0)
+			/*
+			 * There is a prioritised block and none was selected
+			 * because there is at least one old dirty block gumming
+			 * up the works. Let's gc the oldest dirty block.
+			 */
+			selected = dev->oldestDirtyBlock;
 	}
 
-	/* If we're doing aggressive GC then we are happy to take a less-dirty block, and
-	 * search harder.
+	/* If we're doing aggressive GC then we are happy to take a less-dirty block.
 	 * else (we're doing a leasurely gc), then we only bother to do this if the
-	 * block has only a few pages in use.
+	 * block has only a few pages in use. Background gc gets less fussy the
+	 * longer it has gone without finding anything, and takes anything up to
+	 * half used when the erased reserve is running low.
 	 */
 
-	if (!selected){
-		int pagesUsed;
-		int nBlocks = dev->internalEndBlock - dev->internalStartBlock + 1;
-		if (aggressive){
-			threshold = dev->param.nChunksPerBlock;
-			iterations = nBlocks;
-		} else {
-			int maxThreshold;
-
-			if(background)
-				maxThreshold = dev->param.nChunksPerBlock/2;
-			else
-				maxThreshold = dev->param.nChunksPerBlock/8;
+	if (aggressive)
+		threshold = dev->param.nChunksPerBlock - 1;
+	else {
+		int maxThreshold;
 
-			if(maxThreshold <  YAFFS_GC_PASSIVE_THRESHOLD)
-				maxThreshold = YAFFS_GC_PASSIVE_THRESHOLD;
+		if(background)
+			maxThreshold = dev->param.nChunksPerBlock/2;
+		else
+			maxThreshold = dev->param.nChunksPerBlock/8;
 
-			threshold = background ?
-				(dev->gcNotDone + 2) * 2 : 0;
-			if(threshold <YAFFS_GC_PASSIVE_THRESHOLD)
-				threshold = YAFFS_GC_PASSIVE_THRESHOLD;
-			if(threshold > maxThreshold)
-				threshold = maxThreshold;
+		if(maxThreshold <  YAFFS_GC_PASSIVE_THRESHOLD)
+			maxThreshold = YAFFS_GC_PASSIVE_THRESHOLD;
 
-			iterations = nBlocks / 16 + 1;
-			if (iterations > 100)
-				iterations = 100;
-		}
+		threshold = background ?
+			(dev->gcNotDone + 2) * 2 : 0;
+		if(background && yaffs_GCBelowReserve(dev))
+			threshold = maxThreshold;
+		if(threshold <YAFFS_GC_PASSIVE_THRESHOLD)
+			threshold = YAFFS_GC_PASSIVE_THRESHOLD;
+		if(threshold > maxThreshold)
+			threshold = maxThreshold;
+	}
 
-		for (i = 0;
-			i < iterations &&
-			(dev->gcDirtiest < 1 ||
-				dev->gcPagesInUse > YAFFS_GC_GOOD_ENOUGH);
-			i++) {
-			dev->gcBlockFinder++;
-			if (dev->gcBlockFinder < dev->internalStartBlock ||
-				dev->gcBlockFinder > dev->internalEndBlock)
-				dev->gcBlockFinder = dev->internalStartBlock;
-
-			bi = yaffs_GetBlockInfo(dev, dev->gcBlockFinder);
-
-			pagesUsed = bi->pagesInUse - bi->softDeletions;
-
-			if (bi->blockState == YAFFS_BLOCK_STATE_FULL &&
-				pagesUsed < dev->param.nChunksPerBlock &&
-				(dev->gcDirtiest < 1 || pagesUsed < dev->gcPagesInUse) &&
-				yaffs2_BlockNotDisqualifiedFromGC(dev, bi)) {
-				dev->gcDirtiest = dev->gcBlockFinder;
-				dev->gcPagesInUse = pagesUsed;
-			}
-		}
+	for (key = 0; !selected && key <= threshold; key++)
+		selected = yaffs_GCIndexFind(dev, key);
 
-		if(dev->gcDirtiest > 0 && dev->gcPagesInUse <= threshold)
-			selected = dev->gcDirtiest;
-	}
+	/* Aggressive gc will take a prioritised block too */
+	if (!selected && aggressive)
+		selected = yaffs_GCIndexFind(dev,
+					YAFFS_GC_INDEX_PRIORITISED(dev));
 
 	/*
 	 * If nothing has been selected for a while, try selecting the oldest dirty
@@ -2491,15 +2544,15 @@ static unsigned yaffs_FindBlockForGarbageCollection(yaffs_Device *dev,
 		yaffs2_FindOldestDirtySequence(dev);
 		if(dev->oldestDirtyBlock > 0) {
 			selected = dev->oldestDirtyBlock;
-			dev->gcDirtiest = selected;
 			dev->oldestDirtyGCs++;
-			bi = yaffs_GetBlockInfo(dev, selected);
-			dev->gcPagesInUse =  bi->pagesInUse - bi->softDeletions;
 		} else
 			dev->gcNotDone = 0;
 	}
 
 	if(selected){
+		bi = yaffs_GetBlockInfo(dev, selected);
+		dev->gcPagesInUse =  bi->pagesInUse - bi->softDeletions;
+
 		T(YAFFS_TRACE_GC,
 		  (TSTR("GC Selected block %d with %d free, prioritised:%d" TENDSTR),
 		  selected,
@@ -2510,18 +2563,15 @@ static unsigned yaffs_FindBlockForGarbageCollection(yaffs_Device *dev,
 		if(background)
 			dev->backgroundGCs++;
 
-		dev->gcDirtiest = 0;
-		dev->gcPagesInUse = 0;
 		dev->gcNotDone = 0;
 		if(dev->refreshSkip > 0)
 			dev->refreshSkip--;
 	} else{
 		dev->gcNotDone++;
 		T(YAFFS_TRACE_GC,
-		  (TSTR("GC none: finder %d skip %d threshold %d dirtiest %d using %d oldest %d%s" TENDSTR),
-		  dev->gcBlockFinder, dev->gcNotDone,
+		  (TSTR("GC none: skip %d threshold %d oldest %d%s" TENDSTR),
+		  dev->gcNotDone,
 		  threshold,
-		  dev->gcDirtiest, dev->gcPagesInUse,
 		  dev->oldestDirtyBlock,
 		  background ? " bg" : ""));
 	}
@@ -2529,6 +2579,20 @@ static unsigned yaffs_FindBlockForGarbageCollection(yaffs_Device *dev,
 	return selected;
 }
 
+/*
+ * yaffs_GCBelowReserve()
+ * Returns non-zero if there are fewer erased blocks than background gc
+ * should keep in hand, so that foreground writes rarely have to do
+ * aggressive gc themselves.
+ */
+int yaffs_GCBelowReserve(yaffs_Device *dev)
+{
+	int minErased = dev->param.nReservedBlocks +
+			yaffs2_CalcCheckpointBlocksRequired(dev) + 1;
+
+	return dev->nErasedBlocks < minErased + YAFFS_GC_BACKGROUND_RESERVE;
+}
+
 /* New garbage collector
  * If we're very low on erased blocks then we do aggressive garbage collection
  * otherwise we do "leasurely" garbage collection.
@@ -2918,6 +2982,7 @@ void yaffs_DeleteChunk(yaffs_Device *dev, int chunkId, int markNAND, int lyn)
 		yaffs_ClearChunkBit(dev, block, page);
 
 		bi->pagesInUse--;
+		yaffs_GCIndexUpdate(dev, bi);
 
 		if (bi->pagesInUse == 0 &&
 		    !bi->hasShrinkHeader &&
@@ -3176,19 +3241,48 @@ int yaffs_UpdateObjectHeader(yaffs_Object *in, const YCHAR *name, int force,
  *   In Linux, the page cache provides read buffering aand the short op cache provides write
  *   buffering.
  *
- *   There are a limited number (~10) of cache chunks per device so that we don't
- *   need a very intelligent search.
+ *   Caches in use are hashed by object and chunkId for lookups, hashed by
+ *   object alone for flushing an object, and kept on an LRU list for
+ *   pushing out, so none of the operations need to walk the whole cache and
+ *   the cache can be made quite large (eg. for small database writes).
  */
 
+static Y_INLINE int yaffs_ChunkCacheHash(yaffs_Device *dev,
+					const yaffs_Object *obj, int chunkId)
+{
+	return (obj->objectId * 31 + chunkId) & dev->srHashMask;
+}
+
+static Y_INLINE struct ylist_head *yaffs_ChunkCacheObjBucket(yaffs_Device *dev,
+					const yaffs_Object *obj)
+{
+	return &dev->srObjHash[obj->objectId & dev->srHashMask];
+}
+
+/* Take a cache chunk out of use and put it back on the free list. */
+static void yaffs_ReleaseChunkCache(yaffs_Device *dev, yaffs_ChunkCache *cache)
+{
+	if (cache->dirty)
+		dev->srDirty--;
+	cache->dirty = 0;
+	cache->object = NULL;
+	ylist_del_init(&cache->hashLink);
+	ylist_del_init(&cache->objLink);
+	ylist_del(&cache->lruLink);
+	ylist_add(&cache->lruLink, &dev->srFree);
+}
+
 static int yaffs_ObjectHasCachedWriteData(yaffs_Object *obj)
 {
 	yaffs_Device *dev = obj->myDev;
-	int i;
+	struct ylist_head *i;
 	yaffs_ChunkCache *cache;
-	int nCaches = obj->myDev->param.nShortOpCaches;
 
-	for (i = 0; i < nCaches; i++) {
-		cache = &dev->srCache[i];
+	if (dev->param.nShortOpCaches < 1 || !dev->srDirty)
+		return 0;
+
+	ylist_for_each(i, yaffs_ChunkCacheObjBucket(dev, obj)) {
+		cache = ylist_entry(i, yaffs_ChunkCache, objLink);
 		if (cache->object == obj &&
 		    cache->dirty)
 			return 1;
@@ -3202,29 +3296,29 @@ static void yaffs_FlushFilesChunkCache(yaffs_Object *obj)
 {
 	yaffs_Device *dev = obj->myDev;
 	int lowest = -99;	/* Stop compiler whining. */
-	int i;
+	struct ylist_head *i;
+	struct ylist_head *bucket;
 	yaffs_ChunkCache *cache;
+	yaffs_ChunkCache *c;
 	int chunkWritten = 0;
-	int nCaches = obj->myDev->param.nShortOpCaches;
 
-	if (nCaches > 0) {
+	if (dev->param.nShortOpCaches > 0) {
+		bucket = yaffs_ChunkCacheObjBucket(dev, obj);
 		do {
 			cache = NULL;
 
 			/* Find the dirty cache for this object with the lowest chunk id. */
-			for (i = 0; i < nCaches; i++) {
-				if (dev->srCache[i].object == obj &&
-				    dev->srCache[i].dirty) {
-					if (!cache
-					    || dev->srCache[i].chunkId <
-					    lowest) {
-						cache = &dev->srCache[i];
-						lowest = cache->chunkId;
-					}
+			ylist_for_each(i, bucket) {
+				c = ylist_entry(i, yaffs_ChunkCache, objLink);
+				if (c->object == obj && c->dirty &&
+				    !c->locked &&
+				    (!cache || c->chunkId < lowest)) {
+					cache = c;
+					lowest = cache->chunkId;
 				}
 			}
 
-			if (cache && !cache->locked) {
+			if (cache) {
 				/* Write it out and free it up */
 
 				chunkWritten =
@@ -3233,8 +3327,7 @@ static void yaffs_FlushFilesChunkCache(yaffs_Object *obj)
 								 cache->data,
 								 cache->nBytes,
 								 1);
-				cache->dirty = 0;
-				cache->object = NULL;
+				yaffs_ReleaseChunkCache(dev, cache);
 			}
 
 		} while (cache && chunkWritten > 0);
@@ -3257,115 +3350,117 @@ static void yaffs_FlushFilesChunkCache(yaffs_Object *obj)
 void yaffs_FlushEntireDeviceCache(yaffs_Device *dev)
 {
 	yaffs_Object *obj;
-	int nCaches = dev->param.nShortOpCaches;
-	int i;
+	struct ylist_head *i;
+	yaffs_ChunkCache *cache;
+
+	if (dev->param.nShortOpCaches < 1)
+		return;
 
 	/* Find a dirty object in the cache and flush it...
 	 * until there are no further dirty objects.
 	 */
-	do {
+	while (dev->srDirty > 0) {
 		obj = NULL;
-		for (i = 0; i < nCaches && !obj; i++) {
-			if (dev->srCache[i].object &&
-			    dev->srCache[i].dirty)
-				obj = dev->srCache[i].object;
-
+		ylist_for_each(i, &dev->srLru) {
+			cache = ylist_entry(i, yaffs_ChunkCache, lruLink);
+			if (cache->dirty && !cache->locked) {
+				obj = cache->object;
+				break;
+			}
 		}
-		if (obj)
-			yaffs_FlushFilesChunkCache(obj);
+		if (!obj)
+			break;
 
-	} while (obj);
+		yaffs_FlushFilesChunkCache(obj);
+	}
 
 }
 
 
-/* Grab us a cache chunk for use.
+/* Grab us a cache chunk for use by chunk chunkId of obj.
  * First look for an empty one.
- * Then look for the least recently used non-dirty one.
- * Then look for the least recently used dirty one...., flush and look again.
+ * Then push out the least recently used one, flushing its object first if
+ * it is dirty.
  */
-static yaffs_ChunkCache *yaffs_GrabChunkCacheWorker(yaffs_Device *dev)
+static yaffs_ChunkCache *yaffs_GrabChunkCache(yaffs_Device *dev,
+					yaffs_Object *obj, int chunkId)
 {
-	int i;
-
-	if (dev->param.nShortOpCaches > 0) {
-		for (i = 0; i < dev->param.nShortOpCaches; i++) {
-			if (!dev->srCache[i].object)
-				return &dev->srCache[i];
-		}
-	}
+	yaffs_ChunkCache *cache = NULL;
+	struct ylist_head *i;
 
-	return NULL;
-}
+	if (dev->param.nShortOpCaches < 1)
+		return NULL;
 
-static yaffs_ChunkCache *yaffs_GrabChunkCache(yaffs_Device *dev)
-{
-	yaffs_ChunkCache *cache;
-	yaffs_Object *theObj;
-	int usage;
-	int i;
-	int pushout;
+	dev->cacheMisses++;
 
-	if (dev->param.nShortOpCaches > 0) {
-		/* Try find a non-dirty one... */
+	if (ylist_empty(&dev->srFree)) {
+		/* With locking we can't assume the LRU head is usable */
+		ylist_for_each(i, &dev->srLru) {
+			cache = ylist_entry(i, yaffs_ChunkCache, lruLink);
+			if (!cache->locked)
+				break;
+			cache = NULL;
+		}
 
-		cache = yaffs_GrabChunkCacheWorker(dev);
+		if (!cache)
+			return NULL;
 
-		if (!cache) {
-			/* They were all dirty, find the last recently used object and flush
-			 * its cache, then  find again.
-			 * NB what's here is not very accurate, we actually flush the object
-			 * the last recently used page.
-			 */
+		/* NB Pushing out a dirty chunk flushes its whole object. */
+		if (cache->dirty)
+			yaffs_FlushFilesChunkCache(cache->object);
+		else
+			yaffs_ReleaseChunkCache(dev, cache);
 
-			/* With locking we can't assume we can use entry zero */
+		if (ylist_empty(&dev->srFree))
+			return NULL;
+	}
 
-			theObj = NULL;
-			usage = -1;
-			cache = NULL;
-			pushout = -1;
+	cache = ylist_entry(dev->srFree.next, yaffs_ChunkCache, lruLink);
+	ylist_del(&cache->lruLink);
+	ylist_add_tail(&cache->lruLink, &dev->srLru);
+	ylist_add(&cache->hashLink,
+		  &dev->srHash[yaffs_ChunkCacheHash(dev, obj, chunkId)]);
+	ylist_add(&cache->objLink, yaffs_ChunkCacheObjBucket(dev, obj));
+	cache->object = obj;
+	cache->chunkId = chunkId;
+	cache->dirty = 0;
+	cache->locked = 0;
+	cache->nBytes = 0;
 
-			for (i = 0; i < dev->param.nShortOpCaches; i++) {
-				if (dev->srCache[i].object &&
-				    !dev->srCache[i].locked &&
-				    (dev->srCache[i].lastUse < usage || !cache)) {
-					usage = dev->srCache[i].lastUse;
-					theObj = dev->srCache[i].object;
-					cache = &dev->srCache[i];
-					pushout = i;
-				}
-			}
+	return cache;
+}
 
-			if (!cache || cache->dirty) {
-				/* Flush and try again */
-				yaffs_FlushFilesChunkCache(theObj);
-				cache = yaffs_GrabChunkCacheWorker(dev);
-			}
+static yaffs_ChunkCache *yaffs_FindChunkCacheWorker(const yaffs_Object *obj,
+						int chunkId)
+{
+	yaffs_Device *dev = obj->myDev;
+	struct ylist_head *i;
+	struct ylist_head *bucket;
+	yaffs_ChunkCache *cache;
 
-		}
-		return cache;
-	} else
+	if (dev->param.nShortOpCaches < 1)
 		return NULL;
 
+	bucket = &dev->srHash[yaffs_ChunkCacheHash(dev, obj, chunkId)];
+	ylist_for_each(i, bucket) {
+		cache = ylist_entry(i, yaffs_ChunkCache, hashLink);
+		if (cache->object == obj &&
+		    cache->chunkId == chunkId)
+			return cache;
+	}
+	return NULL;
 }
 
 /* Find a cached chunk */
 static yaffs_ChunkCache *yaffs_FindChunkCache(const yaffs_Object *obj,
 					      int chunkId)
 {
-	yaffs_Device *dev = obj->myDev;
-	int i;
-	if (dev->param.nShortOpCaches > 0) {
-		for (i = 0; i < dev->param.nShortOpCaches; i++) {
-			if (dev->srCache[i].object == obj &&
-			    dev->srCache[i].chunkId == chunkId) {
-				dev->cacheHits++;
+	yaffs_ChunkCache *cache = yaffs_FindChunkCacheWorker(obj, chunkId);
 
-				return &dev->srCache[i];
-			}
-		}
-	}
-	return NULL;
+	if (cache)
+		obj->myDev->cacheHits++;
+
+	return cache;
 }
 
 /* Mark the chunk for the least recently used algorithym */
@@ -3374,21 +3469,13 @@ static void yaffs_UseChunkCache(yaffs_Device *dev, yaffs_ChunkCache *cache,
 {
 
 	if (dev->param.nShortOpCaches > 0) {
-		if (dev->srLastUse < 0 || dev->srLastUse > 100000000) {
-			/* Reset the cache usages */
-			int i;
-			for (i = 1; i < dev->param.nShortOpCaches; i++)
-				dev->srCache[i].lastUse = 0;
-
-			dev->srLastUse = 0;
-		}
+		ylist_del(&cache->lruLink);
+		ylist_add_tail(&cache->lruLink, &dev->srLru);
 
-		dev->srLastUse++;
-
-		cache->lastUse = dev->srLastUse;
-
-		if (isAWrite)
+		if (isAWrite && !cache->dirty) {
 			cache->dirty = 1;
+			dev->srDirty++;
+		}
 	}
 }
 
@@ -3399,10 +3486,11 @@ static void yaffs_UseChunkCache(yaffs_Device *dev, yaffs_ChunkCache *cache,
 static void yaffs_InvalidateChunkCache(yaffs_Object *object, int chunkId)
 {
 	if (object->myDev->param.nShortOpCaches > 0) {
-		yaffs_ChunkCache *cache = yaffs_FindChunkCache(object, chunkId);
+		yaffs_ChunkCache *cache =
+			yaffs_FindChunkCacheWorker(object, chunkId);
 
 		if (cache)
-			cache->object = NULL;
+			yaffs_ReleaseChunkCache(object->myDev, cache);
 	}
 }
 
@@ -3411,14 +3499,17 @@ static void yaffs_InvalidateChunkCache(yaffs_Object *object, int chunkId)
  */
 static void yaffs_InvalidateWholeChunkCache(yaffs_Object *in)
 {
-	int i;
+	struct ylist_head *i;
+	struct ylist_head *n;
+	yaffs_ChunkCache *cache;
 	yaffs_Device *dev = in->myDev;
 
 	if (dev->param.nShortOpCaches > 0) {
 		/* Invalidate it. */
-		for (i = 0; i < dev->param.nShortOpCaches; i++) {
-			if (dev->srCache[i].object == in)
-				dev->srCache[i].object = NULL;
+		ylist_for_each_safe(i, n, yaffs_ChunkCacheObjBucket(dev, in)) {
+			cache = ylist_entry(i, yaffs_ChunkCache, objLink);
+			if (cache->object == in)
+				yaffs_ReleaseChunkCache(dev, cache);
 		}
 	}
 }
@@ -3475,15 +3566,11 @@ int yaffs_ReadDataFromFile(yaffs_Object *in, __u8 *buffer, loff_t offset,
 				/* If we can't find the data in the cache, then load it up. */
 
 				if (!cache) {
-					cache = yaffs_GrabChunkCache(in->myDev);
-					cache->object = in;
-					cache->chunkId = chunk;
-					cache->dirty = 0;
-					cache->locked = 0;
+					cache = yaffs_GrabChunkCache(dev, in,
+								     chunk);
 					yaffs_ReadChunkDataFromObject(in, chunk,
 								      cache->
 								      data);
-					cache->nBytes = 0;
 				}
 
 				yaffs_UseChunkCache(dev, cache, 0);
@@ -3526,6 +3613,51 @@ int yaffs_ReadDataFromFile(yaffs_Object *in, __u8 *buffer, loff_t offset,
 	return nDone;
 }
 
+/* Read whole chunks of a file without changing anything in the device, so
+ * that yaffs_readpage can run several of these at once under the shared gross
+ * lock. Writers and the garbage collector still hold the lock exclusively.
+ * Returns the number of bytes read, or -1 if the read needs more than that:
+ * a partial chunk or inband tags (which go through the short op cache), a
+ * chunk that is in the cache, chunk groups (which need tags to be read) or
+ * an ECC problem. The caller must then redo the read with
+ * yaffs_ReadDataFromFile() holding the device to itself.
+ */
+int yaffs_ReadDataFromFileShared(yaffs_Object *in, __u8 *buffer, loff_t offset,
+			int nBytes)
+{
+	yaffs_Device *dev = in->myDev;
+	int chunk;
+	int chunkInNAND;
+	__u32 start;
+	int nDone = 0;
+
+	if (dev->param.inbandTags || dev->chunkGroupSize != 1)
+		return -1;
+
+	while (nDone < nBytes) {
+		yaffs_AddrToChunk(dev, offset, &chunk, &start);
+		chunk++;
+
+		if (start || nBytes - nDone < dev->nDataBytesPerChunk ||
+		    yaffs_FindChunkCacheWorker(in, chunk))
+			return -1;
+
+		chunkInNAND = yaffs_FindChunkInFile(in, chunk, NULL);
+		if (chunkInNAND < 0)
+			/* A hole reads as zeros */
+			memset(buffer, 0, dev->nDataBytesPerChunk);
+		else if (yaffs_ReadChunkDataFromNAND(dev, chunkInNAND,
+						     buffer) != YAFFS_OK)
+			return -1;
+
+		offset += dev->nDataBytesPerChunk;
+		buffer += dev->nDataBytesPerChunk;
+		nDone += dev->nDataBytesPerChunk;
+	}
+
+	return nDone;
+}
+
 int yaffs_DoWriteDataToFile(yaffs_Object *in, const __u8 *buffer, loff_t offset,
 			int nBytes, int writeThrough)
 {
@@ -3602,11 +3734,8 @@ int yaffs_DoWriteDataToFile(yaffs_Object *in, const __u8 *buffer, loff_t offset,
 
 				if (!cache
 				    && yaffs_CheckSpaceForAllocation(dev, 1)) {
-					cache = yaffs_GrabChunkCache(dev);
-					cache->object = in;
-					cache->chunkId = chunk;
-					cache->dirty = 0;
-					cache->locked = 0;
+					cache = yaffs_GrabChunkCache(dev, in,
+								     chunk);
 					yaffs_ReadChunkDataFromObject(in, chunk,
 								      cache->data);
 				} else if (cache &&
@@ -3638,6 +3767,7 @@ int yaffs_DoWriteDataToFile(yaffs_Object *in, const __u8 *buffer, loff_t offset,
 						     cache->data, cache->nBytes,
 						     1);
 						cache->dirty = 0;
+						dev->srDirty--;
 					}
 
 				} else {
@@ -5270,7 +5400,6 @@ int yaffs_GutsInitialise(yaffs_Device *dev)
 	dev->passiveGCs = 0;
 	dev->oldestDirtyGCs = 0;
 	dev->backgroundGCs = 0;
-	dev->gcBlockFinder = 0;
 	dev->bufferedBlock = -1;
 	dev->doingBufferedBlockRewrite = 0;
 	dev->nDeletedFiles = 0;
@@ -5293,6 +5422,7 @@ int yaffs_GutsInitialise(yaffs_Device *dev)
 		init_failed = 1;
 
 	dev->srCache = NULL;
+	dev->srHash = NULL;
 	dev->gcCleanupList = NULL;
 
 
@@ -5300,31 +5430,51 @@ int yaffs_GutsInitialise(yaffs_Device *dev)
 	    dev->param.nShortOpCaches > 0) {
 		int i;
 		void *buf;
-		int srCacheBytes = dev->param.nShortOpCaches * sizeof(yaffs_ChunkCache);
+		int srCacheBytes;
+
+		int nBuckets;
 
 		if (dev->param.nShortOpCaches > YAFFS_MAX_SHORT_OP_CACHES)
 			dev->param.nShortOpCaches = YAFFS_MAX_SHORT_OP_CACHES;
+		srCacheBytes = dev->param.nShortOpCaches *
+				sizeof(yaffs_ChunkCache);
+
+		/* One bucket per cache, rounded up to a power of two */
+		for (nBuckets = 1; nBuckets < dev->param.nShortOpCaches;)
+			nBuckets <<= 1;
+		dev->srHashMask = nBuckets - 1;
 
 		dev->srCache =  YMALLOC(srCacheBytes);
+		dev->srHash = YMALLOC(2 * nBuckets * sizeof(struct ylist_head));
+		dev->srObjHash = dev->srHash ? dev->srHash + nBuckets : NULL;
 
 		buf = (__u8 *) dev->srCache;
+		if (!dev->srHash)
+			buf = NULL;
 
 		if (dev->srCache)
 			memset(dev->srCache, 0, srCacheBytes);
 
+		YINIT_LIST_HEAD(&dev->srLru);
+		YINIT_LIST_HEAD(&dev->srFree);
+		for (i = 0; i < 2 * nBuckets && buf; i++)
+			YINIT_LIST_HEAD(&dev->srHash[i]);
+
 		for (i = 0; i < dev->param.nShortOpCaches && buf; i++) {
 			dev->srCache[i].object = NULL;
-			dev->srCache[i].lastUse = 0;
 			dev->srCache[i].dirty = 0;
+			YINIT_LIST_HEAD(&dev->srCache[i].hashLink);
+			YINIT_LIST_HEAD(&dev->srCache[i].objLink);
+			ylist_add_tail(&dev->srCache[i].lruLink, &dev->srFree);
 			dev->srCache[i].data = buf = YMALLOC_DMA(dev->param.totalBytesPerChunk);
 		}
 		if (!buf)
 			init_failed = 1;
-
-		dev->srLastUse = 0;
 	}
 
+	dev->srDirty = 0;
 	dev->cacheHits = 0;
+	dev->cacheMisses = 0;
 
 	if (!init_failed) {
 		dev->gcCleanupList = YMALLOC(dev->param.nChunksPerBlock * sizeof(__u32));
@@ -5382,6 +5532,7 @@ int yaffs_GutsInitialise(yaffs_Device *dev)
 		} else if (!yaffs1_Scan(dev))
 				init_failed = 1;
 
+		yaffs_GCIndexRebuild(dev);
 		yaffs_StripDeletedObjects(dev);
 		yaffs_FixHangingObjects(dev);
 		if(dev->param.emptyLostAndFound)
@@ -5438,6 +5589,11 @@ void yaffs_Deinitialise(yaffs_Device *dev)
 			YFREE(dev->srCache);
 			dev->srCache = NULL;
 		}
+		if (dev->srHash) {
+			YFREE(dev->srHash);
+			dev->srHash = NULL;
+			dev->srObjHash = NULL;
+		}
 
 		YFREE(dev->gcCleanupList);
 
@@ -5483,9 +5639,7 @@ int yaffs_GetNumberOfFreeChunks(yaffs_Device *dev)
 	/* This is what we report to the outside world */
 
 	int nFree;
-	int nDirtyCacheChunks;
 	int blocksForCheckpoint;
-	int i;
 
 #if 1
 	nFree = dev->nFreeChunks;
@@ -5495,14 +5649,9 @@ int yaffs_GetNumberOfFreeChunks(yaffs_Device *dev)
 
 	nFree += dev->nDeletedFiles;
 
-	/* Now count the number of dirty chunks in the cache and subtract those */
-
-	for (nDirtyCacheChunks = 0, i = 0; i < dev->param.nShortOpCaches; i++) {
-		if (dev->srCache[i].dirty)
-			nDirtyCacheChunks++;
-	}
+	/* Now subtract the number of dirty chunks in the cache */
 
-	nFree -= nDirtyCacheChunks;
+	nFree -= dev->srDirty;
 
 	nFree -= ((dev->param.nReservedBlocks + 1) * dev->param.nChunksPerBlock);
 
@@ -88,7 +88,7 @@
 #define YAFFS_SEQUENCE_CHECKPOINT_DATA  0x21
 
 
-#define YAFFS_MAX_SHORT_OP_CACHES	20
+#define YAFFS_MAX_SHORT_OP_CACHES	512
 
 #define YAFFS_N_TEMP_BUFFERS		6
 
@@ -113,9 +113,11 @@
 
 /* ChunkCache is used for short read/write operations.*/
 typedef struct {
+	struct ylist_head hashLink;	/* In the (object, chunkId) hash */
+	struct ylist_head objLink;	/* In the per-object hash */
+	struct ylist_head lruLink;	/* In the LRU list or free list */
 	struct yaffs_ObjectStruct *object;
 	int chunkId;
-	int lastUse;
 	int dirty;
 	int nBytes;		/* Only valid if the cache is dirty */
 	int locked;		/* Can't push out or flush while locked. */
@@ -575,6 +577,17 @@ struct yaffs_DeviceParamStruct {
 	int (*markNANDBlockBad) (struct yaffs_DeviceStruct *dev, int blockNo);
 	int (*queryNANDBlock) (struct yaffs_DeviceStruct *dev, int blockNo,
 			       yaffs_BlockState *state, __u32 *sequenceNumber);
+
+	/* Optional scan read-ahead. readBlockTags fills in the tags of every
+	 * chunk in a block, tags[0] being the first chunk, or fails so that
+	 * the scan reads the chunks one at a time. prefetchBlockTags starts
+	 * reading the block that will be asked for next in the background.
+	 * A negative block just waits for any read in flight to finish.
+	 */
+	int (*readBlockTags) (struct yaffs_DeviceStruct *dev, int blockNo,
+			      yaffs_ExtendedTags *tags);
+	void (*prefetchBlockTags) (struct yaffs_DeviceStruct *dev,
+				   int blockNo);
 #endif
 
 	/* The removeObjectCallback function must be supplied by OS flavours that
@@ -698,14 +711,14 @@ struct yaffs_DeviceStruct {
 
 	unsigned hasPendingPrioritisedGCs; /* We think this device might have pending prioritised gcs */
 	unsigned gcDisable;
-	unsigned gcBlockFinder;
-	unsigned gcDirtiest;
 	unsigned gcPagesInUse;
 	unsigned gcNotDone;
 	unsigned gcBlock;
 	unsigned gcChunk;
 	unsigned gcSkip;
 
+	struct ylist_head *gcIndex;	/* Full blocks by pages in use */
+
 	/* Special directories */
 	yaffs_Object *rootDir;
 	yaffs_Object *lostNFoundDir;
@@ -719,7 +732,12 @@ struct yaffs_DeviceStruct {
 	int doingBufferedBlockRewrite;
 
 	yaffs_ChunkCache *srCache;
-	int srLastUse;
+	struct ylist_head *srHash;	/* Hashed by object and chunkId */
+	struct ylist_head *srObjHash;	/* Hashed by object */
+	int srHashMask;
+	struct ylist_head srLru;	/* In use, least recently used first */
+	struct ylist_head srFree;	/* Not in use */
+	int srDirty;			/* Number of dirty caches */
 
 	/* Stuff for background deletion and unlinked files.*/
 	yaffs_Object *unlinkedDir;	/* Directory where unlinked and deleted files live. */
@@ -769,6 +787,7 @@ struct yaffs_DeviceStruct {
 	__u32 nUnmarkedDeletions;
 	__u32 refreshCount;
 	__u32 cacheHits;
+	__u32 cacheMisses;
 
 };
 
@@ -855,6 +874,8 @@ int yaffs_GetAttributes(yaffs_Object *obj, struct iattr *attr);
 /* File operations */
 int yaffs_ReadDataFromFile(yaffs_Object *obj, __u8 *buffer, loff_t offset,
 				int nBytes);
+int yaffs_ReadDataFromFileShared(yaffs_Object *obj, __u8 *buffer,
+				loff_t offset, int nBytes);
 int yaffs_WriteDataToFile(yaffs_Object *obj, const __u8 *buffer, loff_t offset,
 				int nBytes, int writeThrough);
 int yaffs_ResizeFile(yaffs_Object *obj, loff_t newSize);
@@ -915,6 +936,7 @@ void yaffs_HandleDeferedFree(yaffs_Object *obj);
 void yaffs_UpdateDirtyDirectories(yaffs_Device *dev);
 
 int yaffs_BackgroundGarbageCollect(yaffs_Device *dev, unsigned urgency);
+int yaffs_GCBelowReserve(yaffs_Device *dev);
 
 /* Debug dump  */
 int yaffs_DumpObject(yaffs_Object *obj);
@@ -19,16 +19,32 @@
 #include "devextras.h"
 #include "yportenv.h"
 
+#if (LINUX_VERSION_CODE > KERNEL_VERSION(2, 6, 19))
+#include <linux/completion.h>
+#include <linux/workqueue.h>
+#endif
+
 struct yaffs_LinuxContext {
 	struct ylist_head	contextList; /* List of these we have mounted */
 	struct yaffs_DeviceStruct *dev;
 	struct super_block * superBlock;
 	struct task_struct *bgThread; /* Background thread for this device */
 	int bgRunning;
-        struct semaphore grossLock;     /* Gross locking semaphore */
+	struct rw_semaphore grossLock;	/* Shared only by readpage */
 	__u8 *spareBuffer;      /* For mtdif2 use. Don't know the size of the buffer
 				 * at compile time so we have to allocate it.
 				 */
+#if (LINUX_VERSION_CODE > KERNEL_VERSION(2, 6, 19))
+	/* Scan read-ahead, for mtdif2 use */
+	__u8 *scanBuffer;	/* oob of a whole block */
+	struct work_struct scanWork;
+	struct completion scanDone;
+	int scanBlock;		/* block being read into scanBuffer */
+	int scanResult;
+	int scanPending;
+#endif
+	unsigned long lastDirtied;	/* jiffies when last modified */
+	int dirtySinceCheckpoint;	/* changed since bg checkpoint */
 	struct ylist_head searchContexts;
 	void (*putSuperFunc)(struct super_block *sb);
 
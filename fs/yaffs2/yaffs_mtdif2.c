@@ -255,3 +255,103 @@ int nandmtd2_QueryNANDBlock(struct yaffs_DeviceStruct *dev, int blockNo,
 		return YAFFS_FAIL;
 }
 
+#if (LINUX_VERSION_CODE > KERNEL_VERSION(2, 6, 19))
+/* Scan read-ahead.
+ * The scan wants the tags of every chunk in one block after another, in an
+ * order it knows in advance. Reading the oob of a whole block is a single
+ * mtd call, and doing it from a work item lets the flash get on with the
+ * next block while the scan is busy with the last one.
+ */
+static int nandmtd2_ReadBlockOOB(yaffs_Device *dev, int blockNo, __u8 *buffer)
+{
+	struct mtd_info *mtd = yaffs_DeviceToMtd(dev);
+	struct mtd_oob_ops ops;
+	int retval;
+
+	loff_t addr = ((loff_t) blockNo) * dev->param.nChunksPerBlock *
+			dev->param.totalBytesPerChunk;
+
+	ops.mode = MTD_OOB_AUTO;
+	ops.ooblen = mtd->oobavail * dev->param.nChunksPerBlock;
+	ops.len = 0;
+	ops.ooboffs = 0;
+	ops.datbuf = NULL;
+	ops.oobbuf = buffer;
+	retval = mtd->read_oob(mtd, addr, &ops);
+
+	if (retval == 0 && ops.oobretlen != ops.ooblen)
+		retval = -EIO;
+	return retval;
+}
+
+void nandmtd2_ReadAheadWorker(struct work_struct *work)
+{
+	struct yaffs_LinuxContext *lc =
+		container_of(work, struct yaffs_LinuxContext, scanWork);
+
+	lc->scanResult = nandmtd2_ReadBlockOOB(lc->dev, lc->scanBlock,
+						lc->scanBuffer);
+	complete(&lc->scanDone);
+}
+
+static void nandmtd2_WaitReadAhead(struct yaffs_LinuxContext *lc)
+{
+	if (lc->scanPending) {
+		wait_for_completion(&lc->scanDone);
+		lc->scanPending = 0;
+	}
+}
+
+void nandmtd2_PrefetchBlockTags(yaffs_Device *dev, int blockNo)
+{
+	struct yaffs_LinuxContext *lc = yaffs_DeviceToLC(dev);
+
+	nandmtd2_WaitReadAhead(lc);
+	if (blockNo < 0)
+		return;
+
+	lc->scanBlock = blockNo;
+	lc->scanPending = 1;
+	INIT_COMPLETION(lc->scanDone);
+	schedule_work(&lc->scanWork);
+}
+
+int nandmtd2_ReadBlockTags(yaffs_Device *dev, int blockNo,
+			   yaffs_ExtendedTags *tags)
+{
+	struct mtd_info *mtd = yaffs_DeviceToMtd(dev);
+	struct yaffs_LinuxContext *lc = yaffs_DeviceToLC(dev);
+	int retval;
+	int i;
+
+	yaffs_PackedTags2 pt;
+
+	int packed_tags_size = dev->param.noTagsECC ? sizeof(pt.t) : sizeof(pt);
+	void * packed_tags_ptr = dev->param.noTagsECC ? (void *) &pt.t: (void *)&pt;
+
+	T(YAFFS_TRACE_MTD,
+	  (TSTR("nandmtd2_ReadBlockTags %d%s" TENDSTR), blockNo,
+	   (lc->scanPending && lc->scanBlock == blockNo) ? " read ahead" : ""));
+
+	nandmtd2_WaitReadAhead(lc);
+	if (lc->scanBlock == blockNo)
+		retval = lc->scanResult;
+	else
+		retval = nandmtd2_ReadBlockOOB(dev, blockNo, lc->scanBuffer);
+	lc->scanBlock = -1;
+
+	/* Leave ECC problems to the chunk by chunk reads, which can tell
+	 * which chunk they are in.
+	 */
+	if (retval || packed_tags_size > mtd->oobavail)
+		return YAFFS_FAIL;
+
+	for (i = 0; i < dev->param.nChunksPerBlock; i++) {
+		memcpy(packed_tags_ptr, lc->scanBuffer + i * mtd->oobavail,
+			packed_tags_size);
+		yaffs_UnpackTags2(&tags[i], &pt, !dev->param.noTagsECC);
+	}
+
+	return YAFFS_OK;
+}
+#endif
@@ -26,4 +26,13 @@ int nandmtd2_MarkNANDBlockBad(struct yaffs_DeviceStruct *dev, int blockNo);
 int nandmtd2_QueryNANDBlock(struct yaffs_DeviceStruct *dev, int blockNo,
 			yaffs_BlockState *state, __u32 *sequenceNumber);
 
+#if (LINUX_VERSION_CODE > KERNEL_VERSION(2, 6, 19))
+struct work_struct;
+
+int nandmtd2_ReadBlockTags(yaffs_Device *dev, int blockNo,
+			yaffs_ExtendedTags *tags);
+void nandmtd2_PrefetchBlockTags(yaffs_Device *dev, int blockNo);
+void nandmtd2_ReadAheadWorker(struct work_struct *work);
+#endif
+
 #endif
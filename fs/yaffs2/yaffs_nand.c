@@ -51,6 +51,63 @@ int yaffs_ReadChunkWithTagsFromNAND(yaffs_Device *dev, int chunkInNAND,
 	return result;
 }
 
+/* Read just the data of a chunk, without its tags.
+ * Nothing but the statistics is changed, so this is safe while other readers
+ * are at it too. Any ECC problem fails the read without being dealt with: the
+ * caller should read the chunk again with yaffs_ReadChunkWithTagsFromNAND()
+ * to get it handled.
+ */
+int yaffs_ReadChunkDataFromNAND(yaffs_Device *dev, int chunkInNAND,
+					__u8 *buffer)
+{
+	int realignedChunkInNAND = chunkInNAND - dev->chunkOffset;
+
+	if (!dev->param.isYaffs2 || !dev->param.readChunkWithTagsFromNAND)
+		return YAFFS_FAIL;
+
+	dev->nPageReads++;
+
+	return dev->param.readChunkWithTagsFromNAND(dev, realignedChunkInNAND,
+						buffer, NULL);
+}
+
+/* Read the tags of every chunk in a block in one go, for the scan.
+ * Fails if the driver can't, in which case the chunks have to be read one by
+ * one instead.
+ */
+int yaffs_ReadBlockTagsFromNAND(yaffs_Device *dev, int blockInNAND,
+					yaffs_ExtendedTags *tags)
+{
+	int realignedBlockInNAND = blockInNAND - dev->blockOffset;
+	yaffs_BlockInfo *bi;
+	int i;
+
+	if (!dev->param.readBlockTags ||
+	    dev->param.readBlockTags(dev, realignedBlockInNAND,
+					tags) != YAFFS_OK)
+		return YAFFS_FAIL;
+
+	dev->nPageReads += dev->param.nChunksPerBlock;
+
+	bi = yaffs_GetBlockInfo(dev, blockInNAND);
+	for (i = 0; i < dev->param.nChunksPerBlock; i++) {
+		if (tags[i].eccResult > YAFFS_ECC_RESULT_NO_ERROR)
+			yaffs_HandleChunkError(dev, bi);
+	}
+
+	return YAFFS_OK;
+}
+
+void yaffs_PrefetchBlockTagsFromNAND(yaffs_Device *dev, int blockInNAND)
+{
+	if (!dev->param.prefetchBlockTags)
+		return;
+
+	if (blockInNAND >= 0)
+		blockInNAND -= dev->blockOffset;
+	dev->param.prefetchBlockTags(dev, blockInNAND);
+}
+
 int yaffs_WriteChunkWithTagsToNAND(yaffs_Device *dev,
 						   int chunkInNAND,
 						   const __u8 *buffer,
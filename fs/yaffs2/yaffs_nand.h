@@ -23,6 +23,14 @@ int yaffs_ReadChunkWithTagsFromNAND(yaffs_Device *dev, int chunkInNAND,
 					__u8 *buffer,
 					yaffs_ExtendedTags *tags);
 
+int yaffs_ReadChunkDataFromNAND(yaffs_Device *dev, int chunkInNAND,
+					__u8 *buffer);
+
+int yaffs_ReadBlockTagsFromNAND(yaffs_Device *dev, int blockInNAND,
+					yaffs_ExtendedTags *tags);
+
+void yaffs_PrefetchBlockTagsFromNAND(yaffs_Device *dev, int blockInNAND);
+
 int yaffs_WriteChunkWithTagsToNAND(yaffs_Device *dev,
 						int chunkInNAND,
 						const __u8 *buffer,
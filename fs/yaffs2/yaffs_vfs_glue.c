@@ -163,6 +163,7 @@ static uint32_t YCALCBLOCKS(uint64_t partition_size, uint32_t block_size)
 #include "yportenv.h"
 #include "yaffs_trace.h"
 #include "yaffs_guts.h"
+#include "yaffs_yaffs2.h"
 
 #include "yaffs_linux.h"
 
@@ -175,6 +176,7 @@ unsigned int yaffs_wr_attempts = YAFFS_WR_ATTEMPTS;
 unsigned int yaffs_auto_checkpoint = 1;
 unsigned int yaffs_gc_control = 1;
 unsigned int yaffs_bg_enable = 1;
+unsigned int yaffs_bg_checkpoint = 5;
 
 /* Module Parameters */
 #if (LINUX_VERSION_CODE > KERNEL_VERSION(2, 5, 0))
@@ -183,6 +185,7 @@ module_param(yaffs_wr_attempts, uint, 0644);
 module_param(yaffs_auto_checkpoint, uint, 0644);
 module_param(yaffs_gc_control, uint, 0644);
 module_param(yaffs_bg_enable, uint, 0644);
+module_param(yaffs_bg_checkpoint, uint, 0644);
 #else
 MODULE_PARM(yaffs_traceMask, "i");
 MODULE_PARM(yaffs_wr_attempts, "i");
@@ -512,17 +515,37 @@ static unsigned yaffs_gc_control_callback(yaffs_Device *dev)
 	return yaffs_gc_control;
 }
                 	                                                                                          	
+/* The gross lock still serialises the whole device: every entry point takes
+ * it exclusively, and writes, allocation and garbage collection are still
+ * done one at a time with everything else locked out. The only exception is
+ * yaffs_readpage, which takes it shared for the whole chunk reads that
+ * yaffs_ReadDataFromFileShared() can do, so that page reads run alongside
+ * each other. There are no per-object locks.
+ */
 static void yaffs_GrossLock(yaffs_Device *dev)
 {
 	T(YAFFS_TRACE_LOCK, (TSTR("yaffs locking %p\n"), current));
-	down(&(yaffs_DeviceToLC(dev)->grossLock));
+	down_write(&(yaffs_DeviceToLC(dev)->grossLock));
 	T(YAFFS_TRACE_LOCK, (TSTR("yaffs locked %p\n"), current));
 }
 
 static void yaffs_GrossUnlock(yaffs_Device *dev)
 {
 	T(YAFFS_TRACE_LOCK, (TSTR("yaffs unlocking %p\n"), current));
-	up(&(yaffs_DeviceToLC(dev)->grossLock));
+	up_write(&(yaffs_DeviceToLC(dev)->grossLock));
+}
+
+static void yaffs_GrossLockShared(yaffs_Device *dev)
+{
+	T(YAFFS_TRACE_LOCK, (TSTR("yaffs locking shared %p\n"), current));
+	down_read(&(yaffs_DeviceToLC(dev)->grossLock));
+	T(YAFFS_TRACE_LOCK, (TSTR("yaffs locked shared %p\n"), current));
+}
+
+static void yaffs_GrossUnlockShared(yaffs_Device *dev)
+{
+	T(YAFFS_TRACE_LOCK, (TSTR("yaffs unlocking shared %p\n"), current));
+	up_read(&(yaffs_DeviceToLC(dev)->grossLock));
 }
 
 #ifdef YAFFS_COMPILE_EXPORTFS
@@ -1014,13 +1037,24 @@ static int yaffs_readpage_nolock(struct file *f, struct page *pg)
 	pg_buf = kmap(pg);
 	/* FIXME: Can kmap fail? */
 
-	yaffs_GrossLock(dev);
+	yaffs_GrossLockShared(dev);
 
-	ret = yaffs_ReadDataFromFile(obj, pg_buf,
+	ret = yaffs_ReadDataFromFileShared(obj, pg_buf,
 				pg->index << PAGE_CACHE_SHIFT,
 				PAGE_CACHE_SIZE);
 
-	yaffs_GrossUnlock(dev);
+	yaffs_GrossUnlockShared(dev);
+
+	if (ret < 0) {
+		/* Needs the cache or error handling: do it the slow way */
+		yaffs_GrossLock(dev);
+
+		ret = yaffs_ReadDataFromFile(obj, pg_buf,
+					pg->index << PAGE_CACHE_SHIFT,
+					PAGE_CACHE_SIZE);
+
+		yaffs_GrossUnlock(dev);
+	}
 
 	if (ret >= 0)
 		ret = 0;
@@ -2253,6 +2287,8 @@ static unsigned yaffs_bg_gc_urgency(yaffs_Device *dev)
 		return 0;
 	else if(scatteredFree < (dev->param.nChunksPerBlock * 2))
 		return 0;
+	else if(yaffs_GCBelowReserve(dev))
+		return 2;
 	else if(erasedChunks > dev->nFreeChunks/2)
 		return 0;
 	else if(erasedChunks > dev->nFreeChunks/4)
@@ -2352,6 +2388,26 @@ static int yaffs_BackgroundThread(void *data)
 			next_dir_update = now + HZ;
 		}
 
+		/* Once things have been quiet for yaffs_bg_checkpoint seconds,
+		 * write a checkpoint so that an unclean shutdown doesn't
+		 * cost a full scan at the next mount. Only try once per
+		 * burst of changes, so that a checkpoint which can't be
+		 * written isn't retried on every pass.
+		 */
+		if(yaffs_bg_checkpoint && yaffs_bg_enable &&
+			context->dirtySinceCheckpoint &&
+			!dev->isCheckpointed &&
+			yaffs2_CheckpointRequired(dev) &&
+			time_after(now, context->lastDirtied +
+					yaffs_bg_checkpoint * HZ) &&
+			!yaffs_bg_gc_urgency(dev)){
+			T(YAFFS_TRACE_BACKGROUND | YAFFS_TRACE_CHECKPOINT,
+				(TSTR("yaffs_background checkpoint\n")));
+			yaffs_FlushSuperBlock(context->superBlock, 1);
+			context->superBlock->s_dirt = 0;
+			context->dirtySinceCheckpoint = 0;
+		}
+
 		if(time_after(now,next_gc) && yaffs_bg_enable){
 			if(!dev->isCheckpointed){
 				urgency = yaffs_bg_gc_urgency(dev);
@@ -2599,6 +2655,8 @@ static void yaffs_MarkSuperBlockDirty(yaffs_Device *dev)
 	T(YAFFS_TRACE_OS, (TSTR("yaffs_MarkSuperBlockDirty() sb = %p\n"), sb));
 	if (sb)
 		sb->s_dirt = 1;
+	yaffs_DeviceToLC(dev)->lastDirtied = jiffies;
+	yaffs_DeviceToLC(dev)->dirtySinceCheckpoint = 1;
 }
 
 typedef struct {
@@ -2606,6 +2664,8 @@ typedef struct {
 	int skip_checkpoint_read;
 	int skip_checkpoint_write;
 	int no_cache;
+	int n_caches;
+	int scan_readahead;
 	int tags_ecc_on;
 	int tags_ecc_overridden;
 	int lazy_loading_enabled;
@@ -2660,6 +2720,13 @@ static int yaffs_parse_options(yaffs_options *options, const char *options_str)
 			options->empty_lost_and_found_overridden=1;
 		} else if (!strcmp(cur_opt, "no-cache"))
 			options->no_cache = 1;
+		else if (!strncmp(cur_opt, "cache-size=", 11)) {
+			options->n_caches =
+				simple_strtoul(cur_opt + 11, NULL, 0);
+			if (options->n_caches < 1)
+				error = 1;
+		} else if (!strcmp(cur_opt, "scan-readahead"))
+			options->scan_readahead = 1;
 		else if (!strcmp(cur_opt, "no-checkpoint-read"))
 			options->skip_checkpoint_read = 1;
 		else if (!strcmp(cur_opt, "no-checkpoint-write"))
@@ -2916,7 +2983,8 @@ static struct super_block *yaffs_internal_read_super(int yaffsVersion,
 	param->nChunksPerBlock = YAFFS_CHUNKS_PER_BLOCK;
 	param->totalBytesPerChunk = YAFFS_BYTES_PER_CHUNK;
 	param->nReservedBlocks = 5;
-	param->nShortOpCaches = (options.no_cache) ? 0 : 10;
+	param->nShortOpCaches = (options.no_cache) ? 0 :
+				(options.n_caches) ? options.n_caches : 10;
 	param->inbandTags = options.inband_tags;
 
 #ifdef CONFIG_YAFFS_DISABLE_LAZY_LOAD
@@ -2973,6 +3041,20 @@ static struct super_block *yaffs_internal_read_super(int yaffsVersion,
 #else
 		param->totalBytesPerChunk = mtd->oobblock;
 		param->nChunksPerBlock = mtd->erasesize / mtd->oobblock;
+#endif
+#if (LINUX_VERSION_CODE > KERNEL_VERSION(2, 6, 19))
+		/* Only needed until the scan is done, freed after that */
+		if (options.scan_readahead && !options.inband_tags)
+			context->scanBuffer = YMALLOC(mtd->oobavail *
+						param->nChunksPerBlock);
+		if (context->scanBuffer) {
+			INIT_WORK(&context->scanWork,
+				nandmtd2_ReadAheadWorker);
+			init_completion(&context->scanDone);
+			context->scanBlock = -1;
+			param->readBlockTags = nandmtd2_ReadBlockTags;
+			param->prefetchBlockTags = nandmtd2_PrefetchBlockTags;
+		}
 #endif
 		nBlocks = YCALCBLOCKS(mtd->size, mtd->erasesize);
 
@@ -3036,7 +3118,7 @@ static struct super_block *yaffs_internal_read_super(int yaffsVersion,
         YINIT_LIST_HEAD(&(yaffs_DeviceToLC(dev)->searchContexts));
         param->removeObjectCallback = yaffs_RemoveObjectCallback;
 
-	init_MUTEX(&(yaffs_DeviceToLC(dev)->grossLock));
+	init_rwsem(&(yaffs_DeviceToLC(dev)->grossLock));
 
 	yaffs_GrossLock(dev);
 
@@ -3045,7 +3127,22 @@ static struct super_block *yaffs_internal_read_super(int yaffsVersion,
 	T(YAFFS_TRACE_OS,
 	  (TSTR("yaffs_read_super: guts initialised %s\n"),
 	   (err == YAFFS_OK) ? "OK" : "FAILED"));
+
+#if (LINUX_VERSION_CODE > KERNEL_VERSION(2, 6, 19))
+	if (context->scanBuffer) {
+		param->readBlockTags = NULL;
+		param->prefetchBlockTags = NULL;
+		YFREE(context->scanBuffer);
+		context->scanBuffer = NULL;
+	}
+#endif
 	   
+	/* A fresh mount counts as quiet from now on, and needs a checkpoint
+	 * if it didn't come from one.
+	 */
+	context->lastDirtied = jiffies;
+	context->dirtySinceCheckpoint = !dev->isCheckpointed;
+
 	if(err == YAFFS_OK)
 		yaffs_BackgroundStart(dev);
 		
@@ -3214,6 +3311,7 @@ static char *yaffs_dump_dev_part1(char *buf, yaffs_Device * dev)
 	buf += sprintf(buf, "chunkGroupSize..... %d\n", dev->chunkGroupSize);
 	buf += sprintf(buf, "nErasedBlocks...... %d\n", dev->nErasedBlocks);
 	buf += sprintf(buf, "blocksInCheckpoint. %d\n", dev->blocksInCheckpoint);
+	buf += sprintf(buf, "isCheckpointed..... %d\n", dev->isCheckpointed);
 	buf += sprintf(buf, "\n");
 	buf += sprintf(buf, "nTnodes............ %d\n", dev->nTnodes);
 	buf += sprintf(buf, "nObjects........... %d\n", dev->nObjects);
@@ -3235,6 +3333,7 @@ static char *yaffs_dump_dev_part1(char *buf, yaffs_Device * dev)
 	buf += sprintf(buf, "tagsEccFixed....... %u\n", dev->tagsEccFixed);
 	buf += sprintf(buf, "tagsEccUnfixed..... %u\n", dev->tagsEccUnfixed);
 	buf += sprintf(buf, "cacheHits.......... %u\n", dev->cacheHits);
+	buf += sprintf(buf, "cacheMisses........ %u\n", dev->cacheMisses);
 	buf += sprintf(buf, "nDeletedFiles...... %u\n", dev->nDeletedFiles);
 	buf += sprintf(buf, "nUnlinkedFiles..... %u\n", dev->nUnlinkedFiles);
 	buf += sprintf(buf, "refreshCount....... %u\n", dev->refreshCount);
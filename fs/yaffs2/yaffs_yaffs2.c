@@ -943,6 +943,9 @@ int yaffs2_ScanBackwards(yaffs_Device *dev)
 	yaffs_BlockIndex *blockIndex = NULL;
 	int altBlockIndex = 0;
 
+	yaffs_ExtendedTags *blockTags = NULL;
+	int blockTagsValid;
+
 	T(YAFFS_TRACE_SCAN,
 	  (TSTR
 	   ("yaffs2_ScanBackwards starts  intstartblk %d intendblk %d..."
@@ -964,6 +967,11 @@ int yaffs2_ScanBackwards(yaffs_Device *dev)
 		return YAFFS_FAIL;
 	}
 
+	/* If the driver can read ahead, read the tags a block at a time */
+	if (dev->param.readBlockTags)
+		blockTags = YMALLOC(dev->param.nChunksPerBlock *
+					sizeof(yaffs_ExtendedTags));
+
 	dev->blocksInCheckpoint = 0;
 
 	chunkData = yaffs_GetTempBuffer(dev, __LINE__);
@@ -1063,6 +1071,20 @@ int yaffs2_ScanBackwards(yaffs_Device *dev)
 
 		deleted = 0;
 
+		/* Get this block's tags, then have the next block's read while
+		 * this one is being processed.
+		 */
+		blockTagsValid = 0;
+		if (blockTags &&
+		    (state == YAFFS_BLOCK_STATE_NEEDS_SCANNING ||
+		     state == YAFFS_BLOCK_STATE_ALLOCATING)) {
+			blockTagsValid = (yaffs_ReadBlockTagsFromNAND(dev, blk,
+						blockTags) == YAFFS_OK);
+			if (blockIterator > startIterator)
+				yaffs_PrefetchBlockTagsFromNAND(dev,
+					blockIndex[blockIterator - 1].block);
+		}
+
 		/* For each chunk in each block that needs scanning.... */
 		foundChunksInBlock = 0;
 		for (c = dev->param.nChunksPerBlock - 1;
@@ -1075,8 +1097,12 @@ int yaffs2_ScanBackwards(yaffs_Device *dev)
 
 			chunk = blk * dev->param.nChunksPerBlock + c;
 
-			result = yaffs_ReadChunkWithTagsFromNAND(dev, chunk, NULL,
-							&tags);
+			if (blockTagsValid) {
+				tags = blockTags[c];
+				result = YAFFS_OK;
+			} else
+				result = yaffs_ReadChunkWithTagsFromNAND(dev,
+							chunk, NULL, &tags);
 
 			/* Let's have a good look at this chunk... */
 
@@ -1516,6 +1542,12 @@ int yaffs2_ScanBackwards(yaffs_Device *dev)
 	
 	yaffs_SkipRestOfBlock(dev);
 
+	if (blockTags) {
+		/* Don't leave a read-ahead running if we stopped early */
+		yaffs_PrefetchBlockTagsFromNAND(dev, -1);
+		YFREE(blockTags);
+	}
+
 	if (altBlockIndex)
 		YFREE_ALT(blockIndex);
 	else
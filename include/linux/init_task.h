@@ -15,6 +15,13 @@
 extern struct files_struct init_files;
 extern struct fs_struct init_fs;
 
+#ifdef CONFIG_ANDROID_LOW_MEMORY_KILLER
+#define INIT_LOWMEM_NODE(sig)						\
+	.lowmem_node	= LIST_HEAD_INIT(sig.lowmem_node),
+#else
+#define INIT_LOWMEM_NODE(sig)
+#endif
+
 #define INIT_SIGNALS(sig) {						\
 	.nr_threads	= 1,						\
 	.wait_chldexit	= __WAIT_QUEUE_HEAD_INITIALIZER(sig.wait_chldexit),\
@@ -29,6 +36,7 @@ extern struct fs_struct init_fs;
 		.running = 0,						\
 		.lock = __SPIN_LOCK_UNLOCKED(sig.cputimer.lock),	\
 	},								\
+	INIT_LOWMEM_NODE(sig)						\
 }
 
 extern struct nsproxy init_nsproxy;
@@ -0,0 +1,34 @@
+#ifndef __LZ4_H__
+#define __LZ4_H__
+/*
+ *  LZ4 Public Kernel Interface
+ *
+ *  A compressor and a safe decompressor for the LZ4 block format: a byte
+ *  oriented LZ77 variant that trades some compression ratio for very
+ *  fast decompression.
+ *
+ *  The format is described at http://code.google.com/p/lz4/
+ */
+
+#define LZ4_HASH_LOG		12
+#define LZ4_MEM_COMPRESS	((1 << LZ4_HASH_LOG) * sizeof(u32))
+
+#define lz4_worst_compress(x)	((x) + ((x) / 255) + 16)
+
+/* This requires 'workmem' of size LZ4_MEM_COMPRESS */
+int lz4_compress(const unsigned char *src, size_t src_len,
+			unsigned char *dst, size_t *dst_len, void *wrkmem);
+
+/* safe decompression with overrun testing */
+int lz4_decompress_safe(const unsigned char *src, size_t src_len,
+			unsigned char *dst, size_t *dst_len);
+
+/*
+ * Return values (< 0 = Error)
+ */
+#define LZ4_E_OK			0
+#define LZ4_E_OUTPUT_OVERRUN		(-1)
+#define LZ4_E_INPUT_OVERRUN		(-2)
+#define LZ4_E_LOOKBEHIND_OVERRUN	(-3)
+
+#endif
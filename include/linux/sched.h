@@ -629,6 +629,9 @@ struct signal_struct {
 #endif
 
 	int oom_adj;	/* OOM kill score adjustment (bit shift) */
+#ifdef CONFIG_ANDROID_LOW_MEMORY_KILLER
+	struct list_head lowmem_node;	/* lowmemorykiller's oom_adj index */
+#endif
 };
 
 /* Context switch must be unlocked if interrupts are to be enabled */
@@ -1686,6 +1689,13 @@ extern void thread_group_times(struct task_struct *p, cputime_t *ut, cputime_t *
 
 extern int task_free_register(struct notifier_block *n);
 extern int task_free_unregister(struct notifier_block *n);
+extern void task_notify_event(unsigned long event, struct task_struct *task);
+
+/* events passed to the task_free_register() notifiers, with the task */
+#define TASK_FREE		0	/* task_struct about to be freed */
+#define TASK_NEW_PROCESS	1	/* task started a thread group */
+#define TASK_EXIT_PROCESS	2	/* last thread of the group exits */
+#define TASK_OOM_ADJ		3	/* task->signal->oom_adj changed */
 
 /*
  * Per process flags
@@ -31,6 +31,8 @@ enum stat_item {
 	FLUSH_RFREE_LIST_OBJECTS, /* Rfree objects flushed */
 	CLAIM_REMOTE_LIST,	/* Remote freed list claimed */
 	CLAIM_REMOTE_LIST_OBJECTS, /* Remote freed objects claimed */
+	QUEUE_GROW,		/* Queue grown to absorb flush/claim churn */
+	QUEUE_SHRINK,		/* Queue shrunk back */
 	NR_SLQB_STAT_ITEMS
 };
 
@@ -60,6 +62,11 @@ struct kmem_cache_remote_free {
 struct kmem_cache_list {
 				/* Fastpath LIFO freelist of objects */
 	struct kmlist		freelist;
+				/* freelist watermark and flush size */
+	int			hiwater;
+	int			freebatch;
+				/* Flushes and claims since last tuned */
+	unsigned int		churn;
 #ifdef CONFIG_SMP
 				/* remote_free has reached a watermark */
 	int			remote_free_check;
@@ -128,8 +135,8 @@ struct kmem_cache_node {
  */
 struct kmem_cache {
 	unsigned long	flags;
-	int		hiwater;	/* LIFO list high watermark */
-	int		freebatch;	/* LIFO freelist batch flush size */
+	int		hiwater;	/* Base LIFO list high watermark */
+	int		freebatch;	/* Base LIFO batch flush size */
 #ifdef CONFIG_SMP
 	struct kmem_cache_cpu	**cpu_slab; /* dynamic per-cpu structures */
 #else
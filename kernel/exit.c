@@ -967,6 +967,7 @@ NORET_TYPE void do_exit(long code)
 		exit_itimers(tsk->signal);
 		if (tsk->mm)
 			setmax_mm_hiwater_rss(&tsk->signal->maxrss, tsk->mm);
+		task_notify_event(TASK_EXIT_PROCESS, tsk);
 	}
 	acct_collect(code, group_dead);
 	if (group_dead)
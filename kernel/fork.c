@@ -192,6 +192,15 @@ int task_free_unregister(struct notifier_block *n)
 }
 EXPORT_SYMBOL(task_free_unregister);
 
+/*
+ * task_notify_event - tell the task_free_register() notifiers about an event
+ * in the life of 'task' other than its freeing, one of the TASK_* events.
+ */
+void task_notify_event(unsigned long event, struct task_struct *task)
+{
+	atomic_notifier_call_chain(&task_free_notifier, event, task);
+}
+
 void __put_task_struct(struct task_struct *tsk)
 {
 	WARN_ON(!tsk->exit_state);
@@ -202,7 +211,7 @@ void __put_task_struct(struct task_struct *tsk)
 	delayacct_tsk_free(tsk);
 	put_signal_struct(tsk->signal);
 
-	atomic_notifier_call_chain(&task_free_notifier, 0, tsk);
+	atomic_notifier_call_chain(&task_free_notifier, TASK_FREE, tsk);
 	if (!profile_handoff_task(tsk))
 		free_task(tsk);
 }
@@ -919,6 +928,9 @@ static int copy_signal(unsigned long clone_flags, struct task_struct *tsk)
 	tty_audit_fork(sig);
 
 	sig->oom_adj = current->signal->oom_adj;
+#ifdef CONFIG_ANDROID_LOW_MEMORY_KILLER
+	INIT_LIST_HEAD(&sig->lowmem_node);
+#endif
 
 	return 0;
 }
@@ -1293,6 +1305,7 @@ static struct task_struct *copy_process(unsigned long clone_flags,
 			list_add_tail(&p->sibling, &p->real_parent->children);
 			list_add_tail_rcu(&p->tasks, &init_task.tasks);
 			__get_cpu_var(process_counts)++;
+			task_notify_event(TASK_NEW_PROCESS, p);
 		}
 		attach_pid(p, PIDTYPE_PID, pid);
 		nr_threads++;
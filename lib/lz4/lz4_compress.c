@@ -0,0 +1,173 @@
+/*
+ *  LZ4 compressor
+ *
+ *  Greedy single pass compressor producing the LZ4 block format. Matches
+ *  are found through a hash table of the last position of each 4 byte
+ *  sequence, so the working memory is LZ4_MEM_COMPRESS bytes and the
+ *  input may not exceed 4GB.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/string.h>
+#include <linux/lz4.h>
+#include <asm/unaligned.h>
+#include "lz4defs.h"
+
+static inline u32 lz4_hash(u32 seq)
+{
+	return (seq * 2654435761U) >> (32 - LZ4_HASH_LOG);
+}
+
+/* Number of equal bytes at p and ref, not reading at or beyond limit */
+static inline size_t lz4_count(const unsigned char *p,
+		const unsigned char *ref, const unsigned char *limit)
+{
+	const unsigned char *start = p;
+
+	while (p + sizeof(unsigned long) <= limit) {
+		unsigned long diff = get_unaligned((const unsigned long *)p) ^
+			get_unaligned((const unsigned long *)ref);
+
+		if (diff) {
+#ifdef __LITTLE_ENDIAN
+			p += __ffs(diff) >> 3;
+#else
+			p += (BITS_PER_LONG - 1 - __fls(diff)) >> 3;
+#endif
+			return p - start;
+		}
+		p += sizeof(unsigned long);
+		ref += sizeof(unsigned long);
+	}
+
+	while (p < limit && *p == *ref) {
+		p++;
+		ref++;
+	}
+
+	return p - start;
+}
+
+static inline unsigned char *lz4_put_length(unsigned char *op, size_t len)
+{
+	for (; len >= 255; len -= 255)
+		*op++ = 255;
+	*op++ = len;
+	return op;
+}
+
+/*
+ * Emit a sequence: the literals in [anchor, anchor + lit_len) followed by
+ * a match of match_len bytes at distance offset. A zero match_len emits
+ * the final literal-only sequence. Returns NULL if dst would overflow.
+ */
+static unsigned char *lz4_emit(unsigned char *op, unsigned char *op_end,
+		const unsigned char *anchor, size_t lit_len,
+		size_t offset, size_t match_len)
+{
+	unsigned char *token;
+
+	if (op >= op_end)
+		return NULL;
+	token = op++;
+
+	if (op_end - op < (ptrdiff_t)(lit_len + lit_len / 255 + 1 + 2 +
+							match_len / 255 + 1))
+		return NULL;
+
+	if (lit_len >= LZ4_RUN_MASK) {
+		*token = LZ4_RUN_MASK << LZ4_ML_BITS;
+		op = lz4_put_length(op, lit_len - LZ4_RUN_MASK);
+	} else {
+		*token = lit_len << LZ4_ML_BITS;
+	}
+
+	memcpy(op, anchor, lit_len);
+	op += lit_len;
+
+	if (!match_len)
+		return op;
+
+	put_unaligned_le16(offset, op);
+	op += 2;
+
+	match_len -= LZ4_MIN_MATCH;
+	if (match_len >= LZ4_ML_MASK) {
+		*token |= LZ4_ML_MASK;
+		op = lz4_put_length(op, match_len - LZ4_ML_MASK);
+	} else {
+		*token |= match_len;
+	}
+
+	return op;
+}
+
+int lz4_compress(const unsigned char *src, size_t src_len,
+			unsigned char *dst, size_t *dst_len, void *wrkmem)
+{
+	const unsigned char * const ip_end = src + src_len;
+	const unsigned char * const mf_limit = ip_end - LZ4_MF_LIMIT;
+	const unsigned char * const match_limit = ip_end - LZ4_LAST_LITERALS;
+	unsigned char * const op_end = dst + *dst_len;
+	const unsigned char *ip = src, *anchor = src, *ref;
+	unsigned char *op = dst;
+	u32 *table = wrkmem;
+
+	if (src_len <= LZ4_MF_LIMIT)
+		goto last_literals;
+
+	memset(table, 0, LZ4_MEM_COMPRESS);
+
+	while (ip < mf_limit) {
+		u32 seq = get_unaligned((const u32 *)ip);
+		u32 h = lz4_hash(seq);
+		size_t len;
+
+		ref = src + table[h];
+		table[h] = ip - src;
+
+		if (ref >= ip || ip - ref > LZ4_MAX_DISTANCE ||
+				get_unaligned((const u32 *)ref) != seq) {
+			ip++;
+			continue;
+		}
+
+		/* extend the match backwards over pending literals */
+		while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+			ip--;
+			ref--;
+		}
+
+		len = LZ4_MIN_MATCH + lz4_count(ip + LZ4_MIN_MATCH,
+					ref + LZ4_MIN_MATCH, match_limit);
+
+		op = lz4_emit(op, op_end, anchor, ip - anchor, ip - ref, len);
+		if (!op)
+			return LZ4_E_OUTPUT_OVERRUN;
+
+		ip += len;
+		anchor = ip;
+
+		/* remember a position inside the match for the next search */
+		if (ip - 2 < mf_limit)
+			table[lz4_hash(get_unaligned((const u32 *)(ip - 2)))] =
+							ip - 2 - src;
+	}
+
+last_literals:
+	op = lz4_emit(op, op_end, anchor, ip_end - anchor, 0, 0);
+	if (!op)
+		return LZ4_E_OUTPUT_OVERRUN;
+
+	*dst_len = op - dst;
+	return LZ4_E_OK;
+}
+EXPORT_SYMBOL_GPL(lz4_compress);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("LZ4 Compressor");
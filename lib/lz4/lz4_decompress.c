@@ -0,0 +1,101 @@
+/*
+ *  LZ4 decompressor
+ *
+ *  Safe decompressor for the LZ4 block format: every length and offset
+ *  read from the compressed stream is checked against the input and
+ *  output buffers, so corrupted data can not cause out of bounds access.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/string.h>
+#include <linux/lz4.h>
+#include <asm/unaligned.h>
+#include "lz4defs.h"
+
+/* Read an extended length; returns 0 if the input ends first */
+static inline int lz4_get_length(const unsigned char **ip,
+		const unsigned char *ip_end, size_t *len)
+{
+	unsigned int s;
+
+	do {
+		if (*ip >= ip_end)
+			return 0;
+		s = *(*ip)++;
+		*len += s;
+	} while (s == 255);
+
+	return 1;
+}
+
+int lz4_decompress_safe(const unsigned char *in, size_t in_len,
+			unsigned char *out, size_t *out_len)
+{
+	const unsigned char * const ip_end = in + in_len;
+	unsigned char * const op_end = out + *out_len;
+	const unsigned char *ip = in;
+	unsigned char *op = out;
+
+	*out_len = 0;
+
+	while (ip < ip_end) {
+		unsigned int token = *ip++;
+		const unsigned char *ref;
+		size_t len, offset;
+
+		len = token >> LZ4_ML_BITS;
+		if (len == LZ4_RUN_MASK && !lz4_get_length(&ip, ip_end, &len))
+			return LZ4_E_INPUT_OVERRUN;
+
+		if (len > (size_t)(ip_end - ip))
+			return LZ4_E_INPUT_OVERRUN;
+		if (len > (size_t)(op_end - op))
+			return LZ4_E_OUTPUT_OVERRUN;
+
+		memcpy(op, ip, len);
+		op += len;
+		ip += len;
+
+		/* the last sequence has no match part */
+		if (ip == ip_end)
+			break;
+
+		if (ip_end - ip < 2)
+			return LZ4_E_INPUT_OVERRUN;
+		offset = get_unaligned_le16(ip);
+		ip += 2;
+
+		if (!offset || offset > (size_t)(op - out))
+			return LZ4_E_LOOKBEHIND_OVERRUN;
+
+		len = token & LZ4_ML_MASK;
+		if (len == LZ4_ML_MASK && !lz4_get_length(&ip, ip_end, &len))
+			return LZ4_E_INPUT_OVERRUN;
+		len += LZ4_MIN_MATCH;
+
+		if (len > (size_t)(op_end - op))
+			return LZ4_E_OUTPUT_OVERRUN;
+
+		ref = op - offset;
+		if (offset >= len) {
+			memcpy(op, ref, len);
+			op += len;
+		} else {
+			/* overlapping match: replicates the last offset bytes */
+			while (len--)
+				*op++ = *ref++;
+		}
+	}
+
+	*out_len = op - out;
+	return LZ4_E_OK;
+}
+EXPORT_SYMBOL_GPL(lz4_decompress_safe);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("LZ4 Decompressor");
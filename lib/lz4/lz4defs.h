@@ -0,0 +1,17 @@
+/*
+ *  lz4defs.h -- LZ4 block format constants
+ *
+ *  Shared by the compressor and the decompressor.
+ */
+
+#define LZ4_MIN_MATCH		4
+#define LZ4_MAX_DISTANCE	65535
+
+/* the last 5 bytes of a block are always literals */
+#define LZ4_LAST_LITERALS	5
+/* a match may not start within the last 12 bytes of a block */
+#define LZ4_MF_LIMIT		12
+
+#define LZ4_ML_BITS		4
+#define LZ4_ML_MASK		((1U << LZ4_ML_BITS) - 1)
+#define LZ4_RUN_MASK		((1U << (8 - LZ4_ML_BITS)) - 1)
@@ -0,0 +1,728 @@
+/*
+ * mm/slab-bench.c
+ *
+ * Microbenchmark of the slab allocator, to compare SLAB, SLUB and SLQB on
+ * the same machine. It times kmem_cache_alloc/kmem_cache_free, against
+ * caches created for the benchmark, and kmalloc/kfree under a few patterns:
+ *
+ *  lifo:     each CPU allocates an object and frees it at once.
+ *  bulk:     each CPU allocates a batch of objects, then frees them all.
+ *  bulkapi:  as bulk, with kmem_cache_alloc_bulk/kmem_cache_free_bulk, for
+ *            the caches only.
+ *  prodcons: a CPU allocates batches of objects that another one frees, for
+ *            as many pairs of CPUs.
+ *  mixed:    each CPU keeps a batch of kmalloc objects of random sizes, and
+ *            replaces a random one at each step.
+ *
+ * Each pattern runs on 1, 2, 4... CPUs at once, up to all online CPUs or
+ * max_cpus, so the results also show how the allocator scales. They are
+ * given per operation, in cycles where the architecture has a cycle counter
+ * and in ns otherwise, averaged over all CPUs of the run: alloc and free for
+ * bulk, bulkapi and prodcons, an alloc and a free for lifo and mixed.
+ *
+ * All patterns run when the module is loaded. The results are then in
+ * /sys/kernel/debug/slab_bench/results, and writing the name of a pattern,
+ * or "all", to /sys/kernel/debug/slab_bench/run runs it again, with the
+ * module parameters as they are at that time.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include <linux/init.h>
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/kthread.h>
+#include <linux/completion.h>
+#include <linux/cpu.h>
+#include <linux/cpumask.h>
+#include <linux/debugfs.h>
+#include <linux/uaccess.h>
+#include <linux/mutex.h>
+#include <linux/ktime.h>
+#include <linux/sched.h>
+#include <linux/timex.h>
+
+static int iterations = 100000;
+module_param(iterations, int, 0644);
+MODULE_PARM_DESC(iterations, "Objects allocated per CPU and run");
+
+static int batch = 256;
+module_param(batch, int, 0644);
+MODULE_PARM_DESC(batch, "Objects per batch of bulk, prodcons and mixed");
+
+static int max_cpus;
+module_param(max_cpus, int, 0644);
+MODULE_PARM_DESC(max_cpus, "Most CPUs to run on at once, 0 for all online");
+
+#define BENCH_MAX_BATCH		4096
+#define BENCH_MIXED_MAX_SIZE	2048
+#define BENCH_RESULTS_SIZE	(64 * 1024)
+
+static const int bench_sizes[] = { 8, 64, 256, 1024, 4096 };
+#define BENCH_NR_SIZES		ARRAY_SIZE(bench_sizes)
+
+static struct kmem_cache *bench_caches[BENCH_NR_SIZES];
+static char bench_cache_names[BENCH_NR_SIZES][24];
+
+/* bench_mutex serializes the runs, and protects the results. */
+static DEFINE_MUTEX(bench_mutex);
+static char *bench_results;
+static size_t bench_results_len;
+static int bench_have_cycles;
+/* the parameters of the current run, set under bench_mutex */
+static int bench_iterations;
+static int bench_batch;
+
+struct bench_run;
+
+struct bench_thread {
+	struct bench_run	*run;
+	struct task_struct	*task;
+	int			index;
+	void			**objs;
+
+	u64			alloc_time;
+	u64			free_time;
+	unsigned long		nr_alloc;
+	unsigned long		nr_free;
+	int			failed;
+};
+
+/*
+ * A prodcons producer hands its batches to its consumer through two
+ * buffers, so that it can fill one while the other is being freed. A
+ * buffer is full while its nr is non zero.
+ */
+struct bench_pair {
+	void			**buf[2];
+	int			nr[2];
+	int			stop;
+};
+
+struct bench_run {
+	struct kmem_cache	*cache;		/* NULL for kmalloc */
+	int			size;
+	void			(*fn)(struct bench_thread *t);
+	int			iterations;
+	int			batch;		/* size of the objs arrays */
+	int			nr_threads;
+	atomic_t		waiting;
+	atomic_t		running;
+	struct completion	done;
+	struct bench_pair	*pairs;
+	struct bench_thread	threads[0];
+};
+
+struct bench_pattern {
+	const char		*name;
+	void			(*fn)(struct bench_thread *t);
+	int			kmalloc_only;
+	int			cache_only;
+	int			min_threads;
+	int			has_free;
+};
+
+static inline u64 bench_now(void)
+{
+	if (bench_have_cycles)
+		return get_cycles();
+	return ktime_to_ns(ktime_get());
+}
+
+static inline void *bench_alloc(struct bench_run *run, int size)
+{
+	if (run->cache)
+		return kmem_cache_alloc(run->cache, GFP_KERNEL);
+	return kmalloc(size, GFP_KERNEL);
+}
+
+static inline void bench_free(struct bench_run *run, void *object)
+{
+	if (run->cache)
+		kmem_cache_free(run->cache, object);
+	else
+		kfree(object);
+}
+
+static void bench_lifo(struct bench_thread *t)
+{
+	struct bench_run *run = t->run;
+	int done, nr, i;
+	void *object;
+	u64 start;
+
+	for (done = 0; done < run->iterations && !t->failed; done += nr) {
+		nr = min(run->batch, run->iterations - done);
+
+		start = bench_now();
+		for (i = 0; i < nr; i++) {
+			object = bench_alloc(run, run->size);
+			if (unlikely(!object)) {
+				t->failed = 1;
+				break;
+			}
+			bench_free(run, object);
+		}
+		t->alloc_time += bench_now() - start;
+		t->nr_alloc += i;
+
+		cond_resched();
+	}
+}
+
+static void bench_bulk(struct bench_thread *t)
+{
+	struct bench_run *run = t->run;
+	int done, nr, i;
+	u64 start;
+
+	for (done = 0; done < run->iterations && !t->failed; done += nr) {
+		nr = min(run->batch, run->iterations - done);
+
+		start = bench_now();
+		for (i = 0; i < nr; i++) {
+			t->objs[i] = bench_alloc(run, run->size);
+			if (unlikely(!t->objs[i])) {
+				t->failed = 1;
+				break;
+			}
+		}
+		t->alloc_time += bench_now() - start;
+		t->nr_alloc += i;
+		nr = i;
+
+		start = bench_now();
+		for (i = 0; i < nr; i++)
+			bench_free(run, t->objs[i]);
+		t->free_time += bench_now() - start;
+		t->nr_free += nr;
+
+		cond_resched();
+	}
+}
+
+static void bench_bulk_api(struct bench_thread *t)
+{
+	struct bench_run *run = t->run;
+	int done, nr;
+	u64 start;
+
+	for (done = 0; done < run->iterations; done += nr) {
+		nr = min(run->batch, run->iterations - done);
+
+		start = bench_now();
+		if (unlikely(!kmem_cache_alloc_bulk(run->cache, GFP_KERNEL, nr,
+						    t->objs))) {
+			t->failed = 1;
+			break;
+		}
+		t->alloc_time += bench_now() - start;
+		t->nr_alloc += nr;
+
+		start = bench_now();
+		kmem_cache_free_bulk(run->cache, nr, t->objs);
+		t->free_time += bench_now() - start;
+		t->nr_free += nr;
+
+		cond_resched();
+	}
+}
+
+/* Even threads produce, odd threads consume. */
+static void bench_prodcons(struct bench_thread *t)
+{
+	struct bench_run *run = t->run;
+	struct bench_pair *pair = &run->pairs[t->index / 2];
+	int done, nr, i, k;
+	u64 start;
+
+	if (t->index & 1) {
+		for (k = 0; ; k ^= 1) {
+			while (!(nr = ACCESS_ONCE(pair->nr[k]))) {
+				if (ACCESS_ONCE(pair->stop)) {
+					smp_rmb();
+					if (!ACCESS_ONCE(pair->nr[k]))
+						return;
+				}
+				cpu_relax();
+			}
+			smp_rmb();
+
+			start = bench_now();
+			for (i = 0; i < nr; i++)
+				bench_free(run, pair->buf[k][i]);
+			t->free_time += bench_now() - start;
+			t->nr_free += nr;
+
+			smp_mb();
+			pair->nr[k] = 0;
+
+			cond_resched();
+		}
+	}
+
+	for (done = 0, k = 0; done < run->iterations; done += nr, k ^= 1) {
+		while (ACCESS_ONCE(pair->nr[k]))
+			cpu_relax();
+		smp_mb();
+
+		nr = min(run->batch, run->iterations - done);
+		start = bench_now();
+		for (i = 0; i < nr; i++) {
+			pair->buf[k][i] = bench_alloc(run, run->size);
+			if (unlikely(!pair->buf[k][i]))
+				break;
+		}
+		t->alloc_time += bench_now() - start;
+		t->nr_alloc += i;
+
+		smp_wmb();
+		pair->nr[k] = i;
+		if (unlikely(i < nr)) {
+			t->failed = 1;
+			break;
+		}
+
+		cond_resched();
+	}
+
+	smp_wmb();
+	pair->stop = 1;
+}
+
+static inline u32 bench_random(u32 *state)
+{
+	/* xorshift: cheap enough not to show in the timings */
+	*state ^= *state << 13;
+	*state ^= *state >> 17;
+	*state ^= *state << 5;
+	return *state;
+}
+
+static void bench_mixed(struct bench_thread *t)
+{
+	struct bench_run *run = t->run;
+	u32 state = 2463534242UL + t->index;
+	int nr = min(run->batch, run->iterations);
+	int done, step, i, slot;
+	u64 start;
+
+	for (i = 0; i < nr; i++) {
+		t->objs[i] = kmalloc(bench_random(&state) %
+				BENCH_MIXED_MAX_SIZE + 1, GFP_KERNEL);
+		if (!t->objs[i]) {
+			t->failed = 1;
+			nr = i;
+			goto out;
+		}
+	}
+
+	for (done = 0; done < run->iterations && !t->failed; done += step) {
+		step = min(run->batch, run->iterations - done);
+
+		start = bench_now();
+		for (i = 0; i < step; i++) {
+			slot = bench_random(&state) % nr;
+			kfree(t->objs[slot]);
+			t->objs[slot] = kmalloc(bench_random(&state) %
+					BENCH_MIXED_MAX_SIZE + 1, GFP_KERNEL);
+			if (unlikely(!t->objs[slot])) {
+				t->failed = 1;
+				break;
+			}
+		}
+		t->alloc_time += bench_now() - start;
+		t->nr_alloc += i;
+
+		cond_resched();
+	}
+
+out:
+	for (i = 0; i < nr; i++)
+		kfree(t->objs[i]);
+}
+
+static const struct bench_pattern bench_patterns[] = {
+	{ "lifo",	bench_lifo,	0, 0, 1, 0 },
+	{ "bulk",	bench_bulk,	0, 0, 1, 1 },
+	{ "bulkapi",	bench_bulk_api,	0, 1, 1, 1 },
+	{ "prodcons",	bench_prodcons,	0, 0, 2, 1 },
+	{ "mixed",	bench_mixed,	1, 0, 1, 0 },
+};
+
+static int bench_thread_fn(void *data)
+{
+	struct bench_thread *t = data;
+	struct bench_run *run = t->run;
+
+	/* Start all CPUs together. */
+	atomic_dec(&run->waiting);
+	while (atomic_read(&run->waiting))
+		cpu_relax();
+
+	run->fn(t);
+
+	if (atomic_dec_and_test(&run->running))
+		complete(&run->done);
+
+	set_current_state(TASK_INTERRUPTIBLE);
+	while (!kthread_should_stop()) {
+		schedule();
+		set_current_state(TASK_INTERRUPTIBLE);
+	}
+	__set_current_state(TASK_RUNNING);
+
+	return 0;
+}
+
+static void bench_printf(const char *fmt, ...)
+{
+	va_list args;
+
+	va_start(args, fmt);
+	bench_results_len += vscnprintf(bench_results + bench_results_len,
+			BENCH_RESULTS_SIZE - bench_results_len, fmt, args);
+	va_end(args);
+}
+
+static void bench_report(const struct bench_pattern *pat,
+			struct bench_run *run)
+{
+	u64 alloc_time = 0, free_time = 0;
+	unsigned long nr_alloc = 0, nr_free = 0;
+	int failed = 0, i;
+
+	for (i = 0; i < run->nr_threads; i++) {
+		struct bench_thread *t = &run->threads[i];
+
+		alloc_time += t->alloc_time;
+		free_time += t->free_time;
+		nr_alloc += t->nr_alloc;
+		nr_free += t->nr_free;
+		failed |= t->failed;
+	}
+
+	bench_printf("%-9s %-16s %4d", pat->name, run->cache ?
+			kmem_cache_name(run->cache) : "kmalloc",
+			run->nr_threads);
+	if (pat->kmalloc_only)
+		bench_printf(" %6s", "-");
+	else
+		bench_printf(" %6d", run->size);
+
+	if (nr_alloc)
+		do_div(alloc_time, nr_alloc);
+	if (nr_free)
+		do_div(free_time, nr_free);
+	if (pat->has_free)
+		bench_printf(" %10llu %10llu %10llu",
+				(unsigned long long)alloc_time,
+				(unsigned long long)free_time,
+				(unsigned long long)(alloc_time + free_time));
+	else
+		bench_printf(" %10s %10s %10llu", "-", "-",
+				(unsigned long long)alloc_time);
+	bench_printf("%s\n", failed ? " (allocation failed)" : "");
+}
+
+static void bench_free_run(struct bench_run *run)
+{
+	int i;
+
+	for (i = 0; i < run->nr_threads; i++)
+		kfree(run->threads[i].objs);
+	if (run->pairs) {
+		for (i = 0; i < run->nr_threads / 2; i++) {
+			kfree(run->pairs[i].buf[0]);
+			kfree(run->pairs[i].buf[1]);
+		}
+		kfree(run->pairs);
+	}
+	kfree(run);
+}
+
+static struct bench_run *bench_alloc_run(const struct bench_pattern *pat,
+			struct kmem_cache *cache, int size, int nr_threads)
+{
+	size_t objs_size = bench_batch * sizeof(void *);
+	struct bench_run *run;
+	int i;
+
+	run = kzalloc(sizeof(*run) + nr_threads * sizeof(struct bench_thread),
+			GFP_KERNEL);
+	if (!run)
+		return NULL;
+
+	run->cache = cache;
+	run->size = size;
+	run->fn = pat->fn;
+	run->iterations = bench_iterations;
+	run->batch = bench_batch;
+	run->nr_threads = nr_threads;
+	atomic_set(&run->waiting, nr_threads);
+	atomic_set(&run->running, nr_threads);
+	init_completion(&run->done);
+
+	for (i = 0; i < nr_threads; i++) {
+		run->threads[i].run = run;
+		run->threads[i].index = i;
+		run->threads[i].objs = kmalloc(objs_size, GFP_KERNEL);
+		if (!run->threads[i].objs)
+			goto error;
+	}
+
+	if (pat->fn == bench_prodcons) {
+		run->pairs = kcalloc(nr_threads / 2, sizeof(struct bench_pair),
+				GFP_KERNEL);
+		if (!run->pairs)
+			goto error;
+		for (i = 0; i < nr_threads / 2; i++) {
+			run->pairs[i].buf[0] = kmalloc(objs_size, GFP_KERNEL);
+			run->pairs[i].buf[1] = kmalloc(objs_size, GFP_KERNEL);
+			if (!run->pairs[i].buf[0] || !run->pairs[i].buf[1])
+				goto error;
+		}
+	}
+
+	return run;
+
+error:
+	bench_free_run(run);
+	return NULL;
+}
+
+/*
+ * Run a pattern on the first nr_threads online CPUs, one thread each.
+ * Called with bench_mutex and the CPU hotplug lock held.
+ */
+static int bench_run_one(const struct bench_pattern *pat,
+			struct kmem_cache *cache, int size, int nr_threads)
+{
+	struct bench_run *run;
+	int i = 0, cpu, err = 0;
+
+	run = bench_alloc_run(pat, cache, size, nr_threads);
+	if (!run)
+		return -ENOMEM;
+
+	for_each_online_cpu(cpu) {
+		struct bench_thread *t = &run->threads[i];
+
+		if (i == nr_threads)
+			break;
+		t->task = kthread_create(bench_thread_fn, t, "slab_bench/%d",
+				cpu);
+		if (IS_ERR(t->task)) {
+			err = PTR_ERR(t->task);
+			t->task = NULL;
+			break;
+		}
+		kthread_bind(t->task, cpu);
+		i++;
+	}
+
+	if (!err) {
+		for (i = 0; i < nr_threads; i++)
+			wake_up_process(run->threads[i].task);
+		wait_for_completion(&run->done);
+		bench_report(pat, run);
+	}
+
+	for (i = 0; i < nr_threads && run->threads[i].task; i++)
+		kthread_stop(run->threads[i].task);
+
+	bench_free_run(run);
+	return err;
+}
+
+static int bench_run_pattern(const struct bench_pattern *pat)
+{
+	int cpus, nr_threads, i, err = 0;
+
+	get_online_cpus();
+
+	cpus = num_online_cpus();
+	if (max_cpus > 0)
+		cpus = min(cpus, max_cpus);
+	if (cpus < pat->min_threads) {
+		bench_printf("%-9s needs %d CPUs\n", pat->name,
+				pat->min_threads);
+		goto out;
+	}
+
+	for (nr_threads = pat->min_threads; ; nr_threads <<= 1) {
+		if (nr_threads > cpus)
+			nr_threads = cpus & ~(pat->min_threads - 1);
+
+		if (pat->kmalloc_only)
+			err = bench_run_one(pat, NULL, 0, nr_threads);
+
+		for (i = 0; i < BENCH_NR_SIZES && !pat->kmalloc_only; i++) {
+			if (!pat->cache_only)
+				err = bench_run_one(pat, NULL, bench_sizes[i],
+						nr_threads);
+			if (!err)
+				err = bench_run_one(pat, bench_caches[i],
+						bench_sizes[i], nr_threads);
+			if (err)
+				break;
+		}
+
+		if (err || nr_threads >= (cpus & ~(pat->min_threads - 1)))
+			break;
+	}
+
+out:
+	put_online_cpus();
+	return err;
+}
+
+static int bench_run_patterns(const char *name)
+{
+	const struct bench_pattern *pat;
+	int found = 0, err = 0;
+
+	/*
+	 * The parameters may be written at any time: read them once, and
+	 * only use this snapshot, which also sizes the objs arrays.
+	 */
+	bench_batch = clamp(ACCESS_ONCE(batch), 1, BENCH_MAX_BATCH);
+	bench_iterations = max(ACCESS_ONCE(iterations), 1);
+
+	bench_results_len = 0;
+	bench_printf("# %d objects per CPU, batches of %d, times in %s\n",
+			bench_iterations, bench_batch,
+			bench_have_cycles ? "cycles" : "ns");
+	bench_printf("# %-7s %-16s %4s %6s %10s %10s %10s\n", "pattern",
+			"cache", "cpus", "size", "alloc", "free", "both");
+
+	for (pat = bench_patterns;
+	     pat < bench_patterns + ARRAY_SIZE(bench_patterns) && !err; pat++) {
+		if (strcmp(name, "all") && strcmp(name, pat->name))
+			continue;
+		found = 1;
+		err = bench_run_pattern(pat);
+	}
+
+	if (!found)
+		return -EINVAL;
+	if (err)
+		bench_printf("# stopped: error %d\n", err);
+	return err;
+}
+
+static ssize_t bench_run_write(struct file *file, const char __user *ubuf,
+				size_t count, loff_t *ppos)
+{
+	char name[16];
+	size_t len = min(count, sizeof(name) - 1);
+	int err;
+
+	if (copy_from_user(name, ubuf, len))
+		return -EFAULT;
+	name[len] = '\0';
+
+	mutex_lock(&bench_mutex);
+	err = bench_run_patterns(strim(name));
+	mutex_unlock(&bench_mutex);
+
+	return err ? err : count;
+}
+
+static const struct file_operations bench_run_fops = {
+	.owner	= THIS_MODULE,
+	.write	= bench_run_write,
+};
+
+static ssize_t bench_results_read(struct file *file, char __user *ubuf,
+				size_t count, loff_t *ppos)
+{
+	ssize_t ret;
+
+	mutex_lock(&bench_mutex);
+	ret = simple_read_from_buffer(ubuf, count, ppos, bench_results,
+			bench_results_len);
+	mutex_unlock(&bench_mutex);
+
+	return ret;
+}
+
+static const struct file_operations bench_results_fops = {
+	.owner	= THIS_MODULE,
+	.read	= bench_results_read,
+};
+
+static struct dentry *bench_dir;
+
+static void bench_destroy_caches(void)
+{
+	int i;
+
+	for (i = 0; i < BENCH_NR_SIZES; i++)
+		if (bench_caches[i])
+			kmem_cache_destroy(bench_caches[i]);
+}
+
+static int __init slab_bench_init(void)
+{
+	cycles_t cycles = get_cycles();
+	int i;
+
+	/* Without a cycle counter, get_cycles() always returns 0. */
+	bench_have_cycles = cycles || get_cycles();
+
+	for (i = 0; i < BENCH_NR_SIZES; i++) {
+		snprintf(bench_cache_names[i], sizeof(bench_cache_names[i]),
+				"slab_bench-%d", bench_sizes[i]);
+		bench_caches[i] = kmem_cache_create(bench_cache_names[i],
+				bench_sizes[i], 0, 0, NULL);
+		if (!bench_caches[i])
+			goto error;
+	}
+
+	bench_results = vmalloc(BENCH_RESULTS_SIZE);
+	if (!bench_results)
+		goto error;
+
+	bench_dir = debugfs_create_dir("slab_bench", NULL);
+	if (!bench_dir)
+		goto error_results;
+	if (!debugfs_create_file("run", S_IWUSR, bench_dir, NULL,
+				&bench_run_fops) ||
+	    !debugfs_create_file("results", S_IRUGO, bench_dir, NULL,
+				&bench_results_fops))
+		goto error_dir;
+
+	mutex_lock(&bench_mutex);
+	bench_run_patterns("all");
+	mutex_unlock(&bench_mutex);
+	printk(KERN_INFO "slab_bench: results in "
+			"/sys/kernel/debug/slab_bench/results\n");
+
+	return 0;
+
+error_dir:
+	debugfs_remove_recursive(bench_dir);
+error_results:
+	vfree(bench_results);
+error:
+	bench_destroy_caches();
+	return -ENOMEM;
+}
+
+static void __exit slab_bench_exit(void)
+{
+	debugfs_remove_recursive(bench_dir);
+	vfree(bench_results);
+	bench_destroy_caches();
+}
+
+module_init(slab_bench_init);
+module_exit(slab_bench_exit);
+
+MODULE_DESCRIPTION("Slab allocator microbenchmark");
+MODULE_LICENSE("GPL");
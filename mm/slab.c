@@ -3829,6 +3829,49 @@ void kmem_cache_free(struct kmem_cache *cachep, void *objp)
 }
 EXPORT_SYMBOL(kmem_cache_free);
 
+/**
+ * kmem_cache_alloc_bulk - Allocate several objects
+ * @cachep: The cache to allocate from.
+ * @flags: See kmalloc().
+ * @nr: The number of objects to allocate.
+ * @p: The array the objects are stored in.
+ *
+ * Allocate @nr objects from this cache into @p.  Either all of them are
+ * allocated and @nr is returned, or none is and 0 is returned.
+ */
+int kmem_cache_alloc_bulk(struct kmem_cache *cachep, gfp_t flags, size_t nr,
+			  void **p)
+{
+	size_t i;
+
+	for (i = 0; i < nr; i++) {
+		p[i] = kmem_cache_alloc(cachep, flags);
+		if (unlikely(!p[i])) {
+			kmem_cache_free_bulk(cachep, i, p);
+			return 0;
+		}
+	}
+	return nr;
+}
+EXPORT_SYMBOL(kmem_cache_alloc_bulk);
+
+/**
+ * kmem_cache_free_bulk - Deallocate several objects
+ * @cachep: The cache the allocations were from.
+ * @nr: The number of objects to free.
+ * @p: The array of objects.
+ *
+ * Free @nr objects which were previously allocated from this cache.
+ */
+void kmem_cache_free_bulk(struct kmem_cache *cachep, size_t nr, void **p)
+{
+	size_t i;
+
+	for (i = 0; i < nr; i++)
+		kmem_cache_free(cachep, p[i]);
+}
+EXPORT_SYMBOL(kmem_cache_free_bulk);
+
 /**
  * kfree - free previously allocated memory
  * @objp: pointer returned by kmalloc.
@@ -91,6 +91,31 @@ static inline int slab_freebatch(struct kmem_cache *s)
 	return s->freebatch;
 }
 
+static inline int list_hiwater(struct kmem_cache_list *l)
+{
+	return l->hiwater;
+}
+
+static inline int list_freebatch(struct kmem_cache_list *l)
+{
+	return l->freebatch;
+}
+
+/*
+ * Set the watermark of a list, with its batch size kept in the same ratio to
+ * the cache's batch size.
+ */
+static void set_list_hiwater(struct kmem_cache *s, struct kmem_cache_list *l,
+				int hiwater)
+{
+	int freebatch = slab_freebatch(s);
+
+	if (slab_hiwater(s))
+		freebatch = (long)freebatch * hiwater / slab_hiwater(s);
+	l->hiwater = hiwater;
+	l->freebatch = max(freebatch, 1);
+}
+
 /*
  * Lock order:
  * kmem_cache_node->list_lock
@@ -126,6 +151,12 @@ static inline int slab_freebatch(struct kmem_cache *s)
  *   cacheline acquisitions, and give a cooling off period for remotely freed
  *   objects before they are re-allocated.
  *
+ * - The watermark and batch size of the LIFO list start at the cache's. When
+ *   the list keeps overflowing, or claiming remotely freed objects, they are
+ *   grown so that fewer objects bounce through the pages and the remote
+ *   queues; once the churn stops they are shrunk back. Under memory pressure,
+ *   a shrinker resets them and flushes the lists.
+ *
  * node specific allocations from somewhere other than the local node are
  * handled by a per-node list which is the same as the above per-CPU data
  * structures except for the following differences:
@@ -1131,7 +1162,7 @@ static void flush_free_list(struct kmem_cache *s, struct kmem_cache_list *l)
 	if (unlikely(!nr))
 		return;
 
-	nr = min(slab_freebatch(s), nr);
+	nr = min(list_freebatch(l), nr);
 
 	slqb_stat_inc(l, FLUSH_FREE_LIST);
 	slqb_stat_add(l, FLUSH_FREE_LIST_OBJECTS, nr);
@@ -1266,9 +1297,10 @@ static __always_inline void *__cache_list_get_object(struct kmem_cache *s,
 
 #ifdef CONFIG_SMP
 	if (unlikely(l->remote_free_check)) {
+		l->churn++;
 		claim_remote_free_list(s, l);
 
-		if (l->freelist.nr > slab_hiwater(s))
+		if (l->freelist.nr > list_hiwater(l))
 			flush_free_list(s, l);
 
 		/* repetition here helps gcc :( */
@@ -1649,7 +1681,7 @@ static void flush_remote_free_cache(struct kmem_cache *s,
 	 * No point in having remote CPU free thse as it will just
 	 * free them back to the page list anyway.
 	 */
-	if (unlikely(dst->remote_free.list.nr > (slab_hiwater(s) >> 1))) {
+	if (unlikely(dst->remote_free.list.nr > (list_hiwater(dst) >> 1))) {
 		void **head;
 
 		head = src->head;
@@ -1687,14 +1719,14 @@ static void flush_remote_free_cache(struct kmem_cache *s,
 	src->tail = NULL;
 	src->nr = 0;
 
-	if (dst->remote_free.list.nr < slab_freebatch(s))
+	if (dst->remote_free.list.nr < list_freebatch(dst))
 		set = 1;
 	else
 		set = 0;
 
 	dst->remote_free.list.nr += nr;
 
-	if (unlikely(dst->remote_free.list.nr >= slab_freebatch(s) && set))
+	if (unlikely(dst->remote_free.list.nr >= list_freebatch(dst) && set))
 		dst->remote_free_check = 1;
 
 	spin_unlock(&dst->remote_free.lock);
@@ -1729,8 +1761,10 @@ static noinline void slab_free_to_remote(struct kmem_cache *s,
 	r->tail = object;
 	r->nr++;
 
-	if (unlikely(r->nr >= slab_freebatch(s)))
+	if (unlikely(r->nr >= list_freebatch(&c->list))) {
+		c->list.churn++;
 		flush_remote_free_cache(s, c);
+	}
 }
 #endif
 
@@ -1765,8 +1799,10 @@ static __always_inline void __slab_free(struct kmem_cache *s,
 			l->freelist.tail = object;
 		l->freelist.nr++;
 
-		if (unlikely(l->freelist.nr > slab_hiwater(s)))
+		if (unlikely(l->freelist.nr > list_hiwater(l))) {
+			l->churn++;
 			flush_free_list(s, l);
+		}
 
 	} else {
 #ifdef CONFIG_SMP
@@ -1811,6 +1847,179 @@ void kmem_cache_free(struct kmem_cache *s, void *object)
 }
 EXPORT_SYMBOL(kmem_cache_free);
 
+/*
+ * Bulk allocation path. Take as many objects as there are from the LIFO
+ * freelist in one go, and go through __slab_alloc for the others. Return
+ * the number of objects allocated.
+ *
+ * Must be called with interrupts disabled.
+ */
+static size_t __slab_alloc_bulk(struct kmem_cache *s, gfp_t gfpflags,
+				int node, size_t nr, void **p)
+{
+	size_t i = 0;
+
+	while (i < nr) {
+		struct kmem_cache_list *l;
+		void *object;
+
+		/* __slab_alloc may have enabled interrupts */
+		l = &get_cpu_slab(s, smp_processor_id())->list;
+		if (node == -1 || node == numa_node_id()) {
+			unsigned int got = 0;
+
+			object = l->freelist.head;
+			while (object && i < nr) {
+				p[i++] = object;
+				object = get_freepointer(s, object);
+				got++;
+			}
+			VM_BUG_ON(l->freelist.nr < got);
+			l->freelist.nr -= got;
+			l->freelist.head = object;
+			slqb_stat_add(l, ALLOC, got);
+			if (i == nr)
+				break;
+		}
+
+		object = __slab_alloc(s, gfpflags, node);
+		if (unlikely(!object))
+			break;
+		p[i++] = object;
+	}
+
+	return i;
+}
+
+int kmem_cache_alloc_bulk(struct kmem_cache *s, gfp_t gfpflags, size_t nr,
+			  void **p)
+{
+	unsigned long flags;
+	int node = -1;
+	size_t i;
+
+	if (unlikely(slab_debug(s))) {
+		for (i = 0; i < nr; i++) {
+			p[i] = __kmem_cache_alloc(s, gfpflags, _RET_IP_);
+			if (unlikely(!p[i]))
+				goto fail;
+		}
+		return nr;
+	}
+
+	gfpflags &= gfp_allowed_mask;
+
+	lockdep_trace_alloc(gfpflags);
+	might_sleep_if(gfpflags & __GFP_WAIT);
+
+	if (should_failslab(s->objsize, gfpflags, s->flags))
+		return 0;
+
+#ifdef CONFIG_NUMA
+	if (unlikely(current->flags & (PF_SPREAD_SLAB | PF_MEMPOLICY)))
+		node = alternate_nid(s, gfpflags, node);
+#endif
+
+	local_irq_save(flags);
+	i = __slab_alloc_bulk(s, gfpflags, node, nr, p);
+	local_irq_restore(flags);
+
+	if (unlikely(i < nr))
+		goto fail;
+
+	if (unlikely(gfpflags & __GFP_ZERO)) {
+		for (i = 0; i < nr; i++)
+			memset(p[i], 0, s->objsize);
+	}
+
+	return nr;
+
+fail:
+	kmem_cache_free_bulk(s, i, p);
+	return 0;
+}
+EXPORT_SYMBOL(kmem_cache_alloc_bulk);
+
+/*
+ * Bulk freeing path. Local-node objects are chained together and spliced
+ * onto the LIFO freelist at once, which is then flushed down to the
+ * watermark.
+ *
+ * Must be called with interrupts disabled.
+ */
+static void __slab_free_bulk(struct kmem_cache *s, size_t nr, void **p)
+{
+	struct kmem_cache_cpu *c;
+	struct kmem_cache_list *l;
+	void *head = NULL, *tail = NULL;
+	unsigned int local = 0;
+	int nid = numa_node_id();
+	size_t i;
+
+	c = get_cpu_slab(s, smp_processor_id());
+	l = &c->list;
+
+	slqb_stat_add(l, FREE, nr);
+
+	for (i = 0; i < nr; i++) {
+		void *object = p[i];
+		struct slqb_page *page;
+
+		if (NUMA_BUILD && slab_numa(s)) {
+			page = virt_to_head_slqb_page(object);
+			if (unlikely(slqb_page_to_nid(page) != nid)) {
+#ifdef CONFIG_SMP
+				slab_free_to_remote(s, page, object, c);
+				slqb_stat_inc(l, FREE_REMOTE);
+#endif
+				continue;
+			}
+		}
+
+		set_freepointer(s, object, head);
+		head = object;
+		if (!tail)
+			tail = object;
+		local++;
+	}
+
+	if (!local)
+		return;
+
+	set_freepointer(s, tail, l->freelist.head);
+	l->freelist.head = head;
+	if (!l->freelist.nr)
+		l->freelist.tail = tail;
+	l->freelist.nr += local;
+
+	if (unlikely(l->freelist.nr > list_hiwater(l))) {
+		l->churn++;
+		do {
+			flush_free_list(s, l);
+		} while (l->freelist.nr > list_hiwater(l));
+	}
+}
+
+void kmem_cache_free_bulk(struct kmem_cache *s, size_t nr, void **p)
+{
+	unsigned long flags;
+	size_t i;
+
+	if (unlikely(slab_debug(s))) {
+		for (i = 0; i < nr; i++)
+			kmem_cache_free(s, p[i]);
+		return;
+	}
+
+	for (i = 0; i < nr; i++)
+		debug_check_no_locks_freed(p[i], s->objsize);
+
+	local_irq_save(flags);
+	__slab_free_bulk(s, nr, p);
+	local_irq_restore(flags);
+}
+EXPORT_SYMBOL(kmem_cache_free_bulk);
+
 /*
  * Calculate the order of allocation given an slab object size.
  *
@@ -1919,6 +2128,8 @@ static void init_kmem_cache_list(struct kmem_cache *s,
 	l->freelist.tail	= NULL;
 	l->nr_partial		= 0;
 	l->nr_slabs		= 0;
+	l->churn		= 0;
+	set_list_hiwater(s, l, slab_hiwater(s));
 	INIT_LIST_HEAD(&l->partial);
 	spin_lock_init(&l->page_lock);
 
@@ -2683,7 +2894,13 @@ int kmem_cache_shrink(struct kmem_cache *s)
 }
 EXPORT_SYMBOL(kmem_cache_shrink);
 
-#if defined(CONFIG_NUMA) && defined(CONFIG_MEMORY_HOTPLUG)
+/*
+ * Flush all the per-CPU lists of all caches, shrinking their watermarks back
+ * to the caches'. Phase 0 sends the objects of other lists to them, phase 1
+ * (once it is done on all CPUs) claims and flushes those.
+ *
+ * Must be called with slqb_lock held.
+ */
 static void kmem_cache_reap_percpu(void *arg)
 {
 	int cpu = smp_processor_id();
@@ -2695,8 +2912,14 @@ static void kmem_cache_reap_percpu(void *arg)
 		struct kmem_cache_list *l = &c->list;
 
 		if (phase == 0) {
+			if (list_hiwater(l) > slab_hiwater(s)) {
+				set_list_hiwater(s, l, slab_hiwater(s));
+				slqb_stat_inc(l, QUEUE_SHRINK);
+			}
 			flush_free_list_all(s, l);
+#ifdef CONFIG_SMP
 			flush_remote_free_cache(s, c);
+#endif
 		}
 
 		if (phase == 1) {
@@ -2706,6 +2929,7 @@ static void kmem_cache_reap_percpu(void *arg)
 	}
 }
 
+#if defined(CONFIG_NUMA) && defined(CONFIG_MEMORY_HOTPLUG)
 static void kmem_cache_reap(void)
 {
 	struct kmem_cache *s;
@@ -2735,6 +2959,48 @@ static void kmem_cache_reap(void)
 }
 #endif
 
+/*
+ * Every time cache_trim_worker runs, a per-CPU list that saw at least
+ * SLQB_CHURN_GROW overflows and claims since the last time has its watermark
+ * doubled, up to 1 << SLQB_GROW_SHIFT times the cache's but no more than
+ * SLQB_GROW_MAX_BYTES worth of objects. One that saw no more than
+ * SLQB_CHURN_SHRINK has it halved, down to the cache's.
+ */
+#define SLQB_CHURN_GROW		32
+#define SLQB_CHURN_SHRINK	4
+#define SLQB_GROW_SHIFT		2
+#define SLQB_GROW_MAX_BYTES	(256 * 1024)
+
+static int max_list_hiwater(struct kmem_cache *s)
+{
+	int hiwater = min(slab_hiwater(s) << SLQB_GROW_SHIFT,
+				(int)(SLQB_GROW_MAX_BYTES / s->size));
+
+	return max(hiwater, slab_hiwater(s));
+}
+
+/*
+ * Caller must be the owner CPU of the list, with interrupts disabled.
+ */
+static void tune_cache_list(struct kmem_cache *s, struct kmem_cache_list *l)
+{
+	unsigned int churn = l->churn;
+	int hiwater = list_hiwater(l);
+
+	l->churn = 0;
+
+	if (churn >= SLQB_CHURN_GROW) {
+		hiwater = min(max(hiwater, 1) << 1, max_list_hiwater(s));
+		if (hiwater > list_hiwater(l)) {
+			set_list_hiwater(s, l, hiwater);
+			slqb_stat_inc(l, QUEUE_GROW);
+		}
+	} else if (churn <= SLQB_CHURN_SHRINK && hiwater > slab_hiwater(s)) {
+		set_list_hiwater(s, l, max(hiwater >> 1, slab_hiwater(s)));
+		slqb_stat_inc(l, QUEUE_SHRINK);
+	}
+}
+
 static void cache_trim_worker(struct work_struct *w)
 {
 	struct delayed_work *work =
@@ -2760,6 +3026,7 @@ static void cache_trim_worker(struct work_struct *w)
 #endif
 
 		local_irq_disable();
+		tune_cache_list(s, &get_cpu_slab(s, smp_processor_id())->list);
 		kmem_cache_trim_percpu(s);
 		local_irq_enable();
 	}
@@ -2788,6 +3055,55 @@ static void __cpuinit start_cpu_timer(int cpu)
 	}
 }
 
+/*
+ * Objects queued on the per-CPU lists pin their slabs. Under memory pressure,
+ * flush them all and take back any watermark grown by tune_cache_list. As it
+ * takes two IPIs to all CPUs, this is done at most every SLQB_REAP_INTERVAL.
+ */
+#define SLQB_REAP_INTERVAL	(HZ / 10)
+
+static unsigned long slqb_reap_time;
+
+static unsigned long count_queued_objects(void)
+{
+	struct kmem_cache *s;
+	unsigned long nr = 0;
+	int cpu;
+
+	list_for_each_entry(s, &slab_caches, list) {
+		for_each_online_cpu(cpu)
+			nr += get_cpu_slab(s, cpu)->list.freelist.nr;
+	}
+
+	return nr;
+}
+
+static int slqb_shrink(struct shrinker *shrink, int nr_to_scan, gfp_t gfp_mask)
+{
+	unsigned long nr;
+
+	if (!down_read_trylock(&slqb_lock))
+		return -1;
+
+	nr = count_queued_objects();
+	if (nr_to_scan && nr &&
+	    time_after(jiffies, slqb_reap_time + SLQB_REAP_INTERVAL)) {
+		slqb_reap_time = jiffies;
+		on_each_cpu(kmem_cache_reap_percpu, (void *)0, 1);
+		on_each_cpu(kmem_cache_reap_percpu, (void *)1, 1);
+		nr = count_queued_objects();
+	}
+
+	up_read(&slqb_lock);
+
+	return min(nr, (unsigned long)INT_MAX);
+}
+
+static struct shrinker slqb_shrinker = {
+	.shrink = slqb_shrink,
+	.seeks = DEFAULT_SEEKS,
+};
+
 static int __init cpucache_init(void)
 {
 	int cpu;
@@ -2795,6 +3111,8 @@ static int __init cpucache_init(void)
 	for_each_online_cpu(cpu)
 		start_cpu_timer(cpu);
 
+	register_shrinker(&slqb_shrinker);
+
 	return 0;
 }
 device_initcall(cpucache_init);
@@ -3205,6 +3523,7 @@ struct stats_gather {
 	unsigned long nr_partial;
 	unsigned long nr_inuse;
 	unsigned long nr_objects;
+	int max_hiwater;
 
 #ifdef CONFIG_SLQB_STATS
 	unsigned long stats[NR_SLQB_STAT_ITEMS];
@@ -3240,6 +3559,7 @@ static void __gather_stats(void *arg)
 	gather->nr_slabs += nr_slabs;
 	gather->nr_partial += nr_partial;
 	gather->nr_inuse += nr_inuse;
+	gather->max_hiwater = max(gather->max_hiwater, list_hiwater(l));
 #ifdef CONFIG_SLQB_STATS
 	for (i = 0; i < NR_SLQB_STAT_ITEMS; i++)
 		gather->stats[i] += l->stats[i];
@@ -3387,6 +3707,90 @@ static int __init slab_proc_init(void)
 	return 0;
 }
 module_init(slab_proc_init);
+
+#ifdef CONFIG_SLQB_STATS
+/*
+ * /proc/slqbinfo: how much of the freeing to each cache is remote, how much
+ * its LIFO lists churn and how far their watermarks were tuned, and how many
+ * of its slabs are partially used.
+ */
+static void print_slqbinfo_header(struct seq_file *m)
+{
+	seq_puts(m, "slqbinfo - version: 1.0\n");
+	seq_puts(m, "# name	    <allocs> <frees> <remote_frees>");
+	seq_puts(m, " <remote_permille>");
+	seq_puts(m, " : flushes <free_list> <rfree_list> <claim_remote>");
+	seq_puts(m, " : queue <hiwater> <max_hiwater> <grow> <shrink>");
+	seq_puts(m, " : slabdata <partial_slabs> <num_slabs>");
+	seq_putc(m, '\n');
+}
+
+static void *q_start(struct seq_file *m, loff_t *pos)
+{
+	loff_t n = *pos;
+
+	down_read(&slqb_lock);
+	if (!n)
+		print_slqbinfo_header(m);
+
+	return seq_list_start(&slab_caches, *pos);
+}
+
+static int q_show(struct seq_file *m, void *p)
+{
+	struct stats_gather stats;
+	struct kmem_cache *s;
+	unsigned long frees, remote;
+
+	s = list_entry(p, struct kmem_cache, list);
+
+	gather_stats_locked(s, &stats);
+
+	frees = stats.stats[FREE];
+	remote = stats.stats[FREE_REMOTE] + stats.stats[FLUSH_FREE_LIST_REMOTE];
+
+	seq_printf(m, "%-17s %10lu %10lu %10lu %4lu", s->name,
+			stats.stats[ALLOC], frees, remote,
+			frees ? remote * 1000 / frees : 0UL);
+	seq_printf(m, " : flushes %8lu %8lu %8lu",
+			stats.stats[FLUSH_FREE_LIST],
+			stats.stats[FLUSH_RFREE_LIST],
+			stats.stats[CLAIM_REMOTE_LIST]);
+	seq_printf(m, " : queue %5d %5d %6lu %6lu", slab_hiwater(s),
+			stats.max_hiwater, stats.stats[QUEUE_GROW],
+			stats.stats[QUEUE_SHRINK]);
+	seq_printf(m, " : slabdata %6lu %6lu", stats.nr_partial,
+			stats.nr_slabs);
+	seq_putc(m, '\n');
+	return 0;
+}
+
+static const struct seq_operations slqbinfo_op = {
+	.start = q_start,
+	.next = s_next,
+	.stop = s_stop,
+	.show = q_show,
+};
+
+static int slqbinfo_open(struct inode *inode, struct file *file)
+{
+	return seq_open(file, &slqbinfo_op);
+}
+
+static const struct file_operations proc_slqbinfo_operations = {
+	.open		= slqbinfo_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= seq_release,
+};
+
+static int __init slqb_proc_init(void)
+{
+	proc_create("slqbinfo", S_IRUGO, NULL, &proc_slqbinfo_operations);
+	return 0;
+}
+module_init(slqb_proc_init);
+#endif /* CONFIG_SLQB_STATS */
 #endif /* CONFIG_SLABINFO */
 
 #ifdef CONFIG_SLQB_SYSFS
@@ -3460,6 +3864,16 @@ static ssize_t slabs_show(struct kmem_cache *s, char *buf)
 }
 SLAB_ATTR_RO(slabs);
 
+static ssize_t partial_show(struct kmem_cache *s, char *buf)
+{
+	struct stats_gather stats;
+
+	gather_stats(s, &stats);
+
+	return sprintf(buf, "%lu\n", stats.nr_partial);
+}
+SLAB_ATTR_RO(partial);
+
 static ssize_t objects_show(struct kmem_cache *s, char *buf)
 {
 	struct stats_gather stats;
@@ -3541,6 +3955,33 @@ static ssize_t store_user_show(struct kmem_cache *s, char *buf)
 }
 SLAB_ATTR_RO(store_user);
 
+/*
+ * Restart the tuning of the lists of a cache from its new watermark and batch
+ * size. The lists of other CPUs are updated racily, as the cache's limits
+ * always were.
+ */
+static void reset_list_hiwater(struct kmem_cache *s)
+{
+	int cpu;
+#ifdef CONFIG_NUMA
+	int node;
+#endif
+
+	down_read(&slqb_lock);
+	for_each_online_cpu(cpu)
+		set_list_hiwater(s, &get_cpu_slab(s, cpu)->list,
+				slab_hiwater(s));
+#ifdef CONFIG_NUMA
+	for_each_node_state(node, N_NORMAL_MEMORY) {
+		struct kmem_cache_node *n = s->node_slab[node];
+
+		if (n)
+			set_list_hiwater(s, &n->list, slab_hiwater(s));
+	}
+#endif
+	up_read(&slqb_lock);
+}
+
 static ssize_t hiwater_store(struct kmem_cache *s,
 				const char *buf, size_t length)
 {
@@ -3555,6 +3996,7 @@ static ssize_t hiwater_store(struct kmem_cache *s,
 		return -EINVAL;
 
 	s->hiwater = hiwater;
+	reset_list_hiwater(s);
 
 	return length;
 }
@@ -3579,6 +4021,7 @@ static ssize_t freebatch_store(struct kmem_cache *s,
 		return -EINVAL;
 
 	s->freebatch = freebatch;
+	reset_list_hiwater(s);
 
 	return length;
 }
@@ -3635,6 +4078,8 @@ STAT_ATTR(FLUSH_RFREE_LIST, flush_rfree_list);
 STAT_ATTR(FLUSH_RFREE_LIST_OBJECTS, flush_rfree_list_objects);
 STAT_ATTR(CLAIM_REMOTE_LIST, claim_remote_list);
 STAT_ATTR(CLAIM_REMOTE_LIST_OBJECTS, claim_remote_list_objects);
+STAT_ATTR(QUEUE_GROW, queue_grow);
+STAT_ATTR(QUEUE_SHRINK, queue_shrink);
 #endif
 
 static struct attribute *slab_attrs[] = {
@@ -3645,6 +4090,7 @@ static struct attribute *slab_attrs[] = {
 	&objects_attr.attr,
 	&total_objects_attr.attr,
 	&slabs_attr.attr,
+	&partial_attr.attr,
 	&ctor_attr.attr,
 	&align_attr.attr,
 	&hwcache_align_attr.attr,
@@ -3673,6 +4119,8 @@ static struct attribute *slab_attrs[] = {
 	&flush_rfree_list_objects_attr.attr,
 	&claim_remote_list_attr.attr,
 	&claim_remote_list_objects_attr.attr,
+	&queue_grow_attr.attr,
+	&queue_shrink_attr.attr,
 #endif
 #ifdef CONFIG_FAILSLAB
 	&failslab_attr.attr,
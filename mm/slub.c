@@ -1678,6 +1678,20 @@ debug:
 	goto unlock_out;
 }
 
+/*
+ * Interrupts-on processing of an allocated object (zeroing, kmemcheck and
+ * kmemleak).
+ */
+static __always_inline void slab_post_alloc(struct kmem_cache *s,
+		gfp_t gfpflags, void *object)
+{
+	if (unlikely(gfpflags & __GFP_ZERO) && object)
+		memset(object, 0, s->objsize);
+
+	kmemcheck_slab_alloc(s, gfpflags, object, s->objsize);
+	kmemleak_alloc_recursive(object, s->objsize, 1, s->flags, gfpflags);
+}
+
 /*
  * Inlined fastpath so that allocation functions (kmalloc, kmem_cache_alloc)
  * have the fastpath folded into their functions. So no function call
@@ -1716,11 +1730,7 @@ static __always_inline void *slab_alloc(struct kmem_cache *s,
 	}
 	local_irq_restore(flags);
 
-	if (unlikely(gfpflags & __GFP_ZERO) && object)
-		memset(object, 0, s->objsize);
-
-	kmemcheck_slab_alloc(s, gfpflags, object, s->objsize);
-	kmemleak_alloc_recursive(object, s->objsize, 1, s->flags, gfpflags);
+	slab_post_alloc(s, gfpflags, object);
 
 	return object;
 }
@@ -1843,16 +1853,12 @@ debug:
  * If fastpath is not possible then fall back to __slab_free where we deal
  * with all sorts of special processing.
  */
-static __always_inline void slab_free(struct kmem_cache *s,
-			struct page *page, void *x, unsigned long addr)
+static __always_inline void __slab_free_object(struct kmem_cache *s,
+			struct kmem_cache_cpu *c, struct page *page, void *x,
+			unsigned long addr)
 {
 	void **object = (void *)x;
-	struct kmem_cache_cpu *c;
-	unsigned long flags;
 
-	kmemleak_free_recursive(x, s->flags);
-	local_irq_save(flags);
-	c = __this_cpu_ptr(s->cpu_slab);
 	kmemcheck_slab_free(s, object, s->objsize);
 	debug_check_no_locks_freed(object, s->objsize);
 	if (!(s->flags & SLAB_DEBUG_OBJECTS))
@@ -1863,7 +1869,16 @@ static __always_inline void slab_free(struct kmem_cache *s,
 		stat(s, FREE_FASTPATH);
 	} else
 		__slab_free(s, page, x, addr);
+}
 
+static __always_inline void slab_free(struct kmem_cache *s,
+			struct page *page, void *x, unsigned long addr)
+{
+	unsigned long flags;
+
+	kmemleak_free_recursive(x, s->flags);
+	local_irq_save(flags);
+	__slab_free_object(s, __this_cpu_ptr(s->cpu_slab), page, x, addr);
 	local_irq_restore(flags);
 }
 
@@ -1879,6 +1894,80 @@ void kmem_cache_free(struct kmem_cache *s, void *x)
 }
 EXPORT_SYMBOL(kmem_cache_free);
 
+/*
+ * Bulk allocation and freeing disable interrupts once for the whole array,
+ * and take the objects from, or put them on, the lockless freelist of the
+ * cpu slab as long as they can.
+ */
+int kmem_cache_alloc_bulk(struct kmem_cache *s, gfp_t gfpflags, size_t nr,
+			  void **p)
+{
+	struct kmem_cache_cpu *c;
+	unsigned long flags;
+	size_t i, j;
+
+	gfpflags &= gfp_allowed_mask;
+
+	lockdep_trace_alloc(gfpflags);
+	might_sleep_if(gfpflags & __GFP_WAIT);
+
+	if (should_failslab(s->objsize, gfpflags, s->flags))
+		return 0;
+
+	local_irq_save(flags);
+	c = __this_cpu_ptr(s->cpu_slab);
+	for (i = 0; i < nr; i++) {
+		void **object = c->freelist;
+
+		if (unlikely(!object)) {
+			object = __slab_alloc(s, gfpflags, -1, _RET_IP_, c);
+			/* __slab_alloc may have enabled interrupts */
+			c = __this_cpu_ptr(s->cpu_slab);
+			if (unlikely(!object))
+				break;
+		} else {
+			c->freelist = get_freepointer(s, object);
+			stat(s, ALLOC_FASTPATH);
+		}
+		p[i] = object;
+	}
+	local_irq_restore(flags);
+
+	for (j = 0; j < i; j++) {
+		slab_post_alloc(s, gfpflags, p[j]);
+		trace_kmem_cache_alloc(_RET_IP_, p[j], s->objsize, s->size,
+				       gfpflags);
+	}
+
+	if (unlikely(i < nr)) {
+		kmem_cache_free_bulk(s, i, p);
+		return 0;
+	}
+	return nr;
+}
+EXPORT_SYMBOL(kmem_cache_alloc_bulk);
+
+void kmem_cache_free_bulk(struct kmem_cache *s, size_t nr, void **p)
+{
+	struct kmem_cache_cpu *c;
+	unsigned long flags;
+	size_t i;
+
+	for (i = 0; i < nr; i++)
+		kmemleak_free_recursive(p[i], s->flags);
+
+	local_irq_save(flags);
+	c = __this_cpu_ptr(s->cpu_slab);
+	for (i = 0; i < nr; i++)
+		__slab_free_object(s, c, virt_to_head_page(p[i]), p[i],
+				   _RET_IP_);
+	local_irq_restore(flags);
+
+	for (i = 0; i < nr; i++)
+		trace_kmem_cache_free(_RET_IP_, p[i]);
+}
+EXPORT_SYMBOL(kmem_cache_free_bulk);
+
 /* Figure out on which slab page the object resides */
 static struct page *get_object_page(const void *x)
 {
@@ -2559,6 +2559,9 @@ int netif_rx_ni(struct sk_buff *skb)
 }
 EXPORT_SYMBOL(netif_rx_ni);
 
+/* Completed skbs are freed this many at a time. */
+#define NET_TX_FREE_BULK	16
+
 static void net_tx_action(struct softirq_action *h)
 {
 	struct softnet_data *sd = &__get_cpu_var(softnet_data);
@@ -2572,11 +2575,16 @@ static void net_tx_action(struct softirq_action *h)
 		local_irq_enable();
 
 		while (clist) {
-			struct sk_buff *skb = clist;
-			clist = clist->next;
+			struct sk_buff *skbs[NET_TX_FREE_BULK];
+			int nr;
+
+			for (nr = 0; clist && nr < NET_TX_FREE_BULK; nr++) {
+				skbs[nr] = clist;
+				clist = clist->next;
 
-			WARN_ON(atomic_read(&skb->users));
-			__kfree_skb(skb);
+				WARN_ON(atomic_read(&skbs[nr]->users));
+			}
+			__kfree_skb_bulk(skbs, nr);
 		}
 	}
 
@@ -430,6 +430,33 @@ void __kfree_skb(struct sk_buff *skb)
 }
 EXPORT_SYMBOL(__kfree_skb);
 
+/**
+ *	__kfree_skb_bulk - private function
+ *	@skbs: array of buffers
+ *	@nr: number of buffers
+ *
+ *	Free @nr sk_buffs as __kfree_skb() would, returning the shells that
+ *	came from skbuff_head_cache to it in a single call. The array is
+ *	overwritten.
+ */
+void __kfree_skb_bulk(struct sk_buff **skbs, int nr)
+{
+	void **heads = (void **)skbs;
+	int i, n = 0;
+
+	for (i = 0; i < nr; i++) {
+		struct sk_buff *skb = skbs[i];
+
+		skb_release_all(skb);
+		if (skb->fclone == SKB_FCLONE_UNAVAILABLE)
+			heads[n++] = skb;
+		else
+			kfree_skbmem(skb);
+	}
+	kmem_cache_free_bulk(skbuff_head_cache, n, heads);
+}
+EXPORT_SYMBOL(__kfree_skb_bulk);
+
 /**
  *	kfree_skb - free an sk_buff
  *	@skb: buffer to free